@@ -90,13 +90,60 @@ const float minProgressDistance = 0.01;
 ///////////////////////////////////////////
 
 struct IrradianceField {
+    // Probes of the lattice in world space
     Vector3int32            probeCounts;
     Point3                  probeStartPosition;
     Vector3                 probeStep;
+
+    // Probes that have storage: probe indices, the atlases and the per-probe textures cover this grid.
+    // Equal to probeCounts unless the grid is sparse.
+    Vector3int32            storageProbeCounts;
+
+    // Constants for fastDivide() by storageProbeCounts.x and storageProbeCounts.x * storageProbeCounts.y.
+    // See ProbeMath::FastDivisor
+    ivec3                   probeCountXDivisor;
+    ivec3                   probeCountXYDivisor;
+
+    // Atlas tiling, see probeAtlasCoord(). 0 = one row of probes per z slice,
+    // otherwise the number of storageProbeCounts.x x storageProbeCounts.y slice tiles per row.
+    int                     probeAtlasSlicesPerRow;
+    ivec3                   probeAtlasSliceDivisor;
+
+    // Grids that follow the viewer scroll toroidally: the probe at lattice coordinate c (relative to
+    // probeStartPosition) is stored at (c + probeScrollOffset) mod probeCounts. Zero for fixed grids.
+    // See storageGridCoord() and IrradianceField::scrollTo.
+    ivec3                   probeScrollOffset;
+
+    // Sparse grids: the lattice is split into bricks of brickSize^3 probes and only the bricks near
+    // geometry have storage. brickIndirectionbuffer holds the storage brick of each of the brickCounts
+    // lattice bricks, brickCounts.x * brickCounts.y x brickCounts.z, or -1. brickSize = 0 for dense grids.
+    // See IrradianceField::allocateBricks
+    int                     brickSize;
+    ivec3                   brickCounts;
+
+    // Storage bricks along each axis of the storage grid, and fastDivide() constants for brickSize,
+    // storageBrickCounts.x and storageBrickCounts.x * storageBrickCounts.y
+    ivec3                   storageBrickCounts;
+    ivec3                   brickSizeDivisor;
+    ivec3                   storageBrickCountXDivisor;
+    ivec3                   storageBrickCountXYDivisor;
+    isampler2D              brickIndirectionbuffer;
     int                     lowResolutionDownsampleFactor;
     sampler2D               irradianceProbeGridbuffer;
     sampler2D               meanMeanSquaredProbeGridbuffer;
 
+    // Radiance SH coefficients of each probe when IRRADIANCE_SH_ORDER > 0, which replace
+    // irradianceProbeGridbuffer. See SphericalHarmonics.glsl
+    sampler2D               irradianceSHbuffer;
+
+    // Multiplies the (mean, mean^2) samples: (1, 1) for the float atlases, (maxDistance, maxDistance^2)
+    // for the RG16 unorm copy. See ProbeAtlasCompression.h
+    Vector2                 depthMomentScale;
+
+    // World-space offset of each probe from its lattice position, one texel per probe at probeAtlasCoord()
+    // of its storage coordinate, IrradianceField::probeAtlasSize() texels. See IrradianceField::m_probeOffsets
+    sampler2D               probeOffsetsbuffer;
+
     int                     irradianceTextureWidth;
     int                     irradianceTextureHeight;
     int                     depthTextureWidth;
@@ -148,23 +195,105 @@ Color3 gridCoordToColor(GridCoord gridCoord) {
 }
 
 
+/** n / d for the divisor d that \a divisor was computed for by ProbeMath::FastDivisor:
+    (multiplier, shift1, shift2). Exact for all n. */
+uint fastDivide(uint n, ivec3 divisor) {
+    uint hi, lo;
+    umulExtended(n, uint(divisor.x), hi, lo);
+    return (hi + ((n - hi) >> uint(divisor.y))) >> uint(divisor.z);
+}
+
 GridCoord probeIndexToGridCoord(in IrradianceField L, ProbeIndex index) {    
-    /* Works for any # of probes */
+    /* Works for any # of probes, but the integer divisions are slow */
     /*
     iPos.x = index % L.probeCounts.x;
     iPos.y = (index % (L.probeCounts.x * L.probeCounts.y)) / L.probeCounts.x;
     iPos.z = index / (L.probeCounts.x * L.probeCounts.y);
     */
 
-    // Assumes probeCounts are powers of two.
-    // Saves ~10ms compared to the divisions above
-    // Precomputing the MSB actually slows this code down substantially
-    ivec3 iPos;
-    iPos.x = index & (L.probeCounts.x - 1);
-    iPos.y = (index & ((L.probeCounts.x * L.probeCounts.y) - 1)) >> findMSB(L.probeCounts.x);
-    iPos.z = index >> findMSB(L.probeCounts.x * L.probeCounts.y);
+    // Replaces the divisions with a multiply-high and shifts, so that probeCounts
+    // need not be powers of two. Matches ProbeMath::probeIndexToGridCoord.
+    uint i = uint(index);
+    uint z = fastDivide(i, L.probeCountXYDivisor);
+    uint xy = i - z * uint(L.storageProbeCounts.x * L.storageProbeCounts.y);
+    uint y = fastDivide(xy, L.probeCountXDivisor);
 
-    return iPos;
+    return ivec3(int(xy - y * uint(L.storageProbeCounts.x)), int(y), int(z));
+}
+
+
+/** Storage coordinate, which probe indices and probeAtlasCoord() use, of the probe at lattice coordinate \a c.
+    x < 0 if the probe is in an unallocated brick of a sparse grid. */
+GridCoord storageGridCoord(in IrradianceField L, GridCoord c) {
+    if (L.brickSize > 0) {
+        // Lattice coordinates are not negative, so the divisions can use fastDivide()
+        GridCoord brick = GridCoord(fastDivide(uint(c.x), L.brickSizeDivisor),
+                                    fastDivide(uint(c.y), L.brickSizeDivisor),
+                                    fastDivide(uint(c.z), L.brickSizeDivisor));
+        int storageBrick = texelFetch(L.brickIndirectionbuffer, ivec2(brick.x + brick.y * L.brickCounts.x, brick.z), 0).r;
+        if (storageBrick < 0) {
+            return GridCoord(-1);
+        }
+
+        // Storage bricks are numbered x fastest within the storage grid, as in probeIndexToGridCoord()
+        uint b = uint(storageBrick);
+        uint z = fastDivide(b, L.storageBrickCountXYDivisor);
+        uint xy = b - z * uint(L.storageBrickCounts.x * L.storageBrickCounts.y);
+        uint y = fastDivide(xy, L.storageBrickCountXDivisor);
+        GridCoord storageBrickCoord = GridCoord(int(xy - y * uint(L.storageBrickCounts.x)), int(y), int(z));
+        return storageBrickCoord * L.brickSize + (c - brick * L.brickSize);
+    }
+
+    GridCoord s = c + L.probeScrollOffset;
+    return s - L.probeCounts * ivec3(greaterThanEqual(s, L.probeCounts));
+}
+
+/** Inverse of storageGridCoord() for dense grids. Sparse grids generate their probe rays on the CPU,
+    which has the inverse brick table. */
+GridCoord latticeGridCoord(in IrradianceField L, GridCoord s) {
+    GridCoord c = s - L.probeScrollOffset;
+    return c + L.probeCounts * ivec3(lessThan(c, GridCoord(0)));
+}
+
+/** Column and row of the probe in the probe atlases (and the per-probe textures that share their
+    layout), in units of probes, from its storage coordinate. Matches ProbeMath::probeAtlasCoord. */
+ivec2 probeAtlasCoord(in IrradianceField L, GridCoord c) {
+    if (L.probeAtlasSlicesPerRow == 0) {
+        return ivec2(c.x + c.y * L.storageProbeCounts.x, c.z);
+    } else {
+        int tileRow = int(fastDivide(uint(c.z), L.probeAtlasSliceDivisor));
+        int tileColumn = c.z - tileRow * L.probeAtlasSlicesPerRow;
+        return ivec2(c.x + tileColumn * L.storageProbeCounts.x, c.y + tileRow * L.storageProbeCounts.y);
+    }
+}
+
+
+/** Normalized texture coordinate of the top-left interior texel corner of the probe at \a atlasCoord.
+    The (2, 2) compensates for the 1 pixel border around the texture and the further 1 pixel border
+    around the top left probe. */
+vec2 probeAtlasOrigin(ivec2 atlasCoord, int fullTextureWidth, int fullTextureHeight, int probeSideLength) {
+    // Length of a probe side, plus one pixel on each edge for the border
+    float probeWithBorderSide = float(probeSideLength) + 2.0f;
+
+    vec2 probeTopLeftPosition = vec2(atlasCoord) * probeWithBorderSide + vec2(2.0f, 2.0f);
+    return probeTopLeftPosition / vec2(float(fullTextureWidth), float(fullTextureHeight));
+}
+
+/** Normalized texture coordinate of direction \a dir in the probe whose probeAtlasOrigin() is \a probeOrigin */
+vec2 textureCoordFromProbeOrigin(vec3 dir, vec2 probeOrigin, int fullTextureWidth, int fullTextureHeight, int probeSideLength) {
+    vec2 normalizedOctCoord = octEncode(normalize(dir));
+    vec2 normalizedOctCoordZeroOne = (normalizedOctCoord + vec2(1.0f)) * 0.5f;
+
+    vec2 octCoordNormalizedToTextureDimensions = (normalizedOctCoordZeroOne * float(probeSideLength)) / vec2(float(fullTextureWidth), float(fullTextureHeight));
+
+    return probeOrigin + octCoordNormalizedToTextureDimensions;
+}
+
+/** Normalized texture coordinate of direction \a dir in the probe at \a atlasCoord of an octahedral atlas */
+vec2 textureCoordFromDirection(vec3 dir, ivec2 atlasCoord, int fullTextureWidth, int fullTextureHeight, int probeSideLength) {
+    return textureCoordFromProbeOrigin(dir,
+        probeAtlasOrigin(atlasCoord, fullTextureWidth, fullTextureHeight, probeSideLength),
+        fullTextureWidth, fullTextureHeight, probeSideLength);
 }
 
 
@@ -208,12 +337,23 @@ CycleIndex nearestProbeIndices(in IrradianceField L, Point3 X) {
 }
 
 
+/** Lattice position of the probe at lattice coordinate \a c, without its relocation offset. Use for trilinear weights. */
 Point3 gridCoordToPosition(in IrradianceField L, GridCoord c) {
     return L.probeStep * Vector3(c) + L.probeStartPosition;
 }
 
+/** Relocation offset of the probe at lattice coordinate \a c, which must have storage */
+Vector3 probeOffset(in IrradianceField L, GridCoord c) {
+    return texelFetch(L.probeOffsetsbuffer, probeAtlasCoord(L, storageGridCoord(L, c)), 0).xyz;
+}
+
+/** Actual position of the probe at lattice coordinate \a c, including its relocation offset. Use for visibility and ray origins. */
+Point3 probeLocation(in IrradianceField L, GridCoord c) {
+    return gridCoordToPosition(L, c) + probeOffset(L, c);
+}
+
 Point3 probeLocation(in IrradianceField L, ProbeIndex index) {
-    return gridCoordToPosition(L, probeIndexToGridCoord(L, index));
+    return probeLocation(L, latticeGridCoord(L, probeIndexToGridCoord(L, index)));
 }
 
 
@@ -240,13 +380,14 @@ int idot(ivec3 a, ivec3 b) {
    \see nextCycleIndex, baseProbeIndex
  */
 ProbeIndex relativeProbeIndex(in IrradianceField L, ProbeIndex baseProbeIndex, CycleIndex relativeIndex) {
-    // Guaranteed to be a power of 2
     ProbeIndex numProbes = L.probeCounts.x * L.probeCounts.y * L.probeCounts.z;
 
     ivec3 offset = ivec3(relativeIndex & 1, (relativeIndex >> 1) & 1, (relativeIndex >> 2) & 1);
     ivec3 stride = ivec3(1, L.probeCounts.x, L.probeCounts.x * L.probeCounts.y);
 
-    return (baseProbeIndex + idot(offset, stride)) & (numProbes - 1);
+    // The offset is less than numProbes, so one conditional subtraction wraps it
+    ProbeIndex index = baseProbeIndex + idot(offset, stride);
+    return (index >= numProbes) ? (index - numProbes) : index;
 }
 
 
@@ -0,0 +1,223 @@
+/*
+  Probe cage sampling shared by every pass that shades a point with the irradiance field.
+*/
+
+#ifndef IrradianceFieldSampling_glsl
+#define IrradianceFieldSampling_glsl
+
+#include "GridHelpers.glsl"
+#include "SphericalHarmonics.glsl"
+
+// 0 = octahedral irradiance atlas, 1 or 2 = L1 or L2 SH irradiance. Set by IrradianceField::setShaderArgs
+#ifndef IRRADIANCE_SH_ORDER
+#   define IRRADIANCE_SH_ORDER 0
+#endif
+
+/**
+  Where accumulateCageProbe() finds the irradiance of the probe at atlasCoord: its probeAtlasOrigin()
+  in the irradiance atlas, or with SH irradiance the atlas coordinate itself
+*/
+vec2 irradianceProbeOrigin(IrradianceField L, ivec2 atlasCoord) {
+#   if IRRADIANCE_SH_ORDER > 0
+        return vec2(atlasCoord);
+#   else
+        return probeAtlasOrigin(atlasCoord, L.irradianceTextureWidth, L.irradianceTextureHeight, L.irradianceProbeSideLength);
+#   endif
+}
+
+/**
+  Adds one probe of the cage around wsPosition to sumIrradiance and sumWeight, weighted by \a trilinear
+  and the backface and Chebyshev visibility weights. probePos includes the probe's relocation offset;
+  irradianceOrigin is its irradianceProbeOrigin() and depthOrigin its probeAtlasOrigin() in the depth atlas.
+*/
+void accumulateCageProbe(IrradianceField L, Point3 wsPosition, Vector3 wsN, Vector3 w_o, Vector3 trilinear,
+    Point3 probePos, vec2 irradianceOrigin, vec2 depthOrigin, inout Irradiance3 sumIrradiance, inout float sumWeight) {
+    // Bias the position at which visibility is computed; this
+    // avoids performing a shadow test *at* a surface, which is a
+    // dangerous location because that is exactly the line between
+    // shadowed and unshadowed. If the normal bias is too small,
+    // there will be light and dark leaks. If it is too large,
+    // then samples can pass through thin occluders to the other
+    // side (this can only happen if there are MULTIPLE occluders
+    // near each other, a wall surface won't pass through itself.)
+    Vector3 probeToPoint = wsPosition - probePos + (wsN + 3.0 * w_o) * L.normalBias;
+    Vector3 dir = normalize(-probeToPoint);
+
+    float weight = 1.0;
+
+    // Clamp all of the multiplies. We can't let the weight go to zero because then it would be 
+    // possible for *all* weights to be equally low and get normalized
+    // up to 1/n. We want to distinguish between weights that are 
+    // low because of different factors.
+
+    // Smooth backface test
+    {
+        // Computed without the biasing applied to the "dir" variable. 
+        // This test can cause reflection-map looking errors in the image
+        // (stuff looks shiny) if the transition is poor.
+        Vector3 trueDirectionToProbe = normalize(probePos - wsPosition);
+
+        // The naive soft backface weight would ignore a probe when
+        // it is behind the surface. That's good for walls. But for small details inside of a
+        // room, the normals on the details might rule out all of the probes that have mutual
+        // visibility to the point. So, we instead use a "wrap shading" test below inspired by
+        // NPR work.
+        // weight *= max(0.0001, dot(trueDirectionToProbe, wsN));
+
+        // The small offset at the end reduces the "going to zero" impact
+        // where this is really close to exactly opposite
+        weight *= square(max(0.0001, (dot(trueDirectionToProbe, wsN) + 1.0) * 0.5)) + 0.2;
+    }
+    
+    // Moment visibility test
+    {
+        vec2 texCoord = textureCoordFromProbeOrigin(-dir,
+            depthOrigin,
+            L.depthTextureWidth,
+            L.depthTextureHeight,
+            L.depthProbeSideLength);
+
+        float distToProbe = length(probeToPoint);
+
+        float2 temp = texture(L.meanMeanSquaredProbeGridbuffer, texCoord, 0).rg * L.depthMomentScale;
+        float mean = temp.x;
+        float variance = abs(square(temp.x) - temp.y);
+
+        // http://www.punkuser.net/vsm/vsm_paper.pdf; equation 5
+        // Need the max in the denominator because biasing can cause a negative displacement
+        float chebyshevWeight = variance / (variance + square(max(distToProbe - mean, 0.0)));
+            
+        // Increase contrast in the weight 
+        chebyshevWeight = max(pow3(chebyshevWeight), 0.0);
+
+        weight *= (distToProbe <= mean) ? 1.0 : chebyshevWeight;
+    }
+
+    // Avoid zero weight
+    weight = max(0.000001, weight);
+             
+    Vector3 irradianceDir = wsN;
+
+#   if IRRADIANCE_SH_ORDER > 0
+        Irradiance3 probeIrradiance = shIrradiance(L.irradianceSHbuffer, ivec2(irradianceOrigin), normalize(irradianceDir), IRRADIANCE_SH_ORDER);
+#   else
+        vec2 texCoord = textureCoordFromProbeOrigin(normalize(irradianceDir),
+            irradianceOrigin,
+            L.irradianceTextureWidth,
+            L.irradianceTextureHeight,
+            L.irradianceProbeSideLength);
+
+        Irradiance3 probeIrradiance = texture(L.irradianceProbeGridbuffer, texCoord).rgb;
+#   endif
+
+    // A tiny bit of light is really visible due to log perception, so
+    // crush tiny weights but keep the curve continuous. This must be done
+    // before the trilinear weights, because those should be preserved.
+    const float crushThreshold = 0.2;
+    if (weight < crushThreshold) {
+        weight *= weight * weight * (1.0 / square(crushThreshold)); 
+    }
+
+    // Trilinear weights
+    weight *= trilinear.x * trilinear.y * trilinear.z;
+
+    // Weight in a more-perceptual brightness space instead of radiance space.
+    // This softens the transitions between probes with respect to translation.
+    // It makes little difference most of the time, but when there are radical transitions
+    // between probes this helps soften the ramp.
+#   if LINEAR_BLENDING == 0
+        probeIrradiance = sqrt(probeIrradiance);
+#   endif
+
+    sumIrradiance += weight * probeIrradiance;
+    sumWeight += weight;
+}
+
+/**
+  Normalizes the sums of accumulateCageProbe() and converts them back to linear irradiance
+*/
+Irradiance3 resolveCageIrradiance(Irradiance3 sumIrradiance, float sumWeight) {
+    // Every probe of the cage can only be missing in sparse grids, away from geometry
+    Irradiance3 netIrradiance = sumIrradiance / max(sumWeight, 1e-9);
+
+    // Go back to linear irradiance
+#   if LINEAR_BLENDING == 0
+        netIrradiance = square(netIrradiance);
+#   endif
+
+    return netIrradiance;
+}
+
+/**
+  Irradiance at wsPosition, with shading normal wsN and unit vector w_o toward the viewer,
+  blended from the eight surrounding probes with the trilinear, backface and Chebyshev
+  visibility weights. Callers apply energy preservation and convert to radiance.
+*/
+Irradiance3 sampleIrradianceField(IrradianceField L, Point3 wsPosition, Vector3 wsN, Vector3 w_o) {
+    ivec3 baseGridCoord = baseGridCoord(L, wsPosition);
+    Point3 baseProbePos = gridCoordToPosition(L, baseGridCoord);
+    Irradiance3 sumIrradiance = Irradiance3(0);
+    float sumWeight = 0.0;
+
+    // alpha is how far from the floor(currentVertex) position. on [0, 1] for each axis.
+    Vector3 alpha = clamp((wsPosition - baseProbePos) / L.probeStep, Vector3(0), Vector3(1));
+
+    // Iterate over adjacent probe cage
+    for (int i = 0; i < 8; ++i) {
+        // Compute the offset grid coord and clamp to the probe grid boundary
+        // Offset = 0 or 1 along each axis
+        GridCoord  offset = ivec3(i, i >> 1, i >> 2) & ivec3(1);
+        GridCoord  probeGridCoord = clamp(baseGridCoord + offset, GridCoord(0), GridCoord(L.probeCounts - 1));
+        GridCoord  storageCoord = storageGridCoord(L, probeGridCoord);
+        if (storageCoord.x < 0) {
+            // Unallocated brick of a sparse grid, which has no geometry nearby
+            continue;
+        }
+        ivec2      atlasCoord = probeAtlasCoord(L, storageCoord);
+
+        // Make cosine falloff in tangent plane with respect to the angle from the surface to the probe so that we never
+        // test a probe that is *behind* the surface.
+        // It doesn't have to be cosine, but that is efficient to compute and we must clip to the tangent plane.
+        Point3 probePos = gridCoordToPosition(L, probeGridCoord) + texelFetch(L.probeOffsetsbuffer, atlasCoord, 0).xyz;
+
+        // Compute the trilinear weights based on the grid cell vertex to smoothly
+        // transition between probes. Avoid ever going entirely to zero because that
+        // will cause problems at the border probes. This isn't really a lerp. 
+        // We're using 1-a when offset = 0 and a when offset = 1.
+        Vector3 trilinear = lerp(1.0 - alpha, alpha, offset);
+
+        accumulateCageProbe(L, wsPosition, wsN, w_o, trilinear, probePos,
+            irradianceProbeOrigin(L, atlasCoord),
+            probeAtlasOrigin(atlasCoord, L.depthTextureWidth, L.depthTextureHeight, L.depthProbeSideLength),
+            sumIrradiance, sumWeight);
+    }
+
+    return resolveCageIrradiance(sumIrradiance, sumWeight);
+}
+
+/**
+  Fraction of the shading at wsPosition that cascade L should provide: 1 more than blendCells
+  probe spacings inside its grid, falling to 0 at the outermost probes.
+*/
+float cascadeCoverage(IrradianceField L, Point3 wsPosition, float blendCells) {
+    Point3 lo = L.probeStartPosition;
+    Point3 hi = lo + L.probeStep * Vector3(L.probeCounts - 1);
+    Vector3 inside = min(wsPosition - lo, hi - wsPosition) / L.probeStep;
+    return clamp(min(inside.x, min(inside.y, inside.z)) / blendCells, 0.0, 1.0);
+}
+
+/**
+  Adds cascade L's share of the irradiance at wsPosition to sum. Its share is its coverage times the
+  weight that the finer cascades left in remaining. Pass blendCells = 0 for the coarsest cascade,
+  which takes the rest. The probe lookups are skipped when the share is zero, so a pixel samples at
+  most two cascades. The atlases have no MIP levels, so the divergent texture fetches are safe.
+*/
+void accumulateCascade(IrradianceField L, Point3 wsPosition, Vector3 wsN, Vector3 w_o, float blendCells, inout float remaining, inout Irradiance3 sum) {
+    float weight = remaining * ((blendCells > 0.0) ? cascadeCoverage(L, wsPosition, blendCells) : 1.0);
+    if (weight > 0.0) {
+        sum += weight * sampleIrradianceField(L, wsPosition, wsN, w_o);
+        remaining -= weight;
+    }
+}
+
+#endif
@@ -0,0 +1,73 @@
+/*
+  Per-screen-tile cache of the probe cage addressing, built by GIRenderer_BuildProbeCellCache.glc
+  and read by GIRenderer_ComputeIndirect.pix. See CGIRenderer::buildProbeCellCache.
+
+  Each PROBE_CELL_TILE_SIZE^2 tile of the indirect buffer has PROBE_CELL_CACHE_ENTRIES consecutive
+  texels in a row of two RGBA32F textures. Entry 0 of probeCellPositions is the header: xyz = the
+  lowest base grid coordinate of the tile's pixels, w = 1 if the tile is cached. A tile is cached
+  when the base grid coordinates of its pixels span at most PROBE_CELL_SPAN cells along each axis,
+  so that their cages fit in a block of (PROBE_CELL_SPAN + 1)^3 probes.
+
+  Entry 1 + x + y * (PROBE_CELL_SPAN + 1) + z * (PROBE_CELL_SPAN + 1)^2 describes the probe at
+  header.xyz + (x, y, z), clamped to the grid like the cage in sampleIrradianceField():
+    probeCellPositions:    xyz = probe position with its relocation offset, w = 0 if it has no storage
+    probeCellAtlasOrigins: xy = irradianceProbeOrigin(), zw = probeAtlasOrigin() in the depth atlas
+*/
+
+#ifndef ProbeCellCache_glsl
+#define ProbeCellCache_glsl
+
+#include "IrradianceFieldSampling.glsl"
+
+// Keep in sync with CGIRenderer::probeCellTileSize
+#define PROBE_CELL_TILE_SIZE        16
+#define PROBE_CELL_SPAN             2
+#define PROBE_CELL_BLOCK_SIDE       (PROBE_CELL_SPAN + 1)
+#define PROBE_CELL_CACHE_ENTRIES    (1 + PROBE_CELL_BLOCK_SIDE * PROBE_CELL_BLOCK_SIDE * PROBE_CELL_BLOCK_SIDE)
+
+ivec2 probeCellEntryCoord(ivec2 tile, int entry) {
+    return ivec2(tile.x * PROBE_CELL_CACHE_ENTRIES + entry, tile.y);
+}
+
+/**
+  Same as sampleIrradianceField(), with the probe positions and atlas origins of the cage read from
+  the cache of the pixel's tile. Falls back to sampleIrradianceField() when the tile is not cached or
+  the pixel's cage is outside the tile's block.
+*/
+Irradiance3 sampleIrradianceFieldCached(IrradianceField L, Point3 wsPosition, Vector3 wsN, Vector3 w_o,
+    sampler2D probeCellPositions, sampler2D probeCellAtlasOrigins, ivec2 tile) {
+
+    ivec3 baseGridCoord = baseGridCoord(L, wsPosition);
+    vec4 header = texelFetch(probeCellPositions, probeCellEntryCoord(tile, 0), 0);
+    ivec3 blockCoord = baseGridCoord - ivec3(header.xyz);
+    if ((header.w == 0.0) || any(lessThan(blockCoord, ivec3(0))) || any(greaterThan(blockCoord, ivec3(PROBE_CELL_SPAN - 1)))) {
+        return sampleIrradianceField(L, wsPosition, wsN, w_o);
+    }
+
+    Point3 baseProbePos = gridCoordToPosition(L, baseGridCoord);
+    Irradiance3 sumIrradiance = Irradiance3(0);
+    float sumWeight = 0.0;
+
+    // alpha is how far from the floor(currentVertex) position. on [0, 1] for each axis.
+    Vector3 alpha = clamp((wsPosition - baseProbePos) / L.probeStep, Vector3(0), Vector3(1));
+
+    for (int i = 0; i < 8; ++i) {
+        GridCoord offset = ivec3(i, i >> 1, i >> 2) & ivec3(1);
+        ivec3 c = blockCoord + offset;
+        ivec2 entry = probeCellEntryCoord(tile, 1 + c.x + c.y * PROBE_CELL_BLOCK_SIDE + c.z * PROBE_CELL_BLOCK_SIDE * PROBE_CELL_BLOCK_SIDE);
+
+        vec4 probePos = texelFetch(probeCellPositions, entry, 0);
+        if (probePos.w == 0.0) {
+            // Unallocated brick of a sparse grid, which has no geometry nearby
+            continue;
+        }
+        vec4 atlasOrigins = texelFetch(probeCellAtlasOrigins, entry, 0);
+
+        Vector3 trilinear = lerp(1.0 - alpha, alpha, offset);
+        accumulateCageProbe(L, wsPosition, wsN, w_o, trilinear, probePos.xyz, atlasOrigins.xy, atlasOrigins.zw, sumIrradiance, sumWeight);
+    }
+
+    return resolveCageIrradiance(sumIrradiance, sumWeight);
+}
+
+#endif
@@ -0,0 +1,45 @@
+#ifndef RayHitRecord_glsl
+#define RayHitRecord_glsl
+
+#include <g3dmath.glsl>
+#include <octahedral.glsl>
+
+/*
+  Decoding of the 16-byte packed probe ray hits written by IrradianceField (see RayHitRecord.h).
+  x = float bits of the hit distance (negative on a miss), y = octahedral normal as snorm16x2,
+  z = lambertian RGB8 with a backface flag in alpha, w = emissive RGB9E5.
+*/
+
+struct RayHit {
+    bool        hit;
+    float       distance;
+    Vector3     normal;
+    Color3      lambertian;
+    Radiance3   emissive;
+};
+
+Color3 unpackRGB9E5(uint v) {
+    float scale = exp2(float(int(v >> 27) - 15 - 9));
+    return Color3(float(v & 0x1FFu), float((v >> 9) & 0x1FFu), float((v >> 18) & 0x1FFu)) * scale;
+}
+
+RayHit unpackRayHitRecord(uvec4 record) {
+    RayHit h;
+    h.distance   = uintBitsToFloat(record.x);
+    h.hit        = (h.distance >= 0.0);
+    h.normal     = h.hit ? octDecode(unpackSnorm2x16(record.y)) : Vector3(0.0);
+    h.lambertian = unpackUnorm4x8(record.z).rgb;
+    h.emissive   = unpackRGB9E5(record.w);
+    return h;
+}
+
+/* Only the distance and normal, for the probe update passes */
+float unpackRayHitDistance(uvec4 record) {
+    return uintBitsToFloat(record.x);
+}
+
+Vector3 unpackRayHitNormal(uvec4 record) {
+    return (uintBitsToFloat(record.x) >= 0.0) ? octDecode(unpackSnorm2x16(record.y)) : Vector3(0.0);
+}
+
+#endif
@@ -0,0 +1,53 @@
+/*
+  Real spherical harmonics up to L2 for the SH irradiance probes. See IrradianceField::Specification::irradianceSHOrder.
+  Matches ProbeMath::shBasis and ProbeMath::shIrradiance.
+
+  Each probe stores shCoefficientCount(order) RGB radiance coefficients in consecutive texels of one row
+  of IrradianceField::m_irradianceSH, starting at (atlasCoord.x * shCoefficientCount(order), atlasCoord.y).
+*/
+
+#ifndef SphericalHarmonics_glsl
+#define SphericalHarmonics_glsl
+
+#include <g3dmath.glsl>
+
+int shCoefficientCount(int order) {
+    return (order + 1) * (order + 1);
+}
+
+/** Basis functions up to L2 at unit direction d. Lower orders use the first shCoefficientCount() values. */
+void shBasis(vec3 d, out float Y[9]) {
+    Y[0] = 0.282095;
+    Y[1] = 0.488603 * d.y;
+    Y[2] = 0.488603 * d.z;
+    Y[3] = 0.488603 * d.x;
+    Y[4] = 1.092548 * d.x * d.y;
+    Y[5] = 1.092548 * d.y * d.z;
+    Y[6] = 0.315392 * (3.0 * d.z * d.z - 1.0);
+    Y[7] = 1.092548 * d.x * d.z;
+    Y[8] = 0.546274 * (d.x * d.x - d.y * d.y);
+}
+
+/**
+  Cosine-weighted mean radiance about n, which is what the octahedral irradiance atlas stores, from the
+  radiance coefficients of the probe at atlasCoord. The clamped cosine convolution of each band
+  (Ramamoorthi and Hanrahan 2001) is divided by pi.
+*/
+Irradiance3 shIrradiance(sampler2D coefficients, ivec2 atlasCoord, vec3 n, int order) {
+    const float bandScale[3] = float[3](1.0, 2.0 / 3.0, 0.25);
+    int count = shCoefficientCount(order);
+
+    float Y[9];
+    shBasis(n, Y);
+
+    Irradiance3 result = Irradiance3(0);
+    for (int i = 0; i < count; ++i) {
+        int band = (i == 0) ? 0 : ((i < 4) ? 1 : 2);
+        result += texelFetch(coefficients, ivec2(atlasCoord.x * count + i, atlasCoord.y), 0).rgb * (bandScale[band] * Y[i]);
+    }
+
+    // Ringing of the truncated expansion can go slightly negative
+    return max(result, Irradiance3(0));
+}
+
+#endif
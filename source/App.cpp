@@ -1,4 +1,5 @@
 #include "App.h"
+#include "ProbeBenchmark.h"
 
 G3D_START_AT_MAIN();
 
@@ -31,12 +32,40 @@ int main(int argc, const char* argv[])
 	settings.screenCapture.includeG3DRevision = false;
 	settings.screenCapture.filenamePrefix = "_";
 
+	// Benchmarks and bakes run without showing a window
+	if (settings.argArray.contains("--benchmark") || settings.argArray.contains("--bake"))
+	{
+		settings.window.visible = false;
+	}
+
 	return App(settings).run();
 }
 
 
 App::App(const GApp::Settings& settings) : GApp(settings)
 {
+	m_benchmarkMode = settings.argArray.contains("--benchmark");
+	m_bakeMode = settings.argArray.contains("--bake");
+
+	for (const String& arg : settings.argArray)
+	{
+		if (beginsWith(arg, "--bakeFrames="))
+		{
+			m_bakeFrames = max(1, atoi(arg.substr(13).c_str()));
+		}
+		else if (beginsWith(arg, "--benchmarkFrames="))
+		{
+			m_benchmarkFrames = max(2, atoi(arg.substr(18).c_str()));
+		}
+		else if (beginsWith(arg, "--benchmarkReferenceFrames="))
+		{
+			m_benchmarkReferenceFrames = max(1, atoi(arg.substr(27).c_str()));
+		}
+		else if (beginsWith(arg, "--probeStatsLog="))
+		{
+			m_probeStatsLogFilename = arg.substr(16);
+		}
+	}
 }
 
 void App::onInit()
@@ -61,14 +90,154 @@ void App::onInit()
 	m_renderer = m_pGIRenderer;
 	
 	makeGUI();
+
+	if (m_benchmarkMode)
+	{
+		runBenchmarks();
+	}
+	else if (m_bakeMode)
+	{
+		runBake();
+	}
+}
+
+/** Files matching \a pattern in the data directory \a directory, sorted so that runs are comparable */
+static Array<String> dataFiles(const String& directory, const String& pattern)
+{
+	Array<String> files;
+	FileSystem::getFiles(FilePath::concat(System::findDataFile(directory, false), pattern), files, true);
+	files.sort();
+	return files;
+}
+
+void App::runBenchmarks()
+{
+	ProbeBenchmark benchmark;
+	const Array<ProbeBenchmark::ProbeUpdateConfiguration>& configurations = ProbeBenchmark::defaultProbeUpdateConfigurations();
+
+	for (const String& sceneFile : dataFiles("scenes", "*.Scene.Any"))
+	{
+		const String& sceneName = Any::fromFile(sceneFile)["name"].string();
+		loadScene(sceneName);
+		benchmark.benchmarkSceneTriTrees(sceneName, scene());
+		benchmark.benchmarkProbeTracing(sceneName, scene());
+		benchmark.benchmarkProbeUpdates(sceneName, scene(), renderDevice, configurations, m_benchmarkFrames, m_benchmarkReferenceFrames);
+		benchmark.benchmarkCPUReference(sceneName, scene(), renderDevice);
+
+		// Compression error is only meaningful on converged probes
+		convergeProbes(m_bakeFrames);
+		benchmark.benchmarkAtlasCompression(sceneName, m_pIrradianceField);
+	}
+
+	for (const String& modelFile : dataFiles("data/model/CornellBox", "*.ArticulatedModel.Any"))
+	{
+		const String& sceneName = loadModelScene(modelFile);
+		benchmark.benchmarkSceneTriTrees(sceneName, scene());
+		benchmark.benchmarkProbeTracing(sceneName, scene());
+		benchmark.benchmarkProbeUpdates(sceneName, scene(), renderDevice, configurations, m_benchmarkFrames, m_benchmarkReferenceFrames);
+		benchmark.benchmarkSHIrradiance(sceneName, scene(), renderDevice, m_benchmarkFrames, m_benchmarkReferenceFrames);
+	}
+
+	benchmark.benchmarkProbeIndexMath({ Vector3int32(32, 16, 32), Vector3int32(20, 16, 20), Vector3int32(24, 12, 24), Vector3int32(64, 32, 64) });
+
+	benchmark.save();
+	setExitCode(0);
+}
+
+String App::loadModelScene(const String& modelFilename)
+{
+	// Provides the camera, light and skybox
+	loadScene("Dragon (Dynamic Light Source)");
+
+	Array<shared_ptr<VisibleEntity>> entities;
+	scene()->getTypedEntityArray(entities);
+	for (const shared_ptr<VisibleEntity>& entity : entities)
+	{
+		if (notNull(entity->model()))
+		{
+			scene()->removeEntity(entity->name());
+		}
+	}
+
+	// "name.ArticulatedModel.Any" -> "name"
+	const String& name = FilePath::base(FilePath::base(modelFilename));
+	const shared_ptr<ArticulatedModel>& model = ArticulatedModel::create(ArticulatedModel::Specification(Any::fromFile(modelFilename)), name);
+	scene()->insert(model);
+	scene()->insert(VisibleEntity::create(name, scene().get(), model, CFrame()));
+
+	// Poses the entity, which sets the bounds that the probe grid is fitted to
+	scene()->onSimulation(0.0f);
+
+	return name;
+}
+
+void App::convergeProbes(int frames)
+{
+	// The irradiance field only uses the surfaces to find the skybox
+	Array<shared_ptr<Surface>> surfaceArray;
+	scene()->onPose(surfaceArray);
+
+	for (int frame = 0; frame < frames; ++frame)
+	{
+		renderDevice->beginFrame();
+		m_pIrradianceField->onGraphics3D(renderDevice, surfaceArray);
+		renderDevice->endFrame();
+	}
+}
+
+void App::runBake()
+{
+	for (const String& sceneFile : dataFiles("scenes", "*.Scene.Any"))
+	{
+		const String& sceneName = Any::fromFile(sceneFile)["name"].string();
+
+		// Starts from the existing cache, if it is still valid, and refines it
+		loadScene(sceneName);
+
+		const RealTime start = System::time();
+		convergeProbes(m_bakeFrames);
+		m_pIrradianceField->saveProbeCache();
+		debugPrintf("Baked %s: %d frames in %.1f s\n", sceneName.c_str(), m_bakeFrames, System::time() - start);
+	}
+
+	setExitCode(0);
 }
 
 void App::onGraphics3D(RenderDevice * rd, Array<shared_ptr<Surface>>& surface3D)
 {
-	if (m_pIrradianceField)
+	if (m_pIrradianceFieldCascades)
 	{
+		m_pIrradianceFieldCascades->setViewerPosition(activeCamera()->frame().translation);
+		m_pIrradianceFieldCascades->onGraphics3D(rd, surface3D);
+		m_pIrradianceFieldCascades->debugDraw();
+
+		screenPrintf("Active probes: %d / %d in %d cascades", m_pIrradianceFieldCascades->activeProbeCount(),
+			m_pIrradianceFieldCascades->probeCount(), m_pIrradianceFieldCascades->cascadeCount());
+		screenPrintf("Probes updated this frame: %d", m_pIrradianceFieldCascades->scheduledProbeCount());
+		screenPrintf("Converged probes: %d", m_pIrradianceFieldCascades->convergedProbeCount());
+		screenPrintf("Invalidated probes: %d", m_pIrradianceFieldCascades->invalidatedProbeCount());
+	}
+	else if (m_pIrradianceField)
+	{
+		m_pIrradianceField->setViewerPosition(activeCamera()->frame().translation);
 		m_pIrradianceField->onGraphics3D(rd, surface3D);
 		m_pIrradianceField->debugDraw();
+
+		screenPrintf("Active probes: %d / %d (%.1f%%)", m_pIrradianceField->activeProbeCount(),
+			m_pIrradianceField->probeCount(), 100.0f * m_pIrradianceField->activeProbeFraction());
+		screenPrintf("Probes updated this frame: %d", m_pIrradianceField->scheduledProbeCount());
+		screenPrintf("Converged probes: %d (%d rays each)", m_pIrradianceField->convergedProbeCount(), m_pIrradianceField->convergedRaysPerProbe());
+		screenPrintf("Invalidated probes: %d (%d lights, %d entities changed)", m_pIrradianceField->invalidatedProbeCount(),
+			m_pIrradianceField->sceneChangeTracker().changedLightCount(), m_pIrradianceField->sceneChangeTracker().changedEntityCount());
+
+		const ProbeStats::Frame& stats = m_pIrradianceField->stats().averageFrame(30);
+		screenPrintf("Probe pipeline: %.2f ms CPU (trace %.2f ms), %.2f ms GPU; %d rays, %.0f%% miss, %.0f%% backface",
+			stats.totalCPUMilliseconds(), stats.cpuMilliseconds[ProbeStats::TRACE], stats.totalGPUMilliseconds(),
+			stats.raysTraced, 100.0f * stats.missFraction(), 100.0f * stats.backfaceFraction());
+		if (m_pIrradianceField->isSparse())
+		{
+			screenPrintf("Probe bricks allocated: %d / %d", m_pIrradianceField->allocatedBrickCount(), m_pIrradianceField->brickCount());
+		}
 	}
 
 	GApp::onGraphics3D(rd, surface3D);
@@ -76,9 +245,45 @@ void App::onGraphics3D(RenderDevice * rd, Array<shared_ptr<Surface>>& surface3D)
 
 void App::onAfterLoadScene(const Any & any, const String & sceneName)
 {
+	m_sceneName = sceneName;
 	m_pIrradianceField = IrradianceField::create(sceneName, scene());
 	m_pIrradianceField->onSceneChanged(scene());
 	m_pGIRenderer->setIrradianceField(m_pIrradianceField);
+	if (!m_probeStatsLogFilename.empty())
+	{
+		// About an hour at 60 Hz
+		m_pIrradianceField->stats().setMaxFrames(216000);
+	}
+
+	// Recreated for the new scene
+	m_pIrradianceFieldCascades = nullptr;
+	setUseCascades(m_useCascades);
+}
+
+void App::onCleanup()
+{
+	if (!m_probeStatsLogFilename.empty() && notNull(m_pIrradianceField))
+	{
+		m_pIrradianceField->stats().save(m_probeStatsLogFilename);
+		debugPrintf("Wrote %d frames of probe stats to %s\n", m_pIrradianceField->stats().frames().size(), m_probeStatsLogFilename.c_str());
+	}
+
+	GApp::onCleanup();
+}
+
+void App::setUseCascades(bool b)
+{
+	m_useCascades = b;
+	if (m_useCascades && isNull(m_pIrradianceFieldCascades))
+	{
+		m_pIrradianceFieldCascades = IrradianceFieldCascades::create(m_sceneName, scene());
+		m_pIrradianceFieldCascades->onSceneChanged(scene());
+	}
+	else if (!m_useCascades)
+	{
+		m_pIrradianceFieldCascades = nullptr;
+	}
+	m_pGIRenderer->setIrradianceFieldCascades(m_pIrradianceFieldCascades);
 }
 
 void App::makeGUI()
@@ -86,6 +291,29 @@ void App::makeGUI()
 	debugWindow->setVisible(true);
 	developerWindow->videoRecordDialog->setEnabled(true);
 
+	debugPane->addButton("Save probe cache", [this]() { m_pIrradianceField->saveProbeCache(); });
+	debugPane->addCheckBox("Compressed probe atlases", Pointer<bool>(
+		[this]() { return m_pIrradianceField->sampleCompressedAtlases(); },
+		[this](bool b) { m_pIrradianceField->setSampleCompressedAtlases(b); }));
+	debugPane->addButton("Recompress", [this]() { m_pIrradianceField->compressAtlases(); });
+	debugPane->addCheckBox("Compact probe ray hits", Pointer<bool>(
+		[this]() { return m_pIrradianceField->compactRayHits(); },
+		[this](bool b) { m_pIrradianceField->setCompactRayHits(b); }));
+	debugPane->addCheckBox("Asynchronous probe tracing", Pointer<bool>(
+		[this]() { return m_pIrradianceField->asyncTrace(); },
+		[this](bool b) { m_pIrradianceField->setAsyncTrace(b); }));
+	debugPane->addCheckBox("Light change invalidation", Pointer<bool>(
+		[this]() { return m_pIrradianceField->lightChangeInvalidation(); },
+		[this](bool b) { m_pIrradianceField->setLightChangeInvalidation(b); }));
+	debugPane->addNumberBox("SH irradiance order", Pointer<int>(
+		[this]() { return m_pIrradianceField->irradianceSHOrder(); },
+		[this](int order) { m_pIrradianceField->setIrradianceSHOrder(order); }), "", GuiTheme::NO_SLIDER, 0, 2);
+	debugPane->addCheckBox("Camera-centered cascades", Pointer<bool>(
+		[this]() { return m_useCascades; },
+		[this](bool b) { setUseCascades(b); }));
+	debugPane->addCheckBox("Probe cell cache", Pointer<bool>(m_pGIRenderer, &CGIRenderer::probeCellCache, &CGIRenderer::setProbeCellCache));
+	debugPane->addNumberBox("Indirect downsample", Pointer<int>(m_pGIRenderer, &CGIRenderer::indirectDownsample, &CGIRenderer::setIndirectDownsample), "x", GuiTheme::NO_SLIDER, 1, 4);
+
 	debugWindow->pack();
 	debugWindow->setRect(Rect2D::xywh(0, 0, (float)window()->width(), debugWindow->rect().height()));
 }
@@ -7,13 +7,55 @@ class App : public GApp
 {
 	shared_ptr<CGIRenderer>     m_pGIRenderer;
 	shared_ptr<IrradianceField> m_pIrradianceField;
+
+	/** Camera-centered cascades that replace m_pIrradianceField for shading while m_useCascades is set */
+	shared_ptr<IrradianceFieldCascades> m_pIrradianceFieldCascades;
+	bool                        m_useCascades = false;
+
+	/** Name passed to onAfterLoadScene, for creating the cascades later */
+	String                      m_sceneName;
+
+	/** Set by the --benchmark command line option */
+	bool                        m_benchmarkMode = false;
+
+	/** Set by the --bake command line option */
+	bool                        m_bakeMode = false;
+
+	/** Probe updates run for each scene by runBake and before the atlas compression benchmark. Set by --bakeFrames=N. */
+	int                         m_bakeFrames = 600;
+
+	/** Probe updates timed per configuration by ProbeBenchmark::benchmarkProbeUpdates, and the updates of its
+		converged reference. Set by --benchmarkFrames=N and --benchmarkReferenceFrames=N. */
+	int                         m_benchmarkFrames = 64;
+	int                         m_benchmarkReferenceFrames = 256;
+
+	/** If not empty, the ProbeStats frame log of m_pIrradianceField is written here on exit, as JSON if
+		the name ends in .json and CSV otherwise. Set by --probeStatsLog=filename. */
+	String                      m_probeStatsLogFilename;
 protected:
 	void makeGUI();
 
+	/** Runs ProbeBenchmark over the bundled scenes and Cornell box models, writes the CSV results and exits */
+	void runBenchmarks();
+
+	/** Loads the base scene with its models replaced by an entity of the ArticulatedModel in \a modelFilename,
+		so that a bare model is lit and has a skybox. Returns the name of the new scene, which is the model file's base name. */
+	String loadModelScene(const String& modelFilename);
+
+	/** Runs the probe update \a frames times on the current scene outside the render loop */
+	void convergeProbes(int frames);
+
+	/** Converges the probes of each bundled scene without a window, writes their probe caches and exits */
+	void runBake();
+
+	/** Creates or releases m_pIrradianceFieldCascades and switches the renderer to it */
+	void setUseCascades(bool b);
+
 public:
 	App(const GApp::Settings& settings = GApp::Settings());
 
 	virtual void onInit() override;
 	virtual void onGraphics3D(RenderDevice* rd, Array<shared_ptr<Surface>>& surface3D) override;
 	virtual void onAfterLoadScene(const Any& any, const String& sceneName) override;
+	virtual void onCleanup() override;
 };
@@ -1,26 +1,115 @@
 #include "GIRenderer.h"
 
-void CGIRenderer::renderDeferredShading(RenderDevice * rd, const Array<shared_ptr<Surface>>& sortedVisibleSurfaceArray, const shared_ptr<GBuffer>& gbuffer, const LightingEnvironment & environment)
+void CGIRenderer::setIndirectDownsample(int downsample)
+{
+	m_indirectDownsample = (downsample >= 4) ? 4 : (downsample >= 2) ? 2 : 1;
+}
+
+shared_ptr<Texture> CGIRenderer::computeIndirect(RenderDevice * rd, const shared_ptr<GBuffer>& gbuffer)
 {
-	if (m_pIrradianceField)
+	const int lowWidth = iCeil(gbuffer->width() / float(m_indirectDownsample));
+	const int lowHeight = iCeil(gbuffer->height() / float(m_indirectDownsample));
+
+	// Irradiance is non-negative and low frequency, so the packed float format is sufficient
+	if (isNull(m_pGIFramebuffer))
 	{
-		if (isNull(m_pGIFramebuffer))
+		m_pGIFramebuffer = Framebuffer::create("CGIRenderer::m_pGIFramebuffer");
+		m_pGIFramebuffer->set(Framebuffer::COLOR0, Texture::createEmpty("CGIRenderer::Indirect", lowWidth, lowHeight, ImageFormat::R11G11B10F()));
+	}
+	m_pGIFramebuffer->resize(lowWidth, lowHeight);
+
+	const bool useProbeCellCache = m_probeCellCache && isNull(m_pIrradianceFieldCascades);
+	if (useProbeCellCache)
+	{
+		buildProbeCellCache(rd, gbuffer, lowWidth, lowHeight);
+	}
+
+	// Compute GI
+	rd->push2D(m_pGIFramebuffer); {
+		Args args;
+		gbuffer->setShaderArgsRead(args, "gbuffer_");
+		args.setRect(rd->viewport());
+		if (m_pIrradianceFieldCascades)
 		{
-			m_pGIFramebuffer = Framebuffer::create("CGIRenderer::m_pGIFramebuffer");
-			m_pGIFramebuffer->set(Framebuffer::COLOR0, Texture::createEmpty("CGIRenderer::Indirect", gbuffer->width(), gbuffer->height(), ImageFormat::RGBA32F()));
+			m_pIrradianceFieldCascades->setShaderArgs(args);
 		}
-		m_pGIFramebuffer->resize(gbuffer->width(), gbuffer->height());
-
-		// Compute GI
-		rd->push2D(m_pGIFramebuffer); {
-			Args args;
-			gbuffer->setShaderArgsRead(args, "gbuffer_");
-			args.setRect(rd->viewport());
+		else
+		{
 			m_pIrradianceField->setShaderArgs(args, "irradianceFieldSurface.");
-			args.setUniform("energyPreservation", 1.0f);
+		}
+		args.setUniform("energyPreservation", 1.0f);
+		args.setMacro("INDIRECT_DOWNSAMPLE", m_indirectDownsample);
+		args.setMacro("PROBE_CELL_CACHE", useProbeCellCache ? 1 : 0);
+		if (useProbeCellCache)
+		{
+			args.setUniform("probeCellPositions", m_probeCellPositions, Sampler::buffer());
+			args.setUniform("probeCellAtlasOrigins", m_probeCellAtlasOrigins, Sampler::buffer());
+		}
+
+		LAUNCH_SHADER("shaders/GIRenderer_ComputeIndirect.pix", args);
+	} rd->pop2D();
+
+	if (m_indirectDownsample == 1)
+	{
+		return m_pGIFramebuffer->texture(0);
+	}
 
-			LAUNCH_SHADER("shaders/GIRenderer_ComputeIndirect.pix", args);
-		} rd->pop2D();
+	if (isNull(m_pGIUpsampleFramebuffer))
+	{
+		m_pGIUpsampleFramebuffer = Framebuffer::create("CGIRenderer::m_pGIUpsampleFramebuffer");
+		m_pGIUpsampleFramebuffer->set(Framebuffer::COLOR0, Texture::createEmpty("CGIRenderer::IndirectUpsampled", gbuffer->width(), gbuffer->height(), ImageFormat::R11G11B10F()));
+	}
+	m_pGIUpsampleFramebuffer->resize(gbuffer->width(), gbuffer->height());
+
+	rd->push2D(m_pGIUpsampleFramebuffer); {
+		Args args;
+		gbuffer->setShaderArgsRead(args, "gbuffer_");
+		args.setRect(rd->viewport());
+		args.setUniform("lowResIndirectBuffer", m_pGIFramebuffer->texture(0), Sampler::buffer());
+		args.setUniform("normalSharpness", m_upsampleNormalSharpness);
+		args.setUniform("planeDistanceTolerance", m_upsamplePlaneDistanceTolerance);
+		args.setMacro("INDIRECT_DOWNSAMPLE", m_indirectDownsample);
+
+		LAUNCH_SHADER("shaders/GIRenderer_UpsampleIndirect.pix", args);
+	} rd->pop2D();
+
+	return m_pGIUpsampleFramebuffer->texture(0);
+}
+
+void CGIRenderer::buildProbeCellCache(RenderDevice* rd, const shared_ptr<GBuffer>& gbuffer, int indirectWidth, int indirectHeight)
+{
+	const Vector2int32 tileCount(iCeil(indirectWidth / float(probeCellTileSize)), iCeil(indirectHeight / float(probeCellTileSize)));
+	const int cacheWidth = tileCount.x * probeCellCacheEntries;
+	if (isNull(m_probeCellPositions) || (m_probeCellPositions->width() != cacheWidth) || (m_probeCellPositions->height() != tileCount.y))
+	{
+		m_probeCellPositions = Texture::createEmpty("CGIRenderer::m_probeCellPositions", cacheWidth, tileCount.y, ImageFormat::RGBA32F());
+		m_probeCellAtlasOrigins = Texture::createEmpty("CGIRenderer::m_probeCellAtlasOrigins", cacheWidth, tileCount.y, ImageFormat::RGBA32F());
+	}
+
+	Args args;
+	gbuffer->setShaderArgsRead(args, "gbuffer_");
+	m_pIrradianceField->setShaderArgs(args, "irradianceFieldSurface.");
+	args.setUniform("indirectSize", Vector2int32(indirectWidth, indirectHeight));
+	args.setMacro("INDIRECT_DOWNSAMPLE", m_indirectDownsample);
+	args.setImageUniform("probeCellPositionsImage", m_probeCellPositions, Access::WRITE);
+	args.setImageUniform("probeCellAtlasOriginsImage", m_probeCellAtlasOrigins, Access::WRITE);
+
+	// One work group per tile
+	args.setComputeGroupSize(Vector3int32(probeCellTileSize, probeCellTileSize, 1));
+	args.setComputeGridDim(Vector3int32(tileCount.x, tileCount.y, 1));
+
+	LAUNCH_SHADER("shaders/GIRenderer_BuildProbeCellCache.glc", args);
+
+	// Read with texelFetch by GIRenderer_ComputeIndirect.pix
+	glMemoryBarrier(GL_TEXTURE_FETCH_BARRIER_BIT);
+}
+
+void CGIRenderer::renderDeferredShading(RenderDevice * rd, const Array<shared_ptr<Surface>>& sortedVisibleSurfaceArray, const shared_ptr<GBuffer>& gbuffer, const LightingEnvironment & environment)
+{
+	shared_ptr<Texture> indirect;
+	if (m_pIrradianceField || m_pIrradianceFieldCascades)
+	{
+		indirect = computeIndirect(rd, gbuffer);
 	}
 
 	// Find the skybox
@@ -37,7 +126,7 @@ void CGIRenderer::renderDeferredShading(RenderDevice * rd, const Array<shared_pt
 		gbuffer->setShaderArgsRead(args, "gbuffer_");
 		args.setRect(rd->viewport());
 
-		args.setUniform("matteIndirectBuffer", notNull(m_pGIFramebuffer) ? m_pGIFramebuffer->texture(0) : Texture::opaqueBlack(), Sampler::buffer());
+		args.setUniform("matteIndirectBuffer", notNull(indirect) ? indirect : Texture::opaqueBlack(), Sampler::buffer());
 
 		args.setMacro("OVERRIDE_SKYBOX", true);
 		if (skyboxSurface) skyboxSurface->setShaderArgs(args, "skybox_");
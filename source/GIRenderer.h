@@ -1,13 +1,51 @@
 #pragma once
 #include <G3D/G3D.h>
 #include "IrradianceField.h"
+#include "IrradianceFieldCascades.h"
 
 class CGIRenderer :public DefaultRenderer
 {
 	shared_ptr<IrradianceField> m_pIrradianceField;
 
+	/** Used instead of m_pIrradianceField when set */
+	shared_ptr<IrradianceFieldCascades> m_pIrradianceFieldCascades;
+
+	/** Indirect illumination at 1/m_indirectDownsample resolution in each dimension */
 	shared_ptr<Framebuffer>     m_pGIFramebuffer;
+
+	/** Full-resolution indirect illumination reconstructed from m_pGIFramebuffer. Unused when m_indirectDownsample == 1. */
+	shared_ptr<Framebuffer>     m_pGIUpsampleFramebuffer;
+
+	/** 1, 2 or 4 */
+	int                         m_indirectDownsample = 1;
+
+	/** Bilateral upsample weights. See GIRenderer_UpsampleIndirect.pix */
+	float                       m_upsampleNormalSharpness = 16.0f;
+	float                       m_upsamplePlaneDistanceTolerance = 0.02f;
+
+	/** If true, precompute the probe positions and atlas origins of the probe cells that each screen tile
+		covers, so that GIRenderer_ComputeIndirect.pix reads its probe cage instead of addressing it per
+		pixel. Only used with a single irradiance field. See ProbeCellCache.glsl */
+	bool                        m_probeCellCache = true;
+
+	/** Per-tile probe cell cache, written by GIRenderer_BuildProbeCellCache.glc */
+	shared_ptr<Texture>         m_probeCellPositions;
+	shared_ptr<Texture>         m_probeCellAtlasOrigins;
+
+	/** Evaluates the probe field for every gbuffer pixel (or every m_indirectDownsample^2 block) and
+		returns the full-resolution indirect illumination */
+	shared_ptr<Texture> computeIndirect(RenderDevice* rd, const shared_ptr<GBuffer>& gbuffer);
+
+	/** Fills m_probeCellPositions and m_probeCellAtlasOrigins for an indirect buffer of \a indirectWidth x \a indirectHeight */
+	void buildProbeCellCache(RenderDevice* rd, const shared_ptr<GBuffer>& gbuffer, int indirectWidth, int indirectHeight);
+
 public:
+	/** Side of the screen tiles of the probe cell cache, in indirect buffer pixels. Keep in sync with ProbeCellCache.glsl */
+	static const int probeCellTileSize = 16;
+
+	/** Texels per tile in the probe cell cache: a header and a 3x3x3 block of probes */
+	static const int probeCellCacheEntries = 28;
+
 	static shared_ptr<CGIRenderer> create()
 	{
 		return createShared<CGIRenderer>();
@@ -15,6 +53,17 @@ public:
 
 	void setIrradianceField(shared_ptr<IrradianceField> vIrradianceField) { m_pIrradianceField = vIrradianceField; }
 
+	/** Shade with camera-centered cascades instead of the irradiance field. nullptr restores the irradiance field. */
+	void setIrradianceFieldCascades(shared_ptr<IrradianceFieldCascades> vCascades) { m_pIrradianceFieldCascades = vCascades; }
+
+	/** Evaluate indirect illumination at 1/downsample resolution and upsample it with the gbuffer
+		normals and positions as the guide. Rounded to 1, 2 or 4. */
+	void setIndirectDownsample(int downsample);
+	int indirectDownsample() const { return m_indirectDownsample; }
+
+	void setProbeCellCache(bool b) { m_probeCellCache = b; }
+	bool probeCellCache() const { return m_probeCellCache; }
+
 protected:
 	CGIRenderer() {}
 
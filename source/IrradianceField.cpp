@@ -1,4 +1,5 @@
 #include "IrradianceField.h"
+#include <atomic>
 
 /** How much should the probes count when shading *themselves*? 1.0 preserves
 	energy perfectly. Lower numbers compensate for small leaks/precision by avoiding
@@ -11,7 +12,9 @@ const Array<const ImageFormat*> IrradianceField::s_irradianceFormats = {
 	ImageFormat::RGB10A2(),
 	ImageFormat::R11G11B10F(),
 	ImageFormat::RGB16F(),
-	ImageFormat::RGB32F() };
+	ImageFormat::RGB32F(),
+	ImageFormat::RGBA16F(),
+	ImageFormat::RGBA32F() };
 
 const Array<const ImageFormat*> IrradianceField::s_depthFormats = {
 	ImageFormat::RGB8(),
@@ -32,14 +35,22 @@ Any IrradianceField::Specification::toAny() const
 	a["irradianceChebyshevBias"] = irradianceChebyshevBias;
 	a["normalBias"] = normalBias;
 	a["hysteresis"] = hysteresis;
+	a["minHysteresis"] = minHysteresis;
+	a["convergedRayFraction"] = convergedRayFraction;
 	a["depthSharpness"] = depthSharpness;
 	a["irradianceRaysPerProbe"] = irradianceRaysPerProbe;
 	a["glossyToMatte"] = glossyToMatte;
 	a["singleBounce"] = singleBounce;
 	a["irradianceFormatIndex"] = irradianceFormatIndex;
 	a["depthFormatIndex"] = depthFormatIndex;
+	a["irradianceSHOrder"] = irradianceSHOrder;
+	a["probeAtlasLayout"] = probeAtlasLayout.toAny();
 	a["showLights"] = singleBounce;
 	a["encloseBounds"] = encloseBounds;
+	a["raysPerFrameBudget"] = raysPerFrameBudget;
+	a["traceMillisecondsBudget"] = traceMillisecondsBudget;
+	a["brickSize"] = brickSize;
+	a["brickAllocationMargin"] = brickAllocationMargin;
 	return a;
 }
 
@@ -56,27 +67,34 @@ IrradianceField::Specification::Specification(const Any& any)
 	reader.getIfPresent("irradianceChebyshevBias", irradianceChebyshevBias);
 	reader.getIfPresent("normalBias", normalBias);
 	reader.getIfPresent("hysteresis", hysteresis);
+	reader.getIfPresent("minHysteresis", minHysteresis);
+	reader.getIfPresent("convergedRayFraction", convergedRayFraction);
 	reader.getIfPresent("depthSharpness", depthSharpness);
 	reader.getIfPresent("irradianceRaysPerProbe", irradianceRaysPerProbe);
 	reader.getIfPresent("glossyToMatte", glossyToMatte);
 	reader.getIfPresent("singleBounce", singleBounce);
 	reader.getIfPresent("irradianceFormatIndex", irradianceFormatIndex);
 	reader.getIfPresent("depthFormatIndex", depthFormatIndex);
+	reader.getIfPresent("irradianceSHOrder", irradianceSHOrder);
+	reader.getIfPresent("probeAtlasLayout", probeAtlasLayout);
 	reader.getIfPresent("showLights", showLights);
 	reader.getIfPresent("encloseBounds", encloseBounds);
+	reader.getIfPresent("raysPerFrameBudget", raysPerFrameBudget);
+	reader.getIfPresent("traceMillisecondsBudget", traceMillisecondsBudget);
+	reader.getIfPresent("brickSize", brickSize);
+	reader.getIfPresent("brickAllocationMargin", brickAllocationMargin);
 	reader.verifyDone();
 }
 
-void IrradianceField::loadNewScene
+IrradianceField::Specification IrradianceField::loadSpecification
    (const String& sceneName,
 	const shared_ptr<Scene>& scene,
+	bool& encloseScene,
 	Vector3int32 probeCountsOverride,
 	float maxProbeDistance,
 	int irradianceCubeResolutionOverride,
 	int depthCubeResolutionOverride)
 {
-	const String& sceneFilename = Scene::sceneNameToFilename(sceneName);
-
 	// Check if there is an options file for this scene
 	const String& specName = FilePath::mangle(sceneName) + ".LightFieldModelSpecification.Any";
 	const String& irradianceFieldSpecificationFilename = System::findDataFile(specName, false);
@@ -117,14 +135,14 @@ void IrradianceField::loadNewScene
 		Vector3 boxDims = fullBox.high() - fullBox.low();
 
 		if (specExists) {
-			m_encloseScene = m_encloseScene || spec.encloseBounds;
+			encloseScene = encloseScene || spec.encloseBounds;
 		}
 
 		// In order to minimize the likelihood of probes being stuck in walls, reduce the dimensions somewhat
 		// to be enclosed in the scene bounding box, or increase them to enclose it.
-		boxDims.x *= m_encloseScene ? 1.1f : 0.9f;
-		boxDims.y *= m_encloseScene ? 1.1f : 0.7f; // Reduce y more since we only have 2 probes in that direction
-		boxDims.z *= m_encloseScene ? 1.1f : 0.9f;
+		boxDims.x *= encloseScene ? 1.1f : 0.9f;
+		boxDims.y *= encloseScene ? 1.1f : 0.7f; // Reduce y more since we only have 2 probes in that direction
+		boxDims.z *= encloseScene ? 1.1f : 0.9f;
 
 		spec.probeDimensions = AABox(fullBox.center() - boxDims * 0.5f, fullBox.center() + boxDims * 0.5f);
 	}
@@ -133,11 +151,12 @@ void IrradianceField::loadNewScene
 		spec.probeCounts = probeCountsOverride;
 	}
 	else if (maxProbeDistance > 0.0f) {
-		spec.probeCounts = Vector3int32(Vector3(spec.probeDimensions.high() - spec.probeDimensions.low()) / Vector3(maxProbeDistance, maxProbeDistance, maxProbeDistance));
-		debugPrintf("Debug probe counts: %d, %d, %d\n", spec.probeCounts.x, spec.probeCounts.y, spec.probeCounts.z);
+		// Any count works, so round up only as far as needed to keep the spacing within maxProbeDistance
+		const Vector3& dimensions = spec.probeDimensions.high() - spec.probeDimensions.low();
 		for (int i = 0; i < 3; ++i) {
-			spec.probeCounts[i] = ceilPow2(spec.probeCounts[i]);
+			spec.probeCounts[i] = max(iCeil(dimensions[i] / maxProbeDistance), 1);
 		}
+		debugPrintf("Debug probe counts: %d, %d, %d\n", spec.probeCounts.x, spec.probeCounts.y, spec.probeCounts.z);
 	}
 
 	if (irradianceCubeResolutionOverride > 0) {
@@ -147,7 +166,6 @@ void IrradianceField::loadNewScene
 		spec.depthOctResolution = depthCubeResolutionOverride;
 	}
 
-	// Assume the probe counts are powers of two.
 	int totalProbes = spec.probeCounts.x + spec.probeCounts.y + spec.probeCounts.z;
 	// Do not go larger than 8k texture
 	static const int MAX_TEXTURE_SIZE = 4096 * 4096;
@@ -165,41 +183,153 @@ void IrradianceField::loadNewScene
 		totalProbes = spec.probeCounts.x + spec.probeCounts.y + spec.probeCounts.z;
 	}
 
+	return spec;
+}
+
+float IrradianceField::maxDistanceForSpecification(const Specification& spec)
+{
 	const Vector3 boundingBoxLengths(spec.probeDimensions.high() - spec.probeDimensions.low());
 	// Slightly larger than the diagonal across the grid cell
-	m_maxDistance = (boundingBoxLengths / spec.probeCounts).length() * 1.5f;
+	return (boundingBoxLengths / spec.probeCounts).length() * 1.5f;
+}
+
+int IrradianceField::probeAtlasSlicesPerRow(ProbeAtlasLayout layout, const Vector3int32& probeCounts)
+{
+	if (layout == ProbeAtlasLayout::STRIP)
+	{
+		return 0;
+	}
+
+	// Width slicesPerRow * x, height (z / slicesPerRow) * y
+	const Vector3int32& counts = probeCounts;
+	return iClamp(iRound(sqrtf(float(counts.z * counts.y) / float(counts.x))), 1, counts.z);
+}
+
+void IrradianceField::computeProbeGrid(const Specification& spec, Point3& probeStartPosition, Vector3& probeStep)
+{
+	const Point3& lo = spec.probeDimensions.low();
+	const Point3& hi = spec.probeDimensions.high();
+	probeStep = (hi - lo) / (Vector3(spec.probeCounts) - Vector3(1, 1, 1)).max(Vector3(1, 1, 1));
+	probeStartPosition = lo;
+
+	// Special case of 1-probe high surface
+	for (int i = 0; i < 3; ++i)
+	{
+		if (spec.probeCounts[i] == 1)
+		{
+			probeStartPosition[i] = (hi[i] + lo[i]) / 2.0f;
+		}
+	}
+}
+
+void IrradianceField::loadNewScene
+   (const String& sceneName,
+	const shared_ptr<Scene>& scene,
+	Vector3int32 probeCountsOverride,
+	float maxProbeDistance,
+	int irradianceCubeResolutionOverride,
+	int depthCubeResolutionOverride)
+{
+	const Specification& spec = loadSpecification(sceneName, scene, m_encloseScene, probeCountsOverride, maxProbeDistance,
+		irradianceCubeResolutionOverride, depthCubeResolutionOverride);
+
+	m_maxDistance = maxDistanceForSpecification(spec);
 
 	init(spec);
-	allocateIntermediateBuffers();
 	m_probeFormatChanged = true;
 	generateIrradianceProbes(RenderDevice::current);
 
+	m_sceneName = sceneName;
+	{
+		Array<shared_ptr<VisibleEntity>> entities;
+		Array<shared_ptr<Surface>> surfaceArray;
+		getModelEntities(scene, false, entities);
+		poseEntities(entities, surfaceArray);
+		m_sceneHash = ProbeCache::sceneHash(scene, surfaceArray);
+	}
+
+	m_warmStart = false;
+	// The brick allocation of sparse grids depends on the scene trees, which are built later
+	if (m_loadProbeCache && !isSparse() && loadProbeCache(probeCacheFilename(sceneName)))
+	{
+		debugPrintf("Probes loaded from %s\n", probeCacheFilename(sceneName).c_str());
+	}
+
 	debugPrintf("Load complete.\n");
 }
 
+void IrradianceField::loadNewCascade
+   (const String& sceneName,
+	const shared_ptr<Scene>& scene,
+	Vector3int32 probeCounts,
+	float probeSpacing)
+{
+	bool encloseScene = false;
+	Specification spec = loadSpecification(sceneName, scene, encloseScene, probeCounts, -1.0f);
+
+	// Only the extent of the grid matters; scrollTo places it around the viewer
+	spec.brickSize = 0;
+	spec.probeDimensions = AABox(Point3::zero(), Point3(Vector3(spec.probeCounts - Vector3int32(1, 1, 1)) * probeSpacing));
+
+	m_maxDistance = maxDistanceForSpecification(spec);
+	m_followViewer = true;
+	m_loadProbeCache = false;
+	m_warmStart = false;
+
+	init(spec);
+	m_probeFormatChanged = true;
+	generateIrradianceProbes(RenderDevice::current);
+
+	m_sceneName = sceneName;
+}
+
 shared_ptr<IrradianceField> IrradianceField::create
 (const String& sceneName,
 	const shared_ptr<Scene>& scene,
 	Vector3int32 probeCountsOverride,
 	float maxProbeDistance,
-	int irradianceCubeResolutionOverride)
+	int irradianceCubeResolutionOverride,
+	int depthCubeResolutionOverride,
+	bool loadProbeCache)
 {
 	const shared_ptr<IrradianceField>& irradianceField = createShared<IrradianceField>();
-	irradianceField->loadNewScene(sceneName, scene, probeCountsOverride, maxProbeDistance, irradianceCubeResolutionOverride);
+	irradianceField->m_loadProbeCache = loadProbeCache;
+	irradianceField->loadNewScene(sceneName, scene, probeCountsOverride, maxProbeDistance, irradianceCubeResolutionOverride, depthCubeResolutionOverride);
 	return irradianceField;
 }
 
 IrradianceField::IrradianceField()
 {
-	m_sceneTriTree = TriTree::create(true);
+	m_staticTriTree = TriTree::create(true);
+	m_dynamicTriTree = TriTree::create(true);
+}
+
+IrradianceField::~IrradianceField()
+{
+	// The worker writes into buffers owned by this object, which must be unmapped before they are destroyed
+	finishAsyncTrace();
 }
 
 void IrradianceField::setShaderArgs(UniformTable& args, const String& prefix) {
 	alwaysAssertM(endsWith(prefix, "."), "Requires a struct prefix");
 
 	Sampler bilinear = Sampler::video();
-	m_irradianceProbes->setShaderArgs(args, prefix + "irradianceProbeGrid", bilinear);
-	m_meanDistProbes->setShaderArgs(args, prefix + "meanMeanSquaredProbeGrid", bilinear);
+	if (m_sampleCompressedAtlases && hasCompressedAtlases())
+	{
+		m_compressedIrradianceProbes->setShaderArgs(args, prefix + "irradianceProbeGrid", bilinear);
+		m_compressedMeanDistProbes->setShaderArgs(args, prefix + "meanMeanSquaredProbeGrid", bilinear);
+		args.setUniform(prefix + "depthMomentScale", ProbeAtlasCompression::momentScale(m_maxDistance));
+	}
+	else
+	{
+		m_irradianceProbes->setShaderArgs(args, prefix + "irradianceProbeGrid", bilinear);
+		m_meanDistProbes->setShaderArgs(args, prefix + "meanMeanSquaredProbeGrid", bilinear);
+		args.setUniform(prefix + "depthMomentScale", Vector2(1.0f, 1.0f));
+	}
+
+	// SH coefficients replace the irradiance atlas. The sampler is bound either way because it is a struct member.
+	(notNull(m_irradianceSH) ? m_irradianceSH : Texture::opaqueBlack())->setShaderArgs(args, prefix + "irradianceSH", Sampler::buffer());
+	args.setMacro("IRRADIANCE_SH_ORDER", notNull(m_irradianceSH) ? m_specification.irradianceSHOrder : 0);
 
 	// Uniforms to convert oct to texel and back
 	args.setUniform(prefix + "irradianceTextureWidth", m_irradianceProbes->width());
@@ -212,6 +342,20 @@ void IrradianceField::setShaderArgs(UniformTable& args, const String& prefix) {
 	args.setUniform(prefix + "probeCounts", m_specification.probeCounts);
 	args.setUniform(prefix + "probeStartPosition", m_probeStartPosition);
 	args.setUniform(prefix + "probeStep", m_probeStep);
+	args.setUniform(prefix + "probeCountXDivisor", m_probeCountXDivisor.toVector3int32());
+	args.setUniform(prefix + "probeCountXYDivisor", m_probeCountXYDivisor.toVector3int32());
+	args.setUniform(prefix + "probeAtlasSlicesPerRow", m_probeAtlasSlicesPerRow);
+	args.setUniform(prefix + "probeAtlasSliceDivisor", m_probeAtlasSliceDivisor.toVector3int32());
+	args.setUniform(prefix + "probeScrollOffset", m_probeScrollOffset);
+	args.setUniform(prefix + "storageProbeCounts", m_storageProbeCounts);
+	args.setUniform(prefix + "brickSize", m_specification.brickSize);
+	args.setUniform(prefix + "brickCounts", m_brickCounts);
+	args.setUniform(prefix + "brickSizeDivisor", m_brickSizeDivisor.toVector3int32());
+	args.setUniform(prefix + "storageBrickCounts", m_storageBrickCounts);
+	args.setUniform(prefix + "storageBrickCountXDivisor", m_storageBrickCountXDivisor.toVector3int32());
+	args.setUniform(prefix + "storageBrickCountXYDivisor", m_storageBrickCountXYDivisor.toVector3int32());
+	m_brickIndirectionTexture->setShaderArgs(args, prefix + "brickIndirection", Sampler::buffer());
+	m_probeOffsetTexture->setShaderArgs(args, prefix + "probeOffsets", Sampler::buffer());
 
 	args.setUniform(prefix + "irradianceDistanceBias", m_specification.irradianceDistanceBias);
 	args.setUniform(prefix + "irradianceVarianceBias", m_specification.irradianceVarianceBias);
@@ -228,270 +372,1612 @@ void IrradianceField::init(const Specification& spec)
 	m_name = "Irradiance Field";
 
 	m_specification = spec;
-	alwaysAssertM(G3D::isPow2(m_specification.probeCounts.x * m_specification.probeCounts.y * m_specification.probeCounts.z),
-		"Probe count must be power of two");
+	alwaysAssertM((m_specification.probeCounts.x > 0) && (m_specification.probeCounts.y > 0) && (m_specification.probeCounts.z > 0),
+		"Probe counts must be positive");
+
+	computeProbeGrid(m_specification, m_probeStartPosition, m_probeStep);
+	m_probeScrollOffset = Vector3int32(0, 0, 0);
+	m_probeGridOriginValid = false;
+
+	m_brickIndirection.fastClear();
+	m_storageBrickLatticeCoord.fastClear();
+	const int brickSize = m_specification.brickSize;
+	if (brickSize > 0)
+	{
+		const Vector3int32& counts = m_specification.probeCounts;
+		m_brickCounts = Vector3int32((counts.x + brickSize - 1) / brickSize, (counts.y + brickSize - 1) / brickSize, (counts.z + brickSize - 1) / brickSize);
+
+		// Every brick has storage until allocateBricks() sees the scene trees
+		for (int z = 0; z < m_brickCounts.z; ++z)
+		{
+			for (int y = 0; y < m_brickCounts.y; ++y)
+			{
+				for (int x = 0; x < m_brickCounts.x; ++x)
+				{
+					m_brickIndirection.append(m_storageBrickLatticeCoord.size());
+					m_storageBrickLatticeCoord.append(Point3int32(x, y, z));
+				}
+			}
+		}
+		m_storageBrickCounts = m_brickCounts;
+		m_allocatedBrickCount = m_storageBrickLatticeCoord.size();
+		setStorageGrid(m_storageBrickCounts * brickSize);
+	}
+	else
+	{
+		m_brickCounts = Vector3int32(0, 0, 0);
+		m_storageBrickCounts = Vector3int32(0, 0, 0);
+		m_allocatedBrickCount = 0;
+		setStorageGrid(m_specification.probeCounts);
+	}
+	m_brickIndirectionChanged = true;
 
-	const Point3& lo = spec.probeDimensions.low();
-	const Point3& hi = spec.probeDimensions.high();
-	m_probeStep = (hi - lo) / (Vector3(m_specification.probeCounts) - Vector3(1, 1, 1)).max(Vector3(1, 1, 1));
-	m_probeStartPosition = lo;
 	m_oneBounce = spec.singleBounce;
 	m_irradianceFormatIndex = spec.irradianceFormatIndex;
 	m_depthFormatIndex = spec.depthFormatIndex;
+}
 
-	// Special case of 1-probe high surface
-	for (int i = 0; i < 3; ++i)
+Point3int32 IrradianceField::probeIndexToGridIndex(int index) const
+{
+	return ProbeMath::probeIndexToGridCoord(index, m_probeCountXDivisor, m_probeCountXYDivisor);
+}
+
+Point3int32 IrradianceField::probeIndexToLatticeCoord(int index) const
+{
+	const Point3int32& s = probeIndexToGridIndex(index);
+	if (isSparse())
+	{
+		const int brickSize = m_specification.brickSize;
+		const Point3int32 storageBrick(s.x / brickSize, s.y / brickSize, s.z / brickSize);
+		return m_storageBrickLatticeCoord[storageBrickIndex(s)] * brickSize + (s - storageBrick * brickSize);
+	}
+
+	return ProbeMath::latticeGridCoord(s, m_probeScrollOffset, m_specification.probeCounts);
+}
+
+int IrradianceField::storageBrickIndex(const Point3int32& s) const
+{
+	const int brickSize = m_specification.brickSize;
+	return s.x / brickSize + m_storageBrickCounts.x * (s.y / brickSize + m_storageBrickCounts.y * (s.z / brickSize));
+}
+
+void IrradianceField::setStorageGrid(const Vector3int32& storageProbeCounts)
+{
+	m_storageProbeCounts = storageProbeCounts;
+	m_probeCountXDivisor = ProbeMath::FastDivisor(m_storageProbeCounts.x);
+	m_probeCountXYDivisor = ProbeMath::FastDivisor(m_storageProbeCounts.x * m_storageProbeCounts.y);
+	m_probeAtlasSlicesPerRow = probeAtlasSlicesPerRow(m_specification.probeAtlasLayout, m_storageProbeCounts);
+	m_probeAtlasSliceDivisor = ProbeMath::FastDivisor(max(m_probeAtlasSlicesPerRow, 1));
+	m_brickSizeDivisor = ProbeMath::FastDivisor(max(m_specification.brickSize, 1));
+	m_storageBrickCountXDivisor = ProbeMath::FastDivisor(max(m_storageBrickCounts.x, 1));
+	m_storageBrickCountXYDivisor = ProbeMath::FastDivisor(max(m_storageBrickCounts.x * m_storageBrickCounts.y, 1));
+
+	// Probes start on the lattice
+	m_probeOffsets.resize(probeCount());
+	for (Vector3& offset : m_probeOffsets)
+	{
+		offset = Vector3::zero();
+	}
+	m_probeOffsetsChanged = true;
+
+	const Vector3int32& counts = m_specification.probeCounts;
+	m_probeAllocated.resize(probeCount());
+	for (int i = 0; i < probeCount(); ++i)
 	{
-		if (m_specification.probeCounts[i] == 1)
+		if (!isSparse())
+		{
+			m_probeAllocated[i] = true;
+		}
+		else if (m_storageBrickLatticeCoord[storageBrickIndex(probeIndexToGridIndex(i))].x < 0)
+		{
+			// Padding
+			m_probeAllocated[i] = false;
+		}
+		else
 		{
-			m_probeStartPosition[i] = (hi[i] + lo[i]) / 2.0f;
+			const Point3int32& c = probeIndexToLatticeCoord(i);
+			m_probeAllocated[i] = (c.x < counts.x) && (c.y < counts.y) && (c.z < counts.z);
 		}
 	}
+
+	// Probe indices now name other probes, so the atlases, the ray buffers and the per-probe state
+	// (allocated on the next schedule) start over
+	m_probeStates.fastClear();
+	m_probeMeanRadiancePending = false;
+	m_irradianceRayOrigins.reset();
+	m_probeFormatChanged = true;
+	m_warmStart = false;
 }
 
-Point3int32 IrradianceField::probeIndexToGridIndex(int index) const
+void IrradianceField::allocateBricks()
+{
+	const int brickSize = m_specification.brickSize;
+	const Vector3int32& counts = m_specification.probeCounts;
+
+	// A surface point is shaded by the cage of probes at floor(X) and floor(X) + 1 on the lattice
+	const Vector3& margin = m_probeStep * m_specification.brickAllocationMargin;
+	Array<bool> used;
+	used.resize(m_brickIndirection.size());
+	for (int b = 0; b < used.size(); ++b)
+	{
+		used[b] = false;
+	}
+
+	for (const shared_ptr<TriTree>& tree : { m_staticTriTree, m_dynamicTriTree })
+	{
+		const CPUVertexArray& vertexArray = tree->vertexArray();
+		for (int t = 0; t < tree->size(); ++t)
+		{
+			const Tri& tri = (*tree)[t];
+			const Point3& a = tri.position(vertexArray, 0);
+			const Point3& b = tri.position(vertexArray, 1);
+			const Point3& c = tri.position(vertexArray, 2);
+			const Vector3& lo = (a.min(b).min(c) - margin - m_probeStartPosition) / m_probeStep;
+			const Vector3& hi = (a.max(b).max(c) + margin - m_probeStartPosition) / m_probeStep;
+
+			Point3int32 brickLo, brickHi;
+			bool outside = false;
+			for (int i = 0; i < 3; ++i)
+			{
+				const int cageLo = iFloor(lo[i]);
+				const int cageHi = iFloor(hi[i]) + 1;
+				outside = outside || (cageHi < 0) || (cageLo > counts[i] - 1);
+				brickLo[i] = iClamp(cageLo, 0, counts[i] - 1) / brickSize;
+				brickHi[i] = iClamp(cageHi, 0, counts[i] - 1) / brickSize;
+			}
+
+			if (outside)
+			{
+				continue;
+			}
+
+			for (int z = brickLo.z; z <= brickHi.z; ++z)
+			{
+				for (int y = brickLo.y; y <= brickHi.y; ++y)
+				{
+					for (int x = brickLo.x; x <= brickHi.x; ++x)
+					{
+						used[x + m_brickCounts.x * (y + m_brickCounts.y * z)] = true;
+					}
+				}
+			}
+		}
+	}
+
+	m_storageBrickLatticeCoord.fastClear();
+	for (int z = 0; z < m_brickCounts.z; ++z)
+	{
+		for (int y = 0; y < m_brickCounts.y; ++y)
+		{
+			for (int x = 0; x < m_brickCounts.x; ++x)
+			{
+				const int b = x + m_brickCounts.x * (y + m_brickCounts.y * z);
+				m_brickIndirection[b] = used[b] ? m_storageBrickLatticeCoord.size() : -1;
+				if (used[b])
+				{
+					m_storageBrickLatticeCoord.append(Point3int32(x, y, z));
+				}
+			}
+		}
+	}
+	m_allocatedBrickCount = m_storageBrickLatticeCoord.size();
+
+	// Pack the bricks into a roughly cubic storage grid, which keeps the atlas roughly square.
+	// At least one brick, so that the textures are not empty.
+	const int n = max(m_allocatedBrickCount, 1);
+	m_storageBrickCounts.x = iCeil(powf(float(n), 1.0f / 3.0f));
+	m_storageBrickCounts.y = iCeil(sqrtf(float(n) / float(m_storageBrickCounts.x)));
+	m_storageBrickCounts.z = (n + m_storageBrickCounts.x * m_storageBrickCounts.y - 1) / (m_storageBrickCounts.x * m_storageBrickCounts.y);
+	while (m_storageBrickLatticeCoord.size() < m_storageBrickCounts.x * m_storageBrickCounts.y * m_storageBrickCounts.z)
+	{
+		m_storageBrickLatticeCoord.append(Point3int32(-1, -1, -1));
+	}
+
+	setStorageGrid(m_storageBrickCounts * brickSize);
+	m_brickIndirectionChanged = true;
+
+	debugPrintf("%s: %d of %d probe bricks allocated\n", m_name.c_str(), m_allocatedBrickCount, m_brickIndirection.size());
+}
+
+void IrradianceField::uploadBrickIndirection()
 {
-	const int xIndex = index % m_specification.probeCounts.x;
-	const int yIndex = (index % (m_specification.probeCounts.x * m_specification.probeCounts.y)) / m_specification.probeCounts.x;
-	const int zIndex = index / (m_specification.probeCounts.x * m_specification.probeCounts.y);
-	return Point3int32(xIndex, yIndex, zIndex);
+	// Dense grids never read it, but the sampler must be bound
+	const int width = isSparse() ? m_brickCounts.x * m_brickCounts.y : 1;
+	const int height = isSparse() ? m_brickCounts.z : 1;
+
+	if (isNull(m_brickIndirectionTexture) || (m_brickIndirectionTexture->width() != width) || (m_brickIndirectionTexture->height() != height))
+	{
+		m_brickIndirectionTexture = Texture::createEmpty("IrradianceField::m_brickIndirectionTexture", width, height, ImageFormat::R32I());
+	}
+
+	const shared_ptr<CPUPixelTransferBuffer>& buffer = CPUPixelTransferBuffer::create(width, height, ImageFormat::R32I());
+	int32* indirection = static_cast<int32*>(buffer->mapWrite());
+	indirection[0] = -1;
+	for (int b = 0; b < m_brickIndirection.size(); ++b)
+	{
+		indirection[b] = m_brickIndirection[b];
+	}
+	buffer->unmap();
+
+	m_stats.beginStage(ProbeStats::UPLOAD);
+	m_brickIndirectionTexture->update(buffer);
+	m_stats.addBytesUploaded(int64(width) * height * sizeof(int32));
+	m_stats.endStage(ProbeStats::UPLOAD);
+	m_brickIndirectionChanged = false;
 }
 
 Point3 IrradianceField::probeIndexToPosition(int index) const
 {
-	const Point3int32 P = probeIndexToGridIndex(index);
-	return m_probeStep * Vector3(P) + m_probeStartPosition;
+	const Point3int32 P = probeIndexToLatticeCoord(index);
+	return m_probeStep * Vector3(P) + m_probeStartPosition + m_probeOffsets[index];
 }
 
 void IrradianceField::onGraphics3D(RenderDevice* rd, const Array<shared_ptr<Surface>>& surfaceArray)
 {
-	if (m_sceneDirty && System::time() - lastSceneUpdateTime() > 0.1)
+	m_stats.beginFrame();
+
+	// The previous frame's trace reads the scene trees, which may be rebuilt below
+	finishAsyncTrace();
+
+	if (!m_ownsSceneTriTrees)
+	{
+		// The owner rebuilds the trees
+		if (lastSceneUpdateTime() != m_sharedTriTreeBuildTime)
+		{
+			m_sharedTriTreeBuildTime = lastSceneUpdateTime();
+			reclassifyAllProbes();
+		}
+	}
+	else if (m_sceneDirty && System::time() - lastSceneUpdateTime() > 0.1)
 	{
-		m_sceneTriTree->setContents(m_scene);
+		m_stats.beginStage(ProbeStats::TRITREE_REBUILD);
+		rebuildSceneTriTrees();
+		m_stats.endStage(ProbeStats::TRITREE_REBUILD);
 		m_sceneDirty = false;
 	}
+	else
+	{
+		m_stats.beginStage(ProbeStats::TRITREE_REBUILD);
+		updateDynamicTriTree();
+		m_stats.endStage(ProbeStats::TRITREE_REBUILD);
+	}
+
+	if (m_followViewer)
+	{
+		scrollTo(m_viewerPosition);
+	}
 
 	generateIrradianceProbes(rd);
 	generateIrradianceRays(rd, m_scene);
-	sampleAndShadeIrradianceRays(rd, m_scene, surfaceArray);
-	updateIrradianceProbes(rd, m_scene);
+	sampleAndShadeIrradianceRays(rd, m_scene);
+	if (m_probeBatchShaded)
+	{
+		updateIrradianceProbes(rd, m_scene);
+	}
+
+	m_stats.setProbeCounts(probeCount(), m_activeProbeCount, m_scheduledProbeCount);
+	m_stats.endFrame();
 }
 
 void IrradianceField::onSceneChanged(const shared_ptr<Scene>& scene)
 {
 	m_scene = scene;
 	m_sceneDirty = true;
+
+	// A new scene is not a change of the old one
+	m_sceneChangeTracker.reset();
 }
 
-Color3 IrradianceField::probeCoordVisualizationColor(Point3int32 P)
+void IrradianceField::getModelEntities(const shared_ptr<Scene>& scene, bool canChange, Array<shared_ptr<VisibleEntity>>& entities)
 {
-	Color3 c(float(P.x & 1), float(P.y & 1), float(P.z & 1));
-	// Make all probes the same brightness
-	c /= max(c.r + c.g + c.b, 0.01f);
-	return c * 0.6f + Color3(0.2f);
+	entities.fastClear();
+	Array<shared_ptr<VisibleEntity>> allEntities;
+	scene->getTypedEntityArray(allEntities);
+	for (const shared_ptr<VisibleEntity>& entity : allEntities)
+	{
+		if (entity->visible() && notNull(entity->model()) && (entity->canChange() == canChange))
+		{
+			entities.append(entity);
+		}
+	}
 }
 
-void IrradianceField::debugDraw() const
+void IrradianceField::poseEntities(const Array<shared_ptr<VisibleEntity>>& entities, Array<shared_ptr<Surface>>& surfaceArray)
 {
-	const float radius = 0.075f;
-	for (int i = 0; i < probeCount(); ++i)
+	surfaceArray.fastClear();
+	for (const shared_ptr<VisibleEntity>& entity : entities)
 	{
-		Color3 color;
-		const Point3& probeCenter = probeIndexToPosition(i);
-
-		const Point3int32 P = probeIndexToGridIndex(i);
-		color = probeCoordVisualizationColor(P);
-		//color = Color3::fromASRGB(0xff007e);
-
-		::debugDraw(std::make_shared<SphereShape>(probeCenter, radius), 0.0f, color * 0.8f, Color4::clear());
+		entity->onPose(surfaceArray);
 	}
 }
 
-void IrradianceField::allocateIntermediateBuffers()
+void IrradianceField::rebuildSceneTriTrees()
 {
-	const ImageFormat* depthFormat = ImageFormat::DEPTH32();
+	Array<shared_ptr<VisibleEntity>> entities;
+	Array<shared_ptr<Surface>> surfaceArray;
 
-	GBuffer::Specification gbufferRTSpec;
+	getModelEntities(m_scene, false, entities);
+	poseEntities(entities, surfaceArray);
+	m_staticTriTree->setContents(surfaceArray);
 
-	gbufferRTSpec.encoding[GBuffer::Field::LAMBERTIAN].format = ImageFormat::RGBA32F();
-	gbufferRTSpec.encoding[GBuffer::Field::GLOSSY].format = ImageFormat::RGBA32F();
-	gbufferRTSpec.encoding[GBuffer::Field::EMISSIVE].format = ImageFormat::RGBA32F();
-	gbufferRTSpec.encoding[GBuffer::Field::TRANSMISSIVE].format = ImageFormat::RGBA32F();
-	gbufferRTSpec.encoding[GBuffer::Field::WS_POSITION].format = ImageFormat::RGBA32F();
-	gbufferRTSpec.encoding[GBuffer::Field::WS_NORMAL] = Texture::Encoding(ImageFormat::RGBA32F(), FrameName::CAMERA, 1.0f, 0.0f);
-	gbufferRTSpec.encoding[GBuffer::Field::DEPTH_AND_STENCIL].format = nullptr;
-	gbufferRTSpec.encoding[GBuffer::Field::CS_NORMAL] = nullptr;
-	gbufferRTSpec.encoding[GBuffer::Field::CS_POSITION] = nullptr;
+	getModelEntities(m_scene, true, entities);
+	poseEntities(entities, surfaceArray);
+	m_dynamicTriTree->setContents(surfaceArray);
+	m_dynamicEntityCount = entities.size();
+	m_dynamicTriTreeBuildTime = System::time();
 
-	int rayDimX = probeCount();
-	int rayDimY = m_specification.irradianceRaysPerProbe;
+	if (isSparse())
+	{
+		allocateBricks();
+	}
 
-	m_irradianceRaysGBuffer = GBuffer::create(gbufferRTSpec, "IrradianceField::m_irradianceRaysGBuffer");
-	m_irradianceRaysGBuffer->setSpecification(gbufferRTSpec);
-	m_irradianceRaysGBuffer->resize(rayDimX, rayDimY);
+	reclassifyAllProbes();
 }
 
-void IrradianceField::renderIndirectIllumination
-   (RenderDevice*                          rd,
-	const shared_ptr<GBuffer>&             gbuffer,
-	const LightingEnvironment&             environment)
+void IrradianceField::reclassifyAllProbes()
 {
-	m_giFramebuffer->resize(gbuffer->width(), gbuffer->height());
-
-	// Compute GI
-	rd->push2D(m_giFramebuffer); {
-		rd->setGuardBandClip2D(gbuffer->colorGuardBandThickness());
-		// Don't shade the skybox on this pass because it will be forward rendered
-		rd->setDepthTest(RenderDevice::DEPTH_GREATER);
-		Args args;
-		gbuffer->setShaderArgsRead(args, "gbuffer_");
-		args.setRect(rd->viewport());
-		setShaderArgs(args, "irradianceFieldSurface.");
-		m_irradianceRayOrigins->setShaderArgs(args, "gbuffer_WS_RAY_ORIGIN_", Sampler::buffer());
-		args.setUniform("energyPreservation", recursiveEnergyPreservation);
-		args.setMacro("RT_GBUFFER", 1);
-
-		LAUNCH_SHADER("shaders/GIRenderer_ComputeIndirect.pix", args);
-	} rd->pop2D();
+	for (int& frames : m_probeFramesSinceUpdate)
+	{
+		frames = max(frames, m_probeStateRefreshInterval);
+	}
 }
 
-void IrradianceField::generateIrradianceRays(RenderDevice* rd, const shared_ptr<Scene>& scene)
+void IrradianceField::shareSceneTriTrees(const shared_ptr<IrradianceField>& owner)
 {
-	BEGIN_PROFILER_EVENT("generateIrradianceRays");
-
-	rd->push2D(m_irradianceRaysFB); {
-		Args args;
-
-		args.setMacro("RAYS_PER_PROBE", m_specification.irradianceRaysPerProbe);
-		args.setRect(rd->viewport());
-		
-		setShaderArgs(args, "irradianceFieldSurface.");
-		args.setUniform("randomOrientation", Matrix3::fromAxisAngle(Vector3::random(), Random::common().uniform(0.f, 2 * pif())));
-
-		LAUNCH_SHADER("shaders/IrradianceField_GenerateRandomRays.pix", args);
-
-	} rd->pop2D();
+	m_staticTriTree = owner->m_staticTriTree;
+	m_dynamicTriTree = owner->m_dynamicTriTree;
+	m_ownsSceneTriTrees = false;
 
-	END_PROFILER_EVENT();
+	// One set of tracing threads for all the fields, or asynchronous traces would oversubscribe the cores
+	m_probeRayTracer.sharePool(owner->m_probeRayTracer);
+	m_sharedTriTreeBuildTime = lastSceneUpdateTime();
 }
 
-void IrradianceField::sampleAndShadeArbitraryRays
-   (RenderDevice*                       rd,
-	const Array<shared_ptr<Surface>>&   surfaceArray,
-	const shared_ptr<Framebuffer>&      targetFramebuffer,
-	const LightingEnvironment&          environment,
-	const shared_ptr<Texture>&          rayOrigins,
-	const shared_ptr<Texture>&          rayDirections,
-	const bool                          useProbeIndirect,
-	const bool                          glossyToMatte,
-	const shared_ptr<GBuffer>&          gbuffer,
-	const TriTree::IntersectRayOptions  traceOptions)
+void IrradianceField::resetProbe(int index)
 {
-	BEGIN_PROFILER_EVENT("sampleAndShadeArbitraryRays");
-	//m_sceneTriTree->intersectRays(rayOrigins, rayDirections, gbuffer, traceOptions);
+	m_probeOffsets[index] = Vector3::zero();
+	m_probeOffsetsChanged = true;
 
-	int Width = rayOrigins->width();
-	int Height = rayOrigins->height();
-	shared_ptr<GLPixelTransferBuffer> RTOutBuffers[5];
-	for (int i = 0; i < 5; ++i)
+	// The per-probe state is allocated on the first schedule, which resets every probe anyway
+	if (index < m_probeStates.size())
 	{
-		switch (i) {
-		case 2:
-		case 3:
-			RTOutBuffers[i] = GLPixelTransferBuffer::create(Width, Height, ImageFormat::RGBA8());// , nullptr, 1, GL_STREAM_DRAW);
-			break;
-		default:
-			RTOutBuffers[i] = GLPixelTransferBuffer::create(Width, Height, ImageFormat::RGBA32F());// , nullptr, 1, GL_STREAM_DRAW);
+		m_probeStates[index] = ProbeState::ACTIVE;
+		m_probeNeedsReset[index] = true;
+		m_probeFramesSinceUpdate[index] = max(m_probeFramesSinceUpdate[index], m_probeStateRefreshInterval);
+		m_probeMeanLuminance[index] = -1.0f;
+		m_probeRadianceChange[index] = 1.0f;
+		m_probeStableUpdates[index] = 0;
+		if (m_probeConverged[index])
+		{
+			m_probeConverged[index] = false;
+			--m_convergedProbeCount;
 		}
 	}
+}
 
-	m_sceneTriTree->intersectRays(rayOrigins->toPixelTransferBuffer(), rayDirections->toPixelTransferBuffer(), RTOutBuffers);
-
-	gbuffer->texture(GBuffer::Field::WS_POSITION)->update(RTOutBuffers[0]);
-	gbuffer->texture(GBuffer::Field::WS_NORMAL)->update(  RTOutBuffers[1]);
-	gbuffer->texture(GBuffer::Field::LAMBERTIAN)->update( RTOutBuffers[2]);
-	gbuffer->texture(GBuffer::Field::GLOSSY)->update(     RTOutBuffers[3]);
-	gbuffer->texture(GBuffer::Field::EMISSIVE)->update(   RTOutBuffers[4]);
-
-	renderIndirectIllumination(rd, gbuffer, environment);
+void IrradianceField::scrollTo(const Point3& center)
+{
+	alwaysAssertM(!isSparse(), "Sparse grids cannot scroll");
+	const Vector3int32& counts = m_specification.probeCounts;
 
-	// Find the skybox
-	shared_ptr<SkyboxSurface> skyboxSurface;
-	for (const shared_ptr<Surface>& surface : surfaceArray) 
+	// An axis with a single probe has no spacing and does not scroll
+	Point3int32 origin;
+	for (int a = 0; a < 3; ++a)
 	{
-		skyboxSurface = dynamic_pointer_cast<SkyboxSurface>(surface);
-		if (skyboxSurface) { break; }
+		origin[a] = (m_probeStep[a] > 0.0f) ? (iFloor(center[a] / m_probeStep[a]) - counts[a] / 2) : 0;
 	}
 
-	//////////////////////////////////////////////////////////////////////////////////
-	// Perform deferred shading on the GBuffer
-	rd->push2D(targetFramebuffer); {
-		// Disable screen-space effects. Note that this is a COPY we're making in order to mutate it
-		LightingEnvironment e = environment;
-		e.ambientOcclusionSettings.enabled = false;
-
-		Args args;
-		e.setShaderArgs(args);
-		gbuffer->setShaderArgsRead(args, "gbuffer_");
-		args.setRect(rd->viewport());
+	if (m_probeGridOriginValid && (origin == m_probeGridOrigin))
+	{
+		return;
+	}
 
-		args.setMacro("GLOSSY_TO_MATTE", glossyToMatte);
-		args.setUniform("matteIndirectBuffer", useProbeIndirect ? m_giFramebuffer->texture(0) : Texture::opaqueBlack(), Sampler::buffer());
-		args.setMacro("LIGHTING_MODE", LightingMode::DIRECT_INDIRECT);
+	const Vector3int32 delta = origin - m_probeGridOrigin;
+	const bool jumped = !m_probeGridOriginValid ||
+		(abs(delta.x) >= counts.x) || (abs(delta.y) >= counts.y) || (abs(delta.z) >= counts.z);
 
-		args.setMacro("OVERRIDE_SKYBOX", true);
-		if (skyboxSurface) skyboxSurface->setShaderArgs(args, "skybox_");
+	// A probe that stays in the grid keeps its storage: its lattice coordinate falls by delta,
+	// so the scroll offset grows by delta
+	for (int a = 0; a < 3; ++a)
+	{
+		m_probeScrollOffset[a] = jumped ? 0 : (((m_probeScrollOffset[a] + delta[a]) % counts[a]) + counts[a]) % counts[a];
+	}
+	m_probeGridOrigin = origin;
+	m_probeGridOriginValid = true;
+	m_probeStartPosition = m_probeStep * Vector3(origin);
 
-		// When rendering the probes, we don't have ray traced glossy reflections at the probe's primary ray hits,
-		// so use the environment map (won't matter, because we usually kill all glossy reflection for irradiance
-		// probes anyway since it is so viewer dependent).
-		args.setMacro("USE_GLOSSY_INDIRECT_BUFFER", false);
-		rayOrigins->setShaderArgs(args, "gbuffer_WS_RAY_ORIGIN_", Sampler::buffer());
-		rayDirections->setShaderArgs(args, "gbuffer_WS_RAY_DIRECTION_", Sampler::buffer());
+	// Probes in the newly exposed planes hold values for the opposite side of the old grid
+	for (int i = 0; i < probeCount(); ++i)
+	{
+		bool exposed = jumped;
+		if (!exposed)
+		{
+			const Point3int32& c = probeIndexToLatticeCoord(i);
+			for (int a = 0; a < 3; ++a)
+			{
+				exposed = exposed || ((delta[a] > 0) ? (c[a] >= counts[a] - delta[a]) : (c[a] < -delta[a]));
+			}
+		}
 
-		LAUNCH_SHADER("shaders/GIRenderer_DeferredShade.pix", args);
-	} rd->pop2D();
+		if (exposed)
+		{
+			resetProbe(i);
+		}
+	}
 
-	END_PROFILER_EVENT();
+	// Rays generated before the scroll must not classify or relocate the reset probes. Their atlas
+	// updates still land, but the reset discards them at the next update.
+	const auto forgetResetProbes = [&](Array<int>& rowProbeIndex) {
+		for (int& probeIndex : rowProbeIndex)
+		{
+			if ((probeIndex >= 0) && (probeIndex < m_probeNeedsReset.size()) && m_probeNeedsReset[probeIndex])
+			{
+				probeIndex = -1;
+			}
+		}
+	};
+	for (RayStagingBuffers& staging : m_rayStaging)
+	{
+		forgetResetProbes(staging.rowProbeIndex);
+	}
+	forgetResetProbes(m_probeMeanRadianceRowProbeIndex);
 }
 
-void IrradianceField::sampleAndShadeIrradianceRays(RenderDevice* rd, const shared_ptr<Scene>& scene, const Array<shared_ptr<Surface>>& surfaceArray)
+void IrradianceField::updateDynamicTriTree()
 {
-	BEGIN_PROFILER_EVENT("sampleIrradianceRays");
-
-	m_irradianceRaysGBuffer->prepare(rd, 0.0f, 0.0f, Vector2int16(0, 0), Vector2int16(0, 0));
+	Array<shared_ptr<VisibleEntity>> entities;
+	getModelEntities(m_scene, true, entities);
 
-	// Don't cull backfaces...if a probe looks through a back face (e.g., single-sided ceiling), it will get incorrect results
-	sampleAndShadeArbitraryRays
-	    (rd,
-		surfaceArray,
-		m_irradianceRaysShadedFB,
-		scene->lightingEnvironment(),
-		m_irradianceRayOrigins,
-		m_irradianceRayDirections,
-		!m_oneBounce,
-		m_specification.glossyToMatte,
-		m_irradianceRaysGBuffer,
-		TriTree::DO_NOT_CULL_BACKFACES);
+	bool changed = (entities.size() != m_dynamicEntityCount);
+	for (const shared_ptr<VisibleEntity>& entity : entities)
+	{
+		changed = changed || (entity->lastChangeTime() > m_dynamicTriTreeBuildTime);
+	}
 
-	END_PROFILER_EVENT();
+	if (changed)
+	{
+		Array<shared_ptr<Surface>> surfaceArray;
+		poseEntities(entities, surfaceArray);
+		m_dynamicTriTree->setContents(surfaceArray);
+		m_dynamicEntityCount = entities.size();
+		m_dynamicTriTreeBuildTime = System::time();
+	}
 }
 
-void IrradianceField::updateIrradianceProbes(RenderDevice* rd, const shared_ptr<Scene>& scene)
+void IrradianceField::traceRays(const RayStagingBuffers& rays, const TriTree::IntersectRayOptions traceOptions) const
 {
-	BEGIN_PROFILER_EVENT("updateIrradianceProbes");
-
-	static const bool IRRADIANCE = true, DEPTH = false;
-
-	updateIrradianceProbe(rd, IRRADIANCE);
-	updateIrradianceProbe(rd, DEPTH);
-
-	m_firstFrame = false;
+	if (m_useProbeRayTracer)
+	{
+		ProbeRayTracer::Output output;
+		output.records = static_cast<RayHitRecord*>(rays.hitRecordBuffer->mapWrite());
+		output.positions = static_cast<Vector4*>(rays.hitBuffers[0]->mapWrite());
+		output.normals = static_cast<Vector4*>(rays.hitBuffers[1]->mapWrite());
+
+		m_probeRayTracer.trace(m_staticTriTree, m_dynamicTriTree,
+			static_cast<const Vector4*>(rays.rayOriginBuffer->mapRead()),
+			static_cast<const Vector4*>(rays.rayDirectionBuffer->mapRead()),
+			rays.rayOriginBuffer->width(), rays.rowCount, output, traceOptions);
+
+		rays.rayOriginBuffer->unmap();
+		rays.rayDirectionBuffer->unmap();
+		rays.hitRecordBuffer->unmap();
+		rays.hitBuffers[0]->unmap();
+		rays.hitBuffers[1]->unmap();
+		return;
+	}
 
-	END_PROFILER_EVENT();
+	m_staticTriTree->intersectRays(rays.rayOriginBuffer, rays.rayDirectionBuffer, rays.hitBuffers, traceOptions);
+	if (m_dynamicTriTree->size() > 0)
+	{
+		m_dynamicTriTree->intersectRays(rays.rayOriginBuffer, rays.rayDirectionBuffer, rays.dynamicHitBuffers, traceOptions);
+		mergeDynamicHits(rays);
+	}
 }
 
-void IrradianceField::updateIrradianceProbe(RenderDevice* rd, bool irradiance)
+void IrradianceField::scheduleProbes(RayStagingBuffers& staging)
+{
+	const int count = probeCount();
+	if (m_probeStates.size() != count)
+	{
+		m_probeStates.resize(count);
+		m_probeNeedsReset.resize(count);
+		m_probeFramesSinceUpdate.resize(count);
+		m_probeMeanLuminance.resize(count);
+		m_probeRadianceChange.resize(count);
+		m_probeConverged.resize(count);
+		m_probeStableUpdates.resize(count);
+		m_probeInvalidatedFrames.resize(count);
+		m_probePriority.resize(count);
+		m_activeProbeCount = 0;
+		m_convergedProbeCount = 0;
+		for (int i = 0; i < count; ++i)
+		{
+			// Storage of sparse grids without a probe is never traced
+			m_probeStates[i] = m_probeAllocated[i] ? ProbeState::ACTIVE : ProbeState::INACTIVE;
+			m_probeNeedsReset[i] = !m_warmStart;
+			m_probeFramesSinceUpdate[i] = 0;
+			m_probeMeanLuminance[i] = -1.0f;
+			m_probeRadianceChange[i] = 0.0f;
+			m_probeConverged[i] = false;
+			m_probeStableUpdates[i] = 0;
+			m_probeInvalidatedFrames[i] = 0;
+			m_activeProbeCount += (m_probeStates[i] == ProbeState::ACTIVE) ? 1 : 0;
+		}
+		m_probeMeanRadiancePending = false;
+		m_invalidatedProbeCount = 0;
+	}
+
+	readProbeRadianceChange();
+	invalidateChangedProbes();
+
+	// Probes that want an update: the active ones, and the others when they are due to be reclassified
+	m_scheduleCandidates.fastClear();
+	for (int i = 0; i < count; ++i)
+	{
+		++m_probeFramesSinceUpdate[i];
+		if (!m_probeAllocated[i])
+		{
+			continue;
+		}
+
+		if (!m_cullInactiveProbes || (m_probeStates[i] == ProbeState::ACTIVE) || (m_probeFramesSinceUpdate[i] > m_probeStateRefreshInterval))
+		{
+			// Nothing near a converged probe changed, so it only needs the occasional update
+			if (maintenanceOnly(i) && (m_probeFramesSinceUpdate[i] < m_maintenanceInterval))
+			{
+				continue;
+			}
+			m_scheduleCandidates.append(i);
+		}
+		else
+		{
+			// Not updated for a while, so the old value is meaningless
+			m_probeNeedsReset[i] = true;
+		}
+	}
+
+	// Keep the highest priority candidates that fit in the budget
+	const int budget = probeBudget();
+	if (m_scheduleCandidates.size() > budget)
+	{
+		for (const int i : m_scheduleCandidates)
+		{
+			m_probePriority[i] = probePriority(i);
+		}
+		std::nth_element(m_scheduleCandidates.begin(), m_scheduleCandidates.begin() + budget, m_scheduleCandidates.end(),
+			[&](int a, int b) { return m_probePriority[a] > m_probePriority[b]; });
+		m_scheduleCandidates.resize(budget);
+
+		// Keep rows in probe order for coherent memory access
+		m_scheduleCandidates.sort();
+	}
+
+	const int scheduleWidth = staging.probeSchedule->width();
+	const int scheduleHeight = staging.probeSchedule->height();
+	if (isNull(m_probeScheduleBuffer) || (m_probeScheduleBuffer->width() != scheduleWidth) || (m_probeScheduleBuffer->height() != scheduleHeight))
+	{
+		m_probeScheduleBuffer = CPUPixelTransferBuffer::create(scheduleWidth, scheduleHeight, ImageFormat::RGBA32F());
+	}
+
+	// CPU-generated rays are compacted so that the scheduled probes fill the first rows. The ray generation
+	// shader writes one row per probe, so there each probe keeps its own row and skipped rows are empty.
+	staging.rowProbeIndex.resize(count);
+	staging.rowRayCount.resize(count);
+	staging.rowHysteresis.resize(count);
+	for (int row = 0; row < count; ++row)
+	{
+		staging.rowProbeIndex[row] = -1;
+		staging.rowRayCount[row] = 0;
+		staging.rowHysteresis[row] = 0.0f;
+	}
+
+	// Atlas tiles past the last z slice have no probe and keep -1
+	Vector4* schedule = static_cast<Vector4*>(m_probeScheduleBuffer->mapWrite());
+	for (int t = 0; t < scheduleWidth * scheduleHeight; ++t)
+	{
+		schedule[t] = Vector4(-1.0f, 0.0f, 0.0f, 0.0f);
+	}
+
+	const int convergedRayCount = convergedRaysPerProbe();
+	staging.tracedRayCount = 0;
+	for (int c = 0; c < m_scheduleCandidates.size(); ++c)
+	{
+		const int i = m_scheduleCandidates[c];
+		const int row = generateRaysOnCPU() ? c : i;
+
+		// A reset probe starts over from a single estimate, which needs every ray
+		const bool reset = m_firstFrame || m_probeNeedsReset[i];
+		if (reset && m_probeConverged[i])
+		{
+			m_probeConverged[i] = false;
+			--m_convergedProbeCount;
+		}
+		const bool invalidated = (m_probeInvalidatedFrames[i] > 0);
+		const int rayCount = (m_probeConverged[i] && !invalidated) ? convergedRayCount : m_specification.irradianceRaysPerProbe;
+
+		// Apply the blends of the frames this probe waited all at once. A probe at the maintenance rate
+		// did not miss any change while it waited, so it is blended as if it had been updated every frame.
+		float hysteresis = maintenanceOnly(i) ? probeHysteresis(i) : pow(probeHysteresis(i), float(m_probeFramesSinceUpdate[i]));
+		if (invalidated)
+		{
+			hysteresis = min(hysteresis, m_specification.minHysteresis);
+		}
+		hysteresis = reset ? 0.0f : hysteresis;
+		const Point2int32& atlasCoord = probeAtlasCoord(i);
+		schedule[atlasCoord.y * scheduleWidth + atlasCoord.x] = Vector4(float(row), hysteresis, float(rayCount), 0.0f);
+
+		staging.rowProbeIndex[row] = i;
+		staging.rowRayCount[row] = rayCount;
+		staging.rowHysteresis[row] = hysteresis;
+		staging.tracedRayCount += rayCount;
+
+		m_probeNeedsReset[i] = false;
+		m_probeFramesSinceUpdate[i] = 0;
+	}
+	m_probeScheduleBuffer->unmap();
+
+	staging.scheduledProbeCount = m_scheduleCandidates.size();
+	staging.rowCount = generateRaysOnCPU() ? m_scheduleCandidates.size() : count;
+	m_scheduledProbeCount = m_scheduleCandidates.size();
+
+	m_stats.beginStage(ProbeStats::UPLOAD);
+	staging.probeSchedule->update(m_probeScheduleBuffer);
+	m_stats.addBytesUploaded(int64(scheduleWidth) * scheduleHeight * sizeof(Vector4));
+	m_stats.endStage(ProbeStats::UPLOAD);
+}
+
+int IrradianceField::probeBudget() const
+{
+	int rays = m_specification.raysPerFrameBudget;
+	if ((m_specification.traceMillisecondsBudget > 0.0f) && (m_raysPerMillisecond > 0.0f))
+	{
+		const int timedRays = int(m_specification.traceMillisecondsBudget * m_raysPerMillisecond);
+		rays = (rays > 0) ? min(rays, timedRays) : timedRays;
+	}
+
+	return (rays > 0) ? max(1, rays / m_specification.irradianceRaysPerProbe) : probeCount();
+}
+
+int IrradianceField::convergedRaysPerProbe() const
+{
+	const int raysPerProbe = m_specification.irradianceRaysPerProbe;
+	return clamp(iRound(float(raysPerProbe) * m_specification.convergedRayFraction), min(8, raysPerProbe), raysPerProbe);
+}
+
+float IrradianceField::probeHysteresis(int probeIndex) const
+{
+	if (!m_adaptiveUpdates)
+	{
+		return m_specification.hysteresis;
+	}
+
+	const float changeRange = max(m_changeThreshold - m_convergenceThreshold, 1e-3f);
+	const float t = clamp((m_probeRadianceChange[probeIndex] - m_convergenceThreshold) / changeRange, 0.0f, 1.0f);
+	const float hysteresis = lerp(m_specification.hysteresis, min(m_specification.minHysteresis, m_specification.hysteresis), t);
+
+	if (m_probeConverged[probeIndex])
+	{
+		// Weigh the fewer rays of a converged probe's update accordingly, so that its noise does not rise
+		const float rayFraction = float(convergedRaysPerProbe()) / float(m_specification.irradianceRaysPerProbe);
+		return 1.0f - (1.0f - hysteresis) * rayFraction;
+	}
+
+	return hysteresis;
+}
+
+float IrradianceField::probePriority(int probeIndex) const
+{
+	// In units of grid cells
+	const float viewerDistance = (probeIndexToPosition(probeIndex) - m_viewerPosition).length() / max(m_probeStep.length(), 1e-6f);
+
+	const float invalidation = (m_probeInvalidatedFrames[probeIndex] > 0) ? m_invalidationPriority : 1.0f;
+
+	return invalidation * float(m_probeFramesSinceUpdate[probeIndex]) * (1.0f + m_radianceChangePriority * m_probeRadianceChange[probeIndex]) / (1.0f + viewerDistance);
+}
+
+void IrradianceField::invalidateChangedProbes()
+{
+	m_changedRegions.fastClear();
+	if (notNull(m_scene))
+	{
+		m_sceneChangeTracker.update(m_scene, m_invalidationMarginCells * m_probeStep.max(), m_changedRegions);
+	}
+	if (!m_lightChangeInvalidation)
+	{
+		m_changedRegions.fastClear();
+	}
+
+	std::atomic<int> invalidatedCount(0);
+	runConcurrently(0, probeCount(), [&](int i) {
+		int& frames = m_probeInvalidatedFrames[i];
+		frames = max(frames - 1, 0);
+
+		if (m_probeAllocated[i] && (m_changedRegions.size() > 0))
+		{
+			const Point3& P = probeIndexToPosition(i);
+			for (const SceneChangeTracker::Region& region : m_changedRegions)
+			{
+				if (region.contains(P))
+				{
+					frames = m_invalidationFrames;
+					break;
+				}
+			}
+		}
+
+		if (frames > 0)
+		{
+			++invalidatedCount;
+		}
+	});
+	m_invalidatedProbeCount = invalidatedCount;
+
+	// Newly invalidated probes stop being converged, so that their radiance is measured again
+	if (m_changedRegions.size() > 0)
+	{
+		for (int i = 0; i < probeCount(); ++i)
+		{
+			if ((m_probeInvalidatedFrames[i] == m_invalidationFrames) && m_probeConverged[i])
+			{
+				m_probeConverged[i] = false;
+				m_probeStableUpdates[i] = 0;
+				--m_convergedProbeCount;
+			}
+		}
+	}
+}
+
+void IrradianceField::classifyProbes(RayStagingBuffers& rays)
+{
+	const int raysPerProbe = rays.rayOriginBuffer->width();
+
+	const Vector4* origins = static_cast<const Vector4*>(rays.rayOriginBuffer->mapRead());
+	const Vector4* directions = static_cast<const Vector4*>(rays.rayDirectionBuffer->mapRead());
+	const Vector4* hitPositions = static_cast<const Vector4*>(rays.hitBuffers[0]->mapRead());
+	const Vector4* hitNormals = static_cast<const Vector4*>(rays.hitBuffers[1]->mapRead());
+
+	// ProbeRayTracer records which side of the triangle each ray hit. TriTree::intersectRays does not,
+	// so without it the shading normal stands in, which misses back faces whose normal faces the ray.
+	const RayHitRecord* records = m_useProbeRayTracer ? static_cast<const RayHitRecord*>(rays.hitRecordBuffer->mapRead()) : nullptr;
+
+	const float minFrontfaceDistance = m_probeMinFrontfaceDistance * m_probeStep.min();
+	const Vector3& maxOffset = m_probeStep * m_maxProbeOffset;
+	std::atomic<int> movedProbeCount(0);
+	std::atomic<int> tracedRayCount(0);
+	std::atomic<int> hitRayCount(0);
+	std::atomic<int> backfaceRayCount(0);
+
+	rays.rowHitCount.resize(rays.rowCount);
+	runConcurrently(0, rays.rowCount, [&](int row) {
+		const int probeIndex = rays.rowProbeIndex[row];
+		rays.rowHitCount[row] = 0;
+		if (probeIndex < 0)
+		{
+			return;
+		}
+
+		const int rayCount = rays.rowRayCount[row];
+		int hitCount = 0;
+		int backfaceCount = 0;
+		bool nearSurface = false;
+		float closestBackfaceDistance = finf();
+		float closestFrontfaceDistance = finf();
+		Vector3 closestBackfaceDirection;
+		Vector3 closestFrontfaceDirection;
+		for (int i = row * raysPerProbe; i < row * raysPerProbe + rayCount; ++i)
+		{
+			// Normals are zero on a miss
+			const Vector3& normal = hitNormals[i].xyz();
+			if (normal.squaredLength() == 0.0f)
+			{
+				continue;
+			}
+			++hitCount;
+
+			const Vector3& direction = directions[i].xyz();
+			const Vector3& probeToHit = hitPositions[i].xyz() - origins[i].xyz();
+			const float distance = probeToHit.length();
+			const bool backface = notNull(records) ? records[i].backface() : (normal.dot(direction) > 0.0f);
+			if (backface)
+			{
+				++backfaceCount;
+				if (distance < closestBackfaceDistance)
+				{
+					closestBackfaceDistance = distance;
+					closestBackfaceDirection = direction;
+				}
+			}
+			else
+			{
+				if (distance < closestFrontfaceDistance)
+				{
+					closestFrontfaceDistance = distance;
+					closestFrontfaceDirection = direction;
+				}
+
+				// Only surfaces within the cells that share this probe can be shaded by it
+				const Vector3& offset = probeToHit.abs();
+				nearSurface = nearSurface || ((offset.x <= m_probeStep.x) && (offset.y <= m_probeStep.y) && (offset.z <= m_probeStep.z));
+			}
+		}
+
+		rays.rowHitCount[row] = hitCount;
+		tracedRayCount += rayCount;
+		hitRayCount += hitCount;
+		backfaceRayCount += backfaceCount;
+
+		const bool insideGeometry = (backfaceCount > m_backfaceFractionThreshold * rayCount);
+		if (insideGeometry)
+		{
+			m_probeStates[probeIndex] = ProbeState::INSIDE_GEOMETRY;
+		}
+		else
+		{
+			m_probeStates[probeIndex] = nearSurface ? ProbeState::ACTIVE : ProbeState::INACTIVE;
+		}
+
+		if (m_relocateProbes)
+		{
+			// Step through the nearest backface to get out of the geometry, or back away from a
+			// surface that is so close that the probe mostly sees it
+			Vector3 move = Vector3::zero();
+			if (insideGeometry)
+			{
+				move = closestBackfaceDirection * (closestBackfaceDistance + minFrontfaceDistance * 0.5f);
+			}
+			else if (closestFrontfaceDistance < minFrontfaceDistance)
+			{
+				move = -closestFrontfaceDirection * (minFrontfaceDistance - closestFrontfaceDistance);
+			}
+
+			if (!move.isZero())
+			{
+				// The rays started at the probe's position when they were generated
+				const Point3& latticePosition = probeIndexToPosition(probeIndex) - m_probeOffsets[probeIndex];
+				const Vector3& offset = (origins[row * raysPerProbe].xyz() + move - latticePosition).clamp(-maxOffset, maxOffset);
+				if ((offset - m_probeOffsets[probeIndex]).length() > 0.05f * minFrontfaceDistance)
+				{
+					m_probeOffsets[probeIndex] = offset;
+
+					// The probe's old values were seen from somewhere else
+					m_probeNeedsReset[probeIndex] = true;
+					++movedProbeCount;
+				}
+			}
+		}
+	});
+
+	rays.rayOriginBuffer->unmap();
+	rays.rayDirectionBuffer->unmap();
+	rays.hitBuffers[0]->unmap();
+	rays.hitBuffers[1]->unmap();
+	if (notNull(records))
+	{
+		rays.hitRecordBuffer->unmap();
+	}
+
+	m_activeProbeCount = 0;
+	for (const ProbeState& state : m_probeStates)
+	{
+		m_activeProbeCount += (state == ProbeState::ACTIVE) ? 1 : 0;
+	}
+
+	m_probeOffsetsChanged = m_probeOffsetsChanged || (movedProbeCount > 0);
+	m_stats.addRays(tracedRayCount, hitRayCount, backfaceRayCount);
+}
+
+void IrradianceField::uploadProbeOffsets()
+{
+	const int width = probeAtlasSize().x;
+	const int height = probeAtlasSize().y;
+
+	if (isNull(m_probeOffsetTexture) || (m_probeOffsetTexture->width() != width) || (m_probeOffsetTexture->height() != height))
+	{
+		m_probeOffsetTexture = Texture::createEmpty("IrradianceField::m_probeOffsetTexture", width, height, ImageFormat::RGBA32F());
+	}
+
+	const shared_ptr<CPUPixelTransferBuffer>& buffer = CPUPixelTransferBuffer::create(width, height, ImageFormat::RGBA32F());
+	Vector4* offsets = static_cast<Vector4*>(buffer->mapWrite());
+	System::memset(offsets, 0, sizeof(Vector4) * width * height);
+	for (int i = 0; i < m_probeOffsets.size(); ++i)
+	{
+		const Point2int32& atlasCoord = probeAtlasCoord(i);
+		offsets[atlasCoord.y * width + atlasCoord.x] = Vector4(m_probeOffsets[i], 0.0f);
+	}
+	buffer->unmap();
+
+	m_stats.beginStage(ProbeStats::UPLOAD);
+	m_probeOffsetTexture->update(buffer);
+	m_stats.addBytesUploaded(int64(width) * height * sizeof(Vector4));
+	m_stats.endStage(ProbeStats::UPLOAD);
+	m_probeOffsetsChanged = false;
+}
+
+void IrradianceField::mergeDynamicHits(const RayStagingBuffers& rays) const
+{
+	const int width = rays.rayOriginBuffer->width();
+	const int height = rays.rayOriginBuffer->height();
+
+	const Vector4* origins = static_cast<const Vector4*>(rays.rayOriginBuffer->mapRead());
+	void* staticHits[5];
+	const void* dynamicHits[5];
+	for (int i = 0; i < 5; ++i)
+	{
+		staticHits[i] = rays.hitBuffers[i]->mapReadWrite();
+		dynamicHits[i] = rays.dynamicHitBuffers[i]->mapRead();
+	}
+
+	const Vector4* staticPosition = static_cast<const Vector4*>(staticHits[0]);
+	const Vector4* staticNormal = static_cast<const Vector4*>(staticHits[1]);
+	const Vector4* dynamicPosition = static_cast<const Vector4*>(dynamicHits[0]);
+	const Vector4* dynamicNormal = static_cast<const Vector4*>(dynamicHits[1]);
+
+	runConcurrently(0, height, [&](int y) {
+		for (int i = y * width; i < (y + 1) * width; ++i)
+		{
+			// Normals are zero on a miss
+			if (dynamicNormal[i].xyz().squaredLength() == 0.0f)
+			{
+				continue;
+			}
+
+			const Point3& origin = origins[i].xyz();
+			const bool staticHit = staticNormal[i].xyz().squaredLength() > 0.0f;
+			if (staticHit && ((staticPosition[i].xyz() - origin).squaredLength() <= (dynamicPosition[i].xyz() - origin).squaredLength()))
+			{
+				continue;
+			}
+
+			for (int b = 0; b < 5; ++b)
+			{
+				const size_t texelSize = rays.hitBuffers[b]->format()->cpuBitsPerPixel / 8;
+				System::memcpy(static_cast<uint8*>(staticHits[b]) + i * texelSize, static_cast<const uint8*>(dynamicHits[b]) + i * texelSize, texelSize);
+			}
+		}
+	});
+
+	rays.rayOriginBuffer->unmap();
+	for (int i = 0; i < 5; ++i)
+	{
+		rays.hitBuffers[i]->unmap();
+		rays.dynamicHitBuffers[i]->unmap();
+	}
+}
+
+Color3 IrradianceField::probeCoordVisualizationColor(Point3int32 P)
+{
+	Color3 c(float(P.x & 1), float(P.y & 1), float(P.z & 1));
+	// Make all probes the same brightness
+	c /= max(c.r + c.g + c.b, 0.01f);
+	return c * 0.6f + Color3(0.2f);
+}
+
+void IrradianceField::debugDraw() const
+{
+	const float radius = 0.075f;
+	for (int i = 0; i < probeCount(); ++i)
+	{
+		if (!m_probeAllocated[i])
+		{
+			continue;
+		}
+
+		Color3 color;
+		const Point3& probeCenter = probeIndexToPosition(i);
+
+		const Point3int32 P = probeIndexToLatticeCoord(i);
+		color = probeCoordVisualizationColor(P);
+		//color = Color3::fromASRGB(0xff007e);
+
+		if (i < m_probeStates.size())
+		{
+			if (m_probeStates[i] == ProbeState::INACTIVE)
+			{
+				color = Color3(0.15f);
+			}
+			else if (m_probeStates[i] == ProbeState::INSIDE_GEOMETRY)
+			{
+				color = Color3(0.6f, 0.0f, 0.0f);
+			}
+		}
+
+		::debugDraw(std::make_shared<SphereShape>(probeCenter, radius), 0.0f, color * 0.8f, Color4::clear());
+	}
+}
+
+void IrradianceField::allocateRayStagingBuffers(RayStagingBuffers& staging, int rayDimX, int rayDimY)
+{
+	staging.rayOrigins = Texture::createEmpty("IrradianceField::m_irradianceRayOrigins", rayDimX, rayDimY, ImageFormat::RGBA32F());
+	staging.rayDirections = Texture::createEmpty("IrradianceField::m_irradianceRayDirections", rayDimX, rayDimY, ImageFormat::RGBA32F());
+	staging.raysFB = Framebuffer::create(staging.rayOrigins, staging.rayDirections);
+
+	// Read by the CPU tracer. Written by the CPU ray generator, or copied from the GPU ray generation pass.
+	const GLenum rayUsage = generateRaysOnCPU() ? GL_STREAM_DRAW : GL_STREAM_READ;
+	staging.rayOriginBuffer = GLPixelTransferBuffer::create(rayDimX, rayDimY, ImageFormat::RGBA32F(), nullptr, 1, rayUsage);
+	staging.rayDirectionBuffer = GLPixelTransferBuffer::create(rayDimX, rayDimY, ImageFormat::RGBA32F(), nullptr, 1, rayUsage);
+
+	staging.probeSchedule = Texture::createEmpty("IrradianceField::m_probeSchedule", probeAtlasSize().x, probeAtlasSize().y, ImageFormat::RGBA32F());
+	staging.rowProbeIndex.fastClear();
+	staging.rowRayCount.fastClear();
+	staging.rowHysteresis.fastClear();
+	staging.rowHitCount.fastClear();
+	staging.rowCount = 0;
+	staging.tracedRayCount = 0;
+	staging.hitCount = 0;
+
+	// Written by the CPU tracer, read by the GPU
+	for (int i = 0; i < 5; ++i)
+	{
+		const ImageFormat* format = ((i == 2) || (i == 3)) ? ImageFormat::RGBA8() : ImageFormat::RGBA32F();
+		staging.hitBuffers[i] = GLPixelTransferBuffer::create(rayDimX, rayDimY, format, nullptr, 1, GL_STREAM_DRAW);
+		staging.dynamicHitBuffers[i] = GLPixelTransferBuffer::create(rayDimX, rayDimY, format, nullptr, 1, GL_STREAM_READ);
+	}
+
+	// Packed from hitBuffers by the CPU, uploaded to m_rayHitRecords
+	staging.hitRecordBuffer = GLPixelTransferBuffer::create(rayDimX, rayDimY, ImageFormat::RGBA32UI(), nullptr, 1, GL_STREAM_DRAW);
+
+	// Written by buildRayHitList, uploaded to m_rayHitList
+	staging.hitListBuffer = GLPixelTransferBuffer::create(rayDimX, rayDimY, ImageFormat::R32UI(), nullptr, 1, GL_STREAM_DRAW);
+
+	staging.pending = false;
+}
+
+/** Starts an asynchronous copy of one color attachment of \a fb into \a buffer.
+	The copy completes on the GPU timeline; mapping \a buffer waits for it. */
+static void readAttachmentAsync(const shared_ptr<Framebuffer>& fb, Framebuffer::AttachmentPoint attachment, const shared_ptr<GLPixelTransferBuffer>& buffer)
+{
+	glBindFramebuffer(GL_READ_FRAMEBUFFER, fb->openGLID());
+	glReadBuffer(GLenum(attachment));
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, buffer->glBufferID());
+	glReadPixels(0, 0, buffer->width(), buffer->height(), GL_RGBA, GL_FLOAT, 0);
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, GL_NONE);
+	glBindFramebuffer(GL_READ_FRAMEBUFFER, GL_NONE);
+}
+
+/** Uploads the first \a rowCount rows of \a buffer into \a texture, which has the same width and an integer format */
+static void uploadIntegerRows(const shared_ptr<GLPixelTransferBuffer>& buffer, const shared_ptr<Texture>& texture, int rowCount)
+{
+	const ImageFormat* format = texture->format();
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, buffer->glBufferID());
+	glBindTexture(GL_TEXTURE_2D, texture->openGLID());
+	glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, buffer->width(), rowCount, format->openGLBaseFormat, format->openGLDataFormat, 0);
+	glBindTexture(GL_TEXTURE_2D, GL_NONE);
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, GL_NONE);
+}
+
+void IrradianceField::generateIrradianceRays(RenderDevice* rd, const shared_ptr<Scene>& scene)
+{
+	BEGIN_PROFILER_EVENT("generateIrradianceRays");
+	m_stats.beginStage(ProbeStats::RAY_GENERATION);
+
+	RayStagingBuffers& staging = m_rayStaging[m_rayStagingIndex];
+	const Matrix3& randomOrientation = Matrix3::fromAxisAngle(Vector3::random(m_random), m_random.uniform(0.f, 2 * pif()));
+
+	scheduleProbes(staging);
+
+	if (generateRaysOnCPU())
+	{
+		m_rayGenerator.setRaysPerProbe(m_specification.irradianceRaysPerProbe, convergedRaysPerProbe());
+		m_rayGenerator.setOrientation(randomOrientation);
+
+		m_probePositions.resize(staging.rowCount);
+		for (int row = 0; row < m_probePositions.size(); ++row)
+		{
+			m_probePositions[row] = probeIndexToPosition(staging.rowProbeIndex[row]);
+		}
+
+		// Write straight into the tracer's input. The rows after the scheduled probes hold empty rays.
+		const int raysPerProbe = m_specification.irradianceRaysPerProbe;
+		const int tracedRayCount = staging.rowCount * raysPerProbe;
+		Vector4* origins = static_cast<Vector4*>(staging.rayOriginBuffer->mapWrite());
+		Vector4* directions = static_cast<Vector4*>(staging.rayDirectionBuffer->mapWrite());
+		m_rayGenerator.writeRays(m_probePositions, staging.rowRayCount, origins, directions);
+		ProbeRayGenerator::writeEmptyRays(origins + tracedRayCount, directions + tracedRayCount, probeCount() * raysPerProbe - tracedRayCount);
+		staging.rayOriginBuffer->unmap();
+		staging.rayDirectionBuffer->unmap();
+
+		// The shading and probe update passes still read the rays on the GPU. This is a
+		// GPU-side copy from the buffers, not a round trip.
+		m_stats.beginStage(ProbeStats::UPLOAD);
+		staging.rayOrigins->update(staging.rayOriginBuffer);
+		staging.rayDirections->update(staging.rayDirectionBuffer);
+		m_stats.addBytesUploaded(2 * int64(staging.rayOriginBuffer->size()));
+		m_stats.endStage(ProbeStats::UPLOAD);
+
+		// Nothing to wait for, so this slot is traced on this frame
+		staging.pending = false;
+	}
+	else
+	{
+		rd->push2D(staging.raysFB); {
+			Args args;
+
+			args.setMacro("RAYS_PER_PROBE", m_specification.irradianceRaysPerProbe);
+			args.setRect(rd->viewport());
+
+			setShaderArgs(args, "irradianceFieldSurface.");
+			args.setUniform("randomOrientation", randomOrientation);
+			staging.probeSchedule->setShaderArgs(args, "probeSchedule.", Sampler::buffer());
+
+			LAUNCH_SHADER("shaders/IrradianceField_GenerateRandomRays.pix", args);
+
+		} rd->pop2D();
+
+		// Copy the rays into persistent CPU-visible memory without waiting for them
+		m_stats.beginStage(ProbeStats::READBACK);
+		readAttachmentAsync(staging.raysFB, Framebuffer::COLOR0, staging.rayOriginBuffer);
+		readAttachmentAsync(staging.raysFB, Framebuffer::COLOR1, staging.rayDirectionBuffer);
+		m_stats.addBytesReadBack(2 * int64(staging.rayOriginBuffer->size()));
+		m_stats.endStage(ProbeStats::READBACK);
+		staging.pending = true;
+	}
+
+	m_stats.endStage(ProbeStats::RAY_GENERATION);
+	END_PROFILER_EVENT();
+}
+
+void IrradianceField::packRayHits(const RayStagingBuffers& rays) const
+{
+	const int width = rays.rayOriginBuffer->width();
+
+	const Vector4* origins = static_cast<const Vector4*>(rays.rayOriginBuffer->mapRead());
+	const Vector4* hitPositions = static_cast<const Vector4*>(rays.hitBuffers[0]->mapRead());
+	const Vector4* hitNormals = static_cast<const Vector4*>(rays.hitBuffers[1]->mapRead());
+	const uint32* hitLambertian = static_cast<const uint32*>(rays.hitBuffers[2]->mapRead());
+	const uint32* hitGlossy = static_cast<const uint32*>(rays.hitBuffers[3]->mapRead());
+	const bool glossyToMatte = m_specification.glossyToMatte;
+	const Vector4* hitEmissive = static_cast<const Vector4*>(rays.hitBuffers[4]->mapRead());
+	RayHitRecord* records = static_cast<RayHitRecord*>(rays.hitRecordBuffer->mapWrite());
+
+	// Rows past rowCount are not shaded or read by the probe update
+	runConcurrently(0, rays.rowCount, [&](int row) {
+		for (int i = row * width; i < (row + 1) * width; ++i)
+		{
+			// Normals are zero on a miss
+			const Vector3& normal = hitNormals[i].xyz();
+			const uint32 lambertian = glossyToMatte ? RayHitRecord::addUnorm4x8(hitLambertian[i], hitGlossy[i]) : hitLambertian[i];
+			records[i] = (normal.squaredLength() == 0.0f) ?
+				RayHitRecord::miss() :
+				RayHitRecord::hit((hitPositions[i].xyz() - origins[i].xyz()).length(), normal, lambertian, hitEmissive[i].rgb(),
+					normal.dot(hitPositions[i].xyz() - origins[i].xyz()) > 0.0f);
+		}
+	});
+
+	rays.rayOriginBuffer->unmap();
+	rays.hitBuffers[0]->unmap();
+	rays.hitBuffers[1]->unmap();
+	rays.hitBuffers[2]->unmap();
+	rays.hitBuffers[3]->unmap();
+	rays.hitBuffers[4]->unmap();
+	rays.hitRecordBuffer->unmap();
+}
+
+void IrradianceField::buildRayHitList(RayStagingBuffers& rays) const
+{
+	const int width = rays.rayOriginBuffer->width();
+
+	// Each row's range of the list, in row order so that the hits of a probe stay together
+	Array<int> rowHitOffset;
+	rowHitOffset.resize(rays.rowCount);
+	int hitCount = 0;
+	for (int row = 0; row < rays.rowCount; ++row)
+	{
+		rowHitOffset[row] = hitCount;
+		hitCount += rays.rowHitCount[row];
+	}
+
+	const Vector4* hitNormals = static_cast<const Vector4*>(rays.hitBuffers[1]->mapRead());
+	uint32* hitList = static_cast<uint32*>(rays.hitListBuffer->mapWrite());
+
+	runConcurrently(0, rays.rowCount, [&](int row) {
+		int k = rowHitOffset[row];
+		for (int i = row * width; i < row * width + rays.rowRayCount[row]; ++i)
+		{
+			// Normals are zero on a miss
+			if (hitNormals[i].xyz().squaredLength() > 0.0f)
+			{
+				hitList[k] = uint32(i);
+				++k;
+			}
+		}
+		debugAssertM(k == rowHitOffset[row] + rays.rowHitCount[row], "Hit count does not match classifyProbes");
+	});
+
+	rays.hitBuffers[1]->unmap();
+	rays.hitListBuffer->unmap();
+	rays.hitCount = hitCount;
+}
+
+void IrradianceField::sampleAndShadeArbitraryRays
+   (RenderDevice*                       rd,
+	const shared_ptr<Framebuffer>&      targetFramebuffer,
+	const LightingEnvironment&          environment,
+	const RayStagingBuffers&            rays,
+	const bool                          useProbeIndirect)
+{
+	BEGIN_PROFILER_EVENT("sampleAndShadeArbitraryRays");
+
+	// Rows past rowCount hold no rays
+	const Rect2D& shadedRect = Rect2D::xywh(0.0f, 0.0f, float(m_rayHitRecords->width()), float(rays.rowCount));
+
+	// Rows of the hit list, laid out like the rays
+	const int width = m_rayHitRecords->width();
+	const int hitRows = m_compactRayHits ? (rays.hitCount + width - 1) / width : 0;
+
+	m_stats.beginStage(ProbeStats::UPLOAD);
+	m_rayHitRecords->update(rays.hitRecordBuffer);
+	m_stats.addBytesUploaded(int64(rays.hitRecordBuffer->size()));
+	if (hitRows > 0)
+	{
+		uploadIntegerRows(rays.hitListBuffer, m_rayHitList, hitRows);
+		m_stats.addBytesUploaded(int64(hitRows) * width * sizeof(uint32));
+	}
+	m_stats.endStage(ProbeStats::UPLOAD);
+
+	m_stats.beginStage(ProbeStats::SHADE);
+	if (m_compactRayHits)
+	{
+		shadeCompactedRays(rd, targetFramebuffer, environment, rays, shadedRect, hitRows, useProbeIndirect);
+	}
+	else
+	{
+		rd->push2D(targetFramebuffer); {
+			// Disable screen-space effects. Note that this is a COPY we're making in order to mutate it
+			LightingEnvironment e = environment;
+			e.ambientOcclusionSettings.enabled = false;
+
+			Args args;
+			e.setShaderArgs(args);
+			args.setRect(shadedRect);
+
+			args.setUniform("rayHitRecords", m_rayHitRecords, Sampler::buffer());
+			args.setUniform("rayOrigins", rays.rayOrigins, Sampler::buffer());
+			args.setUniform("rayDirections", rays.rayDirections, Sampler::buffer());
+
+			// Irradiance of the probes themselves at the hit, for multiple bounces
+			args.setMacro("USE_PROBE_INDIRECT", useProbeIndirect);
+			args.setMacro("COMPACT_HITS", false);
+			setShaderArgs(args, "irradianceFieldSurface.");
+			args.setUniform("energyPreservation", recursiveEnergyPreservation);
+
+			// Misses see the sky
+			dynamic_pointer_cast<Skybox>(m_scene->entity("skybox"))->keyframeArray()[0]->setShaderArgs(args, "skybox_", Sampler::defaults());
+
+			LAUNCH_SHADER("shaders/IrradianceField_ShadeRayHits.pix", args);
+		} rd->pop2D();
+	}
+
+	m_stats.endStage(ProbeStats::SHADE);
+	END_PROFILER_EVENT();
+}
+
+void IrradianceField::shadeCompactedRays
+   (RenderDevice*                       rd,
+	const shared_ptr<Framebuffer>&      targetFramebuffer,
+	const LightingEnvironment&          environment,
+	const RayStagingBuffers&            rays,
+	const Rect2D&                       shadedRect,
+	int                                 hitRows,
+	bool                                useProbeIndirect)
+{
+	// Misses only see the sky. The hit texels are left for the scatter below.
+	rd->push2D(targetFramebuffer); {
+		Args args;
+		args.setRect(shadedRect);
+		args.setUniform("rayHitRecords", m_rayHitRecords, Sampler::buffer());
+		args.setUniform("rayDirections", rays.rayDirections, Sampler::buffer());
+		dynamic_pointer_cast<Skybox>(m_scene->entity("skybox"))->keyframeArray()[0]->setShaderArgs(args, "skybox_", Sampler::defaults());
+
+		LAUNCH_SHADER("shaders/IrradianceField_ShadeRayMisses.pix", args);
+	} rd->pop2D();
+
+	if (hitRows == 0)
+	{
+		return;
+	}
+
+	// Direct and probe lighting over the dense list of hits, so that no pixel of this pass is a miss
+	const int width = m_rayHitRecords->width();
+	rd->push2D(m_shadedRayHitsFB); {
+		// Disable screen-space effects. Note that this is a COPY we're making in order to mutate it
+		LightingEnvironment e = environment;
+		e.ambientOcclusionSettings.enabled = false;
+
+		Args args;
+		e.setShaderArgs(args);
+		args.setRect(Rect2D::xywh(0.0f, 0.0f, float(width), float(hitRows)));
+
+		args.setUniform("rayHitRecords", m_rayHitRecords, Sampler::buffer());
+		args.setUniform("rayOrigins", rays.rayOrigins, Sampler::buffer());
+		args.setUniform("rayDirections", rays.rayDirections, Sampler::buffer());
+		args.setUniform("rayHitList", m_rayHitList, Sampler::buffer());
+		args.setUniform("hitCount", rays.hitCount);
+
+		args.setMacro("USE_PROBE_INDIRECT", useProbeIndirect);
+		args.setMacro("COMPACT_HITS", true);
+		setShaderArgs(args, "irradianceFieldSurface.");
+		args.setUniform("energyPreservation", recursiveEnergyPreservation);
+
+		LAUNCH_SHADER("shaders/IrradianceField_ShadeRayHits.pix", args);
+	} rd->pop2D();
+
+	// Back to ray order for the probe updates
+	Args args;
+	args.setUniform("rayHitList", m_rayHitList, Sampler::buffer());
+	args.setUniform("shadedRayHits", m_shadedRayHitsFB->texture(0), Sampler::buffer());
+	args.setUniform("hitCount", rays.hitCount);
+	args.setImageUniform("shadedRaysImage", targetFramebuffer->texture(0), Access::WRITE);
+
+	static const int groupSide = 16;
+	args.setComputeGroupSize(Vector3int32(groupSide, groupSide, 1));
+	args.setComputeGridDim(Vector3int32(iCeil(width / float(groupSide)), iCeil(hitRows / float(groupSide)), 1));
+
+	LAUNCH_SHADER("shaders/IrradianceField_ScatterShadedHits.glc", args);
+
+	// Read by the mean radiance and probe update passes
+	glMemoryBarrier(GL_SHADER_IMAGE_ACCESS_BARRIER_BIT | GL_TEXTURE_FETCH_BARRIER_BIT);
+}
+
+void IrradianceField::finishAsyncTrace()
+{
+	if (!m_traceJob.valid())
+	{
+		return;
+	}
+
+	// Explicit fence: the worker has finished writing the hit buffers once get() returns
+	m_stats.beginStage(ProbeStats::TRACE);
+	m_asyncTraceMilliseconds = m_traceJob.get();
+	m_stats.endStage(ProbeStats::TRACE);
+
+	const RayStagingBuffers& staging = m_rayStaging[m_asyncTraceIndex];
+	staging.rayOriginBuffer->unmap();
+	staging.rayDirectionBuffer->unmap();
+	staging.hitRecordBuffer->unmap();
+	staging.hitBuffers[0]->unmap();
+	staging.hitBuffers[1]->unmap();
+
+	m_asyncTracedIndex = m_asyncTraceIndex;
+	m_asyncTraceIndex = -1;
+}
+
+void IrradianceField::startAsyncTrace(int index)
+{
+	debugAssertM(!m_traceJob.valid(), "Only one asynchronous trace may run at a time");
+	const RayStagingBuffers& staging = m_rayStaging[index];
+
+	// GL calls must stay on this thread, so the worker only sees mapped memory. The buffers stay
+	// mapped, and are not used by GL, until finishAsyncTrace.
+	ProbeRayTracer::Output output;
+	output.records = static_cast<RayHitRecord*>(staging.hitRecordBuffer->mapWrite());
+	output.positions = static_cast<Vector4*>(staging.hitBuffers[0]->mapWrite());
+	output.normals = static_cast<Vector4*>(staging.hitBuffers[1]->mapWrite());
+	const Vector4* origins = static_cast<const Vector4*>(staging.rayOriginBuffer->mapRead());
+	const Vector4* directions = static_cast<const Vector4*>(staging.rayDirectionBuffer->mapRead());
+
+	const shared_ptr<TriTree> staticTree = m_staticTriTree;
+	const shared_ptr<TriTree> dynamicTree = m_dynamicTriTree;
+	const int raysPerRow = staging.rayOriginBuffer->width();
+	const int rowCount = staging.rowCount;
+
+	m_traceJob = std::async(std::launch::async, [this, staticTree, dynamicTree, origins, directions, raysPerRow, rowCount, output]() {
+		const RealTime start = System::time();
+		m_probeRayTracer.trace(staticTree, dynamicTree, origins, directions, raysPerRow, rowCount, output, TriTree::DO_NOT_CULL_BACKFACES);
+		return float(System::time() - start) * 1000.0f;
+	});
+	m_asyncTraceIndex = index;
+}
+
+void IrradianceField::shadeTracedRays(RenderDevice* rd, const shared_ptr<Scene>& scene, RayStagingBuffers& staging, float traceMilliseconds)
+{
+	// The shading and probe update passes read the rays of this batch
+	m_irradianceRayOrigins = staging.rayOrigins;
+	m_irradianceRayDirections = staging.rayDirections;
+	m_probeSchedule = staging.probeSchedule;
+
+	// Tracing dominates the cost of a probe update, so the millisecond budget is enforced through the trace rate
+	if ((staging.tracedRayCount > 0) && (traceMilliseconds > 0.0f))
+	{
+		const float raysPerMillisecond = float(staging.tracedRayCount) / traceMilliseconds;
+		m_raysPerMillisecond = (m_raysPerMillisecond > 0.0f) ? lerp(m_raysPerMillisecond, raysPerMillisecond, 0.1f) : raysPerMillisecond;
+	}
+
+	m_stats.beginStage(ProbeStats::CLASSIFY);
+	classifyProbes(staging);
+	if (m_probeOffsetsChanged)
+	{
+		uploadProbeOffsets();
+	}
+
+	// The probe tracer writes the packed records itself
+	if (!m_useProbeRayTracer)
+	{
+		packRayHits(staging);
+	}
+	if (m_compactRayHits)
+	{
+		buildRayHitList(staging);
+	}
+	m_stats.endStage(ProbeStats::CLASSIFY);
+
+	sampleAndShadeArbitraryRays
+	    (rd,
+		m_irradianceRaysShadedFB,
+		scene->lightingEnvironment(),
+		staging,
+		!m_oneBounce);
+
+	computeProbeMeanRadiance(rd, staging);
+
+	staging.pending = false;
+	m_probeBatchShaded = true;
+}
+
+void IrradianceField::sampleAndShadeIrradianceRays(RenderDevice* rd, const shared_ptr<Scene>& scene)
+{
+	BEGIN_PROFILER_EVENT("sampleIrradianceRays");
+	m_probeBatchShaded = false;
+	m_probeRayTracer.setGlossyToMatte(m_specification.glossyToMatte);
+
+	// The batch traced on a worker during the previous frame
+	if (m_asyncTracedIndex >= 0)
+	{
+		shadeTracedRays(rd, scene, m_rayStaging[m_asyncTracedIndex], m_asyncTraceMilliseconds);
+		m_asyncTracedIndex = -1;
+	}
+
+	if (m_asyncTrace && canTraceAsync())
+	{
+		// This frame's rays are traced while the frame renders
+		startAsyncTrace(m_rayStagingIndex);
+		m_rayStagingIndex = (m_rayStagingIndex + 1) % RAY_STAGING_BUFFER_COUNT;
+	}
+	else if (!m_probeBatchShaded)
+	{
+		// Trace the previous frame's GPU-generated rays when their copy to the CPU has had a frame to complete,
+		// so that mapping them does not stall. The first frame, CPU-generated rays and non-pipelined mode
+		// trace this frame's rays.
+		const int previousIndex = (m_rayStagingIndex + RAY_STAGING_BUFFER_COUNT - 1) % RAY_STAGING_BUFFER_COUNT;
+		RayStagingBuffers& staging = (m_pipelineRayReadback && m_rayStaging[previousIndex].pending) ?
+			m_rayStaging[previousIndex] : m_rayStaging[m_rayStagingIndex];
+
+		// Don't cull backfaces...if a probe looks through a back face (e.g., single-sided ceiling), it will get incorrect results.
+		// The backface hits are also what classifies probes as INSIDE_GEOMETRY.
+		m_stats.beginStage(ProbeStats::TRACE);
+		const RealTime traceStartTime = System::time();
+		traceRays(staging, TriTree::DO_NOT_CULL_BACKFACES);
+		const float traceMilliseconds = float(System::time() - traceStartTime) * 1000.0f;
+		m_stats.endStage(ProbeStats::TRACE);
+
+		shadeTracedRays(rd, scene, staging, traceMilliseconds);
+		m_rayStagingIndex = (m_rayStagingIndex + 1) % RAY_STAGING_BUFFER_COUNT;
+	}
+
+	END_PROFILER_EVENT();
+}
+
+void IrradianceField::computeProbeMeanRadiance(RenderDevice* rd, const RayStagingBuffers& rays)
+{
+	m_stats.beginStage(ProbeStats::SHADE);
+	rd->push2D(m_probeMeanRadianceFB); {
+		Args args;
+		args.setMacro("RAYS_PER_PROBE", m_specification.irradianceRaysPerProbe);
+		m_irradianceRaysShadedFB->texture(0)->setShaderArgs(args, "rayHitRadiance.", Sampler::buffer());
+		rays.rayDirections->setShaderArgs(args, "rayDirections.", Sampler::buffer());
+		args.setRect(Rect2D::xywh(0.0f, 0.0f, 1.0f, float(rays.rowCount)));
+
+		LAUNCH_SHADER("shaders/IrradianceField_ProbeMeanRadiance.pix", args);
+	} rd->pop2D();
+
+	m_stats.beginStage(ProbeStats::READBACK);
+	readAttachmentAsync(m_probeMeanRadianceFB, Framebuffer::COLOR0, m_probeMeanRadianceBuffer);
+	m_stats.addBytesReadBack(int64(m_probeMeanRadianceBuffer->size()));
+	m_stats.endStage(ProbeStats::READBACK);
+	m_stats.endStage(ProbeStats::SHADE);
+
+	m_probeMeanRadianceRowProbeIndex.resize(rays.rowCount);
+	m_probeMeanRadianceRowHysteresis.resize(rays.rowCount);
+	for (int row = 0; row < rays.rowCount; ++row)
+	{
+		m_probeMeanRadianceRowProbeIndex[row] = rays.rowProbeIndex[row];
+		m_probeMeanRadianceRowHysteresis[row] = rays.rowHysteresis[row];
+	}
+	m_probeMeanRadiancePending = true;
+}
+
+void IrradianceField::readProbeRadianceChange()
+{
+	if (!m_probeMeanRadiancePending)
+	{
+		return;
+	}
+
+	m_stats.beginStage(ProbeStats::READBACK);
+	const Vector4* meanRadiance = static_cast<const Vector4*>(m_probeMeanRadianceBuffer->mapRead());
+	for (int row = 0; row < m_probeMeanRadianceRowProbeIndex.size(); ++row)
+	{
+		const int probeIndex = m_probeMeanRadianceRowProbeIndex[row];
+		if (probeIndex < 0)
+		{
+			continue;
+		}
+
+		const float luminance = Radiance3(meanRadiance[row].x, meanRadiance[row].y, meanRadiance[row].z).luminance();
+		const float stored = m_probeMeanLuminance[probeIndex];
+		const float hysteresis = m_probeMeanRadianceRowHysteresis[row];
+
+		// After a reset the probe holds just this estimate, which there is nothing to compare with
+		if ((hysteresis == 0.0f) || (stored < 0.0f))
+		{
+			m_probeMeanLuminance[probeIndex] = luminance;
+			m_probeStableUpdates[probeIndex] = 0;
+			continue;
+		}
+
+		// Compare the new estimate with the value it is blended into, before the blend
+		const float delta = min(1.0f, abs(luminance - stored) / max(stored, 1e-3f));
+		float& change = m_probeRadianceChange[probeIndex];
+		change = (delta > change) ? delta : lerp(delta, change, m_radianceChangeDecay);
+		m_probeMeanLuminance[probeIndex] = lerp(luminance, stored, hysteresis);
+
+		m_probeStableUpdates[probeIndex] = (change < m_convergenceThreshold) ? (m_probeStableUpdates[probeIndex] + 1) : 0;
+		if (m_probeConverged[probeIndex] && (delta > m_changeThreshold))
+		{
+			m_probeConverged[probeIndex] = false;
+			m_probeStableUpdates[probeIndex] = 0;
+			--m_convergedProbeCount;
+		}
+		else if (m_adaptiveUpdates && !m_probeConverged[probeIndex] && (m_probeStableUpdates[probeIndex] >= m_updatesToConverge))
+		{
+			m_probeConverged[probeIndex] = true;
+			++m_convergedProbeCount;
+		}
+	}
+	m_probeMeanRadianceBuffer->unmap();
+	m_stats.endStage(ProbeStats::READBACK);
+
+	m_probeMeanRadiancePending = false;
+}
+
+void IrradianceField::updateIrradianceProbes(RenderDevice* rd, const shared_ptr<Scene>& scene)
+{
+	BEGIN_PROFILER_EVENT("updateIrradianceProbes");
+
+	static const bool IRRADIANCE = true, DEPTH = false;
+
+	if (notNull(m_irradianceSH))
+	{
+		m_stats.beginStage(ProbeStats::UPDATE_IRRADIANCE);
+		updateSHProbes(rd);
+		m_stats.endStage(ProbeStats::UPDATE_IRRADIANCE);
+
+		m_stats.beginStage(ProbeStats::UPDATE_DEPTH);
+		updateIrradianceProbe(rd, DEPTH);
+		m_stats.endStage(ProbeStats::UPDATE_DEPTH);
+	}
+	else if (m_fusedProbeUpdate && canUseFusedProbeUpdate())
+	{
+		m_stats.beginStage(ProbeStats::UPDATE_IRRADIANCE);
+		updateProbesFused(rd);
+		m_stats.endStage(ProbeStats::UPDATE_IRRADIANCE);
+	}
+	else
+	{
+		m_stats.beginStage(ProbeStats::UPDATE_IRRADIANCE);
+		updateIrradianceProbe(rd, IRRADIANCE);
+		m_stats.endStage(ProbeStats::UPDATE_IRRADIANCE);
+
+		m_stats.beginStage(ProbeStats::UPDATE_DEPTH);
+		updateIrradianceProbe(rd, DEPTH);
+		m_stats.endStage(ProbeStats::UPDATE_DEPTH);
+	}
+
+	m_firstFrame = false;
+
+	END_PROFILER_EVENT();
+}
+
+void IrradianceField::updateIrradianceProbe(RenderDevice* rd, bool irradiance)
 {
 	rd->push2D(irradiance ? m_irradianceProbeFB : m_meanDistProbeFB); {
 
@@ -501,7 +1987,6 @@ void IrradianceField::updateIrradianceProbe(RenderDevice* rd, bool irradiance)
 		Args args;
 
 		args.setMacro("RAYS_PER_PROBE", m_specification.irradianceRaysPerProbe);
-		args.setUniform("hysteresis", m_firstFrame ? 0.0f : m_specification.hysteresis);
 		args.setUniform("depthSharpness", m_specification.depthSharpness);
 		// Uniforms to compute texel to direction and back in oct format
 		args.setUniform("fullTextureWidth", irradiance ? m_irradianceProbeFB->width() : m_meanDistProbeFB->width());
@@ -511,13 +1996,13 @@ void IrradianceField::updateIrradianceProbe(RenderDevice* rd, bool irradiance)
 		setShaderArgs(args, "irradianceFieldSurface.");
 		args.setRect(rd->viewport());
 
-		m_irradianceRaysGBuffer->texture(GBuffer::Field::WS_POSITION)->setShaderArgs(args, "rayHitLocations.", Sampler::buffer());
-		m_irradianceRaysGBuffer->texture(GBuffer::Field::WS_NORMAL)->setShaderArgs(args, "rayHitNormals.", Sampler::buffer());
-
-		m_irradianceRayOrigins->setShaderArgs(args, "rayOrigins.", Sampler::buffer());
+		args.setUniform("rayHitRecords", m_rayHitRecords, Sampler::buffer());
 		m_irradianceRayDirections->setShaderArgs(args, "rayDirections.", Sampler::buffer());
 		m_irradianceRaysShadedFB->texture(0)->setShaderArgs(args, "rayHitRadiance.", Sampler::buffer());
 
+		// Ray row and hysteresis of each probe; probes without a row keep their old values
+		m_probeSchedule->setShaderArgs(args, "probeSchedule.", Sampler::buffer());
+
 		// Set skybox args to read on miss
 		dynamic_pointer_cast<Skybox>(m_scene->entity("skybox"))->keyframeArray()[0]->setShaderArgs(args, "skybox_", Sampler::defaults());
 
@@ -541,6 +2026,115 @@ void IrradianceField::updateIrradianceProbe(RenderDevice* rd, bool irradiance)
 	//} rd->pop2D();
 }
 
+const char* IrradianceField::imageFormatQualifier(const ImageFormat* format)
+{
+	if (format == ImageFormat::RGBA16F()) { return "rgba16f"; }
+	if (format == ImageFormat::RGBA32F()) { return "rgba32f"; }
+	if (format == ImageFormat::R11G11B10F()) { return "r11f_g11f_b10f"; }
+	if (format == ImageFormat::RGB10A2()) { return "rgb10_a2"; }
+	if (format == ImageFormat::RG16F()) { return "rg16f"; }
+	if (format == ImageFormat::RG32F()) { return "rg32f"; }
+
+	// Three-channel formats cannot be bound as images
+	return "";
+}
+
+bool IrradianceField::canUseFusedProbeUpdate() const
+{
+	// One invocation per texel of the larger probe
+	static const int maxGroupSize = 1024;
+
+	return (imageFormatQualifier(m_irradianceProbes->format())[0] != '\0') &&
+		(imageFormatQualifier(m_meanDistProbes->format())[0] != '\0') &&
+		(square(m_specification.irradianceOctResolution) <= maxGroupSize) &&
+		(square(m_specification.depthOctResolution) <= maxGroupSize);
+}
+
+void IrradianceField::updateProbesFused(RenderDevice* rd)
+{
+	const int irradianceSide = irradianceOctSideLength();
+	const int depthSide = depthOctSideLength();
+	const int groupSize = max(square(irradianceSide), square(depthSide));
+
+	Args args;
+	args.setMacro("RAYS_PER_PROBE", m_specification.irradianceRaysPerProbe);
+	args.setMacro("IRRADIANCE_PROBE_SIDE", irradianceSide);
+	args.setMacro("DEPTH_PROBE_SIDE", depthSide);
+	args.setMacro("GROUP_SIZE", groupSize);
+	args.setMacro("IRRADIANCE_IMAGE_FORMAT", imageFormatQualifier(m_irradianceProbes->format()));
+	args.setMacro("DEPTH_IMAGE_FORMAT", imageFormatQualifier(m_meanDistProbes->format()));
+	args.setUniform("depthSharpness", m_specification.depthSharpness);
+	args.setUniform("maxDistance", m_maxDistance);
+
+	args.setUniform("rayHitRecords", m_rayHitRecords, Sampler::buffer());
+	m_irradianceRayDirections->setShaderArgs(args, "rayDirections.", Sampler::buffer());
+	m_irradianceRaysShadedFB->texture(0)->setShaderArgs(args, "rayHitRadiance.", Sampler::buffer());
+	m_probeSchedule->setShaderArgs(args, "probeSchedule.", Sampler::buffer());
+
+	args.setImageUniform("irradianceImage", m_irradianceProbes, Access::READ_WRITE);
+	args.setImageUniform("meanDistImage", m_meanDistProbes, Access::READ_WRITE);
+
+	// One work group per atlas tile. Tiles without a scheduled probe exit immediately.
+	const Vector2int32& atlasSize = probeAtlasSize();
+	args.setComputeGroupSize(Vector3int32(groupSize, 1, 1));
+	args.setComputeGridDim(Vector3int32(atlasSize.x, atlasSize.y, 1));
+
+	LAUNCH_SHADER("shaders/IrradianceField_UpdateProbes.glc", args);
+
+	// The atlases are sampled by the next ray shading pass and by the renderer
+	glMemoryBarrier(GL_SHADER_IMAGE_ACCESS_BARRIER_BIT | GL_TEXTURE_FETCH_BARRIER_BIT);
+}
+
+void IrradianceField::allocateIrradianceSH()
+{
+	const int coefficientCount = shCoefficientCount();
+	if (coefficientCount == 0)
+	{
+		m_irradianceSH.reset();
+		return;
+	}
+
+	const Vector2int32& atlasSize = probeAtlasSize();
+	if (notNull(m_irradianceSH) && (m_irradianceSH->width() == atlasSize.x * coefficientCount) && (m_irradianceSH->height() == atlasSize.y))
+	{
+		return;
+	}
+
+	m_irradianceSH = Texture::createEmpty("IrradianceField::m_irradianceSH", atlasSize.x * coefficientCount, atlasSize.y, ImageFormat::RGBA16F(), Texture::DIM_2D, false, 1);
+	m_irradianceSH->clear();
+
+	// The coefficients start empty, so no probe may blend into them. Every probe waits for its own reset,
+	// because under a ray budget many are not scheduled on the next frame. Before the first schedule
+	// the per-probe state is empty, and allocating it resets every probe anyway.
+	m_probeNeedsReset.setAll(true);
+}
+
+void IrradianceField::updateSHProbes(RenderDevice* rd)
+{
+	// Power of two for the reduction
+	static const int groupSize = 64;
+
+	Args args;
+	args.setMacro("RAYS_PER_PROBE", m_specification.irradianceRaysPerProbe);
+	args.setMacro("SH_ORDER", m_specification.irradianceSHOrder);
+	args.setMacro("GROUP_SIZE", groupSize);
+
+	m_irradianceRayDirections->setShaderArgs(args, "rayDirections.", Sampler::buffer());
+	m_irradianceRaysShadedFB->texture(0)->setShaderArgs(args, "rayHitRadiance.", Sampler::buffer());
+	m_probeSchedule->setShaderArgs(args, "probeSchedule.", Sampler::buffer());
+	args.setImageUniform("shImage", m_irradianceSH, Access::READ_WRITE);
+
+	// One work group per atlas tile. Tiles without a scheduled probe exit immediately.
+	const Vector2int32& atlasSize = probeAtlasSize();
+	args.setComputeGroupSize(Vector3int32(groupSize, 1, 1));
+	args.setComputeGridDim(Vector3int32(atlasSize.x, atlasSize.y, 1));
+
+	LAUNCH_SHADER("shaders/IrradianceField_UpdateSHProbes.glc", args);
+
+	// Sampled by the next ray shading pass and by the renderer
+	glMemoryBarrier(GL_SHADER_IMAGE_ACCESS_BARRIER_BIT | GL_TEXTURE_FETCH_BARRIER_BIT);
+}
+
 void IrradianceField::generateIrradianceProbes(RenderDevice* rd)
 {
 	const int irradianceSide = irradianceOctSideLength();
@@ -552,23 +2146,42 @@ void IrradianceField::generateIrradianceProbes(RenderDevice* rd)
 	// Allocate or reallocate the ray tracing buffers if the probe requirements change
 	if (isNull(m_irradianceRayOrigins) ||
 		m_irradianceRayOrigins->width() != rayDimX ||
-		m_irradianceRayOrigins->height() != rayDimY)
+		m_irradianceRayOrigins->height() != rayDimY ||
+		m_rayStaging[0].probeSchedule->vector2Bounds() != Vector2(probeAtlasSize()))
+	{
+		for (int i = 0; i < RAY_STAGING_BUFFER_COUNT; ++i)
+		{
+			allocateRayStagingBuffers(m_rayStaging[i], rayDimX, rayDimY);
+		}
+		m_rayStagingIndex = 0;
+		m_asyncTracedIndex = -1;
+		m_irradianceRayOrigins = m_rayStaging[0].rayOrigins;
+		m_irradianceRayDirections = m_rayStaging[0].rayDirections;
+		m_irradianceRaysShadedFB = Framebuffer::create(Texture::createEmpty("IrradianceField::m_irradianceRaysShadedFB", rayDimX, rayDimY, ImageFormat::RGBA32F()));
+		m_rayHitRecords = Texture::createEmpty("IrradianceField::m_rayHitRecords", rayDimX, rayDimY, ImageFormat::RGBA32UI());
+		m_rayHitList = Texture::createEmpty("IrradianceField::m_rayHitList", rayDimX, rayDimY, ImageFormat::R32UI());
+		m_shadedRayHitsFB = Framebuffer::create(Texture::createEmpty("IrradianceField::m_shadedRayHitsFB", rayDimX, rayDimY, ImageFormat::RGBA32F()));
+
+		m_probeMeanRadianceFB = Framebuffer::create(Texture::createEmpty("IrradianceField::m_probeMeanRadianceFB", 1, rayDimY, ImageFormat::RGBA32F()));
+		m_probeMeanRadianceBuffer = GLPixelTransferBuffer::create(1, rayDimY, ImageFormat::RGBA32F(), nullptr, 1, GL_STREAM_READ);
+		m_probeMeanRadiancePending = false;
+	}
+
+	if (m_probeOffsetsChanged || isNull(m_probeOffsetTexture))
 	{
-		m_irradianceRayOrigins = Texture::createEmpty("IrradianceField::m_irradianceRayOrigins", rayDimX, rayDimY, ImageFormat::RGBA32F());
-		m_irradianceRayDirections = Texture::createEmpty("IrradianceField::m_irradianceRayDirections", rayDimX, rayDimY, ImageFormat::RGBA32F());
-		m_irradianceRaysFB = Framebuffer::create(m_irradianceRayOrigins, m_irradianceRayDirections);
-		m_irradianceRaysShadedFB = Framebuffer::create(Texture::createEmpty("IrradianceField::m_irradianceRaysShadedFB", rayDimX, rayDimY, ImageFormat::RGB32F()));
-		m_giFramebuffer = Framebuffer::create(Texture::createEmpty("IrradianceField::matte indirect", rayDimX, rayDimY, ImageFormat::RGBA32F()));
+		uploadProbeOffsets();
 	}
 
-	static int oldIrradianceSide = 0;
-	static int oldDepthSide = 0;
+	if (m_brickIndirectionChanged || isNull(m_brickIndirectionTexture))
+	{
+		uploadBrickIndirection();
+	}
 
 	// Allocate irradiance/depth probes if this is the first call or the probe resolution changes (mostly for debugging; in normal use,
 	// this is only invoked once anyway)
 	if (isNull(m_irradianceProbes) ||
-		irradianceSide != oldIrradianceSide ||
-		depthSide != oldDepthSide ||
+		irradianceSide != m_allocatedIrradianceSide ||
+		depthSide != m_allocatedDepthSide ||
 		m_irradianceProbes->format() != s_irradianceFormats[m_irradianceFormatIndex] ||
 		m_meanDistProbes->format() != s_depthFormats[m_depthFormatIndex] ||
 		m_probeFormatChanged)
@@ -576,15 +2189,20 @@ void IrradianceField::generateIrradianceProbes(RenderDevice* rd)
 		m_probeFormatChanged = false;
 
 		// 1-pixel of padding surrounding each probe, 1-pixel padding surrounding entire texture for alignment.
-		const int irradianceWidth = (irradianceSide + 2) * m_specification.probeCounts.x * m_specification.probeCounts.y + 2;
-		const int irradianceHeight = (irradianceSide + 2) * m_specification.probeCounts.z + 2;
+		const Vector2int32& atlasSize = probeAtlasSize();
+		const int irradianceWidth = (irradianceSide + 2) * atlasSize.x + 2;
+		const int irradianceHeight = (irradianceSide + 2) * atlasSize.y + 2;
 
-		const int depthWidth = (depthSide + 2) * m_specification.probeCounts.x * m_specification.probeCounts.y + 2;
-		const int depthHeight = (depthSide + 2) * m_specification.probeCounts.z + 2;
+		const int depthWidth = (depthSide + 2) * atlasSize.x + 2;
+		const int depthHeight = (depthSide + 2) * atlasSize.y + 2;
 
 		m_irradianceProbes = Texture::createEmpty("IrradianceField::m_irradianceProbes", irradianceWidth, irradianceHeight, s_irradianceFormats[m_irradianceFormatIndex], Texture::DIM_2D, false, 1);
 		m_meanDistProbes = Texture::createEmpty("IrradianceField::m_meanDistProbes", depthWidth, depthHeight, s_depthFormats[m_depthFormatIndex], Texture::DIM_2D, false, 1);
 
+		// The compressed copies described the old atlases
+		m_compressedIrradianceProbes.reset();
+		m_compressedMeanDistProbes.reset();
+
 		m_irradianceProbeFB = Framebuffer::create(m_irradianceProbes);
 		m_meanDistProbeFB = Framebuffer::create(m_meanDistProbes);
 
@@ -608,6 +2226,253 @@ void IrradianceField::generateIrradianceProbes(RenderDevice* rd)
 			}; rd->pop2D();
 		}
 	}
-	oldIrradianceSide = irradianceSide;
-	oldDepthSide = depthSide;
+	m_allocatedIrradianceSide = irradianceSide;
+	m_allocatedDepthSide = depthSide;
+
+	allocateIrradianceSH();
+}
+
+size_t IrradianceField::gpuMemoryBytes() const
+{
+	const auto& textureBytes = [](const shared_ptr<Texture>& texture) -> size_t {
+		return isNull(texture) ? 0 : size_t(texture->width()) * size_t(texture->height()) * size_t(texture->format()->openGLBitsPerPixel) / 8;
+	};
+	const auto& bufferBytes = [](const shared_ptr<GLPixelTransferBuffer>& buffer) -> size_t {
+		return isNull(buffer) ? 0 : buffer->size();
+	};
+
+	// The atlas framebuffers also hold a DEPTH32 stencil of the same size, 4 bytes per texel
+	const auto& stencilBytes = [](const shared_ptr<Texture>& texture) -> size_t {
+		return isNull(texture) ? 0 : size_t(texture->width()) * size_t(texture->height()) * 4;
+	};
+	size_t bytes = textureBytes(m_irradianceProbes) + stencilBytes(m_irradianceProbes) +
+		textureBytes(m_meanDistProbes) + stencilBytes(m_meanDistProbes) +
+		textureBytes(m_compressedMeanDistProbes) + textureBytes(m_irradianceSH) +
+		textureBytes(m_probeOffsetTexture) + textureBytes(m_brickIndirectionTexture) + textureBytes(m_rayHitRecords) +
+		textureBytes(m_rayHitList) + bufferBytes(m_probeMeanRadianceBuffer);
+
+	// The BC6H texture reports the format it decodes to, not its size
+	if (notNull(m_compressedIrradianceProbes))
+	{
+		bytes += ProbeAtlasCompression::bc6hBytes(m_compressedIrradianceProbes->width(), m_compressedIrradianceProbes->height());
+	}
+
+	if (notNull(m_irradianceRaysShadedFB))
+	{
+		bytes += textureBytes(m_irradianceRaysShadedFB->texture(0));
+	}
+	if (notNull(m_probeMeanRadianceFB))
+	{
+		bytes += textureBytes(m_probeMeanRadianceFB->texture(0));
+	}
+	if (notNull(m_shadedRayHitsFB))
+	{
+		bytes += textureBytes(m_shadedRayHitsFB->texture(0));
+	}
+
+	for (const RayStagingBuffers& staging : m_rayStaging)
+	{
+		bytes += textureBytes(staging.rayOrigins) + textureBytes(staging.rayDirections) + textureBytes(staging.probeSchedule) +
+			bufferBytes(staging.rayOriginBuffer) + bufferBytes(staging.rayDirectionBuffer) + bufferBytes(staging.hitRecordBuffer) +
+			bufferBytes(staging.hitListBuffer);
+		for (int i = 0; i < 5; ++i)
+		{
+			bytes += bufferBytes(staging.hitBuffers[i]) + bufferBytes(staging.dynamicHitBuffers[i]);
+		}
+	}
+
+	return bytes;
+}
+
+String IrradianceField::probeCacheFilename(const String& sceneName)
+{
+	const String& cacheName = FilePath::mangle(sceneName) + ".ProbeCache";
+	const String& found = System::findDataFile(cacheName, false);
+	return found.empty() ? cacheName : found;
+}
+
+ProbeCache::Header IrradianceField::probeCacheHeader() const
+{
+	ProbeCache::Header header;
+	header.sceneHash = m_sceneHash;
+	header.probeCounts = m_specification.probeCounts;
+	header.probeBoundsLow = m_specification.probeDimensions.low();
+	header.probeBoundsHigh = m_specification.probeDimensions.high();
+	header.probeAtlasLayout = m_specification.probeAtlasLayout.value;
+	header.probeAtlasSlicesPerRow = m_probeAtlasSlicesPerRow;
+	header.irradianceSide = m_specification.irradianceOctResolution;
+	header.depthSide = m_specification.depthOctResolution;
+	header.irradianceWidth = m_irradianceProbes->width();
+	header.irradianceHeight = m_irradianceProbes->height();
+	header.depthWidth = m_meanDistProbes->width();
+	header.depthHeight = m_meanDistProbes->height();
+	header.irradianceFormat = int32(m_irradianceProbes->format()->code);
+	header.depthFormat = int32(m_meanDistProbes->format()->code);
+	return header;
+}
+
+/** Bytes of \a atlas with tightly packed rows */
+static size_t atlasBytes(const shared_ptr<Texture>& atlas)
+{
+	return size_t(atlas->width()) * size_t(atlas->height()) * size_t(atlas->format()->cpuBitsPerPixel / 8);
+}
+
+/** Copies all texels of \a atlas, in its own format, into \a texels */
+static void readAtlas(const shared_ptr<Texture>& atlas, Array<uint8>& texels)
+{
+	const ImageFormat* format = atlas->format();
+	texels.resize(int(atlasBytes(atlas)));
+
+	GLint alignment;
+	glGetIntegerv(GL_PACK_ALIGNMENT, &alignment);
+	glPixelStorei(GL_PACK_ALIGNMENT, 1);
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, GL_NONE);
+	glBindTexture(GL_TEXTURE_2D, atlas->openGLID());
+	glGetTexImage(GL_TEXTURE_2D, 0, format->openGLBaseFormat, format->openGLDataFormat, texels.getCArray());
+	glBindTexture(GL_TEXTURE_2D, GL_NONE);
+	glPixelStorei(GL_PACK_ALIGNMENT, alignment);
+}
+
+/** Replaces all texels of \a atlas with \a texels, which are in the layout readAtlas writes */
+static void writeAtlas(const shared_ptr<Texture>& atlas, const uint8* texels)
+{
+	const ImageFormat* format = atlas->format();
+
+	GLint alignment;
+	glGetIntegerv(GL_UNPACK_ALIGNMENT, &alignment);
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, GL_NONE);
+	glBindTexture(GL_TEXTURE_2D, atlas->openGLID());
+	glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, atlas->width(), atlas->height(), format->openGLBaseFormat, format->openGLDataFormat, texels);
+	glBindTexture(GL_TEXTURE_2D, GL_NONE);
+	glPixelStorei(GL_UNPACK_ALIGNMENT, alignment);
+}
+
+void IrradianceField::saveProbeCache(const String& filename) const
+{
+	if (isSparse())
+	{
+		debugPrintf("Probe caches only hold dense grids; %s was not saved\n", m_sceneName.c_str());
+		return;
+	}
+
+	const String& cacheFilename = filename.empty() ? probeCacheFilename(m_sceneName) : filename;
+
+	Array<uint8> irradianceTexels;
+	Array<uint8> depthTexels;
+	readAtlas(m_irradianceProbes, irradianceTexels);
+	readAtlas(m_meanDistProbes, depthTexels);
+
+	Array<uint8> irradianceBlocks;
+	Array<uint16> moments;
+	encodeCompressedAtlases(irradianceBlocks, moments);
+
+	ProbeCache::save(cacheFilename, probeCacheHeader(), irradianceTexels, depthTexels, m_probeOffsets, irradianceBlocks, moments);
+	debugPrintf("Saved probe cache %s\n", cacheFilename.c_str());
+}
+
+bool IrradianceField::loadProbeCache(const String& filename)
+{
+	const shared_ptr<ProbeCache>& cache = ProbeCache::open(filename);
+	if (isNull(cache))
+	{
+		return false;
+	}
+
+	const ProbeCache::Header& header = cache->header();
+	if (!header.matches(probeCacheHeader()) ||
+		(header.irradianceBytes != atlasBytes(m_irradianceProbes)) ||
+		(header.depthBytes != atlasBytes(m_meanDistProbes)))
+	{
+		debugPrintf("Probe cache %s does not match the scene or probe grid\n", filename.c_str());
+		return false;
+	}
+
+	// The cache holds the octahedral atlas only; a warm start would blend into empty SH coefficients
+	if (notNull(m_irradianceSH))
+	{
+		debugPrintf("Probe cache %s is not used in spherical harmonic irradiance mode\n", filename.c_str());
+		return false;
+	}
+
+	// Straight from the mapping to the atlases
+	writeAtlas(m_irradianceProbes, cache->irradianceTexels());
+	writeAtlas(m_meanDistProbes, cache->depthTexels());
+
+	// Compressed copies, encoded when the cache was saved
+	if ((header.compressedIrradianceBytes == ProbeAtlasCompression::bc6hBytes(m_irradianceProbes->width(), m_irradianceProbes->height())) &&
+		(header.compressedDepthBytes == size_t(m_meanDistProbes->width()) * size_t(m_meanDistProbes->height()) * 2 * sizeof(uint16)))
+	{
+		uploadCompressedAtlases(cache->compressedIrradianceBlocks(), cache->compressedMoments());
+	}
+
+	System::memcpy(m_probeOffsets.getCArray(), cache->probeOffsets(), sizeof(Vector3) * m_probeOffsets.size());
+	m_probeOffsetsChanged = true;
+
+	m_firstFrame = false;
+	m_warmStart = true;
+	return true;
+}
+
+void IrradianceField::encodeCompressedAtlases(Array<uint8>& irradianceBlocks, Array<uint16>& moments) const
+{
+	const shared_ptr<PixelTransferBuffer>& irradiance = m_irradianceProbes->toPixelTransferBuffer(ImageFormat::RGB32F());
+	ProbeAtlasCompression::encodeBC6H(static_cast<const Color3*>(irradiance->mapRead()), irradiance->width(), irradiance->height(), irradianceBlocks);
+	irradiance->unmap();
+
+	const shared_ptr<PixelTransferBuffer>& depth = m_meanDistProbes->toPixelTransferBuffer(ImageFormat::RG32F());
+	ProbeAtlasCompression::encodeMoments(static_cast<const Vector2*>(depth->mapRead()), depth->width() * depth->height(), m_maxDistance, moments);
+	depth->unmap();
+}
+
+void IrradianceField::uploadCompressedAtlases(const uint8* irradianceBlocks, const uint16* moments)
+{
+	const int width = m_irradianceProbes->width();
+	const int height = m_irradianceProbes->height();
+
+	GLuint textureID = GL_NONE;
+	glGenTextures(1, &textureID);
+	glBindTexture(GL_TEXTURE_2D, textureID);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, 0);
+	glCompressedTexImage2D(GL_TEXTURE_2D, 0, GL_COMPRESSED_RGB_BPTC_UNSIGNED_FLOAT, width, height, 0,
+		GLsizei(ProbeAtlasCompression::bc6hBytes(width, height)), irradianceBlocks);
+	glBindTexture(GL_TEXTURE_2D, GL_NONE);
+
+	// G3D has no BPTC ImageFormat, so the texture reports the format that it decodes to. Its
+	// format() does not give its size; see gpuMemoryBytes().
+	m_compressedIrradianceProbes = Texture::fromGLTexture("IrradianceField::m_compressedIrradianceProbes", textureID, ImageFormat::RGB16F(), AlphaFilter::ONE, Texture::DIM_2D);
+
+	if (isNull(m_compressedMeanDistProbes) || (m_compressedMeanDistProbes->vector2Bounds() != m_meanDistProbes->vector2Bounds()))
+	{
+		m_compressedMeanDistProbes = Texture::createEmpty("IrradianceField::m_compressedMeanDistProbes", m_meanDistProbes->width(), m_meanDistProbes->height(), ImageFormat::RG16(), Texture::DIM_2D, false, 1);
+	}
+	writeAtlas(m_compressedMeanDistProbes, reinterpret_cast<const uint8*>(moments));
+}
+
+bool IrradianceField::hasCompressedAtlases() const
+{
+	return notNull(m_compressedIrradianceProbes) && notNull(m_compressedMeanDistProbes) &&
+		(m_compressedIrradianceProbes->vector2Bounds() == m_irradianceProbes->vector2Bounds()) &&
+		(m_compressedMeanDistProbes->vector2Bounds() == m_meanDistProbes->vector2Bounds());
+}
+
+void IrradianceField::compressAtlases()
+{
+	const RealTime start = System::time();
+
+	Array<uint8> irradianceBlocks;
+	Array<uint16> moments;
+	encodeCompressedAtlases(irradianceBlocks, moments);
+	uploadCompressedAtlases(irradianceBlocks.getCArray(), moments.getCArray());
+
+	debugPrintf("Compressed probe atlases in %.1f ms\n", 1000.0 * (System::time() - start));
+}
+
+void IrradianceField::setSampleCompressedAtlases(bool b)
+{
+	m_sampleCompressedAtlases = b;
+	if (b && !hasCompressedAtlases())
+	{
+		compressAtlases();
+	}
 }
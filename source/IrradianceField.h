@@ -1,12 +1,34 @@
 #pragma once
 #include <G3D/G3D.h>
+#include <future>
+#include "ProbeAtlasCompression.h"
+#include "ProbeCache.h"
+#include "ProbeMath.h"
+#include "ProbeRayGenerator.h"
+#include "ProbeRayTracer.h"
+#include "ProbeStats.h"
+#include "SceneChangeTracker.h"
 
 G3D_DECLARE_ENUM_CLASS(LightingMode, DIRECT_INDIRECT, DIRECT_ONLY, INDIRECT_ONLY);
 
+/** Classification of a probe from the results of its most recent rays.
+	INACTIVE probes see no surface in their neighboring grid cells and INSIDE_GEOMETRY
+	probes see mostly backfaces; neither can improve shading, so they are not updated. */
+G3D_DECLARE_ENUM_CLASS(ProbeState, ACTIVE, INACTIVE, INSIDE_GEOMETRY);
+
+/** Placement of the probes in the irradiance and depth atlases.
+	STRIP puts every z slice of the grid in one row of probeCounts.x * probeCounts.y probes.
+	SLICE_TILES makes every z slice a probeCounts.x x probeCounts.y tile and packs the tiles into
+	a roughly square atlas, which keeps the atlas within texture size limits and the probes of
+	a cage near each other in memory. */
+G3D_DECLARE_ENUM_CLASS(ProbeAtlasLayout, STRIP, SLICE_TILES);
+
 class IrradianceField : public ReferenceCountedObject 
 {
 protected:
 	friend class App; // This is here for exposing debugging parameters
+	friend class IrradianceFieldCPU; // Shares the specification and probe grid layout
+	friend class IrradianceFieldCascades; // Creates viewer-centered grids and shares the scene trees between them
 
 	struct Specification 
 	{
@@ -46,6 +68,16 @@ protected:
 		*/
 		float           hysteresis = 0.98f;
 
+		/** Hysteresis of probes whose radiance is changing quickly. Each probe's hysteresis moves between
+			this and hysteresis with the change of its mean radiance between updates, so that lighting
+			changes propagate quickly and static regions stay stable. Equal to hysteresis disables this.
+		*/
+		float           minHysteresis = 0.85f;
+
+		/** Fraction of irradianceRaysPerProbe traced for converged probes, whose radiance has stopped
+			changing, until a change is detected. 1 traces every probe with the full ray count. */
+		float           convergedRayFraction = 0.25f;
+
 		/** Exponent for depth testing. A high value will rapidly react to depth discontinuities, but risks
 			exhibiting banding.
 		*/
@@ -60,12 +92,39 @@ protected:
 
 		bool            singleBounce = false;
 
-		int             irradianceFormatIndex = 4;
+		/** 0 = octahedral irradiance atlas of irradianceOctResolution^2 texels per probe. 1 or 2 = store the
+			radiance of each probe as L1 (4) or L2 (9) RGB spherical harmonic coefficients instead, which
+			are projected in O(rays) per probe and shaded with a few multiply-adds. The depth atlas
+			stays octahedral for visibility. See SphericalHarmonics.glsl */
+		int             irradianceSHOrder = 0;
+
+		/** Indices into s_irradianceFormats and s_depthFormats. The default RGBA16F and RG16F
+			atlases can be written with image stores, which enables the fused probe update. */
+		int             irradianceFormatIndex = 6;
 		int             depthFormatIndex = 1;
 
+		ProbeAtlasLayout probeAtlasLayout = ProbeAtlasLayout::SLICE_TILES;
+
 		bool            showLights = false;
 		bool            encloseBounds = false;
 
+		/** Maximum number of probe rays traced per frame. When the probes that want an update need
+			more, the highest priority ones are updated and the rest wait. 0 = no limit. */
+		int             raysPerFrameBudget = 0;
+
+		/** Maximum milliseconds per frame spent tracing probe rays, converted to a ray budget with
+			the measured trace rate. 0 = no limit. */
+		float           traceMillisecondsBudget = 0.0f;
+
+		/** 0 = dense grid. Otherwise the lattice is split into bricks of brickSize^3 probes and only
+			the bricks near geometry get atlas space, per-probe state and rays, so memory and ray
+			count scale with surface area instead of volume. See allocateBricks() */
+		int             brickSize = 0;
+
+		/** A brick is allocated when geometry is within this many probe spacings of the probe cages it
+			is part of. Covers probe relocation and small movements of dynamic geometry. */
+		float           brickAllocationMargin = 1.0f;
+
 		Specification();
 
 		Any toAny() const;
@@ -104,6 +163,19 @@ protected:
 	*/
 	shared_ptr<Texture>                 m_meanDistProbes;
 
+	/** Radiance SH coefficients used instead of m_irradianceProbes when Specification::irradianceSHOrder > 0,
+		RGBA16F with shCoefficientCount() texels per probe in a row. See SphericalHarmonics.glsl */
+	shared_ptr<Texture>                 m_irradianceSH;
+
+	/** BC6H copy of m_irradianceProbes and RG16 unorm copy of m_meanDistProbes, encoded on the CPU
+		by compressAtlases() or loaded from a probe cache. See ProbeAtlasCompression.h */
+	shared_ptr<Texture>                 m_compressedIrradianceProbes;
+	shared_ptr<Texture>                 m_compressedMeanDistProbes;
+
+	/** If true, shading samples the compressed copies instead of the atlases. The copies are snapshots
+		and do not follow later probe updates, so this is meant for baked lighting. */
+	bool                                m_sampleCompressedAtlases = false;
+
 	/** Framebuffers associated with each probe */
 	shared_ptr<Framebuffer>             m_irradianceProbeFB;
 	shared_ptr<Framebuffer>             m_meanDistProbeFB;
@@ -111,49 +183,536 @@ protected:
 	Point3                              m_probeStartPosition;
 	Vector3                             m_probeStep;
 
+	/** If true, onGraphics3D keeps the grid centered on m_viewerPosition with scrollTo() */
+	bool                                m_followViewer = false;
+
+	/** Lattice coordinate of the first probe, in units of m_probeStep from the origin. Only
+		meaningful for grids that follow the viewer, once m_probeGridOriginValid is set. */
+	Point3int32                         m_probeGridOrigin;
+	bool                                m_probeGridOriginValid = false;
+
+	/** The probe at lattice coordinate c is stored at (c + m_probeScrollOffset) mod probeCounts, so
+		that scrolling the grid moves no atlas texels. Zero unless the grid follows the viewer.
+		See ProbeMath::latticeGridCoord */
+	Vector3int32                        m_probeScrollOffset;
+
+	/** Grid that probe indices, the atlases and the per-probe arrays cover. Equal to
+		m_specification.probeCounts for dense grids; for sparse grids, the allocated bricks packed
+		into a box of m_storageBrickCounts bricks. See setStorageGrid() */
+	Vector3int32                        m_storageProbeCounts;
+
+	/** Sparse grids: bricks along each axis of the lattice and of the storage grid */
+	Vector3int32                        m_brickCounts;
+	Vector3int32                        m_storageBrickCounts;
+
+	/** Sparse grids: storage brick of each lattice brick, x fastest, or -1 where there is no geometry nearby */
+	Array<int>                          m_brickIndirection;
+
+	/** Sparse grids: lattice brick coordinate of each storage brick, x fastest, or -1 for the padding
+		at the end of the storage grid */
+	Array<Point3int32>                  m_storageBrickLatticeCoord;
+	int                                 m_allocatedBrickCount = 0;
+
+	/** False for the storage of a sparse grid that belongs to no lattice probe: the padding bricks,
+		and the parts of bricks beyond the edge of the lattice. These are never traced. */
+	Array<bool>                         m_probeAllocated;
+
+	/** R32I copy of m_brickIndirection, brickCounts.x * brickCounts.y x brickCounts.z. 1x1 for dense grids. */
+	shared_ptr<Texture>                 m_brickIndirectionTexture;
+	bool                                m_brickIndirectionChanged = false;
+
+	/** Divide by m_storageProbeCounts.x and m_storageProbeCounts.x * m_storageProbeCounts.y. Probe counts need not be powers of
+		two; index math on the CPU and GPU (fastDivide() in GridHelpers.glsl) uses these instead. */
+	ProbeMath::FastDivisor              m_probeCountXDivisor;
+	ProbeMath::FastDivisor              m_probeCountXYDivisor;
+
+	/** See ProbeMath::probeAtlasCoord and Specification::probeAtlasLayout */
+	int                                 m_probeAtlasSlicesPerRow = 0;
+	ProbeMath::FastDivisor              m_probeAtlasSliceDivisor;
+
+	/** Sparse grids: divide by the brick size, by m_storageBrickCounts.x and by m_storageBrickCounts.x * m_storageBrickCounts.y,
+		for the brick lookup of storageGridCoord() in GridHelpers.glsl */
+	ProbeMath::FastDivisor              m_brickSizeDivisor;
+	ProbeMath::FastDivisor              m_storageBrickCountXDivisor;
+	ProbeMath::FastDivisor              m_storageBrickCountXYDivisor;
+
 	String                              m_name;
 
-	int                                 m_irradianceFormatIndex = 4;
+	/** Scene passed to loadNewScene, which names the default probe cache file */
+	String                              m_sceneName;
+
+	/** ProbeCache::sceneHash of the scene at loadNewScene */
+	uint64                              m_sceneHash = 0;
+
+	/** If true, loadNewScene starts from the scene's probe cache when it is up to date */
+	bool                                m_loadProbeCache = true;
+
+	/** True when the atlases came from a probe cache; scheduleProbes then blends into them
+		instead of resetting every probe on its first update */
+	bool                                m_warmStart = false;
+
+	int                                 m_irradianceFormatIndex = 6;
 	int                                 m_depthFormatIndex = 1;
 	bool                                m_probeFormatChanged;
 
-	/** Scene tree used for accelerated ray-tracing */
-	shared_ptr<TriTree>                 m_sceneTriTree;
+	/** Oct resolutions that the atlases were last allocated for by generateIrradianceProbes() */
+	int                                 m_allocatedIrradianceSide = 0;
+	int                                 m_allocatedDepthSide = 0;
+
+	/** Scene tree used for accelerated ray-tracing of the entities that cannot change
+		(canChange = false). Built once per scene. */
+	shared_ptr<TriTree>                 m_staticTriTree;
+
+	/** Scene tree over the entities that can change. It only holds the moving geometry, so rebuilding
+		it when one of them moves is cheap. Probe rays trace both trees and keep the nearer hit. */
+	shared_ptr<TriTree>                 m_dynamicTriTree;
+
+	/** System::time() of the last m_dynamicTriTree build */
+	RealTime                            m_dynamicTriTreeBuildTime = 0.0;
+	int                                 m_dynamicEntityCount = 0;
+
+	/** False when the trees belong to another field (see shareSceneTriTrees), which rebuilds them */
+	bool                                m_ownsSceneTriTrees = true;
+
+	/** lastSceneUpdateTime() when the shared trees were last seen, to reclassify the probes after a rebuild */
+	RealTime                            m_sharedTriTreeBuildTime = 0.0;
+
+	/** Number of frames of ray/hit staging buffers kept in flight */
+	static const int RAY_STAGING_BUFFER_COUNT = 3;
+
+	/** Persistent buffers for one batch of probe rays and their trace results.
+		Allocated when the probe configuration changes and reused every frame. */
+	struct RayStagingBuffers
+	{
+		/** Ray origin (xyz) and min distance (w); direction (xyz) and max distance (w). One row per probe. */
+		shared_ptr<Texture>                 rayOrigins;
+		shared_ptr<Texture>                 rayDirections;
+		shared_ptr<Framebuffer>             raysFB;
+
+		/** CPU-visible copies of rayOrigins and rayDirections; the input of TriTree::intersectRays */
+		shared_ptr<GLPixelTransferBuffer>   rayOriginBuffer;
+		shared_ptr<GLPixelTransferBuffer>   rayDirectionBuffer;
+
+		/** Trace results in the order TriTree::intersectRays writes them:
+			WS_POSITION, WS_NORMAL, LAMBERTIAN, GLOSSY, EMISSIVE */
+		shared_ptr<GLPixelTransferBuffer>   hitBuffers[5];
+
+		/** Results of tracing m_dynamicTriTree, merged into hitBuffers */
+		shared_ptr<GLPixelTransferBuffer>   dynamicHitBuffers[5];
+
+		/** hitBuffers packed to one 16-byte RayHitRecord per ray, the only trace result uploaded to the GPU */
+		shared_ptr<GLPixelTransferBuffer>   hitRecordBuffer;
+
+		/** Probe index traced in each row of the ray buffers, or -1 for a row of empty rays */
+		Array<int>                          rowProbeIndex;
+
+		/** Rows at or beyond this hold only empty rays and are not shaded */
+		int                                 rowCount = 0;
+
+		/** Number of rows that hold rays */
+		int                                 scheduledProbeCount = 0;
+
+		/** Rays at the start of each row that are not empty, and the hysteresis the row's probe is
+			updated with. Parallel to rowProbeIndex. */
+		Array<int>                          rowRayCount;
+		Array<float>                        rowHysteresis;
+
+		/** Sum of rowRayCount */
+		int                                 tracedRayCount = 0;
+
+		/** Rays of each row that hit a surface, parallel to rowProbeIndex. Written by classifyProbes. */
+		Array<int>                          rowHitCount;
+
+		/** Index (y * width + x) in the ray buffers of every ray that hit a surface, R32UI in
+			row-major order; the first hitCount entries are valid. Written by buildRayHitList. */
+		shared_ptr<GLPixelTransferBuffer>   hitListBuffer;
+		int                                 hitCount = 0;
+
+		/** One RGBA32F texel per probe at probeAtlasCoord(). x = ray row of the probe, or -1 if it
+			is not updated from this batch (or there is no probe at the texel); y = hysteresis;
+			z = number of rays of the probe, at the start of its row. */
+		shared_ptr<Texture>                 probeSchedule;
+
+		/** True when rays were generated into this slot but have not been traced yet */
+		bool                                pending = false;
+	};
+
+	RayStagingBuffers                   m_rayStaging[RAY_STAGING_BUFFER_COUNT];
+
+	/** Slot that generateIrradianceRays writes next */
+	int                                 m_rayStagingIndex = 0;
+
+	/** If true, trace the rays generated on the previous frame, whose GPU->CPU copy has had
+		a full frame to complete, instead of stalling on this frame's copy. Adds one frame of
+		latency to probe updates. */
+	bool                                m_pipelineRayReadback = true;
+
+	/** If true and canTraceAsync(), each frame's rays are traced on a worker thread while the frame
+		renders, and the hits are classified, shaded and blended into the probes on the next frame.
+		Adds one frame of latency to probe updates; the render thread only waits if the trace takes
+		longer than a frame. */
+	bool                                m_asyncTrace = true;
+
+	/** Trace running on a worker thread. Its result is the trace time in milliseconds. */
+	std::future<float>                  m_traceJob;
+
+	/** Slot of m_rayStaging that m_traceJob traces, and the slot whose trace finished and still has
+		to be shaded, or -1 */
+	int                                 m_asyncTraceIndex = -1;
+	int                                 m_asyncTracedIndex = -1;
+	float                               m_asyncTraceMilliseconds = 0.0f;
+
+	/** False on frames that did not shade a batch of rays, which then skip the probe update */
+	bool                                m_probeBatchShaded = false;
+
+	/** If true, generate probe rays on the CPU directly into the staging buffers that the tracer
+		reads, and upload them for the GPU passes. Otherwise, run IrradianceField_GenerateRandomRays.pix
+		and copy its output back to the CPU. */
+	bool                                m_generateRaysOnCPU = true;
+
+	/** If true, update both probe atlases with IrradianceField_UpdateProbes.glc when the formats allow it,
+		instead of one IrradianceField_UpdateIrradianceProbe.pix pass per atlas */
+	bool                                m_fusedProbeUpdate = true;
 
-	/** Textures storing ray origins and directions for irradiance probe sampling,
-		regenerated every frame and then split between all probes according to a given heuristic */
+	/** If true, shade the misses with a skybox lookup and only the hits, compacted into a dense
+		list, with direct and probe lighting. Otherwise, one pass shades every ray. */
+	bool                                m_compactRayHits = true;
+
+	ProbeRayGenerator                   m_rayGenerator;
+
+	/** Traces probe rays in per-probe packets on a work-stealing pool and writes the packed hit records
+		directly. Used instead of TriTree::intersectRays when m_useProbeRayTracer is true. */
+	ProbeRayTracer                      m_probeRayTracer;
+	bool                                m_useProbeRayTracer = true;
+
+	/** Scratch array of probeIndexToPosition() for every traced probe, in row order */
+	Array<Point3>                       m_probePositions;
+
+	/** Classification of each probe from the last time it was traced */
+	Array<ProbeState>                   m_probeStates;
+
+	/** True for probes whose atlas texels have not been written since they were last
+		skipped for not being ACTIVE; their next update ignores the old value (hysteresis = 0) */
+	Array<bool>                         m_probeNeedsReset;
+
+	/** Frames since each probe was last updated. A probe that waited k frames is blended with
+		hysteresis^k, so that it converges at the same rate over time as one updated every frame. */
+	Array<int>                          m_probeFramesSinceUpdate;
+
+	/** CPU estimate of the luminance stored in each probe: the mean ray luminance of its updates,
+		blended with the hysteresis that the atlases were updated with. Negative when unknown. */
+	Array<float>                        m_probeMeanLuminance;
+
+	/** Relative difference between the mean ray luminance of each probe's updates and
+		m_probeMeanLuminance, clamped to [0, 1]. Rises immediately and decays smoothly, so that one
+		quiet update does not hide an ongoing change. */
+	Array<float>                        m_probeRadianceChange;
+
+	/** Converged probes trace convergedRaysPerProbe() rays until their radiance changes */
+	Array<bool>                         m_probeConverged;
+
+	/** Consecutive updates whose radiance change was below m_convergenceThreshold */
+	Array<int>                          m_probeStableUpdates;
+	int                                 m_convergedProbeCount = 0;
+
+	/** A probe converges after m_updatesToConverge updates with a radiance change below
+		m_convergenceThreshold, and is no longer converged at the first update whose change
+		exceeds m_changeThreshold */
+	float                               m_convergenceThreshold = 0.05f;
+	float                               m_changeThreshold = 0.25f;
+	int                                 m_updatesToConverge = 8;
+
+	/** Weight of the previous m_probeRadianceChange when the change falls */
+	float                               m_radianceChangeDecay = 0.5f;
+
+	/** If false, every update is blended with Specification::hysteresis and no probe converges,
+		so that every traced probe is traced with every ray */
+	bool                                m_adaptiveUpdates = true;
+
+	/** Scratch arrays for scheduleProbes */
+	Array<int>                          m_scheduleCandidates;
+	Array<float>                        m_probePriority;
+
+	int                                 m_activeProbeCount = 0;
+	int                                 m_scheduledProbeCount = 0;
+
+	/** If false, every probe is traced every frame unless the budget is exceeded; classification still runs */
+	bool                                m_cullInactiveProbes = true;
+
+	/** INACTIVE and INSIDE_GEOMETRY probes are traced again after this many frames
+		so that they become active again when geometry moves near them */
+	int                                 m_probeStateRefreshInterval = 16;
+
+	/** How much more a probe whose radiance changed by 100% at its last update is prioritized */
+	float                               m_radianceChangePriority = 4.0f;
+
+	/** If true, probes near lights and entities that changed (see SceneChangeTracker) are invalidated:
+		for m_invalidationFrames frames they are traced with every ray, blended with at most
+		Specification::minHysteresis and prioritized by m_invalidationPriority. Converged probes
+		elsewhere are only updated every m_maintenanceInterval frames. */
+	bool                                m_lightChangeInvalidation = true;
+	int                                 m_invalidationFrames = 8;
+	float                               m_invalidationPriority = 8.0f;
+	int                                 m_maintenanceInterval = 16;
+
+	/** Margin around the changed regions, in probe spacings */
+	float                               m_invalidationMarginCells = 1.0f;
+
+	SceneChangeTracker                  m_sceneChangeTracker;
+
+	/** Scratch array of the regions that changed this frame */
+	Array<SceneChangeTracker::Region>   m_changedRegions;
+
+	/** Remaining boosted frames of each probe; 0 if it is not invalidated */
+	Array<int>                          m_probeInvalidatedFrames;
+	int                                 m_invalidatedProbeCount = 0;
+
+	/** Running average of the probe rays traced per millisecond, for Specification::traceMillisecondsBudget */
+	float                               m_raysPerMillisecond = 0.0f;
+
+	/** Per-stage timings and counters of each onGraphics3D call */
+	ProbeStats                          m_stats;
+
+	/** Source of the per-frame ray rotation. See setRandomSeed. */
+	Random                              m_random;
+
+	/** Probes nearer the viewer are updated first */
+	Point3                              m_viewerPosition;
+
+	/** Mean radiance of the rays in each row of m_irradianceRaysShadedFB, probeCount() x 1 RGBA32F,
+		and its asynchronous copy, which is read on the next frame */
+	shared_ptr<Framebuffer>             m_probeMeanRadianceFB;
+	shared_ptr<GLPixelTransferBuffer>   m_probeMeanRadianceBuffer;
+
+	/** RayStagingBuffers::rowProbeIndex and rowHysteresis of the rows in m_probeMeanRadianceBuffer */
+	Array<int>                          m_probeMeanRadianceRowProbeIndex;
+	Array<float>                        m_probeMeanRadianceRowHysteresis;
+	bool                                m_probeMeanRadiancePending = false;
+
+	/** A probe is INSIDE_GEOMETRY when more than this fraction of its rays hit backfaces */
+	float                               m_backfaceFractionThreshold = 0.25f;
+
+	/** World-space offset of each probe from its lattice position. classifyProbes moves probes out of
+		geometry and away from nearby surfaces; each component stays within m_maxProbeOffset cells. */
+	Array<Vector3>                      m_probeOffsets;
+
+	/** RGBA32F copy of m_probeOffsets with one texel per probe at probeAtlasCoord() */
+	shared_ptr<Texture>                 m_probeOffsetTexture;
+	bool                                m_probeOffsetsChanged = false;
+
+	bool                                m_relocateProbes = true;
+
+	/** Probes move away from front faces nearer than this fraction of the smallest probe spacing */
+	float                               m_probeMinFrontfaceDistance = 0.2f;
+
+	/** Largest offset along each axis, as a fraction of m_probeStep */
+	float                               m_maxProbeOffset = 0.45f;
+
+	/** Upload staging for RayStagingBuffers::probeSchedule */
+	shared_ptr<CPUPixelTransferBuffer>  m_probeScheduleBuffer;
+
+	/** Schedule of the batch that is traced and shaded this frame. Aliases a texture in m_rayStaging. */
+	shared_ptr<Texture>                 m_probeSchedule;
+
+	/** Ray origins and directions of the batch that is traced and shaded this frame.
+		These alias textures in m_rayStaging. */
 	shared_ptr<Texture>                 m_irradianceRayOrigins;
 	shared_ptr<Texture>                 m_irradianceRayDirections;
-	shared_ptr<Framebuffer>             m_irradianceRaysFB;
 
-	shared_ptr<GBuffer>                 m_irradianceRaysGBuffer;
+	/** RayHitRecord of each ray of the batch that is shaded this frame, RGBA32UI */
+	shared_ptr<Texture>                 m_rayHitRecords;
+
+	/** Radiance arriving at the probe along each ray, RGBA32F so that the compacted hits can be scattered into it */
 	shared_ptr<Framebuffer>             m_irradianceRaysShadedFB;
 
+	/** Upload of RayStagingBuffers::hitListBuffer, and the shaded radiance of hit k of the list at the same texel */
+	shared_ptr<Texture>                 m_rayHitList;
+	shared_ptr<Framebuffer>             m_shadedRayHitsFB;
+
 	shared_ptr<Scene>                   m_scene;
 
 	LightingMode                        m_lightingMode = LightingMode::DIRECT_INDIRECT;
 
 	bool                                m_sceneDirty = true;
 
-	shared_ptr<Framebuffer>             m_giFramebuffer;
-
 	Point3 probeIndexToPosition(int index) const;
 
+	/** Storage coordinate of the probe, which places it in the atlases */
 	Point3int32 probeIndexToGridIndex(int index) const;
 
+	/** Coordinate of the probe on the lattice, relative to m_probeStartPosition. Equal to
+		probeIndexToGridIndex() unless the grid has scrolled. */
+	Point3int32 probeIndexToLatticeCoord(int index) const;
+
+	/** Column and row of the probe in the atlases and the per-probe textures, in units of probes */
+	Point2int32 probeAtlasCoord(int index) const {
+		return ProbeMath::probeAtlasCoord(probeIndexToGridIndex(index), m_storageProbeCounts, m_probeAtlasSlicesPerRow);
+	}
+
+	/** Number of probe columns and rows in the atlases and the per-probe textures */
+	Vector2int32 probeAtlasSize() const {
+		return ProbeMath::probeAtlasSize(m_storageProbeCounts, m_probeAtlasSlicesPerRow);
+	}
+
+	/** Index into m_storageBrickLatticeCoord of the brick holding storage coordinate \a s */
+	int storageBrickIndex(const Point3int32& s) const;
+
+	/** Makes \a storageProbeCounts the grid of probe indices and atlases and starts every probe over */
+	void setStorageGrid(const Vector3int32& storageProbeCounts);
+
+	/** Sparse grids: allocates the bricks that have geometry from the scene trees nearby and
+		packs them into the storage grid. Called whenever the scene trees are rebuilt. */
+	void allocateBricks();
+
+	/** Copies m_brickIndirection to m_brickIndirectionTexture, allocating it if needed */
+	void uploadBrickIndirection();
+
+	/** Sparse grids generate their rays on the CPU, where the brick tables are */
+	bool generateRaysOnCPU() const {
+		return m_generateRaysOnCPU || isSparse();
+	}
+
+	bool compactRayHits() const {
+		return m_compactRayHits;
+	}
+
+	/** Asynchronous tracing requires m_probeRayTracer, which writes to mapped memory without GL
+		calls, and CPU ray generation, so that a batch is complete when it is handed to the worker */
+	bool canTraceAsync() const {
+		return m_useProbeRayTracer && generateRaysOnCPU();
+	}
+
+	bool asyncTrace() const {
+		return m_asyncTrace;
+	}
+
+	/** Takes effect on the next frame. A batch that is being traced is still shaded. */
+	void setAsyncTrace(bool b) {
+		m_asyncTrace = b;
+	}
+
+	/** Waits for the asynchronous trace, if one is running, and unmaps its buffers; the batch is
+		shaded by the next onGraphics3D. Called at the start of onGraphics3D, before the scene trees
+		can change. Fields that share their trees with another field must all call this before
+		the owner's onGraphics3D. */
+	void finishAsyncTrace();
+
+	void setCompactRayHits(bool b) {
+		m_compactRayHits = b;
+	}
+
 	void init(const Specification& spec);
 
+	/** Reads the scene's probe specification file (if any) and fills in the probe grid
+		dimensions and counts from the scene bounds and the overrides. */
+	static Specification loadSpecification
+	(const String&            sceneName,
+	 const shared_ptr<Scene>& scene,
+	 bool&                    encloseScene,
+	 Vector3int32             probeCountsOverride,
+	 float                    maxProbeDistance,
+	 int                      irradianceCubeResolutionOverride = -1,
+	 int                      depthCubeResolutionOverride      = -1);
+
+	/** Maximum distance that can be written to a probe for this grid */
+	static float maxDistanceForSpecification(const Specification& spec);
+
+	/** Argument for ProbeMath::probeAtlasCoord. For SLICE_TILES, chooses the number of slice tiles per row
+		that makes the atlas of a \a probeCounts grid closest to square. */
+	static int probeAtlasSlicesPerRow(ProbeAtlasLayout layout, const Vector3int32& probeCounts);
+
+	/** World-space position of probe (0, 0, 0) and the spacing between probes */
+	static void computeProbeGrid(const Specification& spec, Point3& probeStartPosition, Vector3& probeStep);
+
 	IrradianceField();
 
-	/** allocates all of the framebuffers/gbuffers/textures
-		needed for re-generating the irradiancefield. */
-	void allocateIntermediateBuffers();
+	/** Like loadNewScene, for a grid of \a probeCounts probes spaced \a probeSpacing apart that
+		follows the viewer. Does not use the probe cache. */
+	void loadNewCascade
+	(const String&            sceneName,
+	 const shared_ptr<Scene>& scene,
+	 Vector3int32             probeCounts,
+	 float                    probeSpacing);
+
+	/** Traces against the scene trees of \a owner, which must be updated before this field every frame,
+		instead of building its own, and on the tracing threads of \a owner */
+	void shareSceneTriTrees(const shared_ptr<IrradianceField>& owner);
+
+	/** Moves the grid by whole probe cells so that it is centered on \a center. The probes that stay
+		in the grid keep their atlas texels; only the ones that wrap around to the newly exposed
+		planes are reset and prioritized, like probes that have never been traced. */
+	void scrollTo(const Point3& center);
+
+	/** Resets probe \a index for a new lattice position: no offset, hysteresis 0 and first in line for an update */
+	void resetProbe(int index);
+
+	/** Makes every probe due for reclassification, after the scene geometry changed */
+	void reclassifyAllProbes();
+
+	void allocateRayStagingBuffers(RayStagingBuffers& staging, int rayDimX, int rayDimY);
+
+	/** Rebuilds m_staticTriTree and m_dynamicTriTree from m_scene */
+	void rebuildSceneTriTrees();
+
+	/** Rebuilds m_dynamicTriTree if any entity that can change has moved since it was built */
+	void updateDynamicTriTree();
+
+	/** Replaces entries of rays.hitBuffers with rays.dynamicHitBuffers where the dynamic hit is nearer */
+	void mergeDynamicHits(const RayStagingBuffers& rays) const;
+
+	/** Intersects the rays in \a rays, whose CPU-visible buffers must already be filled,
+		with the scene and writes rays.hitBuffers. With m_useProbeRayTracer, only the position and
+		normal hitBuffers are written, along with rays.hitRecordBuffer. */
+	void traceRays(const RayStagingBuffers& rays, const TriTree::IntersectRayOptions traceOptions) const;
+
+	/** Maps the buffers of m_rayStaging[index] and starts tracing them with m_probeRayTracer on a worker thread */
+	void startAsyncTrace(int index);
+
+	/** Everything after the trace: classifies the probes, packs and compacts the hits, shades the rays
+		and computes the probe mean radiance. \a traceMilliseconds is the time the trace took. */
+	void shadeTracedRays(RenderDevice* rd, const shared_ptr<Scene>& scene, RayStagingBuffers& staging, float traceMilliseconds);
+
+	/** Chooses the probes to trace this frame within the budget, assigns them ray rows and uploads staging.probeSchedule */
+	void scheduleProbes(RayStagingBuffers& staging);
+
+	/** Maximum number of probes that can be traced this frame under the budgets of m_specification */
+	int probeBudget() const;
+
+	/** Higher values are updated first. Grows with the time since the last update and the last radiance
+		change, and falls off with distance to the viewer. */
+	float probePriority(int probeIndex) const;
+
+	/** True if the probe is converged and nothing near it changed, so that it is only updated every m_maintenanceInterval frames */
+	bool maintenanceOnly(int probeIndex) const {
+		return m_lightChangeInvalidation && m_probeConverged[probeIndex] && (m_probeInvalidatedFrames[probeIndex] == 0);
+	}
+
+	/** Averages the shaded rays of each probe and starts copying the result to the CPU */
+	void computeProbeMeanRadiance(RenderDevice* rd, const RayStagingBuffers& rays);
+
+	/** Reads the previous frame's computeProbeMeanRadiance output into m_probeMeanLuminance and
+		m_probeRadianceChange, and updates which probes are converged */
+	void readProbeRadianceChange();
+
+	/** Hysteresis of one update of the probe, from its radiance change and whether it is converged */
+	float probeHysteresis(int probeIndex) const;
+
+	/** Finds the lights and entities that changed since the last frame and invalidates the probes near them */
+	void invalidateChangedProbes();
+
+	/** Updates m_probeStates for every probe traced in \a rays from its traced hit buffers, and
+		relocates the probes that are inside geometry or too close to a surface. Counts the hits of
+		each row into rays.rowHitCount. */
+	void classifyProbes(RayStagingBuffers& rays);
+
+	/** Copies m_probeOffsets to m_probeOffsetTexture, allocating it if needed */
+	void uploadProbeOffsets();
 
 	/** Generate rays for irradiance probe updates. */
 	void generateIrradianceRays(RenderDevice* r0d, const shared_ptr<Scene>& scene);
 
 	/** Sample rays for irradiance probe updates, returning shaded hit points. */
-	void sampleAndShadeIrradianceRays(RenderDevice* rd, const shared_ptr<Scene>& scene, const Array<shared_ptr<Surface>>& surfaceArray);
+	void sampleAndShadeIrradianceRays(RenderDevice* rd, const shared_ptr<Scene>& scene);
 
 	/** Update irradiance probes at runtime using newly sampled rays. */
 	void updateIrradianceProbes(RenderDevice* rd, const shared_ptr<Scene>& scene);
@@ -161,24 +720,58 @@ protected:
 	/** Update a single irradiance probe at runtime using newly sampled rays. */
 	void updateIrradianceProbe(RenderDevice* rd, bool irradiance);
 
-	void renderIndirectIllumination
-	(RenderDevice*							   rd,
-	 const shared_ptr<GBuffer>&                gbuffer,
-	 const LightingEnvironment&                environment);
+	/** Update the irradiance and mean distance atlases in one compute pass that reads each
+		probe's rays once. Requires canUseFusedProbeUpdate(). */
+	void updateProbesFused(RenderDevice* rd);
 
-public:
+	/** True if both atlas formats support image stores and the probe tiles fit in one work group */
+	bool canUseFusedProbeUpdate() const;
+
+	/** GLSL image layout qualifier for \a format, or "" if image stores to it are not supported */
+	static const char* imageFormatQualifier(const ImageFormat* format);
+
+	/** Encodes the current atlases as they are stored in m_compressedIrradianceProbes and m_compressedMeanDistProbes */
+	void encodeCompressedAtlases(Array<uint8>& irradianceBlocks, Array<uint16>& moments) const;
+
+	/** Creates the compressed atlas copies from the output of encodeCompressedAtlases */
+	void uploadCompressedAtlases(const uint8* irradianceBlocks, const uint16* moments);
+
+	/** True if the compressed copies exist and match the current atlases */
+	bool hasCompressedAtlases() const;
+
+	/** Header describing the current grid and atlases, without the section offsets */
+	ProbeCache::Header probeCacheHeader() const;
 
+	/** Packs the trace results of the first rays.rowCount rows of \a rays into rays.hitRecordBuffer */
+	void packRayHits(const RayStagingBuffers& rays) const;
+
+	/** Writes the indices of the rays that hit a surface to rays.hitListBuffer, from
+		rays.rowHitCount and the traced normals */
+	void buildRayHitList(RayStagingBuffers& rays) const;
+
+	/** The m_compactRayHits path of sampleAndShadeArbitraryRays: a skybox lookup for every miss in
+		\a shadedRect, full shading of the \a hitRows rows of m_rayHitList into m_shadedRayHitsFB,
+		and a scatter of the shaded hits to their rays in \a targetFramebuffer */
+	void shadeCompactedRays
+	(RenderDevice*                              rd,
+	 const shared_ptr<Framebuffer>&             targetFramebuffer,
+	 const LightingEnvironment&                 environment,
+	 const RayStagingBuffers&                   rays,
+	 const Rect2D&                              shadedRect,
+	 int                                        hitRows,
+	 bool                                       useProbeIndirect);
+
+	/** Shades the hits of \a rays, which must already have been traced with traceRays() and packed
+		with packRayHits(), into targetFramebuffer. With m_compactRayHits, the rays must also have been
+		compacted with buildRayHitList(). Specification::glossyToMatte is applied when the hits are packed. */
 	void sampleAndShadeArbitraryRays
 	(RenderDevice*								rd,
-	 const Array<shared_ptr<Surface>>&          surfaceArray,
 	 const shared_ptr<Framebuffer>&             targetFramebuffer,
 	 const LightingEnvironment&                 environment,
-	 const shared_ptr<Texture>&                 rayOrigins,
-	 const shared_ptr<Texture>&                 rayDirections,
-	 const bool                                 useProbeIndirect,
-	 const bool                                 glossyToMatte,
-	 const shared_ptr<GBuffer>&                 gbuffer,
-	 const TriTree::IntersectRayOptions         traceOptions);
+	 const RayStagingBuffers&                   rays,
+	 const bool                                 useProbeIndirect);
+
+public:
 
 	// Return maxProbeDistance so we can set it in the shader. Note that we may also use this value on the way in
 	// to *set* the maxProbeDistance, or at set the initial distance before converting to powers of two.
@@ -196,6 +789,66 @@ public:
 
 	void generateIrradianceProbes(RenderDevice* rd);
 
+	/** Allocates or releases m_irradianceSH to match Specification::irradianceSHOrder */
+	void allocateIrradianceSH();
+
+	/** Projects the shaded rays of the scheduled probes into m_irradianceSH */
+	void updateSHProbes(RenderDevice* rd);
+
+	/** Replaces the compressed atlas copies with encodings of the current atlases. Stalls on the readback. */
+	void compressAtlases();
+
+	/** See m_sampleCompressedAtlases. Enabling it without up-to-date compressed copies calls compressAtlases(). */
+	void setSampleCompressedAtlases(bool b);
+
+	bool sampleCompressedAtlases() const {
+		return m_sampleCompressedAtlases;
+	}
+
+	/** Atlases written by the probe updates, for reports */
+	const shared_ptr<Texture>& irradianceProbes() const {
+		return m_irradianceProbes;
+	}
+
+	const shared_ptr<Texture>& meanDistProbes() const {
+		return m_meanDistProbes;
+	}
+
+	/** nullptr unless irradianceSHOrder() > 0 */
+	const shared_ptr<Texture>& irradianceSH() const {
+		return m_irradianceSH;
+	}
+
+	/** See Specification::irradianceSHOrder */
+	int irradianceSHOrder() const {
+		return m_specification.irradianceSHOrder;
+	}
+
+	/** Switching representations restarts the probes from hysteresis 0 */
+	void setIrradianceSHOrder(int order) {
+		m_specification.irradianceSHOrder = clamp(order, 0, 2);
+	}
+
+	/** SH coefficients per probe, 0 for the octahedral atlas */
+	int shCoefficientCount() const {
+		return (m_specification.irradianceSHOrder > 0) ? square(m_specification.irradianceSHOrder + 1) : 0;
+	}
+
+	float maxDistance() const {
+		return m_maxDistance;
+	}
+
+	/** Default probe cache file for \a sceneName, next to its LightFieldModelSpecification */
+	static String probeCacheFilename(const String& sceneName);
+
+	/** Writes the atlases and probe offsets to \a filename, or to probeCacheFilename() of the
+		current scene if it is empty. Reads the atlases back from the GPU, so it stalls. */
+	void saveProbeCache(const String& filename = "") const;
+
+	/** Replaces the atlases and probe offsets with those of the probe cache \a filename if it
+		matches the current grid and scene. Returns false and leaves the probes unchanged otherwise. */
+	bool loadProbeCache(const String& filename);
+
 	void setShaderArgs(UniformTable& args, const String& prefix);
 
 	bool encloseScene() {
@@ -241,23 +894,154 @@ public:
 	}
 
 	RealTime lastSceneUpdateTime() {
-		return m_sceneTriTree->lastBuildTime();
+		return m_staticTriTree->lastBuildTime();
 	}
 
+	/** Visible entities with models that can (\a canChange = true) or cannot change */
+	static void getModelEntities(const shared_ptr<Scene>& scene, bool canChange, Array<shared_ptr<VisibleEntity>>& entities);
+
+	/** Poses \a entities into surfaces for TriTree::setContents */
+	static void poseEntities(const Array<shared_ptr<VisibleEntity>>& entities, Array<shared_ptr<Surface>>& surfaceArray);
+
+	/** Number of probe indices, which includes the unallocated storage of sparse grids */
 	int probeCount() const {
-		return m_specification.probeCounts.x * m_specification.probeCounts.y * m_specification.probeCounts.z;
+		return m_storageProbeCounts.x * m_storageProbeCounts.y * m_storageProbeCounts.z;
+	}
+
+	bool isSparse() const {
+		return m_specification.brickSize > 0;
+	}
+
+	/** Sparse grids: bricks with storage, and bricks in the lattice */
+	int allocatedBrickCount() const {
+		return m_allocatedBrickCount;
+	}
+
+	int brickCount() const {
+		return m_brickIndirection.size();
 	}
 
 	const Vector3int32& probeCounts() const {
 		return m_specification.probeCounts;
 	}
 
+	/** Spacing between adjacent probes */
+	const Vector3& probeStep() const {
+		return m_probeStep;
+	}
+
+	/** World-space bounds of the lattice, without the probe relocation offsets */
+	AABox probeBounds() const {
+		return AABox(m_probeStartPosition, m_probeStartPosition + m_probeStep * Vector3(m_specification.probeCounts - Vector3int32(1, 1, 1)));
+	}
+
+	/** Number of probes classified ProbeState::ACTIVE */
+	int activeProbeCount() const {
+		return m_activeProbeCount;
+	}
+
+	float activeProbeFraction() const {
+		return float(m_activeProbeCount) / float(max(probeCount(), 1));
+	}
+
+	/** Number of probes updated this frame */
+	int scheduledProbeCount() const {
+		return m_scheduledProbeCount;
+	}
+
+	/** Number of probes whose radiance has stopped changing, which are traced with fewer rays */
+	int convergedProbeCount() const {
+		return m_convergedProbeCount;
+	}
+
+	/** Rays traced for a converged probe. See Specification::convergedRayFraction */
+	int convergedRaysPerProbe() const;
+
+	/** Number of probes that are being re-traced because a light or entity near them changed */
+	int invalidatedProbeCount() const {
+		return m_invalidatedProbeCount;
+	}
+
+	bool lightChangeInvalidation() const {
+		return m_lightChangeInvalidation;
+	}
+
+	void setLightChangeInvalidation(bool b) {
+		m_lightChangeInvalidation = b;
+	}
+
+	void setCullInactiveProbes(bool b) {
+		m_cullInactiveProbes = b;
+	}
+
+	/** Probes that were already moved keep their offsets */
+	void setRelocateProbes(bool b) {
+		m_relocateProbes = b;
+	}
+
+	/** Adaptive hysteresis and reduced rays for converged probes. See m_adaptiveUpdates. */
+	void setAdaptiveUpdates(bool b) {
+		m_adaptiveUpdates = b;
+	}
+
+	const SceneChangeTracker& sceneChangeTracker() const {
+		return m_sceneChangeTracker;
+	}
+
+	/** Timings and counters of recent frames of the probe pipeline */
+	const ProbeStats& stats() const {
+		return m_stats;
+	}
+
+	ProbeStats& stats() {
+		return m_stats;
+	}
+
+	/** 0 = no limit. See Specification::raysPerFrameBudget */
+	void setRaysPerFrameBudget(int rays) {
+		m_specification.raysPerFrameBudget = rays;
+	}
+
+	/** 0 = no limit. See Specification::traceMillisecondsBudget */
+	void setTraceMillisecondsBudget(float ms) {
+		m_specification.traceMillisecondsBudget = ms;
+	}
+
+	int raysPerProbe() const {
+		return m_specification.irradianceRaysPerProbe;
+	}
+
+	/** The ray buffers are reallocated on the next onGraphics3D */
+	void setRaysPerProbe(int rays) {
+		m_specification.irradianceRaysPerProbe = max(rays, 1);
+	}
+
+	/** Reseeds the per-frame ray rotation. Two fields with the same seed, specification and scene
+		trace the same rays, as long as the trace time budget is disabled. */
+	void setRandomSeed(uint32 seed) {
+		m_random.reset(seed);
+	}
+
+	/** Approximate GPU memory of the atlases, per-probe textures and ray staging buffers */
+	size_t gpuMemoryBytes() const;
+
+	/** Call before onGraphics3D so that probes near the viewer are updated first */
+	void setViewerPosition(const Point3& P) {
+		m_viewerPosition = P;
+	}
+
+	/** \a loadProbeCache = false always starts from hysteresis 0, e.g. for benchmarks */
 	static shared_ptr<IrradianceField> create
 	(const String&            sceneFilename, 
 	 const shared_ptr<Scene>& scene,
 	 Vector3int32             probeCountsOverride              = Vector3int32(-1, -1, -1), 
      float                    maxProbeDistance                 = -1.0f, 
-     int                      irradianceCubeResolutionOverride = -1);
+     int                      irradianceCubeResolutionOverride = -1,
+	 int                      depthCubeResolutionOverride      = -1,
+	 bool                     loadProbeCache                   = true);
+
+	/** Waits for an asynchronous trace that is still running */
+	virtual ~IrradianceField();
 
 	/** The surfaceArray is only used to find the skybox */
 	virtual void onGraphics3D(RenderDevice* rd, const Array<shared_ptr<Surface>>& surfaceArray);
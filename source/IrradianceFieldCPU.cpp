@@ -0,0 +1,499 @@
+#include "IrradianceFieldCPU.h"
+#include "ProbeMath.h"
+
+/** Keep in sync with IrradianceField.cpp */
+static const float recursiveEnergyPreservation = 0.85f;
+
+/** Keep in sync with IrradianceField_UpdateIrradianceProbe.pix */
+static const float energyConservation = 0.95f;
+static const float epsilon = 1e-6f;
+
+IrradianceFieldCPU::IrradianceFieldCPU()
+{
+	m_sceneTriTree = TriTree::create(false);
+}
+
+shared_ptr<IrradianceFieldCPU> IrradianceFieldCPU::create
+   (const IrradianceField::Specification& spec,
+	float                                 maxDistance,
+	const shared_ptr<Scene>&              scene)
+{
+	const shared_ptr<IrradianceFieldCPU>& irradianceField = createShared<IrradianceFieldCPU>();
+	irradianceField->init(spec, maxDistance);
+	irradianceField->onSceneChanged(scene);
+	return irradianceField;
+}
+
+shared_ptr<IrradianceFieldCPU> IrradianceFieldCPU::create(const String& sceneName, const shared_ptr<Scene>& scene)
+{
+	bool encloseScene = false;
+	const IrradianceField::Specification& spec = IrradianceField::loadSpecification(sceneName, scene, encloseScene, Vector3int32(-1, -1, -1), -1.0f);
+	return create(spec, IrradianceField::maxDistanceForSpecification(spec), scene);
+}
+
+shared_ptr<IrradianceFieldCPU> IrradianceFieldCPU::create(const shared_ptr<IrradianceField>& field, const shared_ptr<Scene>& scene)
+{
+	const shared_ptr<IrradianceFieldCPU>& irradianceField = create(field->m_specification, field->m_maxDistance, scene);
+	irradianceField->copyProbeOffsets(*field);
+	return irradianceField;
+}
+
+void IrradianceFieldCPU::copyProbeOffsets(const IrradianceField& field)
+{
+	alwaysAssertM(field.m_probeOffsets.size() == probeCount(), "The irradiance field has different probe counts");
+	m_probeOffsets = field.m_probeOffsets;
+}
+
+void IrradianceFieldCPU::init(const IrradianceField::Specification& spec, float maxDistance)
+{
+	m_specification = spec;
+	m_maxDistance = maxDistance;
+	IrradianceField::computeProbeGrid(m_specification, m_probeStartPosition, m_probeStep);
+	m_probeCountXDivisor = ProbeMath::FastDivisor(m_specification.probeCounts.x);
+	m_probeCountXYDivisor = ProbeMath::FastDivisor(m_specification.probeCounts.x * m_specification.probeCounts.y);
+	m_probeAtlasSlicesPerRow = IrradianceField::probeAtlasSlicesPerRow(m_specification.probeAtlasLayout, m_specification.probeCounts);
+
+	const int irradianceSide = m_specification.irradianceOctResolution;
+	const int depthSide = m_specification.depthOctResolution;
+
+	// 1-pixel of padding surrounding each probe, 1-pixel padding surrounding entire texture for alignment.
+	const Vector2int32& atlasSize = ProbeMath::probeAtlasSize(m_specification.probeCounts, m_probeAtlasSlicesPerRow);
+	m_irradianceWidth = (irradianceSide + 2) * atlasSize.x + 2;
+	m_irradianceHeight = (irradianceSide + 2) * atlasSize.y + 2;
+	m_depthWidth = (depthSide + 2) * atlasSize.x + 2;
+	m_depthHeight = (depthSide + 2) * atlasSize.y + 2;
+
+	m_irradianceAtlas.resize(m_irradianceWidth * m_irradianceHeight);
+	m_irradianceAtlas.setAll(Radiance3::zero());
+	m_meanDistAtlas.resize(m_depthWidth * m_depthHeight);
+	m_meanDistAtlas.setAll(Vector2::zero());
+
+	const int numRays = probeCount() * raysPerProbe();
+	m_rays.resize(numRays);
+	m_rayHits.resize(numRays);
+	m_rayHitRadiance.resize(numRays);
+	m_rayHitDistance.resize(numRays);
+	m_rayGenerator.setRaysPerProbe(raysPerProbe());
+
+	m_probeOffsets.resize(probeCount());
+	m_probeOffsets.setAll(Vector3::zero());
+
+	m_firstFrame = true;
+}
+
+void IrradianceFieldCPU::onSceneChanged(const shared_ptr<Scene>& scene)
+{
+	m_scene = scene;
+	m_sceneTriTree->setContents(m_scene);
+	readSkybox();
+}
+
+void IrradianceFieldCPU::readSkybox()
+{
+	m_skyboxSize = 0;
+	const shared_ptr<Skybox>& skybox = dynamic_pointer_cast<Skybox>(m_scene->entity("skybox"));
+	if (isNull(skybox) || skybox->keyframeArray().empty())
+	{
+		return;
+	}
+
+	const shared_ptr<Texture>& texture = skybox->keyframeArray()[0];
+	const Color4& readMultiplyFirst = texture->encoding().readMultiplyFirst;
+	const Color4& readAddSecond = texture->encoding().readAddSecond;
+	m_skyboxSize = texture->width();
+	for (int face = 0; face < 6; ++face)
+	{
+		const shared_ptr<PixelTransferBuffer>& buffer = texture->toPixelTransferBuffer(ImageFormat::RGB32F(), 0, CubeFace(face));
+		Array<Radiance3>& texels = m_skyboxFaces[face];
+		texels.resize(m_skyboxSize * m_skyboxSize);
+		System::memcpy(texels.getCArray(), buffer->mapRead(), sizeof(Radiance3) * texels.size());
+		buffer->unmap();
+
+		for (Radiance3& L : texels)
+		{
+			L = L * readMultiplyFirst.rgb() + readAddSecond.rgb();
+		}
+	}
+}
+
+Radiance3 IrradianceFieldCPU::missRadiance(const Vector3& direction) const
+{
+	if (m_skyboxSize == 0)
+	{
+		return m_missRadiance;
+	}
+
+	// Face selection of the OpenGL specification, section "Cube Map Texture Selection"
+	const Vector3 a = direction.abs();
+	int face;
+	float sc, tc, ma;
+	if ((a.x >= a.y) && (a.x >= a.z))
+	{
+		face = (direction.x >= 0.0f) ? 0 : 1;
+		ma = a.x;
+		sc = (direction.x >= 0.0f) ? -direction.z : direction.z;
+		tc = -direction.y;
+	}
+	else if (a.y >= a.z)
+	{
+		face = (direction.y >= 0.0f) ? 2 : 3;
+		ma = a.y;
+		sc = direction.x;
+		tc = (direction.y >= 0.0f) ? direction.z : -direction.z;
+	}
+	else
+	{
+		face = (direction.z >= 0.0f) ? 4 : 5;
+		ma = a.z;
+		sc = (direction.z >= 0.0f) ? direction.x : -direction.x;
+		tc = -direction.y;
+	}
+
+	const Point2 texCoord((sc / ma + 1.0f) * 0.5f, (tc / ma + 1.0f) * 0.5f);
+	return bilinearFetch(m_skyboxFaces[face], m_skyboxSize, m_skyboxSize, texCoord);
+}
+
+Point3int32 IrradianceFieldCPU::probeIndexToGridIndex(int index) const
+{
+	return ProbeMath::probeIndexToGridCoord(index, m_probeCountXDivisor, m_probeCountXYDivisor);
+}
+
+Point3 IrradianceFieldCPU::probeIndexToPosition(int index) const
+{
+	const Point3int32 P = probeIndexToGridIndex(index);
+	return m_probeStep * Vector3(P) + m_probeStartPosition + m_probeOffsets[index];
+}
+
+void IrradianceFieldCPU::update()
+{
+	generateRays();
+	traceAndShadeRays();
+	updateProbes();
+}
+
+void IrradianceFieldCPU::generateRays()
+{
+	const RealTime startTime = System::time();
+
+	const int rayCount = raysPerProbe();
+	m_rayGenerator.setOrientation(Matrix3::fromAxisAngle(Vector3::random(m_random), m_random.uniform(0.f, 2 * pif())));
+
+	runConcurrently(0, probeCount(), [&](int probeIndex) {
+		const Point3& origin = probeIndexToPosition(probeIndex);
+		for (int r = 0; r < rayCount; ++r)
+		{
+			m_rays[probeIndex * rayCount + r] = Ray::fromOriginAndDirection(origin, m_rayGenerator.direction(r), ProbeRayGenerator::rayMinDistance, finf());
+		}
+	});
+
+	m_timing.generateRays = System::time() - startTime;
+}
+
+Radiance3 IrradianceFieldCPU::shadeDirect(const shared_ptr<Surfel>& surfel, const Vector3& w_o) const
+{
+	Radiance3 L = Radiance3::zero();
+	const Point3& X = surfel->position;
+	const Vector3& n = surfel->shadingNormal;
+
+	for (const shared_ptr<Light>& light : m_scene->lightingEnvironment().lightArray)
+	{
+		if (!light->enabled() || !light->producesDirectIllumination())
+		{
+			continue;
+		}
+
+		// Directional lights store the direction to the light in position().xyz()
+		const Point3& lightPosition = light->position().xyz();
+		Vector3 w_i;
+		float distance;
+		if (light->position().w == 0.0f)
+		{
+			w_i = lightPosition.direction();
+			distance = finf();
+		}
+		else
+		{
+			w_i = lightPosition - X;
+			distance = w_i.length();
+			w_i /= distance;
+		}
+
+		const float cos_i = w_i.dot(n);
+		if (cos_i <= 0.0f)
+		{
+			continue;
+		}
+
+		if (light->castsShadows())
+		{
+			// Don't cull backfaces, matching the probe rays
+			TriTree::Hit shadowHit;
+			const Ray& shadowRay = Ray::fromOriginAndDirection(X + n * 1e-3f, w_i, 0.0f, distance - 1e-3f);
+			if (m_sceneTriTree->intersectRay(shadowRay, shadowHit, TriTree::OCCLUSION_TEST_ONLY | TriTree::DO_NOT_CULL_BACKFACES))
+			{
+				continue;
+			}
+		}
+
+		L += light->biradiance(X, lightPosition) * surfel->finiteScatteringDensity(w_i, w_o) * cos_i;
+	}
+
+	return L;
+}
+
+void IrradianceFieldCPU::traceAndShadeRays()
+{
+	RealTime startTime = System::time();
+
+	// Don't cull backfaces...if a probe looks through a back face (e.g., single-sided ceiling), it will get incorrect results
+	m_sceneTriTree->intersectRays(m_rays, m_rayHits, TriTree::DO_NOT_CULL_BACKFACES);
+
+	m_timing.trace = System::time() - startTime;
+	startTime = System::time();
+
+	const int rayCount = raysPerProbe();
+	const bool useProbeIndirect = !m_specification.singleBounce;
+
+	runConcurrently(0, probeCount(), [&](int probeIndex) {
+		for (int r = probeIndex * rayCount; r < (probeIndex + 1) * rayCount; ++r)
+		{
+			const TriTree::Hit& hit = m_rayHits[r];
+			const Ray& ray = m_rays[r];
+
+			if (hit.triIndex == TriTree::Hit::NONE)
+			{
+				m_rayHitRadiance[r] = missRadiance(ray.direction());
+				m_rayHitDistance[r] = m_maxDistance;
+				continue;
+			}
+
+			shared_ptr<Surfel> surfel;
+			m_sceneTriTree->sample(hit, surfel);
+
+			const Vector3& w_o = -ray.direction();
+			Radiance3 L = surfel->emittedRadiance(w_o) + shadeDirect(surfel, w_o);
+
+			if (useProbeIndirect)
+			{
+				const shared_ptr<UniversalSurfel>& universalSurfel = dynamic_pointer_cast<UniversalSurfel>(surfel);
+				if (notNull(universalSurfel))
+				{
+					const Radiance3& L_matteIndirect = 2.0f * pif() * recursiveEnergyPreservation * sampleIrradiance(surfel->position, surfel->shadingNormal, w_o);
+					L += L_matteIndirect * universalSurfel->lambertianReflectivity / pif();
+				}
+			}
+
+			m_rayHitRadiance[r] = L;
+
+			// Match the normal bump in IrradianceField_UpdateIrradianceProbe.pix
+			const Point3& hitLocation = surfel->position + surfel->shadingNormal * 0.01f;
+			m_rayHitDistance[r] = min(m_maxDistance, (ray.origin() - hitLocation).length());
+		}
+	});
+
+	m_timing.shade = System::time() - startTime;
+}
+
+void IrradianceFieldCPU::updateProbes()
+{
+	const RealTime startTime = System::time();
+
+	const int rayCount = raysPerProbe();
+	const float hysteresis = m_firstFrame ? 0.0f : m_specification.hysteresis;
+	const int irradianceSide = m_specification.irradianceOctResolution;
+	const int depthSide = m_specification.depthOctResolution;
+
+	runConcurrently(0, probeCount(), [&](int probeIndex) {
+		const int firstRay = probeIndex * rayCount;
+		const Point2int32& atlasCoord = probeAtlasCoord(probeIndexToGridIndex(probeIndex));
+
+		// Gather the probe's rays once into a compact batch that stays in cache while
+		// both atlases are accumulated, matching IrradianceField_UpdateProbes.glc
+		SmallArray<Vector3, 256> rayDirection;
+		SmallArray<Radiance3, 256> rayRadiance;
+		SmallArray<Vector2, 256> rayDistance;
+		rayDirection.resize(rayCount);
+		rayRadiance.resize(rayCount);
+		rayDistance.resize(rayCount);
+		for (int r = 0; r < rayCount; ++r)
+		{
+			const float distance = m_rayHitDistance[firstRay + r];
+			rayDirection[r] = m_rays[firstRay + r].direction();
+			rayRadiance[r] = m_rayHitRadiance[firstRay + r] * energyConservation;
+			rayDistance[r] = Vector2(distance, square(distance));
+		}
+
+		// Irradiance
+		const Point2int32 irradianceTopLeft = ProbeMath::probeAtlasTopLeft(atlasCoord, irradianceSide);
+		for (int y = 0; y < irradianceSide; ++y)
+		{
+			for (int x = 0; x < irradianceSide; ++x)
+			{
+				const Vector3& texelDirection = ProbeMath::probeTexelDirection(x, y, irradianceSide);
+				Radiance3 sum = Radiance3::zero();
+				float sumWeight = 0.0f;
+
+				for (int r = 0; r < rayCount; ++r)
+				{
+					const float weight = max(0.0f, texelDirection.dot(rayDirection[r]));
+					if (weight >= epsilon)
+					{
+						sum += rayRadiance[r] * weight;
+						sumWeight += weight;
+					}
+				}
+
+				if (sumWeight > epsilon)
+				{
+					Radiance3& texel = m_irradianceAtlas[(irradianceTopLeft.y + y) * m_irradianceWidth + irradianceTopLeft.x + x];
+					texel = (sum / sumWeight) * (1.0f - hysteresis) + texel * hysteresis;
+				}
+			}
+		}
+
+		// Mean and mean squared distance
+		const Point2int32 depthTopLeft = ProbeMath::probeAtlasTopLeft(atlasCoord, depthSide);
+		for (int y = 0; y < depthSide; ++y)
+		{
+			for (int x = 0; x < depthSide; ++x)
+			{
+				const Vector3& texelDirection = ProbeMath::probeTexelDirection(x, y, depthSide);
+				Vector2 sum = Vector2::zero();
+				float sumWeight = 0.0f;
+
+				for (int r = 0; r < rayCount; ++r)
+				{
+					const float weight = powf(max(0.0f, texelDirection.dot(rayDirection[r])), m_specification.depthSharpness);
+					if (weight >= epsilon)
+					{
+						sum += rayDistance[r] * weight;
+						sumWeight += weight;
+					}
+				}
+
+				if (sumWeight > epsilon)
+				{
+					Vector2& texel = m_meanDistAtlas[(depthTopLeft.y + y) * m_depthWidth + depthTopLeft.x + x];
+					texel = (sum / sumWeight) * (1.0f - hysteresis) + texel * hysteresis;
+				}
+			}
+		}
+	});
+
+	m_firstFrame = false;
+
+	m_timing.updateProbes = System::time() - startTime;
+}
+
+template<class T>
+T IrradianceFieldCPU::bilinearFetch(const Array<T>& atlas, int width, int height, const Point2& texCoord)
+{
+	const Point2 P = texCoord * Vector2(float(width), float(height)) - Vector2(0.5f, 0.5f);
+	const int x0 = iFloor(P.x);
+	const int y0 = iFloor(P.y);
+	const float fx = P.x - float(x0);
+	const float fy = P.y - float(y0);
+
+	const int xa = iClamp(x0, 0, width - 1), xb = iClamp(x0 + 1, 0, width - 1);
+	const int ya = iClamp(y0, 0, height - 1), yb = iClamp(y0 + 1, 0, height - 1);
+
+	const T& top    = atlas[ya * width + xa] * (1.0f - fx) + atlas[ya * width + xb] * fx;
+	const T& bottom = atlas[yb * width + xa] * (1.0f - fx) + atlas[yb * width + xb] * fx;
+	return top * (1.0f - fy) + bottom * fy;
+}
+
+Irradiance3 IrradianceFieldCPU::sampleIrradiance(const Point3& wsPosition, const Vector3& wsN, const Vector3& w_o) const
+{
+	const Vector3int32& probeCounts = m_specification.probeCounts;
+	const Vector3& floatGridCoord = (wsPosition - m_probeStartPosition) / m_probeStep;
+	const Vector3int32 baseGridCoord(iClamp(iFloor(floatGridCoord.x), 0, probeCounts.x - 1),
+		iClamp(iFloor(floatGridCoord.y), 0, probeCounts.y - 1),
+		iClamp(iFloor(floatGridCoord.z), 0, probeCounts.z - 1));
+	const Point3& baseProbePos = m_probeStep * Vector3(baseGridCoord) + m_probeStartPosition;
+
+	// alpha is how far from the floor(currentVertex) position. on [0, 1] for each axis.
+	const Vector3& alpha = ((wsPosition - baseProbePos) / m_probeStep).clamp(0.0f, 1.0f);
+
+	Irradiance3 sumIrradiance = Irradiance3::zero();
+	float sumWeight = 0.0f;
+
+	// Iterate over adjacent probe cage. See IrradianceFieldSampling.glsl for the derivation of the weights.
+	for (int i = 0; i < 8; ++i)
+	{
+		const Vector3int32 offset(i & 1, (i >> 1) & 1, (i >> 2) & 1);
+		const Vector3int32 probeGridCoord(iMin(baseGridCoord.x + offset.x, probeCounts.x - 1),
+			iMin(baseGridCoord.y + offset.y, probeCounts.y - 1),
+			iMin(baseGridCoord.z + offset.z, probeCounts.z - 1));
+		const Point2int32& atlasCoord = probeAtlasCoord(probeGridCoord);
+
+		const int probeIndex = probeGridCoord.x + probeCounts.x * (probeGridCoord.y + probeCounts.y * probeGridCoord.z);
+		const Point3& probePos = m_probeStep * Vector3(probeGridCoord) + m_probeStartPosition + m_probeOffsets[probeIndex];
+
+		const Vector3& probeToPoint = wsPosition - probePos + (wsN + 3.0f * w_o) * m_specification.normalBias;
+		const Vector3& dir = (-probeToPoint).direction();
+
+		const Vector3 trilinear(offset.x ? alpha.x : 1.0f - alpha.x,
+			offset.y ? alpha.y : 1.0f - alpha.y,
+			offset.z ? alpha.z : 1.0f - alpha.z);
+		float weight = 1.0f;
+
+		// Smooth backface test
+		{
+			const Vector3& trueDirectionToProbe = (probePos - wsPosition).direction();
+			weight *= square(max(0.0001f, (trueDirectionToProbe.dot(wsN) + 1.0f) * 0.5f)) + 0.2f;
+		}
+
+		// Moment visibility test
+		{
+			const Point2& texCoord = ProbeMath::textureCoordFromDirection(-dir, atlasCoord, m_depthWidth, m_depthHeight, m_specification.depthOctResolution);
+			const float distToProbe = probeToPoint.length();
+
+			const Vector2& temp = bilinearFetch(m_meanDistAtlas, m_depthWidth, m_depthHeight, texCoord);
+			const float mean = temp.x;
+			const float variance = fabsf(square(temp.x) - temp.y);
+
+			float chebyshevWeight = variance / (variance + square(max(distToProbe - mean, 0.0f)));
+			chebyshevWeight = max(chebyshevWeight * chebyshevWeight * chebyshevWeight, 0.0f);
+
+			weight *= (distToProbe <= mean) ? 1.0f : chebyshevWeight;
+		}
+
+		// Avoid zero weight
+		weight = max(0.000001f, weight);
+
+		const Point2& texCoord = ProbeMath::textureCoordFromDirection(wsN, atlasCoord, m_irradianceWidth, m_irradianceHeight, m_specification.irradianceOctResolution);
+		Irradiance3 probeIrradiance = bilinearFetch(m_irradianceAtlas, m_irradianceWidth, m_irradianceHeight, texCoord);
+
+		const float crushThreshold = 0.2f;
+		if (weight < crushThreshold)
+		{
+			weight *= weight * weight * (1.0f / square(crushThreshold));
+		}
+
+		// Trilinear weights
+		weight *= trilinear.x * trilinear.y * trilinear.z;
+
+		// Blend in perceptual (sqrt) space, as the shader does when LINEAR_BLENDING == 0
+		probeIrradiance = Irradiance3(sqrtf(probeIrradiance.r), sqrtf(probeIrradiance.g), sqrtf(probeIrradiance.b));
+
+		sumIrradiance += weight * probeIrradiance;
+		sumWeight += weight;
+	}
+
+	const Irradiance3& netIrradiance = sumIrradiance / sumWeight;
+	return netIrradiance * netIrradiance;
+}
+
+shared_ptr<CPUPixelTransferBuffer> IrradianceFieldCPU::irradianceBuffer() const
+{
+	const shared_ptr<CPUPixelTransferBuffer>& buffer = CPUPixelTransferBuffer::create(m_irradianceWidth, m_irradianceHeight, ImageFormat::RGB32F());
+	System::memcpy(buffer->buffer(), m_irradianceAtlas.getCArray(), m_irradianceAtlas.size() * sizeof(Radiance3));
+	return buffer;
+}
+
+shared_ptr<CPUPixelTransferBuffer> IrradianceFieldCPU::meanDistBuffer() const
+{
+	const shared_ptr<CPUPixelTransferBuffer>& buffer = CPUPixelTransferBuffer::create(m_depthWidth, m_depthHeight, ImageFormat::RG32F());
+	System::memcpy(buffer->buffer(), m_meanDistAtlas.getCArray(), m_meanDistAtlas.size() * sizeof(Vector2));
+	return buffer;
+}
@@ -0,0 +1,191 @@
+#pragma once
+#include <G3D/G3D.h>
+#include "IrradianceField.h"
+#include "ProbeMath.h"
+#include "ProbeRayGenerator.h"
+
+/**
+	Headless CPU implementation of the IrradianceField probe update pipeline.
+
+	Mirrors the GPU stages of IrradianceField::onGraphics3D on the CPU:
+	spherical Fibonacci ray generation (IrradianceField_GenerateRandomRays.pix), tracing with
+	TriTree::intersectRays, direct + probe-indirect shading of the hits
+	(IrradianceField_ShadeRayHits.pix and IrradianceFieldSampling.glsl) and the irradiance and
+	mean/mean^2 blend of IrradianceField_UpdateIrradianceProbe.pix.
+
+	The atlases use exactly the same octahedral layout as IrradianceField::m_irradianceProbes and
+	IrradianceField::m_meanDistProbes, so the results can be uploaded directly or compared texel
+	for texel; ProbeBenchmark::benchmarkCPUReference does so and uses it as a timing baseline. Misses
+	read a CPU copy of the skybox, which is the one step that needs a GL context. Work is distributed
+	across probes with runConcurrently().
+*/
+class IrradianceFieldCPU : public ReferenceCountedObject
+{
+public:
+
+	/** Wall-clock time of each stage of the most recent update(), in seconds */
+	struct Timing
+	{
+		RealTime                        generateRays = 0.0;
+		RealTime                        trace = 0.0;
+		RealTime                        shade = 0.0;
+		RealTime                        updateProbes = 0.0;
+
+		RealTime total() const {
+			return generateRays + trace + shade + updateProbes;
+		}
+	};
+
+protected:
+
+	IrradianceField::Specification      m_specification;
+
+	/** Maximum distance that can be written to a probe. */
+	float                               m_maxDistance = 4.0f;
+
+	Point3                              m_probeStartPosition;
+	Vector3                             m_probeStep;
+
+	/** Divide by probeCounts.x and probeCounts.x * probeCounts.y */
+	ProbeMath::FastDivisor              m_probeCountXDivisor;
+	ProbeMath::FastDivisor              m_probeCountXYDivisor;
+
+	/** See ProbeMath::probeAtlasCoord */
+	int                                 m_probeAtlasSlicesPerRow = 0;
+
+	/** Radiance returned by rays that leave a scene without a skybox */
+	Radiance3                           m_missRadiance = Radiance3::zero();
+
+	/** CPU copy of the six faces of the scene's skybox, in CubeFace order, with its read
+		encoding applied. Empty when the scene has no skybox. */
+	Array<Radiance3>                    m_skyboxFaces[6];
+	int                                 m_skyboxSize = 0;
+
+	/** See IrradianceField::m_probeOffsets */
+	Array<Vector3>                      m_probeOffsets;
+
+	shared_ptr<Scene>                   m_scene;
+	shared_ptr<TriTree>                 m_sceneTriTree;
+
+	Random                              m_random;
+
+	ProbeRayGenerator                   m_rayGenerator;
+
+	/** probeCount() * raysPerProbe, one row of rays per probe (same order as m_irradianceRayOrigins) */
+	Array<Ray>                          m_rays;
+	Array<TriTree::Hit>                 m_rayHits;
+	Array<Radiance3>                    m_rayHitRadiance;
+
+	/** Probe-to-hit distance after the normal bump, clamped to m_maxDistance. */
+	Array<float>                        m_rayHitDistance;
+
+	int                                 m_irradianceWidth = 0;
+	int                                 m_irradianceHeight = 0;
+	int                                 m_depthWidth = 0;
+	int                                 m_depthHeight = 0;
+
+	/** Same layout as IrradianceField::m_irradianceProbes, row-major starting at texture row 0 */
+	Array<Radiance3>                    m_irradianceAtlas;
+
+	/** Same layout as IrradianceField::m_meanDistProbes */
+	Array<Vector2>                      m_meanDistAtlas;
+
+	bool                                m_firstFrame = true;
+
+	Timing                              m_timing;
+
+	IrradianceFieldCPU();
+
+	void init(const IrradianceField::Specification& spec, float maxDistance);
+
+	Point3 probeIndexToPosition(int index) const;
+
+	Point3int32 probeIndexToGridIndex(int index) const;
+
+	Point2int32 probeAtlasCoord(const Point3int32& gridCoord) const {
+		return ProbeMath::probeAtlasCoord(gridCoord, m_specification.probeCounts, m_probeAtlasSlicesPerRow);
+	}
+
+	/** Bilinear fetch with the same addressing as a GL texture(), clamped to the edge */
+	template<class T>
+	static T bilinearFetch(const Array<T>& atlas, int width, int height, const Point2& texCoord);
+
+	/** Radiance arriving at a surfel, matching the direct term of GIRenderer_DeferredShade.pix */
+	Radiance3 shadeDirect(const shared_ptr<Surfel>& surfel, const Vector3& w_o) const;
+
+	/** Reads the faces of the "skybox" entity of m_scene, if there is one */
+	void readSkybox();
+
+	/** Radiance of a ray that leaves the scene, matching IrradianceField_ShadeRayMisses.pix */
+	Radiance3 missRadiance(const Vector3& direction) const;
+
+public:
+
+	static shared_ptr<IrradianceFieldCPU> create
+	   (const IrradianceField::Specification& spec,
+		float                                 maxDistance,
+		const shared_ptr<Scene>&              scene);
+
+	/** Creates an engine with the same specification and scene that IrradianceField::create would
+		use for \a sceneName. Reads the skybox for misses, so this requires a GL context. */
+	static shared_ptr<IrradianceFieldCPU> create
+	   (const String&                         sceneName,
+		const shared_ptr<Scene>&              scene);
+
+	/** Creates an engine with the specification, maximum distance and probe offsets of \a field,
+		so that its atlases can be compared with those of \a field texel for texel */
+	static shared_ptr<IrradianceFieldCPU> create
+	   (const shared_ptr<IrradianceField>&    field,
+		const shared_ptr<Scene>&              scene);
+
+	/** Copies the current relocation offsets of \a field, which must have the same probe counts */
+	void copyProbeOffsets(const IrradianceField& field);
+
+	/** Rebuilds the ray tracing acceleration structure and reads the skybox */
+	void onSceneChanged(const shared_ptr<Scene>& scene);
+
+	/** Radiance of the misses in scenes without a skybox */
+	void setMissRadiance(const Radiance3& L) {
+		m_missRadiance = L;
+	}
+
+	/** Seed for the per-frame random ray orientation, for reproducible runs */
+	void setRandomSeed(uint32 seed) {
+		m_random.reset(seed);
+	}
+
+	/** Runs all stages once: generateRays, traceAndShadeRays, updateProbes */
+	void update();
+
+	void generateRays();
+
+	void traceAndShadeRays();
+
+	void updateProbes();
+
+	/** Irradiance incident on a surface, reconstructed from the current atlases with the
+		same probe cage weighting as sampleIrradianceField() in IrradianceFieldSampling.glsl (before energyPreservation and the 2 pi scale) */
+	Irradiance3 sampleIrradiance(const Point3& wsPosition, const Vector3& wsN, const Vector3& w_o) const;
+
+	int probeCount() const {
+		return m_specification.probeCounts.x * m_specification.probeCounts.y * m_specification.probeCounts.z;
+	}
+
+	int raysPerProbe() const {
+		return m_specification.irradianceRaysPerProbe;
+	}
+
+	const IrradianceField::Specification& specification() const {
+		return m_specification;
+	}
+
+	const Timing& lastTiming() const {
+		return m_timing;
+	}
+
+	/** Copies the irradiance atlas into a buffer of format RGB32F that can be uploaded to IrradianceField::m_irradianceProbes */
+	shared_ptr<CPUPixelTransferBuffer> irradianceBuffer() const;
+
+	/** Copies the mean/mean^2 distance atlas into a buffer of format RG32F */
+	shared_ptr<CPUPixelTransferBuffer> meanDistBuffer() const;
+};
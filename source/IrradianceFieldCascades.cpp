@@ -0,0 +1,146 @@
+#include "IrradianceFieldCascades.h"
+
+shared_ptr<IrradianceFieldCascades> IrradianceFieldCascades::create
+   (const String&            sceneName,
+	const shared_ptr<Scene>& scene,
+	int                      cascadeCount,
+	Vector3int32             probeCounts,
+	float                    finestProbeSpacing)
+{
+	alwaysAssertM((cascadeCount >= 1) && (cascadeCount <= maxCascadeCount), format("Between 1 and %d cascades are supported", maxCascadeCount));
+	alwaysAssertM((probeCounts.x >= 2) && (probeCounts.y >= 2) && (probeCounts.z >= 2), "Cascades need at least 2 probes along each axis to have a probe spacing");
+
+	if (finestProbeSpacing <= 0.0f)
+	{
+		bool encloseScene = false;
+		const IrradianceField::Specification& spec = IrradianceField::loadSpecification(sceneName, scene, encloseScene, Vector3int32(-1, -1, -1), -1.0f);
+		Point3 probeStartPosition;
+		Vector3 probeStep;
+		IrradianceField::computeProbeGrid(spec, probeStartPosition, probeStep);
+		finestProbeSpacing = max(probeStep.min(), 0.01f);
+	}
+
+	const shared_ptr<IrradianceFieldCascades>& cascades = createShared<IrradianceFieldCascades>();
+	float spacing = finestProbeSpacing;
+	for (int i = 0; i < cascadeCount; ++i)
+	{
+		const shared_ptr<IrradianceField>& field = createShared<IrradianceField>();
+		field->loadNewCascade(sceneName, scene, probeCounts, spacing);
+		field->m_name = format("Irradiance Field Cascade %d", i);
+		if (i > 0)
+		{
+			field->shareSceneTriTrees(cascades->m_cascades[0]);
+		}
+
+		cascades->m_cascades.append(field);
+		spacing *= 2.0f;
+	}
+
+	return cascades;
+}
+
+void IrradianceFieldCascades::setViewerPosition(const Point3& P)
+{
+	for (const shared_ptr<IrradianceField>& field : m_cascades)
+	{
+		field->setViewerPosition(P);
+	}
+}
+
+void IrradianceFieldCascades::onGraphics3D(RenderDevice* rd, const Array<shared_ptr<Surface>>& surfaceArray)
+{
+	// Every cascade traces the trees of cascade 0, so all traces still running must finish before it rebuilds them
+	for (const shared_ptr<IrradianceField>& field : m_cascades)
+	{
+		field->finishAsyncTrace();
+	}
+
+	// Cascade 0 owns the scene trees, so it rebuilds them before the others trace
+	for (const shared_ptr<IrradianceField>& field : m_cascades)
+	{
+		field->onGraphics3D(rd, surfaceArray);
+	}
+}
+
+void IrradianceFieldCascades::onSceneChanged(const shared_ptr<Scene>& scene)
+{
+	for (const shared_ptr<IrradianceField>& field : m_cascades)
+	{
+		field->onSceneChanged(scene);
+	}
+}
+
+void IrradianceFieldCascades::setShaderArgs(UniformTable& args) const
+{
+	m_cascades[0]->setShaderArgs(args, "irradianceFieldSurface.");
+	for (int i = 1; i < m_cascades.size(); ++i)
+	{
+		m_cascades[i]->setShaderArgs(args, format("irradianceFieldCascade%d.", i));
+	}
+
+	args.setMacro("CASCADE_COUNT", m_cascades.size());
+	if (m_cascades.size() > 1)
+	{
+		args.setUniform("cascadeBlendCells", m_blendCells);
+	}
+}
+
+void IrradianceFieldCascades::debugDraw() const
+{
+	m_cascades[0]->debugDraw();
+	for (int i = 1; i < m_cascades.size(); ++i)
+	{
+		::debugDraw(std::make_shared<BoxShape>(Box(m_cascades[i]->probeBounds())), 0.0f, Color4::clear(),
+			IrradianceField::probeCoordVisualizationColor(Point3int32(i, i + 1, i + 2)));
+	}
+}
+
+int IrradianceFieldCascades::probeCount() const
+{
+	int count = 0;
+	for (const shared_ptr<IrradianceField>& field : m_cascades)
+	{
+		count += field->probeCount();
+	}
+	return count;
+}
+
+int IrradianceFieldCascades::activeProbeCount() const
+{
+	int count = 0;
+	for (const shared_ptr<IrradianceField>& field : m_cascades)
+	{
+		count += field->activeProbeCount();
+	}
+	return count;
+}
+
+int IrradianceFieldCascades::scheduledProbeCount() const
+{
+	int count = 0;
+	for (const shared_ptr<IrradianceField>& field : m_cascades)
+	{
+		count += field->scheduledProbeCount();
+	}
+	return count;
+}
+
+int IrradianceFieldCascades::convergedProbeCount() const
+{
+	int count = 0;
+	for (const shared_ptr<IrradianceField>& field : m_cascades)
+	{
+		count += field->convergedProbeCount();
+	}
+	return count;
+}
+
+int IrradianceFieldCascades::invalidatedProbeCount() const
+{
+	int count = 0;
+	for (const shared_ptr<IrradianceField>& field : m_cascades)
+	{
+		count += field->invalidatedProbeCount();
+	}
+	return count;
+}
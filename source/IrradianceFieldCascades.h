@@ -0,0 +1,82 @@
+#pragma once
+#include <G3D/G3D.h>
+#include "IrradianceField.h"
+
+/**
+	Nested irradiance fields centered on the viewer, for scenes too large for one grid at a useful
+	probe density. Every cascade has the same probe counts; cascade 0 is the finest and each
+	coarser cascade doubles the probe spacing.
+
+	The cascades follow the viewer by whole probe cells (IrradianceField::scrollTo). Their atlases
+	are addressed toroidally, so a scroll only resets and retraces the planes of probes that wrap
+	around to the newly exposed side; the other probes keep their converged values. All cascades
+	trace against the scene trees of cascade 0, on its WorkStealingPool; their asynchronous traces
+	queue on the pool instead of competing for the cores.
+
+	GIRenderer_ComputeIndirect.pix shades each pixel with the finest cascade that covers it, blended
+	into the next coarser one over the outer m_blendCells probe spacings of the finer grid.
+*/
+class IrradianceFieldCascades : public ReferenceCountedObject
+{
+public:
+
+	/** Number of irradianceFieldCascade uniforms in GIRenderer_ComputeIndirect.pix, plus one */
+	static const int maxCascadeCount = 4;
+
+protected:
+
+	/** Finest first */
+	Array<shared_ptr<IrradianceField>>  m_cascades;
+
+	/** Width of the band at the boundary of each cascade that blends into the next coarser one, in probe spacings of the finer cascade */
+	float                               m_blendCells = 2.0f;
+
+	IrradianceFieldCascades() {}
+
+public:
+
+	/** \a finestProbeSpacing <= 0 uses the smallest probe spacing of the scene's default single grid */
+	static shared_ptr<IrradianceFieldCascades> create
+	(const String&            sceneName,
+	 const shared_ptr<Scene>& scene,
+	 int                      cascadeCount       = 3,
+	 Vector3int32             probeCounts        = Vector3int32(16, 8, 16),
+	 float                    finestProbeSpacing = -1.0f);
+
+	int cascadeCount() const {
+		return m_cascades.size();
+	}
+
+	const shared_ptr<IrradianceField>& cascade(int i) const {
+		return m_cascades[i];
+	}
+
+	float blendCells() const {
+		return m_blendCells;
+	}
+
+	void setBlendCells(float cells) {
+		m_blendCells = max(cells, 0.01f);
+	}
+
+	/** Call before onGraphics3D; the cascades scroll to center on \a P */
+	void setViewerPosition(const Point3& P);
+
+	/** Updates every cascade, finest first. The surfaceArray is only used to find the skybox. */
+	void onGraphics3D(RenderDevice* rd, const Array<shared_ptr<Surface>>& surfaceArray);
+
+	void onSceneChanged(const shared_ptr<Scene>& scene);
+
+	/** Binds cascade 0 as irradianceFieldSurface and cascade i as irradianceFieldCascade<i>, and sets CASCADE_COUNT */
+	void setShaderArgs(UniformTable& args) const;
+
+	/** Draws the probes of the finest cascade and the bounds of the others */
+	void debugDraw() const;
+
+	/** Sums over the cascades */
+	int probeCount() const;
+	int activeProbeCount() const;
+	int scheduledProbeCount() const;
+	int convergedProbeCount() const;
+	int invalidatedProbeCount() const;
+};
@@ -0,0 +1,368 @@
+#include "ProbeAtlasCompression.h"
+
+namespace ProbeAtlasCompression
+{
+
+uint16 floatToHalf(float f)
+{
+	uint32 x;
+	System::memcpy(&x, &f, sizeof(x));
+	const uint32 sign = (x >> 16) & 0x8000;
+	x &= 0x7FFFFFFF;
+
+	if (x >= 0x7F800000)
+	{
+		// Infinity or NaN
+		return uint16(sign | 0x7C00 | ((x > 0x7F800000) ? 0x200 : 0));
+	}
+	if (x >= 0x477FF000)
+	{
+		// Rounds to 65520 or more
+		return uint16(sign | 0x7C00);
+	}
+	if (x < 0x38800000)
+	{
+		// Subnormal: below 2^-14 the spacing is exactly 2^-24
+		float magnitude;
+		System::memcpy(&magnitude, &x, sizeof(magnitude));
+		return uint16(sign | uint32(nearbyintf(magnitude * 16777216.0f)));
+	}
+
+	uint32 h = ((((x >> 23) - 127 + 15)) << 10) | ((x & 0x7FFFFF) >> 13);
+	const uint32 remainder = x & 0x1FFF;
+	if ((remainder > 0x1000) || ((remainder == 0x1000) && (h & 1)))
+	{
+		// Carries into the exponent when the mantissa overflows
+		++h;
+	}
+	return uint16(sign | h);
+}
+
+float halfToFloat(uint16 h)
+{
+	const uint32 sign = uint32(h & 0x8000) << 16;
+	const uint32 exponent = (h >> 10) & 0x1F;
+	const uint32 mantissa = h & 0x3FF;
+
+	uint32 x;
+	if (exponent == 0)
+	{
+		const float magnitude = float(mantissa) / 16777216.0f;
+		System::memcpy(&x, &magnitude, sizeof(x));
+		x |= sign;
+	}
+	else if (exponent == 31)
+	{
+		x = sign | 0x7F800000 | (mantissa << 13);
+	}
+	else
+	{
+		x = sign | ((exponent - 15 + 127) << 23) | (mantissa << 13);
+	}
+
+	float f;
+	System::memcpy(&f, &x, sizeof(f));
+	return f;
+}
+
+/** Mode bits of the one-region, 10-bit endpoint, untransformed mode (mode 11 in the D3D documentation) */
+static const uint32 bc6hMode11 = 0x03;
+
+static const int endpointBits = 10;
+
+/** Interpolation weights of 4-bit indices, out of 64 */
+static const int s_weights[16] = { 0, 4, 9, 13, 17, 21, 26, 30, 34, 38, 43, 47, 51, 55, 60, 64 };
+
+/** Expands an endpoint to the 16-bit interpolation domain (BC6H unsigned unquantize) */
+static int unquantize(int endpoint)
+{
+	if (endpoint == 0)
+	{
+		return 0;
+	}
+	if (endpoint == (1 << endpointBits) - 1)
+	{
+		return 0xFFFF;
+	}
+	return ((endpoint << 16) + 0x8000) >> endpointBits;
+}
+
+static int interpolate(int a, int b, int weight)
+{
+	return (a * (64 - weight) + b * weight + 32) >> 6;
+}
+
+/** Interpolated value to half bits (BC6H unsigned finish_unquantize) */
+static uint16 finishUnquantize(int v)
+{
+	return uint16((v * 31) >> 6);
+}
+
+/** Inverse of finishUnquantize. Interpolation is linear in this domain, which is close to logarithmic in radiance. */
+static float toInterpolationDomain(uint16 h)
+{
+	return float(h) * (64.0f / 31.0f);
+}
+
+/** Nearest endpoint to \a u, inverting unquantize */
+static int quantizeEndpoint(float u)
+{
+	return iClamp(iRound((u - 32.0f) / 64.0f), 0, (1 << endpointBits) - 1);
+}
+
+static void quantizeEndpoints(const Vector3& e0, const Vector3& e1, int endpoint[2][3])
+{
+	for (int c = 0; c < 3; ++c)
+	{
+		endpoint[0][c] = quantizeEndpoint(e0[c]);
+		endpoint[1][c] = quantizeEndpoint(e1[c]);
+	}
+}
+
+/** Chooses the nearest palette entry for every texel. Returns the summed squared error in the interpolation domain. */
+static float assignIndices(const Vector3 u[16], const int endpoint[2][3], int index[16])
+{
+	Vector3 palette[16];
+	for (int i = 0; i < 16; ++i)
+	{
+		for (int c = 0; c < 3; ++c)
+		{
+			palette[i][c] = float(interpolate(unquantize(endpoint[0][c]), unquantize(endpoint[1][c]), s_weights[i]));
+		}
+	}
+
+	float error = 0.0f;
+	for (int t = 0; t < 16; ++t)
+	{
+		float best = finf();
+		for (int i = 0; i < 16; ++i)
+		{
+			const float d = (palette[i] - u[t]).squaredLength();
+			if (d < best)
+			{
+				best = d;
+				index[t] = i;
+			}
+		}
+		error += best;
+	}
+	return error;
+}
+
+static void writeBits(uint8* block, int& position, uint32 value, int count)
+{
+	for (int i = 0; i < count; ++i, ++position)
+	{
+		block[position >> 3] |= uint8(((value >> i) & 1) << (position & 7));
+	}
+}
+
+static uint32 readBits(const uint8* block, int& position, int count)
+{
+	uint32 value = 0;
+	for (int i = 0; i < count; ++i, ++position)
+	{
+		value |= uint32((block[position >> 3] >> (position & 7)) & 1) << i;
+	}
+	return value;
+}
+
+/** Fits one line segment to the 16 texels \a u, given in the interpolation domain */
+static void encodeBlock(const Vector3 u[16], uint8* block)
+{
+	Vector3 mean = Vector3::zero();
+	for (int t = 0; t < 16; ++t)
+	{
+		mean += u[t];
+	}
+	mean /= 16.0f;
+
+	// Principal axis by power iteration on the covariance
+	float xx = 0.0f, xy = 0.0f, xz = 0.0f, yy = 0.0f, yz = 0.0f, zz = 0.0f;
+	for (int t = 0; t < 16; ++t)
+	{
+		const Vector3& d = u[t] - mean;
+		xx += d.x * d.x; xy += d.x * d.y; xz += d.x * d.z;
+		yy += d.y * d.y; yz += d.y * d.z; zz += d.z * d.z;
+	}
+
+	Vector3 axis(1.0f, 1.0f, 1.0f);
+	for (int i = 0; i < 8; ++i)
+	{
+		const Vector3 next(xx * axis.x + xy * axis.y + xz * axis.z,
+			xy * axis.x + yy * axis.y + yz * axis.z,
+			xz * axis.x + yz * axis.y + zz * axis.z);
+		const float length = next.length();
+		if (length < 1e-6f)
+		{
+			// Constant block
+			break;
+		}
+		axis = next / length;
+	}
+	axis = axis.direction();
+
+	float tMin = finf(), tMax = -finf();
+	for (int t = 0; t < 16; ++t)
+	{
+		const float p = (u[t] - mean).dot(axis);
+		tMin = min(tMin, p);
+		tMax = max(tMax, p);
+	}
+
+	int endpoint[2][3];
+	int index[16];
+	quantizeEndpoints(mean + axis * tMin, mean + axis * tMax, endpoint);
+	float error = assignIndices(u, endpoint, index);
+
+	// Least-squares endpoints for those indices
+	{
+		float aa = 0.0f, ab = 0.0f, bb = 0.0f;
+		Vector3 ap = Vector3::zero(), bp = Vector3::zero();
+		for (int t = 0; t < 16; ++t)
+		{
+			const float b = float(s_weights[index[t]]) / 64.0f;
+			const float a = 1.0f - b;
+			aa += a * a; ab += a * b; bb += b * b;
+			ap += u[t] * a;
+			bp += u[t] * b;
+		}
+
+		const float det = aa * bb - ab * ab;
+		if (abs(det) > 1e-6f)
+		{
+			int refinedEndpoint[2][3];
+			int refinedIndex[16];
+			quantizeEndpoints((ap * bb - bp * ab) / det, (bp * aa - ap * ab) / det, refinedEndpoint);
+			const float refinedError = assignIndices(u, refinedEndpoint, refinedIndex);
+			if (refinedError < error)
+			{
+				System::memcpy(endpoint, refinedEndpoint, sizeof(endpoint));
+				System::memcpy(index, refinedIndex, sizeof(index));
+			}
+		}
+	}
+
+	// The first index is stored without its high bit, which must therefore be zero
+	if (index[0] >= 8)
+	{
+		for (int c = 0; c < 3; ++c)
+		{
+			std::swap(endpoint[0][c], endpoint[1][c]);
+		}
+		for (int t = 0; t < 16; ++t)
+		{
+			index[t] = 15 - index[t];
+		}
+	}
+
+	System::memset(block, 0, bc6hBlockBytes);
+	int position = 0;
+	writeBits(block, position, bc6hMode11, 5);
+	for (int e = 0; e < 2; ++e)
+	{
+		for (int c = 0; c < 3; ++c)
+		{
+			writeBits(block, position, uint32(endpoint[e][c]), endpointBits);
+		}
+	}
+	for (int t = 0; t < 16; ++t)
+	{
+		writeBits(block, position, uint32(index[t]), (t == 0) ? 3 : 4);
+	}
+}
+
+void encodeBC6H(const Color3* texels, int width, int height, Array<uint8>& blocks)
+{
+	const int blocksX = (width + 3) / 4;
+	const int blocksY = (height + 3) / 4;
+	blocks.resize(int(bc6hBytes(width, height)));
+
+	runConcurrently(0, blocksY, [&](int by) {
+		for (int bx = 0; bx < blocksX; ++bx)
+		{
+			// Partial blocks at the right and bottom edges repeat the last texel
+			Vector3 u[16];
+			for (int t = 0; t < 16; ++t)
+			{
+				const int x = min(bx * 4 + (t & 3), width - 1);
+				const int y = min(by * 4 + (t >> 2), height - 1);
+				const Color3& c = texels[y * width + x];
+				for (int i = 0; i < 3; ++i)
+				{
+					const float v = isNaN(c[i]) ? 0.0f : clamp(c[i], 0.0f, 65504.0f);
+					u[t][i] = toInterpolationDomain(floatToHalf(v));
+				}
+			}
+
+			encodeBlock(u, blocks.getCArray() + (by * blocksX + bx) * bc6hBlockBytes);
+		}
+	});
+}
+
+void decodeBC6H(const uint8* blocks, int width, int height, Array<Color3>& texels)
+{
+	const int blocksX = (width + 3) / 4;
+	const int blocksY = (height + 3) / 4;
+	texels.resize(width * height);
+
+	for (int by = 0; by < blocksY; ++by)
+	{
+		for (int bx = 0; bx < blocksX; ++bx)
+		{
+			const uint8* block = blocks + (by * blocksX + bx) * bc6hBlockBytes;
+			int position = 0;
+			const bool supported = (readBits(block, position, 5) == bc6hMode11);
+
+			int endpoint[2][3];
+			for (int e = 0; e < 2; ++e)
+			{
+				for (int c = 0; c < 3; ++c)
+				{
+					endpoint[e][c] = int(readBits(block, position, endpointBits));
+				}
+			}
+
+			for (int t = 0; t < 16; ++t)
+			{
+				const int index = int(readBits(block, position, (t == 0) ? 3 : 4));
+				const int x = bx * 4 + (t & 3);
+				const int y = by * 4 + (t >> 2);
+				if ((x >= width) || (y >= height))
+				{
+					continue;
+				}
+
+				Color3& texel = texels[y * width + x];
+				for (int c = 0; c < 3; ++c)
+				{
+					texel[c] = supported ?
+						halfToFloat(finishUnquantize(interpolate(unquantize(endpoint[0][c]), unquantize(endpoint[1][c]), s_weights[index]))) : 0.0f;
+				}
+			}
+		}
+	}
+}
+
+void encodeMoments(const Vector2* moments, int count, float maxDistance, Array<uint16>& encoded)
+{
+	const Vector2& scale = momentScale(maxDistance);
+	encoded.resize(2 * count);
+	for (int i = 0; i < count; ++i)
+	{
+		encoded[2 * i] = uint16(iRound(clamp(moments[i].x / scale.x, 0.0f, 1.0f) * 65535.0f));
+		encoded[2 * i + 1] = uint16(iRound(clamp(moments[i].y / scale.y, 0.0f, 1.0f) * 65535.0f));
+	}
+}
+
+void decodeMoments(const uint16* encoded, int count, float maxDistance, Array<Vector2>& moments)
+{
+	const Vector2& scale = momentScale(maxDistance);
+	moments.resize(count);
+	for (int i = 0; i < count; ++i)
+	{
+		moments[i] = Vector2(float(encoded[2 * i]), float(encoded[2 * i + 1])) * scale / 65535.0f;
+	}
+}
+
+}
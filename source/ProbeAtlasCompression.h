@@ -0,0 +1,52 @@
+#pragma once
+#include <G3D/G3D.h>
+
+#ifndef GL_COMPRESSED_RGB_BPTC_UNSIGNED_FLOAT
+#   define GL_COMPRESSED_RGB_BPTC_UNSIGNED_FLOAT 0x8E8F
+#endif
+
+/**
+	CPU encoders for compact copies of the probe atlases, which the shading passes can sample
+	instead of the atlases that the probe updates write.
+
+	Irradiance is stored as BC6H (BPTC unsigned float), 8 bits per texel. The encoder only emits
+	mode 11: one line segment per 4x4 block with 10-bit endpoints and 4-bit indices. Probe
+	irradiance varies smoothly across a tile, so the partitioned modes gain little, and fitting
+	one line keeps the encoder fast enough to run when a probe cache is saved.
+
+	Distance moments are stored as RG16 unorm: mean / maxDistance and mean² / maxDistance².
+	The shader multiplies them back by momentScale() (IrradianceField::depthMomentScale).
+*/
+namespace ProbeAtlasCompression
+{
+	static const int    bc6hBlockBytes = 16;
+
+	/** Number of bytes of BC6H blocks covering a width x height image */
+	inline size_t bc6hBytes(int width, int height)
+	{
+		return size_t((width + 3) / 4) * size_t((height + 3) / 4) * bc6hBlockBytes;
+	}
+
+	/** IEEE 754 binary16 with round to nearest even; out-of-range values become infinity */
+	uint16 floatToHalf(float f);
+
+	float halfToFloat(uint16 h);
+
+	/** Encodes row-major \a texels into BC6H blocks in row-major block order, as glCompressedTexImage2D
+		expects. Negative values clamp to zero and values above the half range to the largest half. */
+	void encodeBC6H(const Color3* texels, int width, int height, Array<uint8>& blocks);
+
+	/** Decodes BC6H blocks of the mode encodeBC6H writes. Blocks of other modes decode to zero. */
+	void decodeBC6H(const uint8* blocks, int width, int height, Array<Color3>& texels);
+
+	/** Multiplier that restores (mean, mean²) from RG16 unorm moments */
+	inline Vector2 momentScale(float maxDistance)
+	{
+		return Vector2(maxDistance, square(maxDistance));
+	}
+
+	/** Quantizes \a count (mean, mean²) pairs to RG16 unorm, interleaved */
+	void encodeMoments(const Vector2* moments, int count, float maxDistance, Array<uint16>& encoded);
+
+	void decodeMoments(const uint16* encoded, int count, float maxDistance, Array<Vector2>& moments);
+}
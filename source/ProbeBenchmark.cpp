@@ -0,0 +1,751 @@
+#include "ProbeBenchmark.h"
+#include "IrradianceField.h"
+#include "IrradianceFieldCPU.h"
+#include "ProbeAtlasCompression.h"
+#include "ProbeMath.h"
+#include "ProbeRayGenerator.h"
+#include "ProbeRayTracer.h"
+#ifdef G3D_WINDOWS
+#   include <windows.h>
+#   include <psapi.h>
+#else
+#   include <sys/resource.h>
+#endif
+
+void ProbeBenchmark::addRow(const String& filename, const String& header, const String& row)
+{
+	bool created = false;
+	Array<String>& rows = m_csvFiles.getCreate(filename, created);
+	if (created)
+	{
+		rows.append(header);
+	}
+	rows.append(row);
+	consolePrintf("%s: %s\n", filename.c_str(), row.c_str());
+}
+
+/** Average wall-clock time of \a f in milliseconds */
+static double averageMilliseconds(int iterations, const std::function<void()>& f)
+{
+	const RealTime start = System::time();
+	for (int i = 0; i < iterations; ++i)
+	{
+		f();
+	}
+	return 1000.0 * (System::time() - start) / double(iterations);
+}
+
+void ProbeBenchmark::benchmarkSceneTriTrees(const String& sceneName, const shared_ptr<Scene>& scene, int iterations)
+{
+	const shared_ptr<TriTree>& fullTree = TriTree::create(true);
+	const double fullRebuildMs = averageMilliseconds(iterations, [&]() { fullTree->setContents(scene); });
+
+	Array<shared_ptr<VisibleEntity>> entities;
+	IrradianceField::getModelEntities(scene, false, entities);
+	Array<shared_ptr<VisibleEntity>> dynamicEntities;
+	IrradianceField::getModelEntities(scene, true, dynamicEntities);
+	entities.append(dynamicEntities);
+
+	// Treat each entity in turn as the only one that moves
+	for (const shared_ptr<VisibleEntity>& moving : entities)
+	{
+		Array<shared_ptr<VisibleEntity>> staticEntities = entities;
+		staticEntities.fastRemove(staticEntities.findIndex(moving));
+
+		Array<shared_ptr<Surface>> staticSurfaces, dynamicSurfaces;
+		const shared_ptr<TriTree>& staticTree = TriTree::create(true);
+		const shared_ptr<TriTree>& dynamicTree = TriTree::create(true);
+
+		const double staticBuildMs = averageMilliseconds(iterations, [&]() {
+			IrradianceField::poseEntities(staticEntities, staticSurfaces);
+			staticTree->setContents(staticSurfaces);
+		});
+
+		// The per-frame cost when the entity moves
+		const double dynamicRebuildMs = averageMilliseconds(iterations, [&]() {
+			IrradianceField::poseEntities(Array<shared_ptr<VisibleEntity>>(moving), dynamicSurfaces);
+			dynamicTree->setContents(dynamicSurfaces);
+		});
+
+		addRow("benchmark-tritree.csv",
+			"scene,movingEntity,totalTris,movingTris,fullRebuildMs,staticBuildMs,dynamicRebuildMs,speedup",
+			format("\"%s\",\"%s\",%d,%d,%.3f,%.3f,%.3f,%.2f",
+				sceneName.c_str(), moving->name().c_str(), fullTree->size(), dynamicTree->size(),
+				fullRebuildMs, staticBuildMs, dynamicRebuildMs, fullRebuildMs / max(dynamicRebuildMs, 1e-6)));
+	}
+}
+
+void ProbeBenchmark::benchmarkProbeIndexMath(const Array<Vector3int32>& probeCountsArray, int iterations)
+{
+	for (const Vector3int32& probeCounts : probeCountsArray)
+	{
+		const int probeCount = probeCounts.x * probeCounts.y * probeCounts.z;
+		const int planeCount = probeCounts.x * probeCounts.y;
+		const ProbeMath::FastDivisor xDivisor(probeCounts.x);
+		const ProbeMath::FastDivisor xyDivisor(planeCount);
+
+		for (int index = 0; index < probeCount; ++index)
+		{
+			const Point3int32 expected(index % probeCounts.x, (index % planeCount) / probeCounts.x, index / planeCount);
+			alwaysAssertM(ProbeMath::probeIndexToGridCoord(index, xDivisor, xyDivisor) == expected, "FastDivisor mismatch");
+		}
+
+		// Accumulated so that the loops cannot be optimized away
+		int checksum = 0;
+
+		const double divisionMs = averageMilliseconds(iterations, [&]() {
+			for (int index = 0; index < probeCount; ++index)
+			{
+				checksum += (index % probeCounts.x) + (index % planeCount) / probeCounts.x + index / planeCount;
+			}
+		});
+
+		const double fastDivisorMs = averageMilliseconds(iterations, [&]() {
+			for (int index = 0; index < probeCount; ++index)
+			{
+				const Point3int32 P = ProbeMath::probeIndexToGridCoord(index, xDivisor, xyDivisor);
+				checksum += P.x + P.y + P.z;
+			}
+		});
+
+		// Only correct for power-of-two counts; timed for every count for comparison
+		const int xShift = highestBit(uint32(probeCounts.x));
+		const int xyShift = highestBit(uint32(planeCount));
+		const double maskMs = averageMilliseconds(iterations, [&]() {
+			for (int index = 0; index < probeCount; ++index)
+			{
+				checksum += (index & (probeCounts.x - 1)) + ((index & (planeCount - 1)) >> xShift) + (index >> xyShift);
+			}
+		});
+
+		const double nsPerIndex = 1e6 / double(max(probeCount, 1));
+		addRow("benchmark-index-math.csv",
+			"probeCountX,probeCountY,probeCountZ,isPow2,divisionNs,maskNs,fastDivisorNs,checksum",
+			format("%d,%d,%d,%d,%.4f,%.4f,%.4f,%d",
+				probeCounts.x, probeCounts.y, probeCounts.z, isPow2(probeCount) ? 1 : 0,
+				divisionMs * nsPerIndex, maskMs * nsPerIndex, fastDivisorMs * nsPerIndex, checksum));
+	}
+}
+
+void ProbeBenchmark::benchmarkProbeTracing(const String& sceneName, const shared_ptr<Scene>& scene, const Vector3int32& probeCounts, int raysPerProbe, int iterations)
+{
+	const shared_ptr<TriTree>& tree = TriTree::create(true);
+	tree->setContents(scene);
+	const shared_ptr<TriTree>& emptyTree = TriTree::create(true);
+
+	// Probe lattice filling the scene bounds, as IrradianceField places it
+	const AABox& bounds = ProbeRayTracer::bounds(tree);
+	const Vector3& step = bounds.extent() / Vector3(probeCounts - Vector3int32(1, 1, 1)).max(Vector3(1, 1, 1));
+	Array<Point3> probePositions;
+	for (int z = 0; z < probeCounts.z; ++z)
+	{
+		for (int y = 0; y < probeCounts.y; ++y)
+		{
+			for (int x = 0; x < probeCounts.x; ++x)
+			{
+				probePositions.append(bounds.low() + step * Vector3(float(x), float(y), float(z)));
+			}
+		}
+	}
+
+	ProbeRayGenerator generator;
+	generator.setRaysPerProbe(raysPerProbe);
+	generator.setOrientation(Matrix3::identity());
+
+	const int rayCount = probePositions.size() * raysPerProbe;
+	Array<Vector4> origins, directions;
+	origins.resize(rayCount);
+	directions.resize(rayCount);
+	generator.writeRays(probePositions, origins.getCArray(), directions.getCArray());
+
+	Array<RayHitRecord> records;
+	Array<Vector4> positions, normals;
+	records.resize(rayCount);
+	positions.resize(rayCount);
+	normals.resize(rayCount);
+
+	ProbeRayTracer::Output output;
+	output.records = records.getCArray();
+	output.positions = positions.getCArray();
+	output.normals = normals.getCArray();
+
+	const String& header = "scene,probes,raysPerProbe,threads,packetWidth,ms,megaraysPerSecond,speedup,steals";
+
+	// Baseline: one flat list of rays on runConcurrently, doing the same intersection and surfel sampling per ray
+	const double flatMs = averageMilliseconds(iterations, [&]() {
+		runConcurrently(0, rayCount, [&](int r) {
+			TriTree::Hit hit;
+			if (tree->intersectRay(Ray::fromOriginAndDirection(origins[r].xyz(), directions[r].xyz(), origins[r].w, directions[r].w), hit))
+			{
+				shared_ptr<Surfel> surfel;
+				tree->sample(hit, surfel);
+				positions[r] = Vector4(surfel->position, 1.0f);
+			}
+		});
+	});
+	addRow("benchmark-probe-tracing.csv", header,
+		format("\"%s\",%d,%d,%d,0,%.3f,%.3f,1.00,0", sceneName.c_str(), probePositions.size(), raysPerProbe,
+			System::numCores(), flatMs, double(rayCount) / (flatMs * 1000.0)));
+
+	// Scaling from 1 to N cores, with and without packets
+	Array<int> threadCounts;
+	for (int threads = 1; threads < System::numCores(); threads *= 2)
+	{
+		threadCounts.append(threads);
+	}
+	threadCounts.append(System::numCores());
+
+	for (const int threads : threadCounts)
+	{
+		for (const int packetWidth : { 1, 8, 16 })
+		{
+			ProbeRayTracer tracer(threads);
+			tracer.setPacketWidth(packetWidth);
+			const double ms = averageMilliseconds(iterations, [&]() {
+				tracer.trace(tree, emptyTree, origins.getCArray(), directions.getCArray(), raysPerProbe, probePositions.size(), output);
+			});
+
+			addRow("benchmark-probe-tracing.csv", header,
+				format("\"%s\",%d,%d,%d,%d,%.3f,%.3f,%.2f,%d", sceneName.c_str(), probePositions.size(), raysPerProbe,
+					threads, packetWidth, ms, double(rayCount) / (ms * 1000.0), flatMs / max(ms, 1e-6), tracer.lastStealCount()));
+		}
+	}
+}
+
+/** Rounds to a float with a 5-bit exponent and \a mantissaBits of mantissa, as stored by the half and packed float formats */
+static float quantizeSmallFloat(float x, int mantissaBits)
+{
+	const float largest = (2.0f - ldexpf(1.0f, -mantissaBits)) * 32768.0f;
+	const float magnitude = min(abs(x), largest);
+	if (magnitude == 0.0f)
+	{
+		return 0.0f;
+	}
+
+	// Below the smallest normal the spacing stays that of the smallest exponent
+	int exponent;
+	frexpf(magnitude, &exponent);
+	const float step = ldexpf(1.0f, max(exponent, -13) - 1 - mantissaBits);
+	return sign(x) * min(largest, nearbyintf(magnitude / step) * step);
+}
+
+/** Rounds to \a bits of unsigned normalized fixed point */
+static float quantizeUnorm(float x, int bits)
+{
+	const float levels = float((1 << bits) - 1);
+	return roundf(clamp(x, 0.0f, 1.0f) * levels) / levels;
+}
+
+/** Error of \a decoded against \a reference, over every channel */
+struct EncodingError
+{
+	double rmse = 0.0;
+
+	/** rmse over the root mean square of the reference */
+	double relativeRmse = 0.0;
+
+	double maxError = 0.0;
+
+	EncodingError(const float* reference, const float* decoded, int count)
+	{
+		double squaredError = 0.0, squaredReference = 0.0;
+		for (int i = 0; i < count; ++i)
+		{
+			const double d = double(decoded[i]) - double(reference[i]);
+			squaredError += d * d;
+			squaredReference += double(reference[i]) * double(reference[i]);
+			maxError = G3D::max(maxError, abs(d));
+		}
+		rmse = sqrt(squaredError / double(max(count, 1)));
+		relativeRmse = sqrt(squaredError / G3D::max(squaredReference, 1e-20));
+	}
+};
+
+void ProbeBenchmark::benchmarkAtlasCompression(const String& sceneName, const shared_ptr<IrradianceField>& field)
+{
+	const String& header = "scene,atlas,format,bitsPerTexel,atlasBytes,bytesPerSample,rmse,relativeRmse,maxError,encodeMs";
+
+	// sampleIrradianceField() makes one bilinear fetch from each atlas for each of 8 probes
+	const int texelsPerSample = 8 * 4;
+
+	const auto& addFormatRow = [&](const String& atlas, const String& formatName, double bitsPerTexel, size_t atlasBytes,
+		const EncodingError& error, double encodeMs) {
+		addRow("benchmark-atlas-compression.csv", header,
+			format("\"%s\",%s,%s,%g,%lld,%g,%g,%g,%g,%.2f", sceneName.c_str(), atlas.c_str(), formatName.c_str(), bitsPerTexel,
+				(long long)atlasBytes, texelsPerSample * bitsPerTexel / 8.0, error.rmse, error.relativeRmse, error.maxError, encodeMs));
+	};
+
+	// Irradiance
+	{
+		const shared_ptr<PixelTransferBuffer>& buffer = field->irradianceProbes()->toPixelTransferBuffer(ImageFormat::RGB32F());
+		const int width = buffer->width();
+		const int height = buffer->height();
+		const int texelCount = width * height;
+		Array<Color3> reference;
+		reference.resize(texelCount);
+		System::memcpy(reference.getCArray(), buffer->mapRead(), sizeof(Color3) * texelCount);
+		buffer->unmap();
+
+		const float* referenceChannels = reinterpret_cast<const float*>(reference.getCArray());
+		Array<Color3> decoded;
+		decoded.resize(texelCount);
+		float* decodedChannels = reinterpret_cast<float*>(decoded.getCArray());
+
+		struct Candidate
+		{
+			const char*                     name;
+			int                             bitsPerTexel;
+			std::function<float(float)>     quantize;
+		};
+
+		const Array<Candidate> candidates = {
+			{ "RGB5A1",     16,  [](float x) { return quantizeUnorm(x, 5); } },
+			{ "RGB8",       24,  [](float x) { return quantizeUnorm(x, 8); } },
+			{ "RGB10A2",    32,  [](float x) { return quantizeUnorm(x, 10); } },
+			{ "R11G11B10F", 32,  [](float x) { return quantizeSmallFloat(max(x, 0.0f), 6); } },
+			{ "RGB16F",     48,  [](float x) { return quantizeSmallFloat(x, 10); } },
+			{ "RGBA16F",    64,  [](float x) { return quantizeSmallFloat(x, 10); } },
+			{ "RGB32F",     96,  [](float x) { return x; } },
+			{ "RGBA32F",    128, [](float x) { return x; } } };
+
+		for (const Candidate& candidate : candidates)
+		{
+			for (int i = 0; i < 3 * texelCount; ++i)
+			{
+				decodedChannels[i] = candidate.quantize(referenceChannels[i]);
+			}
+
+			// R11G11B10F stores 5 bits of mantissa in blue
+			if (String(candidate.name) == "R11G11B10F")
+			{
+				for (int i = 0; i < texelCount; ++i)
+				{
+					decoded[i].b = quantizeSmallFloat(max(reference[i].b, 0.0f), 5);
+				}
+			}
+
+			addFormatRow("irradiance", candidate.name, candidate.bitsPerTexel, size_t(texelCount) * size_t(candidate.bitsPerTexel / 8),
+				EncodingError(referenceChannels, decodedChannels, 3 * texelCount), 0.0);
+		}
+
+		Array<uint8> blocks;
+		const double encodeMs = averageMilliseconds(1, [&]() { ProbeAtlasCompression::encodeBC6H(reference.getCArray(), width, height, blocks); });
+		ProbeAtlasCompression::decodeBC6H(blocks.getCArray(), width, height, decoded);
+		addFormatRow("irradiance", "BC6H", 8.0 * double(blocks.size()) / double(texelCount), blocks.size(),
+			EncodingError(referenceChannels, reinterpret_cast<const float*>(decoded.getCArray()), 3 * texelCount), encodeMs);
+	}
+
+	// Mean and mean squared distance
+	{
+		const shared_ptr<PixelTransferBuffer>& buffer = field->meanDistProbes()->toPixelTransferBuffer(ImageFormat::RG32F());
+		const int texelCount = buffer->width() * buffer->height();
+		Array<Vector2> reference;
+		reference.resize(texelCount);
+		System::memcpy(reference.getCArray(), buffer->mapRead(), sizeof(Vector2) * texelCount);
+		buffer->unmap();
+
+		const float* referenceChannels = reinterpret_cast<const float*>(reference.getCArray());
+		Array<Vector2> decoded;
+		decoded.resize(texelCount);
+		float* decodedChannels = reinterpret_cast<float*>(decoded.getCArray());
+
+		for (int i = 0; i < 2 * texelCount; ++i)
+		{
+			decodedChannels[i] = quantizeUnorm(referenceChannels[i], 8);
+		}
+		addFormatRow("depth", "RGB8", 24, size_t(texelCount) * 3, EncodingError(referenceChannels, decodedChannels, 2 * texelCount), 0.0);
+
+		for (int i = 0; i < 2 * texelCount; ++i)
+		{
+			decodedChannels[i] = quantizeSmallFloat(referenceChannels[i], 10);
+		}
+		addFormatRow("depth", "RG16F", 32, size_t(texelCount) * 4, EncodingError(referenceChannels, decodedChannels, 2 * texelCount), 0.0);
+		addFormatRow("depth", "RG32F", 64, size_t(texelCount) * 8, EncodingError(referenceChannels, referenceChannels, 2 * texelCount), 0.0);
+
+		Array<uint16> moments;
+		const double encodeMs = averageMilliseconds(1, [&]() {
+			ProbeAtlasCompression::encodeMoments(reference.getCArray(), texelCount, field->maxDistance(), moments);
+		});
+		ProbeAtlasCompression::decodeMoments(moments.getCArray(), texelCount, field->maxDistance(), decoded);
+		addFormatRow("depth", "RG16 moments", 32, size_t(texelCount) * 4,
+			EncodingError(referenceChannels, reinterpret_cast<const float*>(decoded.getCArray()), 2 * texelCount), encodeMs);
+	}
+}
+
+/** Peak resident memory of this process so far */
+static int64 peakResidentBytes()
+{
+#ifdef G3D_WINDOWS
+	PROCESS_MEMORY_COUNTERS counters;
+	return GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters)) ? int64(counters.PeakWorkingSetSize) : 0;
+#else
+	struct rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+#   ifdef G3D_OSX
+	return int64(usage.ru_maxrss);
+#   else
+	// Kilobytes on Linux
+	return int64(usage.ru_maxrss) * 1024;
+#   endif
+#endif
+}
+
+Array<ProbeBenchmark::ProbeUpdateConfiguration> ProbeBenchmark::defaultProbeUpdateConfigurations()
+{
+	const ProbeUpdateConfiguration base = { Vector3int32(16, 8, 16), 128, 8, 16 };
+	Array<ProbeUpdateConfiguration> configurations = { base };
+
+	for (const Vector3int32& probeCounts : { Vector3int32(8, 4, 8), Vector3int32(32, 16, 32) })
+	{
+		ProbeUpdateConfiguration c = base;
+		c.probeCounts = probeCounts;
+		configurations.append(c);
+	}
+	for (const int raysPerProbe : { 64, 256 })
+	{
+		ProbeUpdateConfiguration c = base;
+		c.raysPerProbe = raysPerProbe;
+		configurations.append(c);
+	}
+	for (const int irradianceOctResolution : { 6, 12 })
+	{
+		ProbeUpdateConfiguration c = base;
+		c.irradianceOctResolution = irradianceOctResolution;
+		c.depthOctResolution = 2 * irradianceOctResolution;
+		configurations.append(c);
+	}
+
+	return configurations;
+}
+
+/** Irradiance atlas texels of \a field */
+static void readIrradianceAtlas(const shared_ptr<IrradianceField>& field, Array<Color3>& texels)
+{
+	const shared_ptr<PixelTransferBuffer>& buffer = field->irradianceProbes()->toPixelTransferBuffer(ImageFormat::RGB32F());
+	texels.resize(buffer->width() * buffer->height());
+	System::memcpy(texels.getCArray(), buffer->mapRead(), sizeof(Color3) * texels.size());
+	buffer->unmap();
+}
+
+void ProbeBenchmark::benchmarkProbeUpdates(const String& sceneName, const shared_ptr<Scene>& scene, RenderDevice* rd,
+	const Array<ProbeUpdateConfiguration>& configurations, int frames, int referenceFrames, uint32 seed)
+{
+	// The irradiance field only uses the surfaces to find the skybox
+	Array<shared_ptr<Surface>> surfaceArray;
+	scene->onPose(surfaceArray);
+
+	const auto& createField = [&](const ProbeUpdateConfiguration& c, uint32 fieldSeed) {
+		const shared_ptr<IrradianceField>& field = IrradianceField::create(sceneName, scene, c.probeCounts, -1.0f,
+			c.irradianceOctResolution, c.depthOctResolution, false);
+		field->onSceneChanged(scene);
+		field->setRaysPerProbe(c.raysPerProbe);
+		field->setRandomSeed(fieldSeed);
+
+		// Budgets depend on the measured trace rate, which would make the schedule nondeterministic
+		field->setRaysPerFrameBudget(0);
+		field->setTraceMillisecondsBudget(0.0f);
+		return field;
+	};
+
+	const auto& runFrame = [&](const shared_ptr<IrradianceField>& field) {
+		rd->beginFrame();
+		field->onGraphics3D(rd, surfaceArray);
+		rd->endFrame();
+	};
+
+	const String& header = "scene,probeCountX,probeCountY,probeCountZ,raysPerProbe,irradianceOctResolution,depthOctResolution,frames,"
+		"msPerFrame,raysPerSecond,probesPerSecond,cpuMsPerFrame,gpuMsPerFrame,traceMsPerFrame,referenceFrames,convergenceRmse,"
+		"convergenceRelativeRmse,gpuBytes,peakResidentBytes";
+
+	for (const ProbeUpdateConfiguration& c : configurations)
+	{
+		Array<Color3> reference;
+		{
+			const shared_ptr<IrradianceField>& field = createField(c, seed + 1);
+			for (int frame = 0; frame < referenceFrames; ++frame)
+			{
+				runFrame(field);
+			}
+			readIrradianceAtlas(field, reference);
+		}
+
+		const shared_ptr<IrradianceField>& field = createField(c, seed);
+
+		// The first frame builds the scene trees and allocates the ray buffers, so it is not timed
+		runFrame(field);
+		glFinish();
+
+		int64 probesUpdated = 0;
+		const int64 raysBefore = field->stats().totalRaysTraced();
+		const RealTime start = System::time();
+		for (int frame = 1; frame < frames; ++frame)
+		{
+			runFrame(field);
+			probesUpdated += field->scheduledProbeCount();
+		}
+		glFinish();
+		const double seconds = max(System::time() - start, 1e-9);
+		const int timedFrames = max(frames - 1, 1);
+
+		// Converged probes trace fewer than raysPerProbe rays
+		const int64 raysTraced = field->stats().totalRaysTraced() - raysBefore;
+
+		Array<Color3> irradiance;
+		readIrradianceAtlas(field, irradiance);
+		const EncodingError error(reinterpret_cast<const float*>(reference.getCArray()), reinterpret_cast<const float*>(irradiance.getCArray()),
+			3 * min(reference.size(), irradiance.size()));
+
+		const ProbeStats::Frame& stats = field->stats().averageFrame(timedFrames);
+		addRow("benchmark-probe-updates.csv", header,
+			format("\"%s\",%d,%d,%d,%d,%d,%d,%d,%.3f,%.0f,%.0f,%.3f,%.3f,%.3f,%d,%g,%g,%lld,%lld",
+				sceneName.c_str(), field->probeCounts().x, field->probeCounts().y, field->probeCounts().z, c.raysPerProbe, c.irradianceOctResolution,
+				c.depthOctResolution, frames, 1000.0 * seconds / double(timedFrames), double(raysTraced) / seconds,
+				double(probesUpdated) / seconds, stats.totalCPUMilliseconds(), stats.totalGPUMilliseconds(),
+				stats.cpuMilliseconds[ProbeStats::TRACE], referenceFrames, error.rmse, error.relativeRmse,
+				(long long)field->gpuMemoryBytes(), (long long)peakResidentBytes()));
+	}
+}
+
+/** Texels of \a texture as RGBA32F */
+static void readTexels(const shared_ptr<Texture>& texture, Array<Color4>& texels)
+{
+	const shared_ptr<PixelTransferBuffer>& buffer = texture->toPixelTransferBuffer(ImageFormat::RGBA32F());
+	texels.resize(buffer->width() * buffer->height());
+	System::memcpy(texels.getCArray(), buffer->mapRead(), sizeof(Color4) * texels.size());
+	buffer->unmap();
+}
+
+void ProbeBenchmark::benchmarkSHIrradiance(const String& sceneName, const shared_ptr<Scene>& scene, RenderDevice* rd,
+	int frames, int referenceFrames, uint32 seed)
+{
+	Array<shared_ptr<Surface>> surfaceArray;
+	scene->onPose(surfaceArray);
+
+	const ProbeUpdateConfiguration& c = defaultProbeUpdateConfigurations()[0];
+	const auto& createField = [&](int shOrder, uint32 fieldSeed) {
+		const shared_ptr<IrradianceField>& field = IrradianceField::create(sceneName, scene, c.probeCounts, -1.0f,
+			c.irradianceOctResolution, c.depthOctResolution, false);
+		field->onSceneChanged(scene);
+		field->setRaysPerProbe(c.raysPerProbe);
+		field->setRandomSeed(fieldSeed);
+		field->setIrradianceSHOrder(shOrder);
+		field->setRaysPerFrameBudget(0);
+		field->setTraceMillisecondsBudget(0.0f);
+		return field;
+	};
+
+	const auto& runFrames = [&](const shared_ptr<IrradianceField>& field, int count) {
+		for (int frame = 0; frame < count; ++frame)
+		{
+			rd->beginFrame();
+			field->onGraphics3D(rd, surfaceArray);
+			rd->endFrame();
+		}
+	};
+
+	// Reference directions: every interior texel of every probe of a converged octahedral field
+	const shared_ptr<IrradianceField>& referenceField = createField(0, seed + 1);
+	runFrames(referenceField, referenceFrames);
+	Array<Color3> referenceAtlas;
+	readIrradianceAtlas(referenceField, referenceAtlas);
+
+	const int side = c.irradianceOctResolution;
+	const int referenceWidth = referenceField->irradianceProbes()->width();
+
+	Array<Color3> reference;
+	reference.reserve(referenceField->probeCount() * side * side);
+	for (int i = 0; i < referenceField->probeCount(); ++i)
+	{
+		const Point2int32& topLeft = ProbeMath::probeAtlasTopLeft(referenceField->probeAtlasCoord(i), side);
+		for (int y = 0; y < side; ++y)
+		{
+			for (int x = 0; x < side; ++x)
+			{
+				reference.append(referenceAtlas[(topLeft.y + y) * referenceWidth + topLeft.x + x]);
+			}
+		}
+	}
+
+	const String& header = "scene,mode,coefficientsPerProbe,frames,updateIrradianceGpuMs,updateIrradianceCpuMs,msPerFrame,"
+		"irradianceBytes,bytesPerShade,referenceFrames,rmse,relativeRmse,maxError";
+
+	for (const int shOrder : { 0, 1, 2 })
+	{
+		const shared_ptr<IrradianceField>& field = createField(shOrder, seed);
+
+		// Tree builds and allocations
+		runFrames(field, 1);
+		glFinish();
+
+		const RealTime start = System::time();
+		runFrames(field, frames - 1);
+		glFinish();
+		const int timedFrames = max(frames - 1, 1);
+		const double msPerFrame = 1000.0 * (System::time() - start) / double(timedFrames);
+
+		Array<Color3> values;
+		values.reserve(reference.size());
+		int64 irradianceBytes = 0, bytesPerShade = 0;
+		if (shOrder == 0)
+		{
+			const shared_ptr<Texture>& atlas = field->irradianceProbes();
+			Array<Color3> texels;
+			readIrradianceAtlas(field, texels);
+			for (int i = 0; i < field->probeCount(); ++i)
+			{
+				const Point2int32& topLeft = ProbeMath::probeAtlasTopLeft(field->probeAtlasCoord(i), side);
+				for (int y = 0; y < side; ++y)
+				{
+					for (int x = 0; x < side; ++x)
+					{
+						values.append(texels[(topLeft.y + y) * atlas->width() + topLeft.x + x]);
+					}
+				}
+			}
+
+			const int64 texelBytes = atlas->format()->cpuBitsPerPixel / 8;
+			irradianceBytes = int64(atlas->width()) * int64(atlas->height()) * texelBytes;
+
+			// Eight cage probes, one bilinear footprint each
+			bytesPerShade = 8 * 4 * texelBytes;
+		}
+		else
+		{
+			const shared_ptr<Texture>& coefficientTexture = field->irradianceSH();
+			const int coefficientCount = field->shCoefficientCount();
+			Array<Color4> texels;
+			readTexels(coefficientTexture, texels);
+
+			Color3 coefficients[9];
+			for (int i = 0; i < field->probeCount(); ++i)
+			{
+				const Point2int32& atlasCoord = field->probeAtlasCoord(i);
+				for (int k = 0; k < coefficientCount; ++k)
+				{
+					coefficients[k] = texels[atlasCoord.y * coefficientTexture->width() + atlasCoord.x * coefficientCount + k].rgb();
+				}
+
+				for (int y = 0; y < side; ++y)
+				{
+					for (int x = 0; x < side; ++x)
+					{
+						values.append(ProbeMath::shIrradiance(coefficients, shOrder, ProbeMath::probeTexelDirection(x, y, side)));
+					}
+				}
+			}
+
+			// RGBA16F
+			irradianceBytes = int64(coefficientTexture->width()) * int64(coefficientTexture->height()) * 8;
+			bytesPerShade = 8 * coefficientCount * 8;
+		}
+
+		const EncodingError error(reinterpret_cast<const float*>(reference.getCArray()), reinterpret_cast<const float*>(values.getCArray()),
+			3 * min(reference.size(), values.size()));
+
+		const ProbeStats::Frame& stats = field->stats().averageFrame(timedFrames);
+		static const char* modeNames[3] = { "octahedral", "L1", "L2" };
+		addRow("benchmark-sh-irradiance.csv", header,
+			format("\"%s\",%s,%d,%d,%.4f,%.4f,%.3f,%lld,%lld,%d,%g,%g,%g",
+				sceneName.c_str(), modeNames[shOrder], field->shCoefficientCount(), frames,
+				stats.gpuMilliseconds[ProbeStats::UPDATE_IRRADIANCE], stats.cpuMilliseconds[ProbeStats::UPDATE_IRRADIANCE], msPerFrame,
+				(long long)irradianceBytes, (long long)bytesPerShade, referenceFrames, error.rmse, error.relativeRmse, error.maxError));
+	}
+}
+
+void ProbeBenchmark::benchmarkCPUReference(const String& sceneName, const shared_ptr<Scene>& scene, RenderDevice* rd, int frames, uint32 seed)
+{
+	Array<shared_ptr<Surface>> surfaceArray;
+	scene->onPose(surfaceArray);
+
+	const ProbeUpdateConfiguration& c = defaultProbeUpdateConfigurations()[0];
+	const shared_ptr<IrradianceField>& field = IrradianceField::create(sceneName, scene, c.probeCounts, -1.0f,
+		c.irradianceOctResolution, c.depthOctResolution, false);
+	field->onSceneChanged(scene);
+	field->setRaysPerProbe(c.raysPerProbe);
+	field->setRandomSeed(seed);
+	field->setRaysPerFrameBudget(0);
+	field->setTraceMillisecondsBudget(0.0f);
+
+	// The reference traces every probe with every ray from its lattice position each frame, blends
+	// with a fixed hysteresis and shades the rays it traced, so the field must do the same
+	field->setCullInactiveProbes(false);
+	field->setRelocateProbes(false);
+	field->setAdaptiveUpdates(false);
+	field->setLightChangeInvalidation(false);
+	field->setAsyncTrace(false);
+
+	// The first frame builds the scene trees, so it is not timed
+	rd->beginFrame();
+	field->onGraphics3D(rd, surfaceArray);
+	rd->endFrame();
+	glFinish();
+
+	const RealTime start = System::time();
+	for (int frame = 1; frame < frames; ++frame)
+	{
+		rd->beginFrame();
+		field->onGraphics3D(rd, surfaceArray);
+		rd->endFrame();
+	}
+	glFinish();
+	const int timedFrames = max(frames - 1, 1);
+	const double gpuMsPerFrame = 1000.0 * (System::time() - start) / double(timedFrames);
+
+	// Same specification, seed and (zero) probe offsets as the field
+	const shared_ptr<IrradianceFieldCPU>& reference = IrradianceFieldCPU::create(field, scene);
+	reference->setRandomSeed(seed);
+	IrradianceFieldCPU::Timing timing;
+	for (int frame = 0; frame < frames; ++frame)
+	{
+		reference->update();
+		if (frame > 0)
+		{
+			timing.generateRays += reference->lastTiming().generateRays;
+			timing.trace += reference->lastTiming().trace;
+			timing.shade += reference->lastTiming().shade;
+			timing.updateProbes += reference->lastTiming().updateProbes;
+		}
+	}
+	const double msScale = 1000.0 / double(timedFrames);
+
+	Array<Color3> irradiance;
+	readIrradianceAtlas(field, irradiance);
+	const shared_ptr<CPUPixelTransferBuffer>& referenceIrradiance = reference->irradianceBuffer();
+	alwaysAssertM(irradiance.size() == referenceIrradiance->width() * referenceIrradiance->height(), "Irradiance atlas sizes differ");
+	const EncodingError irradianceError(static_cast<const float*>(referenceIrradiance->buffer()),
+		reinterpret_cast<const float*>(irradiance.getCArray()), 3 * irradiance.size());
+
+	Array<Vector2> meanDist;
+	{
+		const shared_ptr<PixelTransferBuffer>& buffer = field->meanDistProbes()->toPixelTransferBuffer(ImageFormat::RG32F());
+		meanDist.resize(buffer->width() * buffer->height());
+		System::memcpy(meanDist.getCArray(), buffer->mapRead(), sizeof(Vector2) * meanDist.size());
+		buffer->unmap();
+	}
+	const shared_ptr<CPUPixelTransferBuffer>& referenceMeanDist = reference->meanDistBuffer();
+	alwaysAssertM(meanDist.size() == referenceMeanDist->width() * referenceMeanDist->height(), "Mean distance atlas sizes differ");
+	const EncodingError meanDistError(static_cast<const float*>(referenceMeanDist->buffer()),
+		reinterpret_cast<const float*>(meanDist.getCArray()), 2 * meanDist.size());
+
+	addRow("benchmark-cpu-reference.csv",
+		"scene,probes,raysPerProbe,frames,cpuGenerateMs,cpuTraceMs,cpuShadeMs,cpuUpdateMs,cpuMsPerFrame,gpuMsPerFrame,gpuSpeedup,"
+		"irradianceRmse,irradianceRelativeRmse,meanDistRmse,meanDistRelativeRmse",
+		format("\"%s\",%d,%d,%d,%.3f,%.3f,%.3f,%.3f,%.3f,%.3f,%.2f,%g,%g,%g,%g",
+			sceneName.c_str(), reference->probeCount(), reference->raysPerProbe(), frames,
+			timing.generateRays * msScale, timing.trace * msScale, timing.shade * msScale, timing.updateProbes * msScale,
+			timing.total() * msScale, gpuMsPerFrame, timing.total() * msScale / max(gpuMsPerFrame, 1e-6),
+			irradianceError.rmse, irradianceError.relativeRmse, meanDistError.rmse, meanDistError.relativeRmse));
+}
+
+void ProbeBenchmark::save(const String& directory) const
+{
+	for (const Table<String, Array<String>>::Entry& entry : m_csvFiles)
+	{
+		TextOutput file(FilePath::concat(directory, entry.key));
+		for (const String& row : entry.value)
+		{
+			file.printf("%s\n", row.c_str());
+		}
+		file.commit();
+	}
+}
@@ -0,0 +1,84 @@
+#pragma once
+#include <G3D/G3D.h>
+
+class IrradianceField;
+
+/**
+	Timing benchmarks for the probe pipeline. Results are appended as CSV rows so that
+	they can be collected by scripts; run them with the --benchmark command line option, which
+	runs without a window over every scene in data-files/scenes and every Cornell box model.
+*/
+class ProbeBenchmark
+{
+protected:
+
+	/** CSV file name -> rows, header first */
+	Table<String, Array<String>>        m_csvFiles;
+
+	void addRow(const String& filename, const String& header, const String& row);
+
+public:
+
+	/** Compares a full TriTree::setContents(scene) rebuild against the two-level update used by
+		IrradianceField, where only the tree over the moving entities is rebuilt. Every visible
+		model entity in turn is treated as the moving one. */
+	void benchmarkSceneTriTrees(const String& sceneName, const shared_ptr<Scene>& scene, int iterations = 10);
+
+	/** Times probe index -> grid coordinate conversion with hardware division, with the power-of-two
+		mask and shift that the shaders used to require, and with ProbeMath::FastDivisor. Verifies that
+		FastDivisor matches division for every probe index. Writes benchmark-index-math.csv. */
+	void benchmarkProbeIndexMath(const Array<Vector3int32>& probeCountsArray, int iterations = 64);
+
+	/** Traces a probeCounts lattice of probe rays over the scene with ProbeRayTracer on 1, 2, 4, ..., N threads
+		and packet widths 1, 8 and 16, against a flat runConcurrently loop over the same rays.
+		Writes benchmark-probe-tracing.csv. */
+	void benchmarkProbeTracing(const String& sceneName, const shared_ptr<Scene>& scene,
+		const Vector3int32& probeCounts = Vector3int32(16, 8, 16), int raysPerProbe = 256, int iterations = 4);
+
+	/** Compares the formats of s_irradianceFormats and s_depthFormats against the BC6H and RG16 moment
+		encodings of ProbeAtlasCompression on the current atlases of \a field: bits per texel, atlas bytes,
+		bytes fetched per sampleIrradianceField() call, and the error of each encoding relative to the
+		atlas contents. Uncompressed formats are emulated by rounding on the CPU. Writes
+		benchmark-atlas-compression.csv. */
+	void benchmarkAtlasCompression(const String& sceneName, const shared_ptr<IrradianceField>& field);
+
+	/** Probe grid parameters swept by benchmarkProbeUpdates */
+	struct ProbeUpdateConfiguration
+	{
+		Vector3int32    probeCounts;
+		int             raysPerProbe;
+		int             irradianceOctResolution;
+		int             depthOctResolution;
+	};
+
+	/** The default sweep: one parameter at a time varied around 16x8x16 probes, 128 rays, 8^2 irradiance and 16^2 depth texels */
+	static Array<ProbeUpdateConfiguration> defaultProbeUpdateConfigurations();
+
+	/** Runs \a frames probe updates of a fresh IrradianceField on \a scene for each configuration, with a fixed
+		ray rotation seed, no probe cache and no update budget. Reports rays and probe updates per second over
+		all but the first frame, the mean ProbeStats stage times, the relative RMS difference of the irradiance
+		atlas from a reference that ran \a referenceFrames updates with another seed, and the GPU memory of the
+		field and the peak resident memory of the process. Writes benchmark-probe-updates.csv. */
+	void benchmarkProbeUpdates(const String& sceneName, const shared_ptr<Scene>& scene, RenderDevice* rd,
+		const Array<ProbeUpdateConfiguration>& configurations, int frames = 64, int referenceFrames = 256, uint32 seed = 1);
+
+	/** Compares the octahedral irradiance atlas against L1 and L2 spherical harmonic irradiance
+		(Specification::irradianceSHOrder) on the base configuration of defaultProbeUpdateConfigurations().
+		Reports the mean irradiance update time, irradiance storage, bytes fetched per
+		sampleIrradianceField() call, and the error against an octahedral reference that ran
+		\a referenceFrames updates with another seed, evaluated at every interior texel direction of the
+		reference. Writes benchmark-sh-irradiance.csv. */
+	void benchmarkSHIrradiance(const String& sceneName, const shared_ptr<Scene>& scene, RenderDevice* rd,
+		int frames = 64, int referenceFrames = 256, uint32 seed = 1);
+
+	/** Runs \a frames probe updates of IrradianceFieldCPU and of an IrradianceField with the base configuration
+		of defaultProbeUpdateConfigurations() and the same seed. The field runs synchronously without probe culling,
+		relocation, adaptive updates or light invalidation, as the reference does. Reports the per-stage CPU times
+		of the reference against the frame time of the GPU field (gpuSpeedup = CPU ms / GPU ms), and the difference
+		of the irradiance and mean distance atlases of the two. Writes benchmark-cpu-reference.csv. */
+	void benchmarkCPUReference(const String& sceneName, const shared_ptr<Scene>& scene, RenderDevice* rd,
+		int frames = 16, uint32 seed = 1);
+
+	/** Writes all CSV files into \a directory */
+	void save(const String& directory = "") const;
+};
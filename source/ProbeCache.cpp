@@ -0,0 +1,235 @@
+#include "ProbeCache.h"
+#ifdef G3D_WINDOWS
+#   include <windows.h>
+#else
+#   include <fcntl.h>
+#   include <sys/mman.h>
+#   include <sys/stat.h>
+#   include <unistd.h>
+#endif
+
+static const char s_magic[8] = { 'D', 'D', 'G', 'I', 'P', 'R', 'B', '\0' };
+
+ProbeCache::Header::Header()
+{
+	System::memcpy(magic, s_magic, sizeof(magic));
+}
+
+bool ProbeCache::Header::matches(const Header& other) const
+{
+	return (sceneHash == other.sceneHash) &&
+		(probeCounts == other.probeCounts) &&
+		(probeBoundsLow == other.probeBoundsLow) &&
+		(probeBoundsHigh == other.probeBoundsHigh) &&
+		(probeAtlasLayout == other.probeAtlasLayout) &&
+		(probeAtlasSlicesPerRow == other.probeAtlasSlicesPerRow) &&
+		(irradianceSide == other.irradianceSide) &&
+		(depthSide == other.depthSide) &&
+		(irradianceWidth == other.irradianceWidth) &&
+		(irradianceHeight == other.irradianceHeight) &&
+		(depthWidth == other.depthWidth) &&
+		(depthHeight == other.depthHeight) &&
+		(irradianceFormat == other.irradianceFormat) &&
+		(depthFormat == other.depthFormat);
+}
+
+ProbeCache::~ProbeCache()
+{
+	unmap();
+}
+
+bool ProbeCache::map(const String& filename)
+{
+	m_filename = filename;
+
+#ifdef G3D_WINDOWS
+	m_file = CreateFileA(filename.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+	if (m_file == INVALID_HANDLE_VALUE)
+	{
+		m_file = nullptr;
+		return false;
+	}
+
+	LARGE_INTEGER size;
+	if (!GetFileSizeEx(m_file, &size) || (size.QuadPart == 0))
+	{
+		return false;
+	}
+	m_size = size_t(size.QuadPart);
+
+	m_mapping = CreateFileMappingA(m_file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+	if (isNull(m_mapping))
+	{
+		return false;
+	}
+
+	m_data = static_cast<const uint8*>(MapViewOfFile(m_mapping, FILE_MAP_READ, 0, 0, 0));
+#else
+	m_file = ::open(filename.c_str(), O_RDONLY);
+	if (m_file < 0)
+	{
+		return false;
+	}
+
+	struct stat status;
+	if ((fstat(m_file, &status) != 0) || (status.st_size == 0))
+	{
+		return false;
+	}
+	m_size = size_t(status.st_size);
+
+	void* data = mmap(nullptr, m_size, PROT_READ, MAP_PRIVATE, m_file, 0);
+	m_data = (data == MAP_FAILED) ? nullptr : static_cast<const uint8*>(data);
+#endif
+
+	return notNull(m_data);
+}
+
+void ProbeCache::unmap()
+{
+#ifdef G3D_WINDOWS
+	if (notNull(m_data))
+	{
+		UnmapViewOfFile(m_data);
+	}
+	if (notNull(m_mapping))
+	{
+		CloseHandle(m_mapping);
+	}
+	if (notNull(m_file))
+	{
+		CloseHandle(m_file);
+	}
+	m_mapping = nullptr;
+	m_file = nullptr;
+#else
+	if (notNull(m_data))
+	{
+		munmap(const_cast<uint8*>(m_data), m_size);
+	}
+	if (m_file >= 0)
+	{
+		::close(m_file);
+	}
+	m_file = -1;
+#endif
+
+	m_data = nullptr;
+	m_size = 0;
+}
+
+shared_ptr<ProbeCache> ProbeCache::open(const String& filename)
+{
+	if (!FileSystem::exists(filename))
+	{
+		return nullptr;
+	}
+
+	const shared_ptr<ProbeCache>& cache = shared_ptr<ProbeCache>(new ProbeCache());
+	if (!cache->map(filename) || (cache->m_size < sizeof(Header)))
+	{
+		debugPrintf("Could not map probe cache %s\n", filename.c_str());
+		return nullptr;
+	}
+
+	const Header& header = cache->header();
+	if ((memcmp(header.magic, s_magic, sizeof(s_magic)) != 0) || (header.version != currentVersion) || (header.headerBytes != sizeof(Header)))
+	{
+		debugPrintf("%s is not a version %u probe cache\n", filename.c_str(), currentVersion);
+		return nullptr;
+	}
+
+	// Every section must lie within the file
+	const uint64 size = cache->m_size;
+	const uint64 probeCount = uint64(header.probeCounts.x) * uint64(header.probeCounts.y) * uint64(header.probeCounts.z);
+	if ((header.irradianceOffset + header.irradianceBytes > size) ||
+		(header.depthOffset + header.depthBytes > size) ||
+		(header.probeOffsetsOffset + header.probeOffsetsBytes > size) ||
+		(header.compressedIrradianceOffset + header.compressedIrradianceBytes > size) ||
+		(header.compressedDepthOffset + header.compressedDepthBytes > size) ||
+		(header.probeOffsetsBytes != probeCount * sizeof(Vector3)))
+	{
+		debugPrintf("Probe cache %s is truncated\n", filename.c_str());
+		return nullptr;
+	}
+
+	return cache;
+}
+
+/** Rounds \a offset up so that every section starts on a 16-byte boundary */
+static uint64 alignSection(uint64 offset)
+{
+	return (offset + 15) & ~uint64(15);
+}
+
+void ProbeCache::save
+   (const String&           filename,
+	Header                  header,
+	const Array<uint8>&     irradianceTexels,
+	const Array<uint8>&     depthTexels,
+	const Array<Vector3>&   probeOffsets,
+	const Array<uint8>&     compressedIrradianceBlocks,
+	const Array<uint16>&    compressedMoments)
+{
+	header.irradianceOffset = alignSection(sizeof(Header));
+	header.irradianceBytes = irradianceTexels.size();
+	header.depthOffset = alignSection(header.irradianceOffset + header.irradianceBytes);
+	header.depthBytes = depthTexels.size();
+	header.probeOffsetsOffset = alignSection(header.depthOffset + header.depthBytes);
+	header.probeOffsetsBytes = probeOffsets.size() * sizeof(Vector3);
+	header.compressedIrradianceOffset = alignSection(header.probeOffsetsOffset + header.probeOffsetsBytes);
+	header.compressedIrradianceBytes = compressedIrradianceBlocks.size();
+	header.compressedDepthOffset = alignSection(header.compressedIrradianceOffset + header.compressedIrradianceBytes);
+	header.compressedDepthBytes = compressedMoments.size() * sizeof(uint16);
+
+	const String& directory = FilePath::parent(filename);
+	if (!directory.empty() && !FileSystem::exists(directory))
+	{
+		FileSystem::createDirectory(directory);
+	}
+
+	// The cache is read back by mapping it, so it is written in the in-memory layout
+	BinaryOutput file(filename, G3D_LITTLE_ENDIAN);
+	file.writeBytes(&header, sizeof(Header));
+	file.skip(int(int64(header.irradianceOffset) - file.position()));
+	file.writeBytes(irradianceTexels.getCArray(), irradianceTexels.size());
+	file.skip(int(int64(header.depthOffset) - file.position()));
+	file.writeBytes(depthTexels.getCArray(), depthTexels.size());
+	file.skip(int(int64(header.probeOffsetsOffset) - file.position()));
+	file.writeBytes(probeOffsets.getCArray(), header.probeOffsetsBytes);
+	file.skip(int(int64(header.compressedIrradianceOffset) - file.position()));
+	file.writeBytes(compressedIrradianceBlocks.getCArray(), compressedIrradianceBlocks.size());
+	file.skip(int(int64(header.compressedDepthOffset) - file.position()));
+	file.writeBytes(compressedMoments.getCArray(), header.compressedDepthBytes);
+	file.commit();
+}
+
+/** 64-bit FNV-1a */
+static uint64 hashBytes(const void* bytes, size_t count, uint64 hash)
+{
+	const uint8* b = static_cast<const uint8*>(bytes);
+	for (size_t i = 0; i < count; ++i)
+	{
+		hash = (hash ^ b[i]) * 0x100000001B3ull;
+	}
+	return hash;
+}
+
+uint64 ProbeCache::sceneHash(const shared_ptr<Scene>& scene, const Array<shared_ptr<Surface>>& staticSurfaces)
+{
+	uint64 hash = 0xCBF29CE484222325ull;
+
+	const String& sceneText = scene->toAny().unparse();
+	hash = hashBytes(sceneText.c_str(), sceneText.size(), hash);
+
+	CPUVertexArray vertexArray;
+	Array<Tri> triArray;
+	Surface::getTris(staticSurfaces, vertexArray, triArray);
+	for (const CPUVertexArray::Vertex& vertex : vertexArray.vertex)
+	{
+		hash = hashBytes(&vertex.position, sizeof(Point3), hash);
+	}
+
+	const int triCount = triArray.size();
+	return hashBytes(&triCount, sizeof(triCount), hash);
+}
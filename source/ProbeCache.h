@@ -0,0 +1,141 @@
+#pragma once
+#include <G3D/G3D.h>
+
+/**
+	Binary file of converged probe atlases, so that a scene starts with converged probes instead
+	of hysteresis 0.
+
+	The file is a Header followed by the raw irradiance atlas texels, the raw mean/mean² distance
+	atlas texels (each tightly packed, in the format of its atlas), the world-space offset of
+	every probe, and the BC6H and RG16 compressed copies of the two atlases (see
+	ProbeAtlasCompression.h). open() memory-maps the file and the atlases are uploaded straight
+	from the mapping.
+
+	A cache is only reused when its scene hash and every grid field of its header match the
+	current IrradianceField. Produced by IrradianceField::saveProbeCache, e.g. from the
+	headless App --bake mode.
+*/
+class ProbeCache
+{
+public:
+
+	static const uint32 currentVersion = 2;
+
+	/** Start of the file. Fixed layout; 64-bit fields first so there is no padding. */
+	struct Header
+	{
+		char        magic[8];
+		uint32      version = currentVersion;
+		uint32      headerBytes = sizeof(Header);
+
+		/** See sceneHash() */
+		uint64      sceneHash = 0;
+
+		/** Byte ranges of the sections within the file */
+		uint64      irradianceOffset = 0;
+		uint64      irradianceBytes = 0;
+		uint64      depthOffset = 0;
+		uint64      depthBytes = 0;
+		uint64      probeOffsetsOffset = 0;
+		uint64      probeOffsetsBytes = 0;
+		uint64      compressedIrradianceOffset = 0;
+		uint64      compressedIrradianceBytes = 0;
+		uint64      compressedDepthOffset = 0;
+		uint64      compressedDepthBytes = 0;
+
+		/** Grid. Must all match for the cache to be reused. */
+		Vector3int32 probeCounts;
+		Vector3     probeBoundsLow;
+		Vector3     probeBoundsHigh;
+		int32       probeAtlasLayout = 0;
+		int32       probeAtlasSlicesPerRow = 0;
+		int32       irradianceSide = 0;
+		int32       depthSide = 0;
+		int32       irradianceWidth = 0;
+		int32       irradianceHeight = 0;
+		int32       depthWidth = 0;
+		int32       depthHeight = 0;
+
+		/** ImageFormat::Code of the atlases */
+		int32       irradianceFormat = 0;
+		int32       depthFormat = 0;
+
+		Header();
+
+		/** True if the grid fields and the scene hash match */
+		bool matches(const Header& other) const;
+	};
+
+protected:
+
+	String                  m_filename;
+	const uint8*            m_data = nullptr;
+	size_t                  m_size = 0;
+
+#ifdef G3D_WINDOWS
+	void*                   m_file = nullptr;
+	void*                   m_mapping = nullptr;
+#else
+	int                     m_file = -1;
+#endif
+
+	ProbeCache() {}
+
+	/** Maps the whole file read-only. Returns false if it does not exist or cannot be mapped. */
+	bool map(const String& filename);
+
+	void unmap();
+
+public:
+
+	~ProbeCache();
+
+	/** Maps \a filename and checks that the header is intact and the sections are within the file.
+		Returns nullptr if the file does not exist or is not a valid cache. Compare header()
+		against the expected header before using the data. */
+	static shared_ptr<ProbeCache> open(const String& filename);
+
+	/** Writes \a header, with the section offsets and sizes filled in, followed by the sections */
+	static void save
+	   (const String&           filename,
+		Header                  header,
+		const Array<uint8>&     irradianceTexels,
+		const Array<uint8>&     depthTexels,
+		const Array<Vector3>&   probeOffsets,
+		const Array<uint8>&     compressedIrradianceBlocks,
+		const Array<uint16>&    compressedMoments);
+
+	/** Hash of the scene file contents and the static geometry. The lights and the entity placement
+		are part of the scene Any, and \a staticSurfaces covers changes to the model files. */
+	static uint64 sceneHash(const shared_ptr<Scene>& scene, const Array<shared_ptr<Surface>>& staticSurfaces);
+
+	const String& filename() const {
+		return m_filename;
+	}
+
+	const Header& header() const {
+		return *reinterpret_cast<const Header*>(m_data);
+	}
+
+	/** Tightly packed texels, valid while this object exists */
+	const uint8* irradianceTexels() const {
+		return m_data + header().irradianceOffset;
+	}
+
+	const uint8* depthTexels() const {
+		return m_data + header().depthOffset;
+	}
+
+	const Vector3* probeOffsets() const {
+		return reinterpret_cast<const Vector3*>(m_data + header().probeOffsetsOffset);
+	}
+
+	/** Empty (zero bytes in the header) if the cache was saved without compressed copies */
+	const uint8* compressedIrradianceBlocks() const {
+		return m_data + header().compressedIrradianceOffset;
+	}
+
+	const uint16* compressedMoments() const {
+		return reinterpret_cast<const uint16*>(m_data + header().compressedDepthOffset);
+	}
+};
@@ -0,0 +1,227 @@
+#pragma once
+#include <G3D/G3D.h>
+
+/**
+	CPU versions of the small math helpers used by the probe shaders
+	(G3D's octahedral.glsl, g3dmath.glsl, GridHelpers.glsl and SphericalHarmonics.glsl). Keep these in sync
+	with the GLSL so that CPU and GPU probe updates write identical atlases.
+*/
+namespace ProbeMath
+{
+	/**
+		Unsigned division by a divisor that is fixed for many divides, using a multiply-high and two
+		shifts instead of a hardware divide (Granlund and Montgomery, "Division by Invariant Integers
+		using Multiplication", 1994). Exact for every 32-bit dividend and divisor >= 1.
+
+		The GPU evaluates the same constants with fastDivide() in GridHelpers.glsl, where they are
+		passed as the ivec3 returned by toVector3int32().
+	*/
+	class FastDivisor
+	{
+	protected:
+		uint32      m_divisor = 1;
+		uint32      m_multiplier = 1;
+		uint32      m_shift1 = 0;
+		uint32      m_shift2 = 0;
+
+	public:
+
+		FastDivisor() {}
+
+		explicit FastDivisor(uint32 divisor) : m_divisor(divisor)
+		{
+			alwaysAssertM(divisor > 0, "Division by zero");
+
+			// l = ceil(log2(divisor))
+			uint32 l = 0;
+			while ((uint64(1) << l) < divisor)
+			{
+				++l;
+			}
+
+			m_multiplier = uint32(((uint64(1) << 32) * ((uint64(1) << l) - divisor)) / divisor + 1);
+			m_shift1 = min(l, 1u);
+			m_shift2 = (l > 0) ? (l - 1) : 0;
+		}
+
+		uint32 divisor() const
+		{
+			return m_divisor;
+		}
+
+		uint32 divide(uint32 n) const
+		{
+			const uint32 t = uint32((uint64(m_multiplier) * n) >> 32);
+			return (t + ((n - t) >> m_shift1)) >> m_shift2;
+		}
+
+		/** (multiplier, shift1, shift2). The multiplier's bits are stored unchanged and
+			reinterpreted as unsigned by the shader. */
+		Vector3int32 toVector3int32() const
+		{
+			return Vector3int32(int32(m_multiplier), int32(m_shift1), int32(m_shift2));
+		}
+	};
+
+	/** Grid coordinate of the probe with linear index \a index, x varying fastest. Matches
+		probeIndexToGridCoord() in GridHelpers.glsl. */
+	inline Point3int32 probeIndexToGridCoord(int index, const FastDivisor& xDivisor, const FastDivisor& xyDivisor)
+	{
+		const uint32 z = xyDivisor.divide(uint32(index));
+		const uint32 xy = uint32(index) - z * xyDivisor.divisor();
+		const uint32 y = xDivisor.divide(xy);
+		return Point3int32(int(xy - y * xDivisor.divisor()), int(y), int(z));
+	}
+
+	/** Lattice coordinate, relative to the first probe of the grid, of the probe stored at grid coordinate \a s
+		of a grid scrolled by \a scrollOffset, which is in [0, probeCounts). Matches latticeGridCoord() in GridHelpers.glsl. */
+	inline Point3int32 latticeGridCoord(const Point3int32& s, const Vector3int32& scrollOffset, const Vector3int32& probeCounts)
+	{
+		Point3int32 c = s - scrollOffset;
+		for (int a = 0; a < 3; ++a)
+		{
+			if (c[a] < 0)
+			{
+				c[a] += probeCounts[a];
+			}
+		}
+		return c;
+	}
+
+	inline Vector2 signNotZero(const Vector2& v)
+	{
+		return Vector2((v.x >= 0.0f) ? 1.0f : -1.0f, (v.y >= 0.0f) ? 1.0f : -1.0f);
+	}
+
+	/** Matches octEncode() in octahedral.glsl. Returns a point on [-1, 1]^2. */
+	inline Vector2 octEncode(const Vector3& v)
+	{
+		const float l1norm = fabsf(v.x) + fabsf(v.y) + fabsf(v.z);
+		Vector2 result = v.xy() * (1.0f / l1norm);
+		if (v.z < 0.0f)
+		{
+			result = (Vector2(1.0f, 1.0f) - Vector2(fabsf(result.y), fabsf(result.x))) * signNotZero(result);
+		}
+		return result;
+	}
+
+	/** Matches octDecode() in octahedral.glsl */
+	inline Vector3 octDecode(const Vector2& o)
+	{
+		Vector3 v(o.x, o.y, 1.0f - fabsf(o.x) - fabsf(o.y));
+		if (v.z < 0.0f)
+		{
+			const Vector2 xy = (Vector2(1.0f, 1.0f) - Vector2(fabsf(v.y), fabsf(v.x))) * signNotZero(v.xy());
+			v.x = xy.x;
+			v.y = xy.y;
+		}
+		return v.direction();
+	}
+
+	/** Matches sphericalFibonacci() in g3dmath.glsl */
+	inline Vector3 sphericalFibonacci(float i, float n)
+	{
+		const float PHI = sqrtf(5.0f) * 0.5f + 0.5f;
+		const float m = i * (PHI - 1.0f);
+		const float phi = 2.0f * pif() * (m - floorf(m));
+		const float cosTheta = 1.0f - (2.0f * i + 1.0f) * (1.0f / n);
+		const float sinTheta = sqrtf(clamp(1.0f - cosTheta * cosTheta, 0.0f, 1.0f));
+		return Vector3(cosf(phi) * sinTheta, sinf(phi) * sinTheta, cosTheta);
+	}
+
+	/** Column and row of a probe in the probe atlases, in units of probes. Matches probeAtlasCoord() in GridHelpers.glsl.
+
+		With \a slicesPerRow = 0 every z slice of the grid is one row of probeCounts.x * probeCounts.y probes.
+		Otherwise every z slice is a probeCounts.x x probeCounts.y tile and \a slicesPerRow tiles share a row,
+		so that the 8 probes of a cage are near each other in the texture. */
+	inline Point2int32 probeAtlasCoord(const Point3int32& gridCoord, const Vector3int32& probeCounts, int slicesPerRow)
+	{
+		if (slicesPerRow == 0)
+		{
+			return Point2int32(gridCoord.x + gridCoord.y * probeCounts.x, gridCoord.z);
+		}
+		else
+		{
+			return Point2int32(gridCoord.x + (gridCoord.z % slicesPerRow) * probeCounts.x,
+				gridCoord.y + (gridCoord.z / slicesPerRow) * probeCounts.y);
+		}
+	}
+
+	/** Number of probe columns and rows in the atlases for probeAtlasCoord() */
+	inline Vector2int32 probeAtlasSize(const Vector3int32& probeCounts, int slicesPerRow)
+	{
+		if (slicesPerRow == 0)
+		{
+			return Vector2int32(probeCounts.x * probeCounts.y, probeCounts.z);
+		}
+		else
+		{
+			return Vector2int32(probeCounts.x * slicesPerRow, probeCounts.y * ((probeCounts.z + slicesPerRow - 1) / slicesPerRow));
+		}
+	}
+
+	/** Texel coordinates of the top-left interior texel of the probe at \a atlasCoord in an octahedral atlas.
+		Every probe occupies (probeSideLength + 2)^2 texels and the whole atlas has one
+		extra pixel of border on each side. Matches textureCoordFromDirection() in GridHelpers.glsl. */
+	inline Point2int32 probeAtlasTopLeft(const Point2int32& atlasCoord, int probeSideLength)
+	{
+		const int probeWithBorderSide = probeSideLength + 2;
+		return Point2int32(atlasCoord.x * probeWithBorderSide + 2, atlasCoord.y * probeWithBorderSide + 2);
+	}
+
+	/** Octahedral direction of the interior texel (x, y) of a probe, matching
+		normalizedOctCoord() in IrradianceField_UpdateIrradianceProbe.pix */
+	inline Vector3 probeTexelDirection(int x, int y, int probeSideLength)
+	{
+		const Vector2 octCoord = (Vector2(float(x), float(y)) + Vector2(0.5f, 0.5f)) * (2.0f / float(probeSideLength)) - Vector2(1.0f, 1.0f);
+		return octDecode(octCoord);
+	}
+
+	/** Normalized texture coordinate of direction \a dir in the probe at \a atlasCoord. Matches
+		textureCoordFromDirection() in GridHelpers.glsl */
+	inline Point2 textureCoordFromDirection(const Vector3& dir, const Point2int32& atlasCoord, int fullTextureWidth, int fullTextureHeight, int probeSideLength)
+	{
+		const Vector2 normalizedOctCoordZeroOne = (octEncode(dir.direction()) + Vector2(1.0f, 1.0f)) * 0.5f;
+		const Vector2 textureSize(float(fullTextureWidth), float(fullTextureHeight));
+		const Point2int32 topLeft = probeAtlasTopLeft(atlasCoord, probeSideLength);
+		return (Vector2(float(topLeft.x), float(topLeft.y)) + normalizedOctCoordZeroOne * float(probeSideLength)) / textureSize;
+	}
+
+	/** Coefficients per probe of an SH irradiance probe of \a order 1 (L1) or 2 (L2). Matches shCoefficientCount() in SphericalHarmonics.glsl */
+	inline int shCoefficientCount(int order)
+	{
+		return (order + 1) * (order + 1);
+	}
+
+	/** Real spherical harmonic basis functions up to L2 at unit direction \a d. Matches shBasis() in SphericalHarmonics.glsl */
+	inline void shBasis(const Vector3& d, float Y[9])
+	{
+		Y[0] = 0.282095f;
+		Y[1] = 0.488603f * d.y;
+		Y[2] = 0.488603f * d.z;
+		Y[3] = 0.488603f * d.x;
+		Y[4] = 1.092548f * d.x * d.y;
+		Y[5] = 1.092548f * d.y * d.z;
+		Y[6] = 0.315392f * (3.0f * d.z * d.z - 1.0f);
+		Y[7] = 1.092548f * d.x * d.z;
+		Y[8] = 0.546274f * (d.x * d.x - d.y * d.y);
+	}
+
+	/** Cosine-weighted mean radiance about \a n, the quantity that the octahedral irradiance atlas stores, from
+		radiance SH \a coefficients of \a order. Matches shIrradiance() in SphericalHarmonics.glsl */
+	inline Color3 shIrradiance(const Color3* coefficients, int order, const Vector3& n)
+	{
+		// Clamped cosine convolution per band (Ramamoorthi and Hanrahan 2001), divided by pi
+		static const float bandScale[3] = { 1.0f, 2.0f / 3.0f, 0.25f };
+
+		float Y[9];
+		shBasis(n, Y);
+		Color3 result = Color3::zero();
+		for (int i = 0; i < shCoefficientCount(order); ++i)
+		{
+			const int band = (i == 0) ? 0 : ((i < 4) ? 1 : 2);
+			result += coefficients[i] * (bandScale[band] * Y[i]);
+		}
+		return result.max(Color3::zero());
+	}
+}
@@ -0,0 +1,127 @@
+#include "ProbeRayGenerator.h"
+#include "ProbeMath.h"
+#ifdef __AVX__
+#   include <immintrin.h>
+#endif
+
+const float ProbeRayGenerator::rayMinDistance = 0.08f;
+
+void ProbeRayGenerator::setRaysPerProbe(int raysPerProbe, int reducedRaysPerProbe)
+{
+	if ((reducedRaysPerProbe <= 0) || (reducedRaysPerProbe > raysPerProbe))
+	{
+		reducedRaysPerProbe = raysPerProbe;
+	}
+
+	if ((raysPerProbe == m_raysPerProbe) && (reducedRaysPerProbe == m_reducedRaysPerProbe))
+	{
+		return;
+	}
+	m_raysPerProbe = raysPerProbe;
+	m_reducedRaysPerProbe = reducedRaysPerProbe;
+
+	const int paddedCount = (raysPerProbe + 7) & ~7;
+	const int paddedReducedCount = (reducedRaysPerProbe < raysPerProbe) ? ((reducedRaysPerProbe + 7) & ~7) : 0;
+	m_reducedOffset = (paddedReducedCount > 0) ? paddedCount : 0;
+
+	m_baseX.resize(paddedCount + paddedReducedCount);
+	m_baseY.resize(paddedCount + paddedReducedCount);
+	m_baseZ.resize(paddedCount + paddedReducedCount);
+	for (int r = 0; r < m_baseX.size(); ++r)
+	{
+		const bool reduced = (r >= paddedCount);
+		const int i = reduced ? (r - paddedCount) : r;
+		const int n = reduced ? reducedRaysPerProbe : raysPerProbe;
+		const Vector3& d = (i < n) ? ProbeMath::sphericalFibonacci(float(i), float(n)) : Vector3::zero();
+		m_baseX[r] = d.x;
+		m_baseY[r] = d.y;
+		m_baseZ[r] = d.z;
+	}
+
+	m_rotatedDirections.resize(m_baseX.size());
+}
+
+void ProbeRayGenerator::setOrientation(const Matrix3& M)
+{
+	const int paddedCount = m_baseX.size();
+	float* out = reinterpret_cast<float*>(m_rotatedDirections.getCArray());
+
+#ifdef __AVX__
+	const __m256 m00 = _mm256_set1_ps(M[0][0]), m01 = _mm256_set1_ps(M[0][1]), m02 = _mm256_set1_ps(M[0][2]);
+	const __m256 m10 = _mm256_set1_ps(M[1][0]), m11 = _mm256_set1_ps(M[1][1]), m12 = _mm256_set1_ps(M[1][2]);
+	const __m256 m20 = _mm256_set1_ps(M[2][0]), m21 = _mm256_set1_ps(M[2][1]), m22 = _mm256_set1_ps(M[2][2]);
+
+	for (int r = 0; r < paddedCount; r += 8)
+	{
+		const __m256 x = _mm256_loadu_ps(m_baseX.getCArray() + r);
+		const __m256 y = _mm256_loadu_ps(m_baseY.getCArray() + r);
+		const __m256 z = _mm256_loadu_ps(m_baseZ.getCArray() + r);
+
+		alignas(32) float rx[8], ry[8], rz[8];
+		_mm256_store_ps(rx, _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(m00, x), _mm256_mul_ps(m01, y)), _mm256_mul_ps(m02, z)));
+		_mm256_store_ps(ry, _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(m10, x), _mm256_mul_ps(m11, y)), _mm256_mul_ps(m12, z)));
+		_mm256_store_ps(rz, _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(m20, x), _mm256_mul_ps(m21, y)), _mm256_mul_ps(m22, z)));
+
+		// Transpose to the RGBA32F layout
+		for (int i = 0; i < 8; ++i)
+		{
+			float* d = out + 4 * (r + i);
+			d[0] = rx[i]; d[1] = ry[i]; d[2] = rz[i]; d[3] = finf();
+		}
+	}
+#else
+	for (int r = 0; r < paddedCount; ++r)
+	{
+		const Vector3& d = M * Vector3(m_baseX[r], m_baseY[r], m_baseZ[r]);
+		m_rotatedDirections[r] = Vector4(d, finf());
+	}
+#endif
+}
+
+void ProbeRayGenerator::writeRays(const Array<Point3>& probePositions, Vector4* origins, Vector4* directions) const
+{
+	const int rayCount = m_raysPerProbe;
+	const Vector4* rotated = m_rotatedDirections.getCArray();
+
+	runConcurrently(0, probePositions.size(), [&](int probeIndex) {
+		const Vector4 origin(probePositions[probeIndex], rayMinDistance);
+		Vector4* originRow = origins + probeIndex * rayCount;
+		for (int r = 0; r < rayCount; ++r)
+		{
+			originRow[r] = origin;
+		}
+		System::memcpy(directions + probeIndex * rayCount, rotated, rayCount * sizeof(Vector4));
+	});
+}
+
+void ProbeRayGenerator::writeRays(const Array<Point3>& probePositions, const Array<int>& rowRayCounts, Vector4* origins, Vector4* directions) const
+{
+	alwaysAssertM(rowRayCounts.size() >= probePositions.size(), "One ray count per row is required");
+	const int rowWidth = m_raysPerProbe;
+
+	runConcurrently(0, probePositions.size(), [&](int probeIndex) {
+		const int rayCount = rowRayCounts[probeIndex];
+		debugAssertM((rayCount == m_raysPerProbe) || (rayCount == m_reducedRaysPerProbe), "Unsupported ray count");
+		const Vector4* rotated = m_rotatedDirections.getCArray() + ((rayCount == m_raysPerProbe) ? 0 : m_reducedOffset);
+
+		const Vector4 origin(probePositions[probeIndex], rayMinDistance);
+		Vector4* originRow = origins + probeIndex * rowWidth;
+		for (int r = 0; r < rayCount; ++r)
+		{
+			originRow[r] = origin;
+		}
+		System::memcpy(directions + probeIndex * rowWidth, rotated, rayCount * sizeof(Vector4));
+		writeEmptyRays(originRow + rayCount, directions + probeIndex * rowWidth + rayCount, rowWidth - rayCount);
+	});
+}
+
+void ProbeRayGenerator::writeEmptyRays(Vector4* origins, Vector4* directions, int count)
+{
+	const Vector4 origin(Point3::zero(), rayMinDistance);
+	const Vector4 direction(Vector3::unitZ(), 0.0f);
+	for (int i = 0; i < count; ++i)
+	{
+		origins[i] = origin;
+		directions[i] = direction;
+	}
+}
@@ -0,0 +1,71 @@
+#pragma once
+#include <G3D/G3D.h>
+
+/**
+	CPU version of IrradianceField_GenerateRandomRays.pix.
+
+	Every probe shoots the same randomly rotated spherical Fibonacci pattern, so the directions
+	are rotated once per frame (8 at a time with AVX when available) and then copied into every
+	probe's row. The output is written directly in the layout that TriTree::intersectRays reads
+	from its ray buffers and the GPU reads from the ray textures: one RGBA32F texel per ray,
+	origin/min distance and direction/max distance, one row of raysPerProbe() texels per probe.
+
+	Converged probes shoot a smaller spherical Fibonacci pattern of reducedRaysPerProbe() rays
+	at the start of their row; the rest of the row holds empty rays.
+*/
+class ProbeRayGenerator
+{
+protected:
+
+	int                 m_raysPerProbe = 0;
+	int                 m_reducedRaysPerProbe = 0;
+
+	/** Start of the reduced pattern in the base and rotated directions */
+	int                 m_reducedOffset = 0;
+
+	/** Unrotated sphericalFibonacci(i, m_raysPerProbe) directions followed by the
+		sphericalFibonacci(i, m_reducedRaysPerProbe) directions as structure-of-arrays,
+		each pattern padded to a multiple of 8 */
+	Array<float>        m_baseX;
+	Array<float>        m_baseY;
+	Array<float>        m_baseZ;
+
+	/** Directions for the current orientation, RGBA32F with w = max distance */
+	Array<Vector4>      m_rotatedDirections;
+
+public:
+
+	/** This value should be on the order of the normal bias. Keep in sync with IrradianceField_GenerateRandomRays.pix */
+	static const float  rayMinDistance;
+
+	/** \a reducedRaysPerProbe <= 0 or >= \a raysPerProbe disables the reduced pattern */
+	void setRaysPerProbe(int raysPerProbe, int reducedRaysPerProbe = 0);
+
+	int raysPerProbe() const {
+		return m_raysPerProbe;
+	}
+
+	/** Equal to raysPerProbe() when there is no reduced pattern */
+	int reducedRaysPerProbe() const {
+		return m_reducedRaysPerProbe;
+	}
+
+	/** Rotates the base directions by \a randomOrientation. Call once per frame before writeRays. */
+	void setOrientation(const Matrix3& randomOrientation);
+
+	/** Direction of ray \a r for the current orientation */
+	Vector3 direction(int r) const {
+		return m_rotatedDirections[r].xyz();
+	}
+
+	/** Writes the rays of all probes. \a origins and \a directions each hold
+		probePositions.size() * raysPerProbe() float4 values, e.g., mapped GLPixelTransferBuffers. */
+	void writeRays(const Array<Point3>& probePositions, Vector4* origins, Vector4* directions) const;
+
+	/** As above, but row i holds \a rowRayCounts[i] rays, which must be raysPerProbe() or
+		reducedRaysPerProbe(), followed by empty rays */
+	void writeRays(const Array<Point3>& probePositions, const Array<int>& rowRayCounts, Vector4* origins, Vector4* directions) const;
+
+	/** Writes \a count rays whose min distance exceeds their max distance, so that the tracer skips them */
+	static void writeEmptyRays(Vector4* origins, Vector4* directions, int count);
+};
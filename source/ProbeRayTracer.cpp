@@ -0,0 +1,247 @@
+#include "ProbeRayTracer.h"
+#ifdef __AVX__
+#   include <immintrin.h>
+#endif
+
+ProbeRayTracer::ProbeRayTracer(int threadCount)
+{
+	m_pool = std::make_shared<WorkStealingPool>(threadCount);
+}
+
+void ProbeRayTracer::setThreadCount(int threadCount)
+{
+	if (threadCount <= 0)
+	{
+		threadCount = System::numCores();
+	}
+
+	if (threadCount != m_pool->threadCount())
+	{
+		m_pool = std::make_shared<WorkStealingPool>(threadCount);
+	}
+}
+
+void ProbeRayTracer::setPacketWidth(int width)
+{
+	m_packetWidth = iClamp(width, 1, maxPacketWidth);
+}
+
+AABox ProbeRayTracer::bounds(const shared_ptr<TriTree>& tree)
+{
+	const Array<CPUVertexArray::Vertex>& vertices = tree->vertexArray().vertex;
+	if (vertices.size() == 0)
+	{
+		return AABox();
+	}
+
+	Point3 lo = vertices[0].position;
+	Point3 hi = lo;
+	for (const CPUVertexArray::Vertex& vertex : vertices)
+	{
+		lo = lo.min(vertex.position);
+		hi = hi.max(vertex.position);
+	}
+	return AABox(lo, hi);
+}
+
+uint32 ProbeRayTracer::packetIntersectsBox(const Vector4* origins, const Vector4* directions, const float* tMax, int count, const AABox& box)
+{
+	const Point3& lo = box.low();
+	const Point3& hi = box.high();
+	uint32 mask = 0;
+	int i = 0;
+
+#ifdef __AVX__
+	const __m256 loX = _mm256_set1_ps(lo.x), loY = _mm256_set1_ps(lo.y), loZ = _mm256_set1_ps(lo.z);
+	const __m256 hiX = _mm256_set1_ps(hi.x), hiY = _mm256_set1_ps(hi.y), hiZ = _mm256_set1_ps(hi.z);
+	const __m256 one = _mm256_set1_ps(1.0f);
+
+	for (; i + 8 <= count; i += 8)
+	{
+		// Transpose from the RGBA32F layout
+		alignas(32) float ox[8], oy[8], oz[8], tMin[8], dx[8], dy[8], dz[8];
+		for (int j = 0; j < 8; ++j)
+		{
+			const Vector4& o = origins[i + j];
+			const Vector4& d = directions[i + j];
+			ox[j] = o.x; oy[j] = o.y; oz[j] = o.z; tMin[j] = o.w;
+			dx[j] = d.x; dy[j] = d.y; dz[j] = d.z;
+		}
+
+		// Slab test. Axis-parallel rays give infinite reciprocals, which the min/max handle.
+		const __m256 invX = _mm256_div_ps(one, _mm256_load_ps(dx));
+		const __m256 invY = _mm256_div_ps(one, _mm256_load_ps(dy));
+		const __m256 invZ = _mm256_div_ps(one, _mm256_load_ps(dz));
+
+		const __m256 x0 = _mm256_mul_ps(_mm256_sub_ps(loX, _mm256_load_ps(ox)), invX);
+		const __m256 x1 = _mm256_mul_ps(_mm256_sub_ps(hiX, _mm256_load_ps(ox)), invX);
+		const __m256 y0 = _mm256_mul_ps(_mm256_sub_ps(loY, _mm256_load_ps(oy)), invY);
+		const __m256 y1 = _mm256_mul_ps(_mm256_sub_ps(hiY, _mm256_load_ps(oy)), invY);
+		const __m256 z0 = _mm256_mul_ps(_mm256_sub_ps(loZ, _mm256_load_ps(oz)), invZ);
+		const __m256 z1 = _mm256_mul_ps(_mm256_sub_ps(hiZ, _mm256_load_ps(oz)), invZ);
+
+		__m256 enter = _mm256_max_ps(_mm256_min_ps(x0, x1), _mm256_max_ps(_mm256_min_ps(y0, y1), _mm256_min_ps(z0, z1)));
+		__m256 exit = _mm256_min_ps(_mm256_max_ps(x0, x1), _mm256_min_ps(_mm256_max_ps(y0, y1), _mm256_max_ps(z0, z1)));
+		enter = _mm256_max_ps(enter, _mm256_load_ps(tMin));
+		exit = _mm256_min_ps(exit, _mm256_loadu_ps(tMax + i));
+
+		mask |= uint32(_mm256_movemask_ps(_mm256_cmp_ps(enter, exit, _CMP_LE_OQ))) << i;
+	}
+#endif
+
+	for (; i < count; ++i)
+	{
+		const Vector4& o = origins[i];
+		const Vector4& d = directions[i];
+		float enter = o.w;
+		float exit = tMax[i];
+		for (int a = 0; a < 3; ++a)
+		{
+			const float inv = 1.0f / d[a];
+			const float t0 = (lo[a] - o[a]) * inv;
+			const float t1 = (hi[a] - o[a]) * inv;
+			enter = max(enter, min(t0, t1));
+			exit = min(exit, max(t0, t1));
+		}
+
+		if (enter <= exit)
+		{
+			mask |= 1u << i;
+		}
+	}
+
+	return mask;
+}
+
+/** RGBA8 as written by TriTree::intersectRays and read by GLSL unpackUnorm4x8 */
+static uint32 packUnorm4x8(const Color3& c)
+{
+	const uint32 r = uint32(iClamp(iRound(c.r * 255.0f), 0, 255));
+	const uint32 g = uint32(iClamp(iRound(c.g * 255.0f), 0, 255));
+	const uint32 b = uint32(iClamp(iRound(c.b * 255.0f), 0, 255));
+	return r | (g << 8) | (b << 16) | (255u << 24);
+}
+
+void ProbeRayTracer::traceRow
+   (const shared_ptr<TriTree>&      staticTree,
+	const shared_ptr<TriTree>&      dynamicTree,
+	const AABox&                    dynamicBounds,
+	const Vector4*                  origins,
+	const Vector4*                  directions,
+	int                             firstRay,
+	int                             rayCount,
+	const Output&                   output,
+	TriTree::IntersectRayOptions    options) const
+{
+	const bool traceDynamic = dynamicTree->size() > 0;
+
+	for (int packetStart = firstRay; packetStart < firstRay + rayCount; packetStart += m_packetWidth)
+	{
+		const int lanes = min(m_packetWidth, firstRay + rayCount - packetStart);
+		const Vector4* packetOrigins = origins + packetStart;
+		const Vector4* packetDirections = directions + packetStart;
+
+		TriTree::Hit hit[maxPacketWidth];
+		TriTree* hitTree[maxPacketWidth];
+		float tMax[maxPacketWidth];
+
+		// Static geometry
+		for (int i = 0; i < lanes; ++i)
+		{
+			const Vector4& o = packetOrigins[i];
+			const Vector4& d = packetDirections[i];
+			hitTree[i] = nullptr;
+			tMax[i] = d.w;
+
+			// Empty rays
+			if (o.w > d.w)
+			{
+				tMax[i] = -finf();
+				continue;
+			}
+
+			if (staticTree->intersectRay(Ray::fromOriginAndDirection(o.xyz(), d.xyz(), o.w, d.w), hit[i], options))
+			{
+				hitTree[i] = staticTree.get();
+				tMax[i] = hit[i].distance;
+			}
+		}
+
+		// Moving geometry, only for the lanes that can reach it before their static hit
+		if (traceDynamic)
+		{
+			const uint32 mask = (m_packetWidth > 1) ?
+				packetIntersectsBox(packetOrigins, packetDirections, tMax, lanes, dynamicBounds) : ((1u << lanes) - 1);
+
+			for (int i = 0; i < lanes; ++i)
+			{
+				// Skips empty rays, whose tMax is -inf
+				if (((mask & (1u << i)) == 0) || (packetOrigins[i].w > tMax[i]))
+				{
+					continue;
+				}
+
+				const Vector4& o = packetOrigins[i];
+				const Vector4& d = packetDirections[i];
+				TriTree::Hit dynamicHit;
+				if (dynamicTree->intersectRay(Ray::fromOriginAndDirection(o.xyz(), d.xyz(), o.w, tMax[i]), dynamicHit, options) &&
+					((hitTree[i] == nullptr) || (dynamicHit.distance < hit[i].distance)))
+				{
+					hit[i] = dynamicHit;
+					hitTree[i] = dynamicTree.get();
+					tMax[i] = dynamicHit.distance;
+				}
+			}
+		}
+
+		// Surface properties of the nearest hits
+		for (int i = 0; i < lanes; ++i)
+		{
+			const int r = packetStart + i;
+			if (hitTree[i] == nullptr)
+			{
+				output.records[r] = RayHitRecord::miss();
+				output.positions[r] = Vector4::zero();
+				output.normals[r] = Vector4::zero();
+				continue;
+			}
+
+			shared_ptr<Surfel> surfel;
+			hitTree[i]->sample(hit[i], surfel);
+
+			const Vector3& direction = packetDirections[i].xyz();
+			const shared_ptr<UniversalSurfel>& universalSurfel = dynamic_pointer_cast<UniversalSurfel>(surfel);
+			Color3 lambertian = Color3::zero();
+			if (notNull(universalSurfel))
+			{
+				lambertian = universalSurfel->lambertianReflectivity;
+				if (m_glossyToMatte)
+				{
+					lambertian += universalSurfel->glossyReflectionCoefficient;
+				}
+			}
+
+			output.records[r] = RayHitRecord::hit((surfel->position - packetOrigins[i].xyz()).length(), surfel->shadingNormal,
+				packUnorm4x8(lambertian), surfel->emittedRadiance(-direction), hit[i].backface);
+			output.positions[r] = Vector4(surfel->position, 1.0f);
+			output.normals[r] = Vector4(surfel->shadingNormal, 0.0f);
+		}
+	}
+}
+
+void ProbeRayTracer::trace
+   (const shared_ptr<TriTree>&      staticTree,
+	const shared_ptr<TriTree>&      dynamicTree,
+	const Vector4*                  origins,
+	const Vector4*                  directions,
+	int                             raysPerRow,
+	int                             rowCount,
+	const Output&                   output,
+	TriTree::IntersectRayOptions    options) const
+{
+	const AABox& dynamicBounds = (dynamicTree->size() > 0) ? bounds(dynamicTree) : AABox();
+
+	m_pool->parallelFor(rowCount, [&](int row, int worker) {
+		traceRow(staticTree, dynamicTree, dynamicBounds, origins, directions, row * raysPerRow, raysPerRow, output, options);
+	});
+}
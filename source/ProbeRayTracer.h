@@ -0,0 +1,119 @@
+#pragma once
+#include <G3D/G3D.h>
+#include "RayHitRecord.h"
+#include "WorkStealingPool.h"
+
+/**
+	Probe-aware CPU front end for TriTree.
+
+	Probe rays arrive in the RayStagingBuffers layout: one row of raysPerProbe rays per probe,
+	all leaving the probe's position, with neighboring indices in neighboring directions.
+	Instead of handing TriTree::intersectRays one flat list, rows are distributed across a
+	WorkStealingPool, so each core keeps tracing the probes of one region of the scene, and
+	each row is traced in packets of packetWidth() coherent rays.
+
+	Each packet is first traced against the static tree. It is then tested against the bounds of
+	the dynamic tree, 8 lanes at a time with AVX, and only the lanes that can reach a moving
+	object before their static hit traverse the dynamic tree. BVH traversal itself happens inside
+	TriTree, which has no packet interface, so the lanes of a packet are traversed one at a time.
+
+	The output is the packed RayHitRecord of every ray, which also records whether the ray hit a
+	back face, plus the hit position and normal used by IrradianceField::classifyProbes in the
+	layout TriTree::intersectRays writes.
+*/
+class ProbeRayTracer
+{
+public:
+
+	/** Destinations for trace(), each with one element per ray. May be mapped GLPixelTransferBuffers. */
+	struct Output
+	{
+		RayHitRecord*       records = nullptr;
+
+		/** World-space hit position (xyz, w = 1), zero on a miss */
+		Vector4*            positions = nullptr;
+
+		/** World-space shading normal, zero on a miss */
+		Vector4*            normals = nullptr;
+	};
+
+protected:
+
+	shared_ptr<WorkStealingPool>    m_pool;
+
+	int                             m_packetWidth = 8;
+
+	/** See setGlossyToMatte() */
+	bool                            m_glossyToMatte = false;
+
+	/** Traces one row of rays */
+	void traceRow
+	   (const shared_ptr<TriTree>&      staticTree,
+		const shared_ptr<TriTree>&      dynamicTree,
+		const AABox&                    dynamicBounds,
+		const Vector4*                  origins,
+		const Vector4*                  directions,
+		int                             firstRay,
+		int                             rayCount,
+		const Output&                   output,
+		TriTree::IntersectRayOptions    options) const;
+
+public:
+
+	/** Largest supported packet */
+	static const int                maxPacketWidth = 16;
+
+	/** \param threadCount 0 = System::numCores() */
+	explicit ProbeRayTracer(int threadCount = 0);
+
+	/** Creates a new pool, which is no longer shared with the tracers of sharePool() */
+	void setThreadCount(int threadCount);
+
+	/** Traces on the pool of \a other from now on. Traces from both tracers, e.g. asynchronous ones on
+		different threads, are queued on the one pool instead of each starting threadCount() threads. */
+	void sharePool(const ProbeRayTracer& other) {
+		m_pool = other.m_pool;
+	}
+
+	int threadCount() const {
+		return m_pool->threadCount();
+	}
+
+	/** Rays traced together. Clamped to [1, maxPacketWidth]; 1 disables the packet bounds test. */
+	void setPacketWidth(int width);
+
+	int packetWidth() const {
+		return m_packetWidth;
+	}
+
+	/** If true, the packed lambertian reflectivity also holds the glossy reflection coefficient
+		(IrradianceField::Specification::glossyToMatte) */
+	void setGlossyToMatte(bool b) {
+		m_glossyToMatte = b;
+	}
+
+	/** Rows moved between threads by the last trace() */
+	int lastStealCount() const {
+		return m_pool->lastStealCount();
+	}
+
+	/** Bounds of all vertices of \a tree */
+	static AABox bounds(const shared_ptr<TriTree>& tree);
+
+	/** Bit i is set if ray i of the packet can hit \a box at a distance on [origin.w, tMax[i]].
+		\a origins and \a directions are in the RGBA32F ray buffer layout. */
+	static uint32 packetIntersectsBox(const Vector4* origins, const Vector4* directions, const float* tMax, int count, const AABox& box);
+
+	/** Traces rows [0, rowCount) of rays in the RayStagingBuffers layout against \a staticTree and,
+		if it is not empty, \a dynamicTree, keeping the nearer hit. Rays whose min distance exceeds
+		their max distance (ProbeRayGenerator::writeEmptyRays) are misses. */
+	void trace
+	   (const shared_ptr<TriTree>&      staticTree,
+		const shared_ptr<TriTree>&      dynamicTree,
+		const Vector4*                  origins,
+		const Vector4*                  directions,
+		int                             raysPerRow,
+		int                             rowCount,
+		const Output&                   output,
+		TriTree::IntersectRayOptions    options = 0) const;
+};
@@ -0,0 +1,399 @@
+#include "ProbeStats.h"
+
+ProbeStats::Frame::Frame()
+{
+	for (int s = 0; s < STAGE_COUNT; ++s)
+	{
+		cpuMilliseconds[s] = 0.0f;
+		gpuMilliseconds[s] = -1.0f;
+	}
+}
+
+float ProbeStats::Frame::totalCPUMilliseconds() const
+{
+	float total = 0.0f;
+	for (int s = 0; s < STAGE_COUNT; ++s)
+	{
+		total += cpuMilliseconds[s];
+	}
+	return total;
+}
+
+float ProbeStats::Frame::totalGPUMilliseconds() const
+{
+	// Stages are either all timed or none
+	if (gpuMilliseconds[0] < 0.0f)
+	{
+		return -1.0f;
+	}
+
+	float total = 0.0f;
+	for (int s = 0; s < STAGE_COUNT; ++s)
+	{
+		total += gpuMilliseconds[s];
+	}
+	return total;
+}
+
+ProbeStats::~ProbeStats()
+{
+	for (QueryFrame& queryFrame : m_queryFrames)
+	{
+		if (queryFrame.queries.size() > 0)
+		{
+			glDeleteQueries(queryFrame.queries.size(), queryFrame.queries.getCArray());
+		}
+	}
+}
+
+const char* ProbeStats::stageName(Stage stage)
+{
+	static const char* names[STAGE_COUNT] = { "rayGeneration", "readback", "trace", "classify", "upload", "shade", "updateIrradiance", "updateDepth", "triTreeRebuild" };
+	return names[stage];
+}
+
+void ProbeStats::beginFrame()
+{
+	debugAssertM(!m_inFrame, "ProbeStats::beginFrame called twice");
+
+	QueryFrame& queryFrame = m_queryFrames[m_current];
+	if (queryFrame.pending)
+	{
+		resolve(queryFrame);
+	}
+
+	queryFrame.frame = Frame();
+	queryFrame.frame.frameIndex = m_frameCount;
+	queryFrame.intervalStage.fastClear();
+	queryFrame.gpuTimed = m_gpuTiming;
+
+	m_stageStack.fastClear();
+	m_inFrame = true;
+	++m_frameCount;
+}
+
+void ProbeStats::endFrame()
+{
+	if (!m_inFrame)
+	{
+		return;
+	}
+
+	debugAssertM(m_stageStack.size() == 0, format("Stage %s was not ended", stageName(m_stageStack.last())));
+	while (m_stageStack.size() > 0)
+	{
+		endStage(m_stageStack.last());
+	}
+
+	m_queryFrames[m_current].pending = true;
+	m_inFrame = false;
+	m_current = (m_current + 1) % maxFramesInFlight;
+
+	// Oldest first, so that m_frames stays in order. The oldest frame is about to be reused, so it
+	// is resolved even if that has to wait; the others only when their results are already there.
+	for (int k = 0; k < maxFramesInFlight; ++k)
+	{
+		QueryFrame& queryFrame = m_queryFrames[(m_current + k) % maxFramesInFlight];
+		if (!queryFrame.pending)
+		{
+			continue;
+		}
+
+		if ((k > 0) && !queriesAvailable(queryFrame))
+		{
+			break;
+		}
+		resolve(queryFrame);
+	}
+}
+
+void ProbeStats::beginInterval(Stage stage)
+{
+	QueryFrame& queryFrame = m_queryFrames[m_current];
+	if (!queryFrame.gpuTimed)
+	{
+		return;
+	}
+
+	const int i = queryFrame.intervalStage.size();
+	const int oldSize = queryFrame.queries.size();
+	if (oldSize < 2 * i + 2)
+	{
+		// Grow by whole frames' worth of intervals so that this rarely allocates
+		const int newSize = max(2 * i + 2, 2 * oldSize);
+		queryFrame.queries.resize(newSize);
+		glGenQueries(newSize - oldSize, queryFrame.queries.getCArray() + oldSize);
+	}
+
+	glQueryCounter(queryFrame.queries[2 * i], GL_TIMESTAMP);
+	queryFrame.intervalStage.append(stage);
+}
+
+void ProbeStats::endInterval()
+{
+	QueryFrame& queryFrame = m_queryFrames[m_current];
+	if (!queryFrame.gpuTimed)
+	{
+		return;
+	}
+
+	// Only the innermost stage has an open interval
+	glQueryCounter(queryFrame.queries[2 * queryFrame.intervalStage.size() - 1], GL_TIMESTAMP);
+}
+
+bool ProbeStats::queriesAvailable(const QueryFrame& queryFrame) const
+{
+	if (queryFrame.intervalStage.size() == 0)
+	{
+		return true;
+	}
+
+	// Queries complete in order
+	GLint available = GL_FALSE;
+	glGetQueryObjectiv(queryFrame.queries[2 * queryFrame.intervalStage.size() - 1], GL_QUERY_RESULT_AVAILABLE, &available);
+	return available == GL_TRUE;
+}
+
+void ProbeStats::resolve(QueryFrame& queryFrame)
+{
+	Frame& frame = queryFrame.frame;
+	if (queryFrame.gpuTimed)
+	{
+		for (int s = 0; s < STAGE_COUNT; ++s)
+		{
+			frame.gpuMilliseconds[s] = 0.0f;
+		}
+
+		for (int i = 0; i < queryFrame.intervalStage.size(); ++i)
+		{
+			GLuint64 begin = 0, end = 0;
+			glGetQueryObjectui64v(queryFrame.queries[2 * i], GL_QUERY_RESULT, &begin);
+			glGetQueryObjectui64v(queryFrame.queries[2 * i + 1], GL_QUERY_RESULT, &end);
+			frame.gpuMilliseconds[queryFrame.intervalStage[i]] += float(double(end - begin) * 1e-6);
+		}
+	}
+
+	m_frames.pushBack(frame);
+	while (m_frames.size() > m_maxFrames)
+	{
+		m_frames.popFront();
+	}
+	queryFrame.pending = false;
+}
+
+void ProbeStats::beginStage(Stage stage)
+{
+	if (!m_inFrame)
+	{
+		return;
+	}
+
+	const RealTime now = System::time();
+	if (m_stageStack.size() > 0)
+	{
+		// Suspend the enclosing stage
+		m_queryFrames[m_current].frame.cpuMilliseconds[m_stageStack.last()] += float((now - m_stageStartTime) * 1000.0);
+		endInterval();
+	}
+
+	m_stageStack.append(stage);
+	m_stageStartTime = now;
+	beginInterval(stage);
+}
+
+void ProbeStats::endStage(Stage stage)
+{
+	if (!m_inFrame || (m_stageStack.size() == 0))
+	{
+		return;
+	}
+	debugAssertM(m_stageStack.last() == stage, format("Ended stage %s inside stage %s", stageName(stage), stageName(m_stageStack.last())));
+
+	const RealTime now = System::time();
+	m_queryFrames[m_current].frame.cpuMilliseconds[m_stageStack.last()] += float((now - m_stageStartTime) * 1000.0);
+	endInterval();
+	m_stageStack.pop();
+
+	if (m_stageStack.size() > 0)
+	{
+		// Resume the enclosing stage
+		m_stageStartTime = now;
+		beginInterval(m_stageStack.last());
+	}
+}
+
+void ProbeStats::addRays(int traced, int hits, int backfaces)
+{
+	if (m_inFrame)
+	{
+		Frame& frame = m_queryFrames[m_current].frame;
+		frame.raysTraced += traced;
+		frame.hitCount += hits;
+		frame.missCount += traced - hits;
+		frame.backfaceCount += backfaces;
+		m_totalRaysTraced += traced;
+	}
+}
+
+void ProbeStats::addBytesUploaded(int64 bytes)
+{
+	if (m_inFrame)
+	{
+		m_queryFrames[m_current].frame.bytesUploaded += bytes;
+	}
+}
+
+void ProbeStats::addBytesReadBack(int64 bytes)
+{
+	if (m_inFrame)
+	{
+		m_queryFrames[m_current].frame.bytesReadBack += bytes;
+	}
+}
+
+void ProbeStats::setProbeCounts(int probeCount, int activeProbeCount, int scheduledProbeCount)
+{
+	if (m_inFrame)
+	{
+		Frame& frame = m_queryFrames[m_current].frame;
+		frame.probeCount = probeCount;
+		frame.activeProbeCount = activeProbeCount;
+		frame.scheduledProbeCount = scheduledProbeCount;
+	}
+}
+
+ProbeStats::Frame ProbeStats::lastFrame() const
+{
+	return (m_frames.size() > 0) ? m_frames[m_frames.size() - 1] : Frame();
+}
+
+ProbeStats::Frame ProbeStats::averageFrame(int count) const
+{
+	count = min(count, m_frames.size());
+	if (count <= 0)
+	{
+		return Frame();
+	}
+
+	Frame average = m_frames[m_frames.size() - 1];
+	for (int i = m_frames.size() - count; i < m_frames.size() - 1; ++i)
+	{
+		const Frame& frame = m_frames[i];
+		for (int s = 0; s < STAGE_COUNT; ++s)
+		{
+			average.cpuMilliseconds[s] += frame.cpuMilliseconds[s];
+			average.gpuMilliseconds[s] += frame.gpuMilliseconds[s];
+		}
+		average.raysTraced += frame.raysTraced;
+		average.hitCount += frame.hitCount;
+		average.missCount += frame.missCount;
+		average.backfaceCount += frame.backfaceCount;
+		average.probeCount += frame.probeCount;
+		average.activeProbeCount += frame.activeProbeCount;
+		average.scheduledProbeCount += frame.scheduledProbeCount;
+		average.bytesUploaded += frame.bytesUploaded;
+		average.bytesReadBack += frame.bytesReadBack;
+	}
+
+	for (int s = 0; s < STAGE_COUNT; ++s)
+	{
+		average.cpuMilliseconds[s] /= float(count);
+		average.gpuMilliseconds[s] /= float(count);
+	}
+	average.raysTraced /= count;
+	average.hitCount /= count;
+	average.missCount /= count;
+	average.backfaceCount /= count;
+	average.probeCount /= count;
+	average.activeProbeCount /= count;
+	average.scheduledProbeCount /= count;
+	average.bytesUploaded /= count;
+	average.bytesReadBack /= count;
+	return average;
+}
+
+void ProbeStats::setMaxFrames(int n)
+{
+	m_maxFrames = max(n, 1);
+	while (m_frames.size() > m_maxFrames)
+	{
+		m_frames.popFront();
+	}
+}
+
+void ProbeStats::clear()
+{
+	m_frames.clear();
+}
+
+/** Rows are long and must not be wrapped */
+static TextOutput::Settings logSettings()
+{
+	TextOutput::Settings settings;
+	settings.wordWrap = TextOutput::Settings::WRAP_NONE;
+	return settings;
+}
+
+void ProbeStats::saveCSV(const String& filename) const
+{
+	TextOutput file(filename, logSettings());
+	file.printf("frame,probes,activeProbes,scheduledProbes,raysTraced,hits,misses,backfaces,bytesUploaded,bytesReadBack");
+	for (int s = 0; s < STAGE_COUNT; ++s)
+	{
+		file.printf(",%sCpuMs,%sGpuMs", stageName(Stage(s)), stageName(Stage(s)));
+	}
+	file.printf(",totalCpuMs,totalGpuMs\n");
+
+	for (int i = 0; i < m_frames.size(); ++i)
+	{
+		const Frame& frame = m_frames[i];
+		file.printf("%d,%d,%d,%d,%d,%d,%d,%d,%lld,%lld", frame.frameIndex, frame.probeCount, frame.activeProbeCount, frame.scheduledProbeCount,
+			frame.raysTraced, frame.hitCount, frame.missCount, frame.backfaceCount, (long long)frame.bytesUploaded, (long long)frame.bytesReadBack);
+		for (int s = 0; s < STAGE_COUNT; ++s)
+		{
+			file.printf(",%.4f,%.4f", frame.cpuMilliseconds[s], frame.gpuMilliseconds[s]);
+		}
+		file.printf(",%.4f,%.4f\n", frame.totalCPUMilliseconds(), frame.totalGPUMilliseconds());
+	}
+	file.commit();
+}
+
+void ProbeStats::saveJSON(const String& filename) const
+{
+	TextOutput file(filename, logSettings());
+	file.printf("[\n");
+	for (int i = 0; i < m_frames.size(); ++i)
+	{
+		const Frame& frame = m_frames[i];
+		file.printf("  { \"frame\": %d, \"probes\": %d, \"activeProbes\": %d, \"scheduledProbes\": %d, ",
+			frame.frameIndex, frame.probeCount, frame.activeProbeCount, frame.scheduledProbeCount);
+		file.printf("\"raysTraced\": %d, \"hits\": %d, \"misses\": %d, \"backfaces\": %d, \"bytesUploaded\": %lld, \"bytesReadBack\": %lld",
+			frame.raysTraced, frame.hitCount, frame.missCount, frame.backfaceCount, (long long)frame.bytesUploaded, (long long)frame.bytesReadBack);
+
+		for (int timeline = 0; timeline < 2; ++timeline)
+		{
+			const float* milliseconds = (timeline == 0) ? frame.cpuMilliseconds : frame.gpuMilliseconds;
+			file.printf(",\n    \"%s\": {", (timeline == 0) ? "cpuMs" : "gpuMs");
+			for (int s = 0; s < STAGE_COUNT; ++s)
+			{
+				file.printf("%s \"%s\": %.4f", (s == 0) ? "" : ",", stageName(Stage(s)), milliseconds[s]);
+			}
+			file.printf(" }");
+		}
+		file.printf(" }%s\n", (i + 1 < m_frames.size()) ? "," : "");
+	}
+	file.printf("]\n");
+	file.commit();
+}
+
+void ProbeStats::save(const String& filename) const
+{
+	if (endsWith(toLower(filename), ".json"))
+	{
+		saveJSON(filename);
+	}
+	else
+	{
+		saveCSV(filename);
+	}
+}
@@ -0,0 +1,213 @@
+#pragma once
+#include <G3D/G3D.h>
+
+/**
+	Per-frame timings and counters of the probe pipeline of one IrradianceField, kept for the last
+	maxFrames() frames and written as a CSV or JSON frame log.
+
+	Each stage is timed on the CPU with System::time() and on the GPU with pairs of GL_TIMESTAMP
+	queries. Stages may nest; a stage that begins inside another suspends it, so every interval is
+	charged to exactly one stage and the stage times of a frame add up. The GPU time of a stage is the
+	time between the GPU reaching its first and last command, which includes any GPU idle time between
+	them, and is near zero for stages that only do CPU work.
+
+	The queries are read back maxFramesInFlight frames later, so a frame is only added to frames()
+	once its GPU timings are known. Reading them back never waits unless the GPU is that far behind.
+*/
+class ProbeStats
+{
+public:
+
+	enum Stage
+	{
+		/** Probe scheduling, and CPU ray generation or the ray generation pass */
+		RAY_GENERATION,
+
+		/** Issuing asynchronous GPU->CPU copies and mapping the ones from earlier frames */
+		READBACK,
+
+		/** Probe ray tracing. With GPU ray generation this includes any wait for the copy of the
+			rays. With asynchronous tracing only the render thread's wait for the worker is charged,
+			not the trace itself. */
+		TRACE,
+
+		/** Probe classification, hit record packing and the list of hits for compacted shading,
+			on the render thread */
+		CLASSIFY,
+
+		/** CPU->GPU texture updates: rays, hit records, probe schedule, offsets and brick indirection */
+		UPLOAD,
+
+		/** Ray hit shading and the per-probe mean radiance */
+		SHADE,
+
+		/** The irradiance atlas update; the fused update of both atlases is charged here */
+		UPDATE_IRRADIANCE,
+
+		/** The depth atlas update when it is a separate pass */
+		UPDATE_DEPTH,
+
+		/** Rebuilding the static and dynamic TriTrees */
+		TRITREE_REBUILD,
+
+		STAGE_COUNT
+	};
+
+	/** Frames whose GPU queries may be outstanding */
+	static const int maxFramesInFlight = 4;
+
+	struct Frame
+	{
+		/** Counts the frames of this object, from 0 */
+		int         frameIndex = 0;
+
+		float       cpuMilliseconds[STAGE_COUNT];
+
+		/** -1 when GPU timing is disabled */
+		float       gpuMilliseconds[STAGE_COUNT];
+
+		/** Rays of the scheduled probes that were traced, and how they ended. Backface hits are also hits. */
+		int         raysTraced = 0;
+		int         hitCount = 0;
+		int         missCount = 0;
+		int         backfaceCount = 0;
+
+		int         probeCount = 0;
+		int         activeProbeCount = 0;
+		int         scheduledProbeCount = 0;
+
+		int64       bytesUploaded = 0;
+		int64       bytesReadBack = 0;
+
+		Frame();
+
+		float totalCPUMilliseconds() const;
+		float totalGPUMilliseconds() const;
+
+		float hitFraction() const {
+			return float(hitCount) / float(max(raysTraced, 1));
+		}
+
+		float missFraction() const {
+			return float(missCount) / float(max(raysTraced, 1));
+		}
+
+		float backfaceFraction() const {
+			return float(backfaceCount) / float(max(raysTraced, 1));
+		}
+	};
+
+protected:
+
+	/** Timestamp query pairs of one frame. Query 2i and 2i + 1 begin and end interval i. */
+	struct QueryFrame
+	{
+		Frame                   frame;
+		Array<GLuint>           queries;
+		Array<Stage>            intervalStage;
+
+		/** False if GPU timing was disabled when the frame began */
+		bool                    gpuTimed = false;
+
+		/** True from endFrame() until the frame is resolved */
+		bool                    pending = false;
+	};
+
+	QueryFrame                  m_queryFrames[maxFramesInFlight];
+
+	/** Index in m_queryFrames of the frame being recorded */
+	int                         m_current = 0;
+
+	bool                        m_inFrame = false;
+	int                         m_frameCount = 0;
+
+	/** Rays of every frame, including those that are not resolved yet */
+	int64                       m_totalRaysTraced = 0;
+
+	/** Open stages, innermost last. Only the innermost one is being timed. */
+	Array<Stage>                m_stageStack;
+	RealTime                    m_stageStartTime = 0.0;
+
+	bool                        m_gpuTiming = true;
+
+	/** Completed frames, oldest first */
+	Queue<Frame>                m_frames;
+	int                         m_maxFrames = 600;
+
+	/** Starts a GPU interval for the innermost stage */
+	void beginInterval(Stage stage);
+	void endInterval();
+
+	/** True if every query of \a queryFrame has a result */
+	bool queriesAvailable(const QueryFrame& queryFrame) const;
+
+	/** Reads the GPU timings of \a queryFrame, waiting for them if necessary, and moves it to m_frames */
+	void resolve(QueryFrame& queryFrame);
+
+public:
+
+	~ProbeStats();
+
+	static const char* stageName(Stage stage);
+
+	/** Call at the start of the pipeline's frame. Stages and counters outside a frame are ignored. */
+	void beginFrame();
+
+	void endFrame();
+
+	void beginStage(Stage stage);
+
+	/** \a stage must be the innermost open stage */
+	void endStage(Stage stage);
+
+	void addRays(int traced, int hits, int backfaces);
+
+	/** Rays traced in all frames so far. Unlike frames(), this does not trail the pipeline. */
+	int64 totalRaysTraced() const {
+		return m_totalRaysTraced;
+	}
+
+	void addBytesUploaded(int64 bytes);
+
+	void addBytesReadBack(int64 bytes);
+
+	void setProbeCounts(int probeCount, int activeProbeCount, int scheduledProbeCount);
+
+	bool gpuTiming() const {
+		return m_gpuTiming;
+	}
+
+	/** Takes effect at the next beginFrame() */
+	void setGPUTiming(bool b) {
+		m_gpuTiming = b;
+	}
+
+	/** Completed frames, oldest first. Trails the pipeline by up to maxFramesInFlight frames. */
+	const Queue<Frame>& frames() const {
+		return m_frames;
+	}
+
+	/** The newest completed frame, or a zeroed frame if there is none yet */
+	Frame lastFrame() const;
+
+	/** Mean of the last \a count completed frames */
+	Frame averageFrame(int count) const;
+
+	int maxFrames() const {
+		return m_maxFrames;
+	}
+
+	/** Older frames are dropped from frames() */
+	void setMaxFrames(int n);
+
+	void clear();
+
+	/** One row per completed frame with a cpuMs and gpuMs column per stage */
+	void saveCSV(const String& filename) const;
+
+	/** An array with one object per completed frame, with the stage timings in "cpuMs" and "gpuMs" objects */
+	void saveJSON(const String& filename) const;
+
+	/** saveJSON if \a filename ends in .json, otherwise saveCSV */
+	void save(const String& filename) const;
+};
@@ -0,0 +1,111 @@
+#pragma once
+#include <G3D/G3D.h>
+#include "ProbeMath.h"
+
+/**
+	Compact result of tracing one probe ray: 16 bytes, stored as one RGBA32UI texel per ray,
+	instead of the five RGBA32F/RGBA8 hit buffers that TriTree::intersectRays writes (~72 bytes).
+	The probe shading and update shaders read it with unpackRayHitRecord() in RayHitRecord.glsl.
+
+	The hit position is not stored; it is reconstructed as origin + direction * distance from
+	the ray textures, which those passes read anyway.
+*/
+struct RayHitRecord
+{
+	/** Float bits of the distance along the ray to the hit, or of -1 on a miss */
+	uint32          distance;
+
+	/** Octahedral world-space shading normal as two snorm16 (GLSL packSnorm2x16) */
+	uint32          normal;
+
+	/** Lambertian reflectivity in RGB8 as written by the tracer (GLSL packUnorm4x8). The alpha byte
+		is 255 if the ray hit the back of the triangle (TriTree::Hit::backface) and 0 otherwise. */
+	uint32          lambertian;
+
+	/** Emitted radiance in the shared-exponent RGB9E5 format */
+	uint32          emissive;
+
+	static RayHitRecord miss()
+	{
+		RayHitRecord record;
+		record.distance = floatBitsToUint(-1.0f);
+		record.normal = 0;
+		record.lambertian = 0;
+		record.emissive = 0;
+		return record;
+	}
+
+	/** The alpha of \a lambertianRGBA8 is replaced by the backface flag */
+	static RayHitRecord hit(float distance, const Vector3& normal, uint32 lambertianRGBA8, const Radiance3& emissive, bool backface)
+	{
+		RayHitRecord record;
+		record.distance = floatBitsToUint(distance);
+		record.normal = packSnorm2x16(ProbeMath::octEncode(normal));
+		record.lambertian = (lambertianRGBA8 & 0x00FFFFFFu) | (backface ? 0xFF000000u : 0u);
+		record.emissive = packRGB9E5(emissive);
+		return record;
+	}
+
+	/** False on a miss */
+	bool backface() const
+	{
+		return (lambertian >> 24) != 0;
+	}
+
+	/** Saturating per-channel sum of the RGB of two RGBA8 values; the alpha of \a a is kept */
+	static uint32 addUnorm4x8(uint32 a, uint32 b)
+	{
+		uint32 result = a & 0xFF000000u;
+		for (int shift = 0; shift < 24; shift += 8)
+		{
+			result |= uint32(iMin(int((a >> shift) & 0xFFu) + int((b >> shift) & 0xFFu), 255)) << shift;
+		}
+		return result;
+	}
+
+	static uint32 floatBitsToUint(float f)
+	{
+		uint32 u;
+		System::memcpy(&u, &f, sizeof(u));
+		return u;
+	}
+
+	/** Matches GLSL packSnorm2x16 */
+	static uint32 packSnorm2x16(const Vector2& v)
+	{
+		const uint32 x = uint32(uint16(int16(iRound(clamp(v.x, -1.0f, 1.0f) * 32767.0f))));
+		const uint32 y = uint32(uint16(int16(iRound(clamp(v.y, -1.0f, 1.0f) * 32767.0f))));
+		return x | (y << 16);
+	}
+
+	/** EXT_texture_shared_exponent encoding: three 9-bit mantissas and a 5-bit exponent with bias 15.
+		Decoded by unpackRGB9E5() in RayHitRecord.glsl. */
+	static uint32 packRGB9E5(const Color3& c)
+	{
+		static const int   mantissaBits = 9;
+		static const int   exponentBias = 15;
+		static const float maxValue = 65408.0f; // (2^9 - 1) / 2^9 * 2^16
+
+		const float r = clamp(c.r, 0.0f, maxValue);
+		const float g = clamp(c.g, 0.0f, maxValue);
+		const float b = clamp(c.b, 0.0f, maxValue);
+		const float maxComponent = max(r, max(g, b));
+		if (maxComponent <= 0.0f)
+		{
+			return 0;
+		}
+
+		int exponent = max(-exponentBias - 1, iFloor(log2(maxComponent))) + 1 + exponentBias;
+		float scale = pow(2.0f, float(exponent - exponentBias - mantissaBits));
+		if (iRound(maxComponent / scale) == (1 << mantissaBits))
+		{
+			scale *= 2.0f;
+			++exponent;
+		}
+
+		const uint32 rm = uint32(iRound(r / scale));
+		const uint32 gm = uint32(iRound(g / scale));
+		const uint32 bm = uint32(iRound(b / scale));
+		return rm | (gm << 9) | (bm << 18) | (uint32(exponent) << 27);
+	}
+};
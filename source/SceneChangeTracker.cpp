@@ -0,0 +1,193 @@
+#include "SceneChangeTracker.h"
+
+SceneChangeTracker::LightState SceneChangeTracker::lightState(const shared_ptr<Light>& light, float cutoff)
+{
+	LightState state;
+	state.frame = light->frame();
+	state.bulbPower = light->bulbPower();
+	state.spotHalfAngle = light->spotHalfAngle();
+	state.enabled = light->enabled();
+
+	const Sphere& sphere = light->effectSphere(cutoff);
+	if ((light->position().w == 0.0f) || !isFinite(sphere.radius))
+	{
+		state.region.bounds = AABox::inf();
+		return state;
+	}
+
+	const Vector3 r(sphere.radius, sphere.radius, sphere.radius);
+	state.region.bounds = AABox(sphere.center - r, sphere.center + r);
+
+	// A square spot reaches sqrt(2) farther from its axis at the corners than a round one
+	float halfAngle = light->spotHalfAngle();
+	if (light->spotSquare())
+	{
+		halfAngle = atanf(tanf(halfAngle) * sqrtf(2.0f));
+	}
+
+	if ((light->type() == Light::Type::SPOT) && (halfAngle < 0.45f * pif()))
+	{
+		Region& region = state.region;
+		region.hasCone = true;
+		region.coneApex = sphere.center;
+		region.coneAxis = light->frame().lookVector().direction();
+		region.coneHalfAngle = halfAngle;
+
+		// The part of the sphere inside the cone lies within the cone cut off at the sphere's radius
+		// along the axis: the apex and a disk of radius r tan(halfAngle) around the axis
+		const Point3& diskCenter = region.coneApex + region.coneAxis * sphere.radius;
+		const float diskRadius = sphere.radius * tanf(halfAngle);
+		const Vector3& a = region.coneAxis;
+		const Vector3 diskExtent(diskRadius * sqrtf(max(1.0f - square(a.x), 0.0f)),
+			diskRadius * sqrtf(max(1.0f - square(a.y), 0.0f)),
+			diskRadius * sqrtf(max(1.0f - square(a.z), 0.0f)));
+		const AABox coneBounds(region.coneApex.min(diskCenter - diskExtent), region.coneApex.max(diskCenter + diskExtent));
+		region.bounds = region.bounds.intersect(coneBounds);
+	}
+
+	return state;
+}
+
+bool SceneChangeTracker::Region::contains(const Point3& P) const
+{
+	if (!bounds.contains(P))
+	{
+		return false;
+	}
+	if (!hasCone)
+	{
+		return true;
+	}
+
+	const Vector3& v = P - coneApex;
+	const float distance = v.length();
+	if (distance <= coneMargin)
+	{
+		return true;
+	}
+
+	// Within coneMargin of the cone: the angle to the axis exceeds the half angle by at most the
+	// angle that the margin subtends at this distance
+	const float angle = acosf(clamp(v.dot(coneAxis) / distance, -1.0f, 1.0f));
+	return angle <= coneHalfAngle + asinf(coneMargin / distance);
+}
+
+void SceneChangeTracker::appendRegion(const Region& region, float margin, Array<Region>& regions)
+{
+	if (!region.bounds.isFinite())
+	{
+		Region everything;
+		everything.bounds = AABox::inf();
+		regions.append(everything);
+		return;
+	}
+
+	Region grown = region;
+	grown.bounds = AABox(region.bounds.low() - Vector3(margin, margin, margin), region.bounds.high() + Vector3(margin, margin, margin));
+	grown.coneMargin = margin;
+	regions.append(grown);
+}
+
+/** A region without a cone */
+static SceneChangeTracker::Region regionOf(const AABox& box)
+{
+	SceneChangeTracker::Region region;
+	region.bounds = box;
+	return region;
+}
+
+void SceneChangeTracker::reset()
+{
+	m_lights.clear();
+	m_entities.clear();
+	m_initialized = false;
+	m_changedLightCount = 0;
+	m_changedEntityCount = 0;
+}
+
+void SceneChangeTracker::update(const shared_ptr<Scene>& scene, float margin, Array<Region>& regions)
+{
+	m_changedLightCount = 0;
+	m_changedEntityCount = 0;
+
+	Table<String, LightState> lights;
+	{
+		Array<shared_ptr<Light>> lightArray;
+		scene->getTypedEntityArray(lightArray);
+		for (const shared_ptr<Light>& light : lightArray)
+		{
+			const LightState& state = lightState(light, m_lightCutoff);
+			lights.set(light->name(), state);
+
+			const LightState* old = m_lights.getPointer(light->name());
+			if (m_initialized && (isNull(old) || !(*old == state)))
+			{
+				// Disabled lights contribute nothing where they are
+				if (state.enabled)
+				{
+					appendRegion(state.region, margin, regions);
+				}
+				if (notNull(old) && old->enabled)
+				{
+					appendRegion(old->region, margin, regions);
+				}
+				++m_changedLightCount;
+			}
+		}
+	}
+
+	Table<String, EntityState> entities;
+	{
+		Array<shared_ptr<VisibleEntity>> entityArray;
+		scene->getTypedEntityArray(entityArray);
+		for (const shared_ptr<VisibleEntity>& entity : entityArray)
+		{
+			// Entities that cannot change are part of the static scene tree and never move
+			if (!entity->visible() || isNull(entity->model()) || !entity->canChange())
+			{
+				continue;
+			}
+
+			EntityState state;
+			state.frame = entity->frame();
+			entity->getLastBounds(state.bounds);
+			entities.set(entity->name(), state);
+
+			const EntityState* old = m_entities.getPointer(entity->name());
+			if (m_initialized && (isNull(old) || !(old->frame == state.frame) || !(old->bounds == state.bounds)))
+			{
+				appendRegion(regionOf(state.bounds), margin, regions);
+				if (notNull(old))
+				{
+					appendRegion(regionOf(old->bounds), margin, regions);
+				}
+				++m_changedEntityCount;
+			}
+		}
+	}
+
+	// Removed since the last update
+	if (m_initialized)
+	{
+		for (const Table<String, LightState>::Entry& entry : m_lights)
+		{
+			if (!lights.containsKey(entry.key) && entry.value.enabled)
+			{
+				appendRegion(entry.value.region, margin, regions);
+				++m_changedLightCount;
+			}
+		}
+		for (const Table<String, EntityState>::Entry& entry : m_entities)
+		{
+			if (!entities.containsKey(entry.key))
+			{
+				appendRegion(regionOf(entry.value.bounds), margin, regions);
+				++m_changedEntityCount;
+			}
+		}
+	}
+
+	m_lights = lights;
+	m_entities = entities;
+	m_initialized = true;
+}
@@ -0,0 +1,104 @@
+#pragma once
+#include <G3D/G3D.h>
+
+/**
+	Finds the regions of a scene whose lighting changed since the previous frame: lights that moved,
+	changed power, cone or enable state, or were added or removed, and changeable model entities
+	that moved, changed shape, or appeared or disappeared. IrradianceField re-traces the probes in
+	these regions with more rays and less hysteresis, and the other probes at a maintenance rate.
+
+	A light's region is its effect sphere (Light::effectSphere) at its old and new state, and for a
+	spot light only the part of the sphere inside its cone; directional lights have no finite region
+	and change the whole scene. An entity's region is its bounding box at the old and new pose. Both
+	are grown by a margin, because light reflected inside a region reaches probes around it.
+*/
+class SceneChangeTracker
+{
+public:
+
+	/** A box, optionally narrowed to the points within a margin of a cone */
+	struct Region
+	{
+		AABox       bounds;
+
+		bool        hasCone = false;
+		Point3      coneApex;
+
+		/** Unit length */
+		Vector3     coneAxis;
+		float       coneHalfAngle = 0.0f;
+
+		/** Points this close to the cone are also inside */
+		float       coneMargin = 0.0f;
+
+		bool contains(const Point3& P) const;
+	};
+
+protected:
+
+	struct LightState
+	{
+		CFrame      frame;
+		Power3      bulbPower;
+		float       spotHalfAngle = 0.0f;
+		bool        enabled = false;
+
+		/** Where the light contributes more than m_lightCutoff, before the margin; infinite bounds for directional lights */
+		Region      region;
+
+		bool operator==(const LightState& other) const {
+			return (frame == other.frame) && (bulbPower == other.bulbPower) && (spotHalfAngle == other.spotHalfAngle) && (enabled == other.enabled);
+		}
+	};
+
+	struct EntityState
+	{
+		CFrame      frame;
+		AABox       bounds;
+	};
+
+	/** By entity name, as of the last update() */
+	Table<String, LightState>       m_lights;
+	Table<String, EntityState>      m_entities;
+
+	/** False until update() has recorded a first state to compare against */
+	bool                            m_initialized = false;
+
+	/** Radiance below which a light no longer counts, for Light::effectSphere */
+	float                           m_lightCutoff = 30.0f / 255.0f;
+
+	int                             m_changedLightCount = 0;
+	int                             m_changedEntityCount = 0;
+
+	static LightState lightState(const shared_ptr<Light>& light, float cutoff);
+
+	/** Appends \a region grown by \a margin, or an infinite box if \a region is infinite */
+	static void appendRegion(const Region& region, float margin, Array<Region>& regions);
+
+public:
+
+	/** Forgets the recorded state. The next update() only records the scene. */
+	void reset();
+
+	/** Compares the lights and changeable model entities of \a scene against the previous call, and appends
+		the world-space regions whose lighting changed, grown by \a margin, to \a regions. Reports nothing on
+		the first call after reset(), when there is nothing to compare against. */
+	void update(const shared_ptr<Scene>& scene, float margin, Array<Region>& regions);
+
+	/** Lights and entities that changed at the last update() */
+	int changedLightCount() const {
+		return m_changedLightCount;
+	}
+
+	int changedEntityCount() const {
+		return m_changedEntityCount;
+	}
+
+	float lightCutoff() const {
+		return m_lightCutoff;
+	}
+
+	void setLightCutoff(float cutoff) {
+		m_lightCutoff = max(cutoff, 1e-6f);
+	}
+};
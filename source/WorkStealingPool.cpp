@@ -0,0 +1,169 @@
+#include "WorkStealingPool.h"
+
+WorkStealingPool::WorkStealingPool(int threadCount) : m_stealCount(0)
+{
+	if (threadCount <= 0)
+	{
+		threadCount = System::numCores();
+	}
+
+	for (int i = 0; i < threadCount; ++i)
+	{
+		m_ranges.push_back(std::unique_ptr<Range>(new Range()));
+	}
+
+	// Worker 0 is the thread that calls parallelFor
+	for (int i = 1; i < threadCount; ++i)
+	{
+		m_threads.push_back(std::thread(&WorkStealingPool::threadMain, this, i));
+	}
+}
+
+WorkStealingPool::~WorkStealingPool()
+{
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_quit = true;
+	}
+	m_start.notify_all();
+
+	for (std::thread& thread : m_threads)
+	{
+		thread.join();
+	}
+}
+
+bool WorkStealingPool::takeFront(int worker, int& index)
+{
+	Range& range = *m_ranges[worker];
+	std::lock_guard<std::mutex> lock(range.mutex);
+	if (range.begin < range.end)
+	{
+		index = range.begin++;
+		return true;
+	}
+	return false;
+}
+
+bool WorkStealingPool::steal(int thief, int& index)
+{
+	while (true)
+	{
+		// Unsynchronized reads only choose the victim; the split below re-checks under its lock
+		int victim = -1;
+		int victimSize = 0;
+		for (int w = 0; w < threadCount(); ++w)
+		{
+			const int size = m_ranges[w]->end - m_ranges[w]->begin;
+			if ((w != thief) && (size > victimSize))
+			{
+				victim = w;
+				victimSize = size;
+			}
+		}
+
+		if (victim < 0)
+		{
+			return false;
+		}
+
+		int begin, end;
+		{
+			Range& range = *m_ranges[victim];
+			std::lock_guard<std::mutex> lock(range.mutex);
+			if (range.begin >= range.end)
+			{
+				// Emptied since it was chosen
+				continue;
+			}
+
+			end = range.end;
+			begin = range.begin + (range.end - range.begin) / 2;
+			range.end = begin;
+		}
+
+		{
+			Range& range = *m_ranges[thief];
+			std::lock_guard<std::mutex> lock(range.mutex);
+			range.begin = begin + 1;
+			range.end = end;
+		}
+
+		++m_stealCount;
+		index = begin;
+		return true;
+	}
+}
+
+void WorkStealingPool::runWorker(int worker)
+{
+	const Body& body = *m_body;
+	int index;
+	while (takeFront(worker, index) || steal(worker, index))
+	{
+		body(index, worker);
+	}
+}
+
+void WorkStealingPool::threadMain(int worker)
+{
+	int generation = 0;
+	while (true)
+	{
+		{
+			std::unique_lock<std::mutex> lock(m_mutex);
+			m_start.wait(lock, [&]() { return m_quit || (m_generation != generation); });
+			if (m_quit)
+			{
+				return;
+			}
+			generation = m_generation;
+		}
+
+		runWorker(worker);
+
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			if (--m_activeWorkers == 0)
+			{
+				m_done.notify_one();
+			}
+		}
+	}
+}
+
+void WorkStealingPool::parallelFor(int count, const Body& body)
+{
+	if (count <= 0)
+	{
+		return;
+	}
+
+	std::lock_guard<std::mutex> loopLock(m_loopMutex);
+
+	const int n = threadCount();
+	for (int w = 0; w < n; ++w)
+	{
+		Range& range = *m_ranges[w];
+		std::lock_guard<std::mutex> lock(range.mutex);
+		range.begin = int(int64(count) * w / n);
+		range.end = int(int64(count) * (w + 1) / n);
+	}
+	m_stealCount = 0;
+
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_body = &body;
+		m_activeWorkers = n - 1;
+		++m_generation;
+	}
+	m_start.notify_all();
+
+	runWorker(0);
+
+	{
+		std::unique_lock<std::mutex> lock(m_mutex);
+		m_done.wait(lock, [&]() { return m_activeWorkers == 0; });
+		m_body = nullptr;
+	}
+}
@@ -0,0 +1,95 @@
+#pragma once
+#include <G3D/G3D.h>
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/**
+	Persistent worker threads that run parallel-for loops.
+
+	Each loop over [0, count) starts with one contiguous range of indices per worker, so that
+	neighboring indices (e.g., neighboring probes, which see the same geometry) run on the same
+	core. A worker takes indices from the front of its own range; when that is empty it steals
+	the back half of the largest remaining range. Unlike a static split, a few expensive
+	indices do not leave the other cores idle, and unlike runConcurrently there is no
+	per-call thread startup.
+
+	The calling thread participates as worker 0. Not reentrant: parallelFor must not be called
+	from inside a loop body. Loops started from several threads at once run one after another,
+	so one pool can be shared by several users without oversubscribing the cores.
+*/
+class WorkStealingPool
+{
+public:
+	/** Called with the loop index and the index of the worker running it, on [0, threadCount()) */
+	typedef std::function<void(int index, int worker)> Body;
+
+protected:
+
+	/** Modified only under mutex. Atomic so that thieves can pick a victim without locking. */
+	struct Range
+	{
+		std::mutex                          mutex;
+		std::atomic<int>                    begin;
+		std::atomic<int>                    end;
+
+		Range() : begin(0), end(0) {}
+	};
+
+	std::vector<std::thread>                m_threads;
+	std::vector<std::unique_ptr<Range>>     m_ranges;
+
+	/** Held for the whole of each parallelFor, so that loops from different threads are queued */
+	std::mutex                              m_loopMutex;
+
+	std::mutex                              m_mutex;
+	std::condition_variable                 m_start;
+	std::condition_variable                 m_done;
+
+	/** Loop being run. Guarded by m_mutex; valid while m_activeWorkers > 0. */
+	const Body*                             m_body = nullptr;
+
+	/** Incremented to start each loop */
+	int                                     m_generation = 0;
+
+	/** Helper threads still running the current loop */
+	int                                     m_activeWorkers = 0;
+
+	bool                                    m_quit = false;
+
+	std::atomic<int>                        m_stealCount;
+
+	/** Takes the next index of \a worker's own range */
+	bool takeFront(int worker, int& index);
+
+	/** Moves the back half of the largest remaining range to \a thief and takes its first index */
+	bool steal(int thief, int& index);
+
+	/** Runs loop indices until no worker has any left */
+	void runWorker(int worker);
+
+	void threadMain(int worker);
+
+public:
+
+	/** \param threadCount Total number of workers including the calling thread. 0 = System::numCores(). */
+	explicit WorkStealingPool(int threadCount = 0);
+
+	~WorkStealingPool();
+
+	int threadCount() const {
+		return int(m_ranges.size());
+	}
+
+	/** Runs \a body for every index on [0, count) and returns when all have completed */
+	void parallelFor(int count, const Body& body);
+
+	/** Number of ranges stolen during the last parallelFor */
+	int lastStealCount() const {
+		return m_stealCount;
+	}
+};